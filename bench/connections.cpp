@@ -0,0 +1,118 @@
+// Opens short-lived connections, each sending one request with
+// "Connection: close", and serves them with a new buffer and arena per
+// connection, then with states taken from a ConnectionPool. The connections
+// are socketpairs on one loop, so the TCP handshake is excluded but the
+// socket and epoll syscalls are not, and those take most of the time. The
+// calls to operator new are counted too.
+//
+// Usage: connections [connections] [concurrency]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#include "connection.hpp"
+#include "count_allocations.hpp"
+#include "default_headers.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+constexpr std::string_view request =
+    "GET /hello?name=world HTTP/1.1\r\n"
+    "Host: localhost:9000\r\n"
+    "User-Agent: connections-bench/1.0\r\n"
+    "Accept: */*\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+template <class Serve>
+static double run(char const *name, Serve &&serve, int connections,
+                  int concurrency) {
+  EpollScheduler sched;
+  std::size_t bytes = 0;
+  char buf[4096];
+  std::vector<AsyncFile> clients;
+  std::vector<Task<>> tasks;
+  clients.reserve(concurrency);
+  tasks.reserve(concurrency);
+  allocations = 0;
+  counting = true;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < connections; i += concurrency) {
+    // A burst of connections is accepted and served together.
+    for (int j = i; j < std::min(i + concurrency, connections); j++) {
+      int fds[2];
+      CHECK_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+      auto &client = clients.emplace_back(fds[1], false);
+      CHECK_SYSCALL(write(client.fd_, request.data(), request.size()));
+      auto &task = tasks.emplace_back(serve(sched, AsyncFile(fds[0])));
+      task.coro_.resume();
+    }
+    for (auto &task : tasks) {
+      while (!task.coro_.done()) {
+        sched.run();
+      }
+      task.result();
+    }
+    for (auto &client : clients) {
+      ssize_t n;
+      while ((n = CHECK_SYSCALL(read(client.fd_, buf, sizeof(buf)))) > 0) {
+        bytes += n;
+      }
+    }
+    tasks.clear();
+    clients.clear();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  counting = false;
+  auto cps = connections / elapsed.count();
+  std::printf("%-8s %10d connections %8.3f s %12.0f conn/s %10zu bytes/conn "
+              "%6.2f allocs/conn\n",
+              name, connections, elapsed.count(), cps, bytes / connections,
+              double(allocations) / connections);
+  return cps;
+}
+
+int main(int argc, char **argv) {
+  int connections = argc > 1 ? std::stoi(argv[1]) : 200000;
+  int concurrency = argc > 2 ? std::stoi(argv[2]) : 10;
+
+  HeaderTemplate headers;
+  HeaderTemplate::Scope scope(headers);
+
+  HTTPRouter router;
+  router.route(HTTPMethod::GET, "/hello",
+               [](HTTPRequest const &req) -> Task<HTTPResponse> {
+                 auto res = HTTPResponse::with_allocator(req.get_allocator());
+                 res.status = 200;
+                 res.headers["Content-Type"] = "text/plain; charset=utf-8";
+                 res.body = "Hello, World!"sv;
+                 co_return res;
+               });
+
+  auto before = run(
+      "fresh",
+      [&](EpollScheduler &sched, AsyncFile file) -> Task<> {
+        AsyncFileBuffer buffer(sched, std::move(file));
+        co_await serve_connection(sched, buffer, router);
+      },
+      connections, concurrency);
+
+  ConnectionPool pool;
+  auto after = run(
+      "pooled",
+      [&](EpollScheduler &sched, AsyncFile file) {
+        return serve_connection(sched, pool, std::move(file), router);
+      },
+      connections, concurrency);
+
+  std::printf("speedup: %.2fx\n", after / before);
+  return 0;
+}
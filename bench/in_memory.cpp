@@ -0,0 +1,194 @@
+// Sends requests through serve_connection() over keep-alive connections, and
+// parses the responses with HTTPResponse::read_from(), on one thread. The
+// connections are either MemoryConnections, so only the parser, the router and
+// the serialization are timed, or socketpairs on an EpollScheduler, which adds
+// the syscalls and the kernel. The difference is what the transport costs.
+//
+// Usage: in_memory [requests] [connections]
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <vector>
+
+#include "arena.hpp"
+#include "connection.hpp"
+#include "default_headers.hpp"
+#include "memory_stream.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+namespace {
+constexpr std::string_view dynamic_request =
+    "GET /hello?name=world HTTP/1.1\r\n"
+    "Host: localhost:9000\r\n"
+    "User-Agent: in-memory-bench/1.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+constexpr std::string_view static_request =
+    "GET /home HTTP/1.1\r\n"
+    "Host: localhost:9000\r\n"
+    "User-Agent: in-memory-bench/1.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+HTTPRouter make_router() {
+  HTTPRouter router;
+  router.route(HTTPMethod::GET, "/hello",
+               [](HTTPRequest const &req) -> Task<HTTPResponse> {
+                 auto res = HTTPResponse::with_allocator(req.get_allocator());
+                 res.status = 200;
+                 res.headers["Content-Type"] = "text/plain; charset=utf-8";
+                 res.headers["X-Name"] = req.parse_uri().params.at("name");
+                 res.body = "Hello, World!"sv;
+                 co_return res;
+               });
+  router.route_static(HTTPMethod::GET, "/home",
+                      HTTPResponse{
+                          .status = 200,
+                          .headers = {{"Content-Type", "text/html"}},
+                          .body = "<h1>Hello, World!</h1>",
+                      });
+  return router;
+}
+
+template <BufferedStream Stream>
+Task<> serve(EpollScheduler &loop, Stream &s, HTTPRouter const &router) {
+  try {
+    co_await serve_connection(loop, s, router);
+  } catch (EOFException &) {
+  }
+}
+
+template <BufferedStream Stream>
+Task<> send(Stream &s, std::string_view request, int requests,
+            std::size_t &bytes) {
+  Arena arena;
+  for (int i = 0; i < requests; i++) {
+    co_await s.puts(request);
+    co_await s.flush();
+    {
+      auto res = HTTPResponse::with_allocator(&arena);
+      co_await res.read_from(s);
+      bytes += res.body.size();
+    }
+    arena.reset();
+  }
+}
+
+// Runs the clients and the servers of all the connections with `step` until
+// the clients are done.
+void run_all(std::vector<Task<>> &clients, std::vector<Task<>> &servers,
+             std::function<void()> const &step) {
+  for (auto &t : servers) {
+    t.coro_.resume();
+  }
+  for (auto &t : clients) {
+    t.coro_.resume();
+  }
+  for (auto &t : clients) {
+    while (!t.coro_.done()) {
+      step();
+    }
+    t.result();
+  }
+}
+
+double report(char const *transport, char const *route, int requests,
+              std::chrono::steady_clock::time_point start, std::size_t bytes) {
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  auto ns = elapsed.count() * 1e9 / requests;
+  std::printf("%-10s %-8s %10d requests %8.3f s %12.0f req/s %10.1f ns/req "
+              "%6zu body bytes/req\n",
+              transport, route, requests, elapsed.count(),
+              requests / elapsed.count(), ns, bytes / requests);
+  return ns;
+}
+
+double run_memory(char const *route, std::string_view request,
+                  HTTPRouter const &router, int requests, int connections) {
+  TimedScheduler sched;
+  EpollScheduler loop; // Only passed along; nothing waits on it.
+  std::vector<std::unique_ptr<MemoryConnection>> conns;
+  std::vector<Task<>> clients, servers;
+  std::size_t bytes = 0;
+  for (int i = 0; i < connections; i++) {
+    auto &c = *conns.emplace_back(std::make_unique<MemoryConnection>(sched));
+    servers.push_back(serve(loop, c.server, router));
+    clients.push_back(send(c.client, request, requests / connections, bytes));
+  }
+  auto start = std::chrono::steady_clock::now();
+  run_all(clients, servers, [&] {
+    if (sched.ready_coros_.empty()) {
+      throw std::runtime_error("deadlock\n" + SOURCE_LOCATION());
+    }
+    sched.run();
+  });
+  auto ns = report("memory", route, requests, start, bytes);
+  for (auto &c : conns) {
+    c->client.shutdown();
+  }
+  sched.run();
+  return ns;
+}
+
+double run_socketpair(char const *route, std::string_view request,
+                      HTTPRouter const &router, int requests,
+                      int connections) {
+  EpollScheduler loop;
+  std::vector<std::unique_ptr<AsyncFileBuffer>> ends;
+  std::vector<Task<>> clients, servers;
+  std::size_t bytes = 0;
+  for (int i = 0; i < connections; i++) {
+    int fds[2];
+    CHECK_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    auto &server = *ends.emplace_back(
+        std::make_unique<AsyncFileBuffer>(loop, AsyncFile(fds[0])));
+    auto &client = *ends.emplace_back(
+        std::make_unique<AsyncFileBuffer>(loop, AsyncFile(fds[1])));
+    servers.push_back(serve(loop, server, router));
+    clients.push_back(send(client, request, requests / connections, bytes));
+  }
+  auto start = std::chrono::steady_clock::now();
+  run_all(clients, servers, [&] { loop.run(); });
+  auto ns = report("socketpair", route, requests, start, bytes);
+  for (std::size_t i = 1; i < ends.size(); i += 2) {
+    CHECK_SYSCALL(shutdown(ends[i]->file_.fd_, SHUT_WR));
+  }
+  for (auto &t : servers) {
+    while (!t.coro_.done()) {
+      loop.run();
+    }
+  }
+  return ns;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  int requests = argc > 1 ? std::stoi(argv[1]) : 1000000;
+  int connections = argc > 2 ? std::stoi(argv[2]) : 1;
+  requests -= requests % connections;
+
+  HeaderTemplate headers;
+  HeaderTemplate::Scope scope(headers);
+  auto router = make_router();
+
+  for (auto [route, request] : {std::pair{"dynamic", dynamic_request},
+                                std::pair{"static", static_request}}) {
+    auto memory = run_memory(route, request, router, requests, connections);
+    // The kernel is slower; fewer requests are enough.
+    auto socket = run_socketpair(route, request, router, requests / 10,
+                                 connections);
+    std::printf("%s: %.1f ns/req in the HTTP stack, %.1f ns/req in the "
+                "transport\n",
+                route, memory, socket - memory);
+  }
+  return 0;
+}
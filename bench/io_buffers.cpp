@@ -0,0 +1,149 @@
+// Gives every connection an input and an output buffer of 8 KiB, either from
+// the heap or from IOBufferSlab, and then serves requests on connections
+// picked at random: a request is copied into the input buffer and a response
+// into the output buffer. Each connection also owns an arena block from the
+// heap, allocated between its buffers, as a server's would.
+//
+// The data TLB misses are counted with perf_event_open() when it's allowed
+// (see /proc/sys/kernel/perf_event_paranoid).
+//
+// Usage: io_buffers [connections] [requests]
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <linux/perf_event.h>
+#include <memory>
+#include <random>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "io_buffer.hpp"
+
+using namespace coro;
+
+namespace {
+struct Connection {
+  IOBuffer in;
+  std::unique_ptr<char[]> arena;
+  IOBuffer out;
+};
+
+// Counts the data TLB misses of this thread while it's alive.
+struct TLBMisses {
+  TLBMisses() {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd_ != -1) {
+      ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+
+  ~TLBMisses() {
+    if (fd_ != -1) {
+      close(fd_);
+    }
+  }
+
+  // -1 if they can't be counted.
+  long long read() {
+    long long n;
+    if (fd_ == -1 || ::read(fd_, &n, sizeof(n)) != sizeof(n)) {
+      return -1;
+    }
+    return n;
+  }
+
+  int fd_;
+};
+
+// The anonymous memory of the process that is backed by huge pages.
+std::string anon_huge_pages() {
+  std::ifstream f("/proc/self/smaps_rollup");
+  std::string line;
+  while (std::getline(f, line)) {
+    if (line.starts_with("AnonHugePages:")) {
+      return line.substr(line.find_first_not_of(' ', 14));
+    }
+  }
+  return "?";
+}
+} // namespace
+
+template <class MakeBuffer>
+static void run(char const *name, MakeBuffer &&make_buffer, int connections,
+                int requests) {
+  std::vector<Connection> conns;
+  conns.reserve(connections);
+  for (int i = 0; i < connections; i++) {
+    auto &c = conns.emplace_back();
+    c.in = make_buffer();
+    c.arena = std::make_unique<char[]>(4096);
+    c.out = make_buffer();
+  }
+
+  char request[160];
+  char response[200];
+  std::memset(request, 'q', sizeof(request));
+  std::memset(response, 'r', sizeof(response));
+  // Every buffer is touched once before measuring, so page faults aren't.
+  for (auto &c : conns) {
+    std::memcpy(c.in.get(), request, sizeof(request));
+    std::memcpy(c.out.get(), response, sizeof(response));
+  }
+
+  std::mt19937 gen(42);
+  std::uniform_int_distribution<int> pick(0, connections - 1);
+  std::uint64_t sum = 0;
+  TLBMisses misses;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < requests; i++) {
+    auto &c = conns[pick(gen)];
+    std::memcpy(c.in.get(), request, sizeof(request));
+    sum += c.in[i % sizeof(request)];
+    std::memcpy(c.out.get(), response, sizeof(response));
+    sum += c.out[i % sizeof(response)];
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  auto n = misses.read();
+
+  std::printf("%-6s %8d connections %10d requests %8.1f ns/req ", name,
+              connections, requests, elapsed.count() / requests);
+  if (n >= 0) {
+    std::printf("%8.3f dTLB misses/req", double(n) / requests);
+  } else {
+    std::printf("dTLB misses: n/a");
+  }
+  std::printf(" AnonHugePages: %s (%llu)\n", anon_huge_pages().c_str(),
+              static_cast<unsigned long long>(sum % 10));
+}
+
+int main(int argc, char **argv) {
+  int connections = argc > 1 ? std::stoi(argv[1]) : 100000;
+  int requests = argc > 2 ? std::stoi(argv[2]) : 10000000;
+
+  run(
+      "heap", [] { return IOBuffer(new char[8192]); }, connections, requests);
+  run(
+      "slab", [] { return make_io_buffer(8192); }, connections, requests);
+
+  auto &stats = IOBufferSlab::local().stats();
+  std::printf("slab regions: %zu hugetlb, %zu transparent, %zu MiB\n",
+              stats.hugetlb_regions, stats.thp_regions, stats.bytes >> 20);
+  return 0;
+}
@@ -0,0 +1,509 @@
+// Microbenchmarks of the core primitives, without the network. Each one is run
+// for at least --min-time seconds, --repeat times, and the median time per
+// operation is reported, along with the fastest and the slowest run.
+//
+// With --json the results are printed as JSON, so that the runs of two commits
+// can be saved and compared:
+//
+//   {"context": {...}, "benchmarks": [{"name": "task/run", "iterations": ...,
+//    "ns_per_op": ..., "min_ns_per_op": ..., "max_ns_per_op": ...}, ...]}
+//
+// Usage: micro [--json] [--filter=substring] [--min-time=seconds]
+//              [--repeat=n]
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <functional>
+#include <map>
+#include <span>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#include "aio.hpp"
+#include "epoll.hpp"
+#include "http.hpp"
+#include "latency.hpp"
+#include "loop_monitor.hpp"
+#include "task.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+namespace {
+// Keeps the compiler from optimizing `v` away.
+template <class T> void do_not_optimize(T const &v) {
+  asm volatile("" : : "r,m"(v) : "memory");
+}
+
+// Runs `n` operations.
+using Body = std::function<void(std::size_t n)>;
+
+struct Benchmark {
+  std::string name;
+  Body body;
+};
+
+struct Result {
+  std::string name;
+  std::size_t iterations;
+  double ns_per_op;
+  double min_ns_per_op;
+  double max_ns_per_op;
+};
+
+double seconds(Body const &body, std::size_t n) {
+  auto start = std::chrono::steady_clock::now();
+  body(n);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+Result measure(Benchmark const &b, double min_time, int repeat) {
+  // Find how many operations take min_time.
+  std::size_t n = 1;
+  while (true) {
+    auto t = seconds(b.body, n);
+    if (t >= min_time) {
+      break;
+    }
+    auto scale = t > 0 ? min_time / t * 1.2 : 10;
+    n = std::max(n + 1, static_cast<std::size_t>(n * std::min(scale, 10.0)));
+  }
+  std::vector<double> ns;
+  for (int i = 0; i < repeat; i++) {
+    ns.push_back(seconds(b.body, n) * 1e9 / n);
+  }
+  std::sort(ns.begin(), ns.end());
+  return {b.name, n, ns[ns.size() / 2], ns.front(), ns.back()};
+}
+
+std::string json_string(std::string_view s) {
+  std::string out = "\"";
+  for (char ch : s) {
+    if (ch == '"' || ch == '\\') {
+      out += '\\';
+    }
+    out += ch;
+  }
+  return out + "\"";
+}
+
+//////////////////////////////// Tasks ////////////////////////////////
+
+Task<int> leaf(int x) { co_return x + 1; }
+
+Task<int> chain(int depth) {
+  if (depth == 0) {
+    co_return 0;
+  }
+  co_return co_await chain(depth - 1) + 1;
+}
+
+void task_create(std::size_t n) {
+  for (std::size_t i = 0; i < n; i++) {
+    auto t = leaf(i);
+    do_not_optimize(t.coro_);
+  }
+}
+
+void task_run(std::size_t n) {
+  for (std::size_t i = 0; i < n; i++) {
+    auto t = leaf(i);
+    t.coro_.resume();
+    do_not_optimize(t.result());
+  }
+}
+
+// Each level awaits the next one: a symmetric transfer in and one out.
+void task_await_chain(std::size_t n) {
+  for (std::size_t i = 0; i < n; i += 16) {
+    auto t = chain(16);
+    t.coro_.resume();
+    do_not_optimize(t.result());
+  }
+}
+
+Task<int> fan_out_2() {
+  auto [a, b] = co_await when_all(leaf(1), leaf(2));
+  co_return a + b;
+}
+
+Task<int> fan_out_8() {
+  auto [a, b, c, d, e, f, g, h] =
+      co_await when_all(leaf(1), leaf(2), leaf(3), leaf(4), leaf(5), leaf(6),
+                        leaf(7), leaf(8));
+  co_return a + b + c + d + e + f + g + h;
+}
+
+Task<int> first_of_8() {
+  auto v = co_await when_any(leaf(1), leaf(2), leaf(3), leaf(4), leaf(5),
+                             leaf(6), leaf(7), leaf(8));
+  co_return static_cast<int>(v.index());
+}
+
+template <Task<int> (*Make)()> void run_each(std::size_t n) {
+  for (std::size_t i = 0; i < n; i++) {
+    auto t = Make();
+    t.coro_.resume();
+    do_not_optimize(t.result());
+  }
+}
+
+//////////////////////////////// Timers ////////////////////////////////
+
+Task<> sleeper(TimedScheduler &sched, Clock::time_point expire) {
+  co_await sleep_until(sched, expire);
+}
+
+// Timers are inserted in batches that expire 1 us after the first one is
+// inserted, which is before the batch is complete, so run() fires them all
+// without waiting.
+void timer_insert_fire(std::size_t n) {
+  TimedScheduler sched;
+  std::vector<Task<>> batch;
+  batch.reserve(1024);
+  for (std::size_t i = 0; i < n;) {
+    auto expire = Clock::now() + 1us;
+    for (; batch.size() < 1024 && i < n; i++) {
+      auto &t = batch.emplace_back(sleeper(sched, expire));
+      t.coro_.resume();
+    }
+    while (sched.run()) {
+    }
+    batch.clear();
+  }
+}
+
+// The timers are canceled (their tasks destroyed) before they expire.
+void timer_insert_cancel(std::size_t n) {
+  TimedScheduler sched;
+  std::vector<Task<>> batch;
+  batch.reserve(1024);
+  auto expire = Clock::now() + 1h;
+  for (std::size_t i = 0; i < n;) {
+    for (; batch.size() < 1024 && i < n; i++) {
+      auto &t = batch.emplace_back(sleeper(sched, expire + i * 1ns));
+      t.coro_.resume();
+    }
+    batch.clear();
+  }
+}
+
+//////////////////////////////// Streams ////////////////////////////////
+
+// Reads the same bytes over and over.
+struct MemoryReader : AsyncIStreamBase<MemoryReader> {
+  explicit MemoryReader(std::string_view data) : data_(data) {}
+
+  Task<std::size_t> read(std::span<char> buffer) {
+    auto n = std::min(buffer.size(), data_.size() - pos_);
+    std::memcpy(buffer.data(), data_.data() + pos_, n);
+    pos_ = (pos_ + n) % data_.size();
+    co_return n;
+  }
+
+  std::string_view data_;
+  std::size_t pos_{};
+};
+
+// Discards what is written.
+struct NullWriter : AsyncOStreamBase<NullWriter> {
+  Task<std::size_t> write(std::span<char const> buffer) {
+    do_not_optimize(buffer.data());
+    co_return buffer.size();
+  }
+};
+
+void stream_getline(std::size_t n) {
+  std::string data;
+  while (data.size() < 64 * 1024) {
+    data += "Accept: text/html,application/xhtml+xml,application/xml\r\n";
+  }
+  MemoryReader reader(data);
+  auto t = [](MemoryReader &reader, std::size_t n) -> Task<> {
+    std::string line;
+    for (std::size_t i = 0; i < n; i++) {
+      line.clear();
+      co_await reader.getline("\r\n"sv, line);
+      do_not_optimize(line.data());
+    }
+  }(reader, n);
+  t.coro_.resume();
+  t.result();
+}
+
+template <std::size_t Size> void stream_puts(std::size_t n) {
+  static std::string const s(Size, 'x');
+  NullWriter writer;
+  auto t = [](NullWriter &writer, std::size_t n) -> Task<> {
+    for (std::size_t i = 0; i < n; i++) {
+      co_await writer.puts(s);
+    }
+    co_await writer.flush();
+  }(writer, n);
+  t.coro_.resume();
+  t.result();
+}
+
+//////////////////////////////// HTTP ////////////////////////////////
+
+constexpr std::string_view request =
+    "GET /api/v1/users/42?fields=name,email HTTP/1.1\r\n"
+    "Host: localhost:9000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+// The requests are pipelined over a socketpair, 32 at a time, so the epoll
+// wait and the read() that fills the buffer are shared by many of them.
+void http_read_from(std::size_t n) {
+  EpollScheduler sched;
+  int fds[2];
+  CHECK_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  AsyncFile client(fds[1]);
+  AsyncFileBuffer server(sched, AsyncFile(fds[0]), 64 * 1024);
+  std::string batch;
+  for (int i = 0; i < 32; i++) {
+    batch += request;
+  }
+  for (std::size_t i = 0; i < n; i += 32) {
+    CHECK_SYSCALL(write(client.fd_, batch.data(), batch.size()));
+    auto t = [](AsyncFileBuffer &server) -> Task<> {
+      HTTPRequest req;
+      for (int j = 0; j < 32; j++) {
+        co_await req.read_from(server);
+        do_not_optimize(req.headers.size());
+      }
+    }(server);
+    t.coro_.resume();
+    while (!t.coro_.done()) {
+      sched.run();
+    }
+    t.result();
+  }
+}
+
+HTTPRouter many_routes() {
+  HTTPRouter router;
+  HTTPHandler handler = [](HTTPRequest const &) -> Task<HTTPResponse> {
+    co_return HTTPResponse{.status = 200};
+  };
+  for (int i = 0; i < 200; i++) {
+    router.route(HTTPMethod::GET, std::format("/api/v1/resource{}", i),
+                 handler);
+    router.route_prefix(HTTPMethod::GET, std::format("/static/dir{}", i),
+                        handler);
+  }
+  return router;
+}
+
+void router_find_exact(std::size_t n) {
+  static auto const router = many_routes();
+  for (std::size_t i = 0; i < n; i++) {
+    auto const &h =
+        router.find_route(HTTPMethod::GET, "/api/v1/resource137?id=7"sv);
+    do_not_optimize(&h);
+  }
+}
+
+void router_find_prefix(std::size_t n) {
+  static auto const router = many_routes();
+  for (std::size_t i = 0; i < n; i++) {
+    auto const &h =
+        router.find_route(HTTPMethod::GET, "/static/dir137/css/site.css"sv);
+    do_not_optimize(&h);
+  }
+}
+
+void router_find_miss(std::size_t n) {
+  static auto const router = many_routes();
+  for (std::size_t i = 0; i < n; i++) {
+    auto const &h = router.find_route(HTTPMethod::GET, "/nothing/here"sv);
+    do_not_optimize(&h);
+  }
+}
+
+void uri_parse(std::size_t n) {
+  for (std::size_t i = 0; i < n; i++) {
+    auto uri = HTTPRequest::ParsedURI::from(
+        "/search?q=coroutines&page=2&sort=desc&lang=en"sv);
+    do_not_optimize(uri.params.size());
+  }
+}
+
+//////////////////////////////// latency ////////////////////////////////
+
+// The clock reads of a request's six phases and its recording, i.e. what
+// serve_connection() adds per request with a LatencyRecorder.
+void latency_record_request(std::size_t n) {
+  static LatencyRecorder recorder;
+  PhaseTimer timer;
+  timer.start();
+  for (std::size_t i = 0; i < n; i++) {
+    for (std::size_t p = 0; p < phase_count; p++) {
+      timer.mark(static_cast<Phase>(p));
+    }
+    recorder.record("/api/v1/resource137"sv, timer);
+    timer.clear();
+  }
+}
+
+// A coroutine that suspends each time it's resumed, to time the resumes.
+struct Suspender {
+  struct promise_type {
+    Suspender get_return_object() {
+      return {std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  std::coroutine_handle<promise_type> h;
+};
+
+Suspender suspend_forever() {
+  while (true) {
+    co_await std::suspend_always{};
+  }
+}
+
+template <bool monitored> void monitor_resume(std::size_t n) {
+  static LoopMonitor monitor;
+  auto h = suspend_forever().h;
+  for (std::size_t i = 0; i < n; i++) {
+    resume_monitored(monitored ? &monitor : nullptr, h);
+  }
+  monitor.before_wait();
+  h.destroy();
+}
+
+//////////////////////////////// cmp:: ////////////////////////////////
+
+template <class Compare> void compare(std::size_t n) {
+  Compare cmp;
+  std::string_view a = "Content-Type", b = "content-type";
+  for (std::size_t i = 0; i < n; i++) {
+    do_not_optimize(a.data());
+    do_not_optimize(cmp(a, b));
+  }
+}
+
+void header_lookup(std::size_t n) {
+  HTTPHeaders headers;
+  for (auto name : {"Host", "User-Agent", "Accept", "Accept-Language",
+                    "Accept-Encoding", "Connection", "Cookie", "Referer"}) {
+    headers[name] = "value";
+  }
+  for (std::size_t i = 0; i < n; i++) {
+    do_not_optimize(headers.find("accept-encoding"sv));
+  }
+}
+
+std::vector<Benchmark> benchmarks() {
+  return {
+      {"task/create", task_create},
+      {"task/run", task_run},
+      {"task/await_chain_per_level", task_await_chain},
+      {"when_all/2", run_each<fan_out_2>},
+      {"when_all/8", run_each<fan_out_8>},
+      {"when_any/8", run_each<first_of_8>},
+      {"timed/insert_fire", timer_insert_fire},
+      {"timed/insert_cancel", timer_insert_cancel},
+      {"stream/getline", stream_getline},
+      {"stream/puts_16", stream_puts<16>},
+      {"stream/puts_1024", stream_puts<1024>},
+      {"stream/puts_16384", stream_puts<16384>},
+      {"http/read_from", http_read_from},
+      {"router/find_exact_400_routes", router_find_exact},
+      {"router/find_prefix_400_routes", router_find_prefix},
+      {"router/find_miss_400_routes", router_find_miss},
+      {"uri/parse", uri_parse},
+      {"latency/record_request", latency_record_request},
+      {"monitor/resume", monitor_resume<true>},
+      {"monitor/resume_unmonitored", monitor_resume<false>},
+      {"cmp/case_insensitive_less", compare<cmp::CaseInsensitiveLess>},
+      {"cmp/case_insensitive_equal", compare<cmp::CaseInsensitiveEqual>},
+      {"cmp/case_insensitive_hash",
+       [](std::size_t n) {
+         cmp::CaseInsensitiveHash hash;
+         std::string_view s = "Accept-Encoding";
+         for (std::size_t i = 0; i < n; i++) {
+           do_not_optimize(s.data());
+           do_not_optimize(hash(s));
+         }
+       }},
+      {"cmp/header_map_find", header_lookup},
+  };
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  bool json = false;
+  std::string filter;
+  double min_time = 0.1;
+  int repeat = 5;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (arg == "--json") {
+      json = true;
+    } else if (arg.starts_with("--filter=")) {
+      filter = arg.substr(9);
+    } else if (arg.starts_with("--min-time=")) {
+      min_time = std::stod(std::string(arg.substr(11)));
+    } else if (arg.starts_with("--repeat=")) {
+      repeat = std::max(1, std::stoi(std::string(arg.substr(9))));
+    } else {
+      std::fprintf(stderr,
+                   "usage: %s [--json] [--filter=substring] "
+                   "[--min-time=seconds] [--repeat=n]\n",
+                   argv[0]);
+      return 2;
+    }
+  }
+
+  std::vector<Result> results;
+  for (auto const &b : benchmarks()) {
+    if (!b.name.contains(filter)) {
+      continue;
+    }
+    auto &r = results.emplace_back(measure(b, min_time, repeat));
+    if (!json) {
+      std::printf("%-32s %12zu iterations %10.2f ns/op (min %.2f, max %.2f)\n",
+                  r.name.c_str(), r.iterations, r.ns_per_op, r.min_ns_per_op,
+                  r.max_ns_per_op);
+    }
+  }
+
+  if (json) {
+    char date[32];
+    auto now = std::time(nullptr);
+    std::strftime(date, sizeof(date), "%FT%TZ", std::gmtime(&now));
+    std::printf("{\n  \"context\": {\"date\": \"%s\", \"compiler\": %s, "
+                "\"min_time\": %g, \"repeat\": %d},\n  \"benchmarks\": [\n",
+                date, json_string(__VERSION__).c_str(), min_time, repeat);
+    for (std::size_t i = 0; i < results.size(); i++) {
+      auto &r = results[i];
+      std::printf("    {\"name\": %s, \"iterations\": %zu, \"ns_per_op\": %.3f, "
+                  "\"min_ns_per_op\": %.3f, \"max_ns_per_op\": %.3f}%s\n",
+                  json_string(r.name).c_str(), r.iterations, r.ns_per_op,
+                  r.min_ns_per_op, r.max_ns_per_op,
+                  i + 1 < results.size() ? "," : "");
+    }
+    std::printf("  ]\n}\n");
+  }
+  return 0;
+}
@@ -0,0 +1,76 @@
+// A thundering herd: N identical requests arrive at the same time for a route
+// that waits on a backend for a while and then spends some CPU time. Compares
+// handler invocations and latency with and without a RequestCoalescer.
+//
+// Usage: request_coalescing [clients]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cache.hpp"
+#include "http.hpp"
+#include "task.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+static TimedScheduler sched;
+static int invocations = 0;
+
+static Task<HTTPResponse> expensive(HTTPRequest req) {
+  ++invocations;
+  co_await sleep_for(sched, 5ms); // The backend.
+  HTTPResponse res;
+  res.status = 200;
+  for (int i = 0; i < 2000; i++) {
+    res.body += std::to_string(i * i);
+  }
+  co_return res;
+}
+
+static Task<> client(HTTPHandler const &handler,
+                     std::vector<Clock::duration> &latencies) {
+  HTTPRequest req{.method = "GET", .uri = "/"};
+  auto start = Clock::now();
+  auto res = co_await handler(req);
+  latencies.push_back(Clock::now() - start);
+}
+
+static void run(char const *name, HTTPHandler const &handler, int clients) {
+  invocations = 0;
+  std::vector<Clock::duration> latencies;
+  std::vector<Task<>> tasks;
+  for (int i = 0; i < clients; i++) {
+    tasks.push_back(client(handler, latencies));
+    tasks.back().coro_.resume();
+  }
+  while (auto delay = sched.run()) {
+    std::this_thread::sleep_for(*delay);
+  }
+  std::ranges::sort(latencies);
+  auto ms = [&](double q) {
+    auto d = latencies[std::min<std::size_t>(latencies.size() - 1,
+                                             q * latencies.size())];
+    return std::chrono::duration<double, std::milli>(d).count();
+  };
+  std::printf("%-10s clients: %5d invocations: %5d p50: %8.3f ms p99: %8.3f "
+              "ms max: %8.3f ms\n",
+              name, clients, invocations, ms(0.5), ms(0.99), ms(1.0));
+}
+
+int main(int argc, char **argv) {
+  int clients = argc > 1 ? std::stoi(argv[1]) : 1000;
+
+  run("plain", expensive, clients);
+
+  RequestCoalescer flights(expensive, {}, &sched);
+  run(
+      "coalesced",
+      [&](HTTPRequest req) { return flights.handle(std::move(req)); },
+      clients);
+  return 0;
+}
@@ -0,0 +1,65 @@
+// Compares an expensive route with and without a ResponseCache in front of it.
+// The handlers are driven directly so the numbers exclude the network.
+//
+// Usage: response_cache [requests]
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "cache.hpp"
+#include "http.hpp"
+
+using namespace coro;
+
+// Roughly what a page that renders a few hundred rows costs.
+static Task<HTTPResponse> expensive(HTTPRequest req) {
+  HTTPResponse res;
+  res.status = 200;
+  res.headers["Content-Type"] = "text/html";
+  auto n = std::stoi(std::string{req.parse_uri().params.at("rows")});
+  for (int i = 0; i < n; i++) {
+    res.body += std::format("<tr><td>{}</td><td>{}</td></tr>", i, i * i);
+  }
+  co_return res;
+}
+
+template <class Handler>
+static double run(char const *name, Handler &&handler, int requests) {
+  std::size_t bytes = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < requests; i++) {
+    auto t = handler(HTTPRequest{.method = "GET", .uri = "/table?rows=500"});
+    t.coro_.resume();
+    bytes += t.result().to_string().size();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  auto qps = requests / elapsed.count();
+  std::printf("%-10s %10d requests %8.3f s %12.0f req/s %10zu bytes/req\n",
+              name, requests, elapsed.count(), qps, bytes / requests);
+  return qps;
+}
+
+int main(int argc, char **argv) {
+  int requests = argc > 1 ? std::stoi(argv[1]) : 100000;
+
+  auto uncached = run("uncached", expensive, requests);
+
+  ResponseCache cache(expensive, ResponseCacheOptions{
+                                     .ttl = std::chrono::seconds(1),
+                                     .stale_while_revalidate =
+                                         std::chrono::seconds(10),
+                                     .query_params = {"rows"},
+                                 });
+  auto cached = run(
+      "cached", [&](HTTPRequest req) { return cache.handle(std::move(req)); },
+      requests);
+
+  auto const &stats = cache.stats();
+  std::printf("speedup: %.1fx (hits: %zu, stale hits: %zu, misses: %zu, "
+              "refreshes: %zu)\n",
+              cached / uncached, stats.hits, stats.stale_hits, stats.misses,
+              stats.refreshes);
+  return 0;
+}
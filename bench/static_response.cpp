@@ -0,0 +1,81 @@
+// Compares serving /home through its handler with serving it as a static
+// response registered with HTTPRouter::route_static(). Each request is looked
+// up, answered and appended to an output buffer, which is what the connection
+// driver does before writing to the socket. The network is excluded.
+//
+// Usage: static_response [requests]
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "default_headers.hpp"
+#include "etag.hpp"
+#include "http.hpp"
+#include "static_response.hpp"
+
+using namespace coro;
+
+static HTTPResponse home() {
+  return HTTPResponse{
+      .status = 200,
+      .headers = {{"Content-Type", "text/html"}},
+      .body = "<h1>Hello, World!</h1>",
+  };
+}
+
+template <class Respond>
+static double run(char const *name, Respond &&respond, int requests) {
+  HTTPRequest req{.method = "GET", .uri = "/home"};
+  std::string out;
+  std::size_t bytes = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < requests; i++) {
+    out.clear();
+    respond(req, out);
+    bytes += out.size();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  auto qps = requests / elapsed.count();
+  std::printf("%-10s %10d requests %8.3f s %12.0f req/s %10zu bytes/req\n",
+              name, requests, elapsed.count(), qps, bytes / requests);
+  return qps;
+}
+
+int main(int argc, char **argv) {
+  int requests = argc > 1 ? std::stoi(argv[1]) : 1000000;
+
+  HTTPRouter dynamic;
+  dynamic.route(HTTPMethod::GET, "/home", [](HTTPRequest) -> Task<HTTPResponse> {
+    auto res = home();
+    add_etag(res);
+    co_return res;
+  });
+  auto before = run(
+      "handler",
+      [&](HTTPRequest const &req, std::string &out) {
+        auto const &handler = dynamic.find_route(req.method, req.uri);
+        auto t = handler(req);
+        t.coro_.resume();
+        auto res = t.result();
+        evaluate_conditional(req, res);
+        out += res.to_string(default_response_headers());
+      },
+      requests);
+
+  HTTPRouter router;
+  router.route_static(HTTPMethod::GET, "/home", home());
+  auto after = run(
+      "static",
+      [&](HTTPRequest const &req, std::string &out) {
+        auto s = router.find_static(http_method(req.method), req.uri);
+        for (auto sv : s->select(req)->pieces(default_response_headers())) {
+          out += sv;
+        }
+      },
+      requests);
+
+  std::printf("speedup: %.1fx\n", after / before);
+  return 0;
+}
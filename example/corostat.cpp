@@ -0,0 +1,170 @@
+// Shows the stats of a running server, like top, from its stats segment (see
+// stats_segment.hpp), so it never touches the server's sockets. Each line is
+// a loop: its gauges and the rates of its counters over the last interval.
+//
+// The server is given by its pid (its segment is then at
+// stats_segment_path(pid)) or by the path of the segment.
+//
+// Usage: corostat <pid | path> [--interval=1] [--count=n]
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <format>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "stats.hpp"
+#include "stats_segment.hpp"
+
+using namespace coro;
+
+namespace {
+struct Options {
+  std::string path;
+  double interval = 1;
+  long count = 0; // 0: until the server is gone.
+};
+
+Options parse_options(int argc, char **argv) {
+  Options o;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    auto value = [&](std::string_view name) -> std::optional<std::string> {
+      if (arg.starts_with(name) && arg.substr(name.size()).starts_with('=')) {
+        return std::string(arg.substr(name.size() + 1));
+      }
+      return std::nullopt;
+    };
+    if (auto v = value("--interval")) {
+      o.interval = std::max(0.05, std::stod(*v));
+    } else if (auto v = value("--count")) {
+      o.count = std::stol(*v);
+    } else if (!arg.starts_with("--") && o.path.empty()) {
+      bool pid = std::all_of(arg.begin(), arg.end(),
+                             [](char ch) { return ch >= '0' && ch <= '9'; });
+      o.path = pid ? stats_segment_path(std::stol(std::string(arg)))
+                   : std::string(arg);
+    } else {
+      throw std::invalid_argument(std::format("unknown option: {}", arg));
+    }
+  }
+  if (o.path.empty()) {
+    throw std::invalid_argument(
+        "usage: corostat <pid | path> [--interval=1] [--count=n]");
+  }
+  return o;
+}
+
+std::int64_t value(StatsSegmentSlot const &s, Stat stat) {
+  return s.values[static_cast<std::size_t>(stat)];
+}
+
+// The rate of `get` between two copies of a slot.
+template <class Get>
+double rate(StatsSegmentSlot const &now, StatsSegmentSlot const &before,
+            Get get) {
+  if (now.time_ns <= before.time_ns) {
+    return 0;
+  }
+  return (get(now) - get(before)) * 1e9 / (now.time_ns - before.time_ns);
+}
+
+void print(StatsSegmentReader const &reader,
+           std::vector<StatsSegmentSlot> const &now,
+           std::vector<StatsSegmentSlot> const &before) {
+  std::printf("pid %llu, %zu loops\n\n",
+              static_cast<unsigned long long>(reader.pid()), now.size());
+  std::printf("%4s %8s %6s %9s %9s %8s %8s %8s %9s %9s %8s %7s %6s %6s %5s\n",
+              "loop", "tid", "conns", "accept/s", "req/s", "2xx/s", "4xx/s",
+              "5xx/s", "in KB/s", "out KB/s", "wake/s", "ev/wake", "timers",
+              "ready", "exc");
+  for (std::size_t i = 0; i < now.size(); i++) {
+    auto const &n = now[i];
+    auto const &b = i < before.size() ? before[i] : now[i];
+    auto stat = [](Stat s) {
+      return [s](StatsSegmentSlot const &slot) {
+        return static_cast<double>(value(slot, s));
+      };
+    };
+    auto status = [](std::size_t c) {
+      return [c](StatsSegmentSlot const &slot) {
+        return static_cast<double>(slot.responses[c]);
+      };
+    };
+    auto wakeups = value(n, Stat::EPOLL_WAKEUPS) - value(b, Stat::EPOLL_WAKEUPS);
+    auto events = value(n, Stat::EPOLL_EVENTS) - value(b, Stat::EPOLL_EVENTS);
+    std::printf(
+        "%4zu %8llu %6lld %9.1f %9.1f %8.1f %8.1f %8.1f %9.1f %9.1f %8.1f "
+        "%7.2f %6lld %6lld %5lld\n",
+        i, static_cast<unsigned long long>(n.tid),
+        static_cast<long long>(value(n, Stat::OPEN_CONNECTIONS)),
+        rate(n, b, stat(Stat::ACCEPTS)), rate(n, b, stat(Stat::REQUESTS)),
+        rate(n, b, status(2)), rate(n, b, status(4)), rate(n, b, status(5)),
+        rate(n, b, stat(Stat::BYTES_READ)) / 1024,
+        rate(n, b, stat(Stat::BYTES_WRITTEN)) / 1024,
+        rate(n, b, stat(Stat::EPOLL_WAKEUPS)),
+        wakeups ? double(events) / wakeups : 0.0,
+        static_cast<long long>(value(n, Stat::TIMERS)),
+        static_cast<long long>(value(n, Stat::READY_COROS)),
+        static_cast<long long>(value(n, Stat::EXCEPTIONS)));
+  }
+  std::fflush(stdout);
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  Options o;
+  try {
+    o = parse_options(argc, argv);
+  } catch (std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 2;
+  }
+  try {
+    StatsSegmentReader reader(o.path);
+    bool tty = isatty(STDOUT_FILENO);
+    std::vector<StatsSegmentSlot> before;
+    for (long frame = 0; o.count == 0 || frame <= o.count; frame++) {
+      if (kill(static_cast<pid_t>(reader.pid()), 0) == -1 && errno == ESRCH) {
+        std::fprintf(stderr, "process %llu is gone\n",
+                     static_cast<unsigned long long>(reader.pid()));
+        return 1;
+      }
+      std::vector<StatsSegmentSlot> now;
+      for (std::size_t i = 0; i < reader.loops(); i++) {
+        // A slot being written for too long keeps its last copy.
+        auto slot = reader.read(i);
+        if (!slot && i < before.size()) {
+          slot = before[i];
+        }
+        now.push_back(slot.value_or(StatsSegmentSlot{}));
+      }
+      // The first frame only gives the rates something to start from.
+      if (frame > 0) {
+        if (tty) {
+          std::printf("\x1b[H\x1b[2J");
+        } else if (frame > 1) {
+          std::printf("\n");
+        }
+        print(reader, now, before);
+      }
+      before = std::move(now);
+      if (o.count == 0 || frame < o.count) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(o.interval));
+      }
+    }
+  } catch (std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,287 @@
+// An HTTP load generator built on the library's own client side:
+// create_tcp_client(), HTTPRequest::write_to() and HTTPResponse::read_from().
+//
+// The connections are spread over loop threads. Each connection sends a
+// request, waits for its response and sends the next one, on the same
+// connection (keep-alive) or on a new one (--close).
+//
+// With --rate, requests are sent on a fixed schedule, whatever the server's
+// speed (an open loop), and a latency is measured from the time the request
+// was due rather than from the time it was sent. A server that stalls then
+// gets the latency its clients would see, instead of the stall delaying the
+// measurements (coordinated omission). Without --rate, each connection sends
+// as fast as it's answered.
+//
+// Responses must have a Content-Length (chunked ones are not read).
+//
+// Usage: loadgen [--host=127.0.0.1] [--port=9000] [--path=/home]
+//                [--connections=64] [--threads=4] [--duration=10]
+//                [--rate=requests/s] [--close] [--json]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "epoll.hpp"
+#include "histogram.hpp"
+#include "http.hpp"
+#include "socket.hpp"
+#include "task.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+namespace {
+struct Options {
+  std::string host = "127.0.0.1";
+  int port = 9000;
+  std::string path = "/home";
+  int connections = 64;
+  int threads = 4;
+  double duration = 10; // Seconds.
+  double rate = 0;      // Requests per second, of all connections. 0: closed.
+  bool close = false;
+  bool json = false;
+};
+
+struct Stats {
+  Histogram latency; // Nanoseconds.
+  std::uint64_t requests{};
+  std::uint64_t errors{};
+  std::uint64_t connects{};
+  std::uint64_t bytes{}; // Of the response bodies.
+  std::uint64_t status[6]{}; // By class: 1xx to 5xx, and 0 for the others.
+};
+
+// The loop of a thread, with its connections.
+struct Worker {
+  TimedScheduler timed;
+  EpollScheduler epoll;
+  Stats stats;
+
+  void run(std::vector<Task<>> &tasks) {
+    for (auto &t : tasks) {
+      t.coro_.resume();
+    }
+    auto done = [&] {
+      return std::all_of(tasks.begin(), tasks.end(),
+                         [](auto &t) { return t.coro_.done(); });
+    };
+    while (!done()) {
+      auto timeout = timed.run();
+      if (epoll.have_registered_events()) {
+        epoll.run(timeout);
+      } else if (timeout) {
+        std::this_thread::sleep_for(*timeout);
+      }
+    }
+  }
+};
+
+Task<> run_connection(Worker &w, Options const &o, SocketAddress const &addr,
+                      Clock::time_point start, Clock::time_point deadline,
+                      Clock::duration interval) {
+  HTTPRequest req{.method = "GET", .uri = std::pmr::string(o.path)};
+  req.headers["Host"] = o.host;
+  req.headers["User-Agent"] = "coro-loadgen";
+  if (o.close) {
+    req.headers["Connection"] = "close";
+  }
+  HTTPResponse res;
+  AsyncFileBuffer conn;
+  bool open = false;
+
+  auto next = start;
+  while (true) {
+    Clock::time_point due;
+    if (interval.count()) {
+      if (next >= deadline) {
+        break;
+      }
+      co_await sleep_until(w.timed, next);
+      due = next;
+      next += interval;
+    } else {
+      due = Clock::now();
+      if (due >= deadline) {
+        break;
+      }
+    }
+
+    try {
+      if (!open) {
+        conn.open(w.epoll, co_await create_tcp_client(w.epoll, addr));
+        open = true;
+        ++w.stats.connects;
+      }
+      co_await req.write_to(conn);
+      co_await conn.flush();
+      co_await res.read_from(conn);
+      auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          Clock::now() - due);
+      w.stats.latency.record(latency.count());
+      ++w.stats.requests;
+      ++w.stats.status[res.status >= 100 && res.status < 600 ? res.status / 100
+                                                             : 0];
+      w.stats.bytes += res.body.size();
+      if (o.close || !res.keep_alive()) {
+        conn.clear();
+        open = false;
+      }
+    } catch (std::exception &) {
+      ++w.stats.errors;
+      conn.clear();
+      open = false;
+    }
+  }
+}
+
+Options parse_options(int argc, char **argv) {
+  Options o;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    auto value = [&](std::string_view name) -> std::optional<std::string> {
+      if (arg.starts_with(name) && arg.substr(name.size()).starts_with('=')) {
+        return std::string(arg.substr(name.size() + 1));
+      }
+      return std::nullopt;
+    };
+    if (auto v = value("--host")) {
+      o.host = *v;
+    } else if (auto v = value("--port")) {
+      o.port = std::stoi(*v);
+    } else if (auto v = value("--path")) {
+      o.path = *v;
+    } else if (auto v = value("--connections")) {
+      o.connections = std::max(1, std::stoi(*v));
+    } else if (auto v = value("--threads")) {
+      o.threads = std::max(1, std::stoi(*v));
+    } else if (auto v = value("--duration")) {
+      o.duration = std::stod(*v);
+    } else if (auto v = value("--rate")) {
+      o.rate = std::stod(*v);
+    } else if (arg == "--close") {
+      o.close = true;
+    } else if (arg == "--json") {
+      o.json = true;
+    } else {
+      throw std::invalid_argument(std::format("unknown option: {}", arg));
+    }
+  }
+  o.threads = std::min(o.threads, o.connections);
+  return o;
+}
+
+void report(Options const &o, Stats const &s, double elapsed) {
+  static constexpr double percentiles[] = {50, 90, 99, 99.9, 99.99, 100};
+  auto ms = [](std::uint64_t ns) { return ns / 1e6; };
+  if (o.json) {
+    std::printf("{\n");
+    std::printf("  \"options\": {\"host\": \"%s\", \"port\": %d, \"path\": "
+                "\"%s\", \"connections\": %d, \"threads\": %d, \"duration\": "
+                "%g, \"rate\": %g, \"keep_alive\": %s},\n",
+                o.host.c_str(), o.port, o.path.c_str(), o.connections,
+                o.threads, o.duration, o.rate, o.close ? "false" : "true");
+    std::printf("  \"elapsed\": %.3f,\n  \"requests\": %llu,\n  \"errors\": "
+                "%llu,\n  \"connects\": %llu,\n  \"requests_per_sec\": %.1f,\n"
+                "  \"body_bytes\": %llu,\n",
+                elapsed, (unsigned long long)s.requests,
+                (unsigned long long)s.errors, (unsigned long long)s.connects,
+                s.requests / elapsed, (unsigned long long)s.bytes);
+    std::printf("  \"status\": {\"1xx\": %llu, \"2xx\": %llu, \"3xx\": %llu, "
+                "\"4xx\": %llu, \"5xx\": %llu, \"other\": %llu},\n",
+                (unsigned long long)s.status[1],
+                (unsigned long long)s.status[2],
+                (unsigned long long)s.status[3],
+                (unsigned long long)s.status[4],
+                (unsigned long long)s.status[5],
+                (unsigned long long)s.status[0]);
+    std::printf("  \"latency_ms\": {\"min\": %.3f, \"mean\": %.3f",
+                ms(s.latency.min()), s.latency.mean() / 1e6);
+    for (auto p : percentiles) {
+      std::printf(", \"p%g\": %.3f", p, ms(s.latency.percentile(p)));
+    }
+    std::printf("}\n}\n");
+    return;
+  }
+  std::printf("%d connections on %d threads, %s, %s, %.1f s\n", o.connections,
+              o.threads, o.close ? "close" : "keep-alive",
+              o.rate ? std::format("{} requests/s scheduled", o.rate).c_str()
+                     : "as fast as possible",
+              elapsed);
+  std::printf("  requests: %llu (%.1f/s), errors: %llu, connects: %llu\n",
+              (unsigned long long)s.requests, s.requests / elapsed,
+              (unsigned long long)s.errors, (unsigned long long)s.connects);
+  std::printf("  status: 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu\n",
+              (unsigned long long)s.status[2], (unsigned long long)s.status[3],
+              (unsigned long long)s.status[4], (unsigned long long)s.status[5],
+              (unsigned long long)(s.status[0] + s.status[1]));
+  std::printf("  latency (ms): min %.3f, mean %.3f\n", ms(s.latency.min()),
+              s.latency.mean() / 1e6);
+  for (auto p : percentiles) {
+    std::printf("    p%-6g %10.3f\n", p, ms(s.latency.percentile(p)));
+  }
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  Options o;
+  try {
+    o = parse_options(argc, argv);
+  } catch (std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 2;
+  }
+  auto addr = socket_address(ip_address(o.host.c_str()), o.port);
+
+  // Every connection sends rate / connections requests a second. Their
+  // schedules are staggered over one interval so they don't send together.
+  Clock::duration interval{};
+  if (o.rate > 0) {
+    interval = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(o.connections / o.rate));
+  }
+  auto start = Clock::now() + 10ms;
+  auto deadline = start + std::chrono::duration_cast<Clock::duration>(
+                              std::chrono::duration<double>(o.duration));
+
+  std::vector<Worker> workers(o.threads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < o.threads; t++) {
+    threads.emplace_back([&, t] {
+      auto &w = workers[t];
+      std::vector<Task<>> tasks;
+      for (int c = t; c < o.connections; c += o.threads) {
+        auto offset = interval * c / o.connections;
+        tasks.push_back(run_connection(w, o, addr, start + offset, deadline,
+                                       interval));
+      }
+      w.run(tasks);
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+
+  Stats total;
+  for (auto &w : workers) {
+    total.latency.merge(w.stats.latency);
+    total.requests += w.stats.requests;
+    total.errors += w.stats.errors;
+    total.connects += w.stats.connects;
+    total.bytes += w.stats.bytes;
+    for (int i = 0; i < 6; i++) {
+      total.status[i] += w.stats.status[i];
+    }
+  }
+  report(o, total, elapsed.count());
+  return 0;
+}
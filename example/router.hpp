@@ -1,38 +1,46 @@
 #pragma once
 
+#include "cache.hpp"
 #include "http.hpp"
+#include "latency.hpp"
+#include "metrics.hpp"
+#include "static_response.hpp"
 #include "task.hpp"
 #include <chrono>
 
 coro::Task<> sleep_until(coro::Clock::time_point then);
 
+// The scheduler whose ready queue runs deferred work (cache refreshes and
+// coalesced waiters), or nullptr to run it inline.
+coro::TimedScheduler *timed_scheduler();
+
 inline coro::HTTPRouter create_router() {
   using namespace coro;
   using namespace std::literals;
   HTTPRouter router;
-  router.route(HTTPMethod::GET, "/", [](HTTPRequest req) -> Task<HTTPResponse> {
-    HTTPResponse res;
-    res.status = 302;
-    res.headers["Location"] = "/home"sv;
-    co_return res;
-  });
-  router.route(HTTPMethod::GET, "/home"sv,
-               [](HTTPRequest req) -> Task<HTTPResponse> {
-                 HTTPResponse res;
-                 res.status = 200;
-                 res.headers["Content-Type"] = "text/html"sv;
-                 res.body = "<h1>Hello, World!</h1>"sv;
+  router.route(HTTPMethod::GET, "/",
+               [](HTTPRequest const &req) -> Task<HTTPResponse> {
+                 auto res = HTTPResponse::with_allocator(req.get_allocator());
+                 res.status = 302;
+                 res.headers["Location"] = "/home"sv;
                  co_return res;
                });
+  router.route_static(HTTPMethod::GET, "/home"sv,
+                      HTTPResponse{
+                          .status = 200,
+                          .headers = {{"Content-Type", "text/html"}},
+                          .body = "<h1>Hello, World!</h1>",
+                      });
   // Simulate a time-consuming task.
   // e.g. /sleep?ms=1.5
   router.route(
-      HTTPMethod::GET, "/sleep"sv, [](HTTPRequest req) -> Task<HTTPResponse> {
-        HTTPResponse res;
+      HTTPMethod::GET, "/sleep"sv,
+      [](HTTPRequest const &req) -> Task<HTTPResponse> {
+        auto res = HTTPResponse::with_allocator(req.get_allocator());
         res.status = 200;
         res.headers["Content-Type"] = "text/html"sv;
         auto uri = req.parse_uri();
-        auto ms = std::stod(uri.params.at("ms"));
+        auto ms = std::stod(std::string{uri.params.at("ms")});
         if (ms < 0) {
           throw std::runtime_error("Negative sleep duration is not allowed.\n" +
                                    SOURCE_LOCATION());
@@ -50,13 +58,86 @@ inline coro::HTTPRouter create_router() {
   // Simulate a output-heavy task.
   // e.g. /repeat?count=10000
   router.route(HTTPMethod::GET, "/repeat"sv,
-               [](HTTPRequest req) -> Task<HTTPResponse> {
-                 HTTPResponse res;
+               [](HTTPRequest const &req) -> Task<HTTPResponse> {
+                 auto res = HTTPResponse::with_allocator(req.get_allocator());
                  res.status = 200;
                  res.headers["Content-Type"] = "text/html"sv;
                  auto uri = req.parse_uri();
-                 auto cnt = std::stoll(uri.params.at("count"));
-                 res.body.assign(cnt, '@');
+                 auto cnt =
+                     std::stoll(std::string{uri.params.at("count")});
+                 res.body = std::string(cnt, '@');
+                 co_return res;
+               });
+  // Stream a body that's generated while it's sent (chunked).
+  // e.g. /stream?lines=10000
+  router.route(
+      HTTPMethod::GET, "/stream"sv,
+      [](HTTPRequest const &req) -> Task<HTTPResponse> {
+        auto res = HTTPResponse::with_allocator(req.get_allocator());
+        res.status = 200;
+        res.headers["Content-Type"] = "text/plain"sv;
+        auto uri = req.parse_uri();
+        auto left = std::make_shared<long long>(
+            std::stoll(std::string{uri.params.at("lines")}));
+        res.body = BodyGenerator([left]() -> Task<std::string> {
+          std::string chunk;
+          for (int i = 0; i < 100 && *left > 0; i++) {
+            chunk += std::format("{}\n", --*left);
+          }
+          co_return chunk;
+        });
+        co_return res;
+      });
+  // Simulate an expensive page that's the same for everyone. Only the first
+  // request in every second renders it, the others are served from the cache.
+  // Requests that arrive while it's being rendered wait for it.
+  // e.g. /table?rows=500
+  route_cached(
+      router, HTTPMethod::GET, "/table"sv,
+      [](HTTPRequest const &req) -> Task<HTTPResponse> {
+        auto res = HTTPResponse::with_allocator(req.get_allocator());
+        res.status = 200;
+        res.headers["Content-Type"] = "text/html"sv;
+        auto uri = req.parse_uri();
+        auto rows = std::stoll(std::string{uri.params.at("rows")});
+        for (long long i = 0; i < rows; i++) {
+          res.body += std::format("<tr><td>{}</td><td>{}</td></tr>", i, i * i);
+        }
+        co_return res;
+      },
+      ResponseCacheOptions{.ttl = 1s,
+                           .stale_while_revalidate = 10s,
+                           .query_params = {"rows"}},
+      timed_scheduler());
+  // Serve the files in the working directory, e.g. /files/README.md. Range
+  // requests only read (or sendfile()) the requested bytes.
+  router.route_prefix(
+      HTTPMethod::GET, "/files"sv,
+      [](HTTPRequest const &req) -> Task<HTTPResponse> {
+        auto path = normalize_path(req.uri);
+        if (path.size() > "/files/"sv.size() && !path.contains("/../")) {
+          try {
+            co_return file_response(path.c_str() + "/files/"sv.size());
+          } catch (std::exception &e) {
+          }
+        }
+        HTTPResponse res;
+        res.status = 404;
+        co_return res;
+      });
+  // The stats of the server in the Prometheus text format.
+  route_metrics(router);
+  // The suspended coroutines of the loop, if built with CORO_FRAME_REGISTRY.
+  route_frames(router);
+  // The coroutines that make the most frames, if built with CORO_FRAME_PROFILE.
+  route_frame_profile(router);
+  // Where the time of the requests so far went, per route and phase.
+  router.route(HTTPMethod::GET, "/latency"sv,
+               [](HTTPRequest const &req) -> Task<HTTPResponse> {
+                 auto res = HTTPResponse::with_allocator(req.get_allocator());
+                 res.status = 200;
+                 res.headers["Content-Type"] = "text/plain"sv;
+                 res.body = format_latency(LatencyRecorder::merged());
                  co_return res;
                });
   return router;
@@ -12,7 +12,9 @@
 #include <unistd.h>
 
 #include "aio.hpp"
+#include "etag.hpp"
 #include "http.hpp"
+#include "range.hpp"
 #include "router.hpp"
 #include "socket.hpp"
 #include "task.hpp"
@@ -25,6 +27,8 @@ coro::Task<> sleep_until(coro::Clock::time_point then) {
   co_return;
 }
 
+coro::TimedScheduler *timed_scheduler() { return nullptr; }
+
 void handle_request(struct sockaddr_in client_addr, socklen_t client_addr_len,
                     FileDescriptor client_sock /* to be moved */,
                     HTTPRouter &router) {
@@ -42,7 +46,7 @@ void handle_request(struct sockaddr_in client_addr, socklen_t client_addr_len,
 
     // Hope there's no I/O in any route handler.
     // I don't want the coroutine to be suspended.
-    auto r = router.find_route(req.method, req.uri);
+    auto const &r = router.find_route(req.method, req.uri);
     HTTPResponse res;
     if (r == nullptr) {
       res.headers["Content-Type"] = "application/json";
@@ -54,9 +58,17 @@ void handle_request(struct sockaddr_in client_addr, socklen_t client_addr_len,
       res = h.result();
       // I have this assertion to make sure that the coroutine is completed.
       assert(h.coro_.done());
+      evaluate_conditional(req, res) || evaluate_range(req, res);
+      if (auto next = res.body.generator()) {
+        // Same as above: the generator is not supposed to wait.
+        auto c = collect_body(*next);
+        c.coro_.resume();
+        assert(c.coro_.done());
+        res.body = c.result();
+      }
     }
 
-    auto s = res.to_string();
+    auto s = res.to_string(default_response_headers());
     if (EOF == fputs(s.c_str(), sock.stream)) {
       THROW_SYSCALL("write (fputs)");
     }
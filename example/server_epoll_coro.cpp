@@ -1,39 +1,108 @@
 #include <arpa/inet.h>
 #include <cassert>
 #include <cerrno>
+#include <csignal>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cxxabi.h>
 #include <exception>
 #include <fcntl.h>
 #include <iostream>
+#include <memory>
 #include <netinet/in.h>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 #include <sys/epoll.h>
 #include <termios.h>
 #include <unistd.h>
 #include <vector>
 
+#include "access_log.hpp"
+#include "affinity.hpp"
+#include "balancer.hpp"
 #include "aio.hpp"
+#include "connection.hpp"
+#include "default_headers.hpp"
 #include "epoll.hpp"
-#include "http.hpp"
+#include "frame_registry.hpp"
+#include "handoff.hpp"
+#include "latency.hpp"
+#include "prefork.hpp"
 #include "router.hpp"
+#include "shutdown.hpp"
 #include "socket.hpp"
+#include "stats.hpp"
+#include "stats_segment.hpp"
 #include "task.hpp"
 #include "utility.hpp"
 
 using namespace coro;
 
+// The requests are logged to the file named by ACCESS_LOG, "-" for stdout, or
+// not at all.
+std::unique_ptr<AccessLog> open_access_log() {
+  auto path = std::getenv("ACCESS_LOG");
+  if (!path || !*path) {
+    return nullptr;
+  }
+  if (std::string_view(path) == "-") {
+    return std::make_unique<AccessLog>(
+        FileDescriptor(CHECK_SYSCALL(dup(STDOUT_FILENO))));
+  }
+  return std::make_unique<AccessLog>(std::string(path));
+}
+
+// Once asked to stop, a loop waits this long for its connections to end.
+constexpr auto drain_timeout = std::chrono::seconds(5);
+
 struct AsyncLoop {
+  AsyncLoop(StatsSegment &stats_segment, AccessLog *access_log,
+            std::optional<Balancer::Loop> balancer)
+      : stats_slot_(stats_segment.add_loop()),
+        access_ring_(access_log ? &access_log->add_ring() : nullptr),
+        balancer_(balancer) {
+    epoll_sched_.on_wake = [this] { headers_.refresh(); };
+  }
+
   void run() {
+    HeaderTemplate::Scope scope(headers_);
+    LatencyRecorder::Scope latency_scope(latency_);
+    LoopStats::Scope stats_scope(stats_);
+    LoopMonitor::Scope monitor_scope(monitor_);
+    std::optional<AccessLog::Scope> access_scope;
+    if (access_ring_) {
+      access_scope.emplace(*access_ring_);
+    }
+    std::optional<Balancer::Scope> balancer_scope;
+    if (balancer_) {
+      balancer_scope.emplace(*balancer_);
+    }
     while (true) {
+      headers_.refresh();
+      publish_stats();
       auto timeout = timed_sched_.run();
+      if (!epoll_sched_.have_registered_events() && !timeout) {
+        break;
+      }
+      if (stop_requested()) {
+        // The connections left after the timeout are closed.
+        auto now = Clock::now();
+        if (!drain_deadline_) {
+          drain_deadline_ = now + drain_timeout;
+        }
+        if (now >= *drain_deadline_) {
+          break;
+        }
+        timeout = std::min(timeout.value_or(Clock::duration::max()),
+                           *drain_deadline_ - now);
+      }
       if (epoll_sched_.have_registered_events()) {
         epoll_sched_.run(timeout);
-      } else if (timeout) {
-        std::this_thread::sleep_for(*timeout);
       } else {
-        break;
+        std::this_thread::sleep_for(*timeout);
       }
     }
   }
@@ -42,50 +111,75 @@ struct AsyncLoop {
 
   EpollScheduler &get_epoll_scheduler() { return epoll_sched_; }
 
+  ConnectionPool &get_connection_pool() { return connections_; }
+
+  // Null without --balance.
+  Balancer::Loop *get_balancer() { return balancer_ ? &*balancer_ : nullptr; }
+
   operator TimedScheduler &() { return get_timed_scheduler(); }
 
   operator EpollScheduler &() { return get_epoll_scheduler(); }
 
 private:
+  // At most every 100 ms.
+  void publish_stats() {
+    using namespace std::literals;
+    auto now = Clock::now();
+    if (now >= next_publish_) {
+      stats_slot_.publish(stats_);
+      next_publish_ = now + 100ms;
+    }
+  }
+
   TimedScheduler timed_sched_;
   EpollScheduler epoll_sched_;
+  HeaderTemplate headers_;     // Date is refreshed once per tick.
+  ConnectionPool connections_; // Buffers of closed connections.
+  LatencyRecorder latency_;     // Phases of the requests served.
+  LoopStats stats_;             // Counters and gauges, see /metrics.
+  LoopMonitor monitor_;         // Loop lag and slow resumes, logged to stderr.
+  StatsSegment::Slot stats_slot_;
+  AccessLog::Ring *access_ring_; // Null without an access log.
+  std::optional<Balancer::Loop> balancer_;
+  Clock::time_point next_publish_;
+  std::optional<Clock::time_point> drain_deadline_;
 };
 
-AsyncLoop loop;
+// The loop of the process, made by serve().
+AsyncLoop *loop;
 AsyncFileStream ain(dup_stdin(), "r");
 AsyncFileStream aout(dup_stdout(), "w");
 AsyncFileStream aerr(dup_stdin(), "w");
 
 coro::Task<> sleep_until(coro::Clock::time_point then) {
-  co_await sleep_until(loop, then);
+  co_await sleep_until(*loop, then);
 }
 
+coro::TimedScheduler *timed_scheduler() { return &loop->get_timed_scheduler(); }
+
 Task<void> handle_request(struct sockaddr_in client_addr,
                           socklen_t client_addr_len, AsyncFile client_sock,
                           HTTPRouter &router) {
   using namespace std::literals;
 
   try {
-    AsyncFileBuffer client_buffer{loop, std::move(client_sock)};
-
     char client_ip[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
 
-    HTTPRequest req;
-    co_await req.read_from(loop, client_buffer);
+    co_await serve_connection(*loop, loop->get_connection_pool(),
+                              std::move(client_sock), router);
+  } catch (EOFException &e) {
+    // Ignore EOF.
+  } catch (std::exception &e) {
+    std::cerr << e.what() << "\n";
+  }
+}
 
-    auto r = router.find_route(req.method, req.uri);
-    if (r == nullptr) {
-      HTTPResponse res;
-      res.headers["Content-Type"] = "application/json";
-      res.status = 404;
-      res.body = R"({ "message": "Cannot find a route." })"sv;
-      co_await res.write_to(loop, client_buffer);
-    } else {
-      auto res = co_await r(req);
-      co_await res.write_to(loop, client_buffer);
-    }
-    co_await client_buffer.flush();
+// Serves a connection that another worker moved to this one.
+Task<void> handle_migrated(MigratedConnection conn, HTTPRouter &router) {
+  try {
+    co_await serve_connection(*loop, loop->get_connection_pool(),
+                              std::move(conn), router);
   } catch (EOFException &e) {
     // Ignore EOF.
   } catch (std::exception &e) {
@@ -111,24 +205,91 @@ template <class T, class P> void spawn_task(Task<T, P> t) {
   spawned_tasks.push_back(std::move(t));
 }
 
-int main() {
-  using namespace std::literals;
-
-  /////////////////// Set up routes ///////////////////
+// Serves on `server_sock` until the process is asked to stop, then lets the
+// open connections finish. Called in each worker with --workers.
+//
+// With a `handoff_path`, the socket is handed to the next server that asks
+// there, and this one stops once it's ready. The server of `handoff`, if any,
+// is told that this one is ready. With a `balancer`, the loop is its loop
+// `index`, and serves the connections the other workers move to it.
+int serve(AsyncFile &server_sock, std::string const &handoff_path,
+          std::optional<Handoff> &handoff, Balancer *balancer = nullptr,
+          int index = 0) {
+  install_stop_handler();
+  // The stats of the loops, for corostat.
+  StatsSegment stats_segment(stats_segment_path(getpid()));
+  auto access_log = open_access_log();
+  AsyncLoop async_loop(stats_segment, access_log.get(),
+                       balancer ? std::optional(balancer->loop(index))
+                                : std::nullopt);
+  loop = &async_loop;
+  // The routes refer to the loop (see route_cached()).
   HTTPRouter router = create_router();
+  std::cout << "Stats are in " << stats_segment.path() << " (see corostat)\n";
 
-  /////////////////// Create a TCP server ///////////////////
+  auto task = [](AsyncFile &server_sock, HTTPRouter &router) -> Task<> {
+    while (true) {
+      struct sockaddr_in client_addr;
+      socklen_t client_addr_len = sizeof(client_addr);
+
+      auto next = co_await when_any(
+          socket_accept(*loop, server_sock, (struct sockaddr *)&client_addr,
+                        &client_addr_len),
+          wait_for_stop(*loop));
+      if (next.index() == 1) {
+        break;
+      }
+
+      // DEBUG() << std::format("client fd: {}, spawned count: {}\n",
+      //                        client_sock.fd_, spawned_tasks.size());
+
+      auto handler =
+          handle_request(client_addr, client_addr_len,
+                         std::get<0>(std::move(next)), router);
+
+      spawn_task(std::move(handler));
+    }
+  }(server_sock, router);
+
+  if (!handoff_path.empty()) {
+    spawn_task(serve_handoff(*loop, handoff_path, {server_sock.fd_}));
+  }
+  if (auto view = loop->get_balancer()) {
+    spawn_task([](Balancer::Loop &view, HTTPRouter &router) -> Task<> {
+      while (true) {
+        auto next = co_await when_any(view.accept(*loop), wait_for_stop(*loop));
+        if (next.index() == 1) {
+          break;
+        }
+        spawn_task(handle_migrated(std::get<0>(std::move(next)), router));
+      }
+    }(*view, router));
+  }
+  if (handoff) {
+    handoff->ready();
+  }
+
+  run_task(*loop, task);
+  task.result(); // Check exception.
+
+  // Those that outlived the drain, before their loop is gone.
+  spawned_tasks.clear();
+  loop = nullptr;
+  return 0;
+}
+
+// Binds the first free port from 9000.
+AsyncFile listen_on_free_port(std::uint16_t &port, bool reuse_port = false) {
   int server_socket;
   struct sockaddr_in server_addr;
 
   const std::uint16_t min_port = 9000;
   const std::uint16_t max_port = min_port + 200;
-  std::uint16_t port = min_port;
+  port = min_port;
   while (true) {
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0) {
-      std::cerr << "Failed to create socket\n";
-      return 1;
+      THROW_SYSCALL("Failed to create socket");
     }
 
     memset(&server_addr, 0, sizeof(server_addr));
@@ -136,6 +297,12 @@ int main() {
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(port);
 
+    int one = 1;
+    if (reuse_port && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &one,
+                                 sizeof(one)) < 0) {
+      CHECK_SYSCALL(close(server_socket));
+      THROW_SYSCALL("Failed to set SO_REUSEPORT");
+    }
     if (bind(server_socket, (struct sockaddr *)&server_addr,
              sizeof(server_addr)) < 0) {
       CHECK_SYSCALL(close(server_socket));
@@ -154,31 +321,97 @@ int main() {
     THROW_SYSCALL("Failed to listen on socket");
   }
 
-  AsyncFile server_sock{server_socket};
-
-  std::cout << "Server is listening on port " << port << "...\n";
-
-  /////////////////// Create the entrypoint task ///////////////////
-  auto task = [](AsyncFile &server_sock, HTTPRouter &router) -> Task<> {
-    while (true) {
-      struct sockaddr_in client_addr;
-      socklen_t client_addr_len = sizeof(client_addr);
+  return AsyncFile{server_socket};
+}
 
-      auto client_sock = co_await socket_accept(
-          loop, server_sock, (struct sockaddr *)&client_addr, &client_addr_len);
+int main(int argc, char **argv) {
+  using namespace std::literals;
 
-      // DEBUG() << std::format("client fd: {}, spawned count: {}\n",
-      //                        client_sock.fd_, spawned_tasks.size());
+  // --workers=N serves in N processes (see Prefork), 0 for one per CPU.
+  std::optional<int> workers;
+  // --handoff=PATH takes the socket of the server at PATH, if any, and hands
+  // it to the next one started with the same option (see handoff.hpp).
+  std::string handoff_path;
+  // --by-cpu gives each worker a socket of its own, which gets the connections
+  // whose packets the CPU of the worker handles (see listen_by_cpu()).
+  bool by_cpu = false;
+  // --balance moves keep-alive connections from the workers that serve the
+  // most to the one that serves the fewest (see Balancer).
+  bool balance = false;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (arg.starts_with("--workers=")) {
+      workers = std::stoi(std::string(arg.substr("--workers="sv.size())));
+    } else if (arg.starts_with("--handoff=")) {
+      handoff_path = arg.substr("--handoff="sv.size());
+    } else if (arg == "--by-cpu") {
+      by_cpu = true;
+    } else if (arg == "--balance") {
+      balance = true;
+    } else {
+      std::cerr << "unknown option: " << arg << "\n";
+      return 2;
+    }
+  }
+  if (workers && !handoff_path.empty()) {
+    std::cerr << "--handoff needs a single process, reload workers with "
+                 "kill -HUP\n";
+    return 2;
+  }
+  if ((by_cpu || balance) && !workers) {
+    std::cerr << "--by-cpu and --balance need --workers\n";
+    return 2;
+  }
 
-      auto handler = handle_request(client_addr, client_addr_len,
-                                    std::move(client_sock), router);
+  // kill -USR1 prints the coroutines of the loop (see frame_registry.hpp).
+  dump_frames_on_signal(SIGUSR1);
 
-      spawn_task(std::move(handler));
-    }
-  }(server_sock, router);
+  /////////////////// Create a TCP server ///////////////////
+  auto handoff = handoff_path.empty() ? std::nullopt : take_over(handoff_path);
+  AsyncFile server_sock;
+  std::uint16_t port;
+  if (handoff) {
+    server_sock = AsyncFile(handoff->fds.at(0).release());
+    sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    CHECK_SYSCALL(
+        getsockname(server_sock.fd_, (struct sockaddr *)&addr, &len));
+    port = ntohs(addr.sin_port);
+    std::cout << "Took over the socket of the server at " << handoff_path
+              << "\n";
+  } else {
+    // With --by-cpu, the socket is the first of the SO_REUSEPORT group.
+    server_sock = listen_on_free_port(port, by_cpu);
+  }
 
-  run_task(loop, task);
-  task.result(); // Check exception.
+  std::cout << "Server is listening on port " << port << "...\n";
 
-  return 0;
-}
\ No newline at end of file
+  if (!workers) {
+    return serve(server_sock, handoff_path, handoff);
+  }
+  if (*workers <= 0) {
+    workers = allowed_cpus().size();
+  }
+  std::vector<AsyncFile> cpu_socks;
+  if (by_cpu) {
+    // The others join the socket that found the port, which keeps it.
+    cpu_socks = listen_by_cpu(std::move(server_sock), *workers);
+  }
+  // Before the workers are forked, so that they share it.
+  std::optional<Balancer> balancer;
+  if (balance) {
+    balancer.emplace(*workers);
+  }
+  // kill -HUP starts new workers and drains the old ones.
+  PreforkOptions options{.workers = *workers};
+  if (balancer) {
+    // A worker that crashed took its connections with it.
+    options.on_respawn = [&](int index) { balancer->reset(index); };
+  }
+  Prefork master(options, [&](int index) {
+    std::optional<Handoff> none;
+    return serve(cpu_socks.empty() ? server_sock : cpu_socks.at(index), "",
+                 none, balancer ? &*balancer : nullptr, index);
+  });
+  return master.run();
+}
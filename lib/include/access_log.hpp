@@ -0,0 +1,297 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <format>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "aio.hpp"
+#include "spsc_ring.hpp"
+#include "stats.hpp"
+#include "utility.hpp"
+
+namespace coro {
+
+// What the access log keeps of a request. It's copied into a ring as is, so
+// it has a fixed size and no pointers; a longer target is truncated.
+struct AccessRecord {
+  static constexpr std::size_t max_method = 8;
+  static constexpr std::size_t max_uri = 104;
+
+  std::int64_t time_ns;      // system_clock, when the response was sent.
+  std::uint32_t duration_us; // From the first byte of the request.
+  std::uint16_t status;
+  std::uint8_t method_size;
+  std::uint8_t truncated; // The target was longer than max_uri.
+  char method[max_method];
+  char uri[max_uri]; // Padded with '\0'.
+
+  static AccessRecord make(std::string_view method, std::string_view uri,
+                           int status, std::chrono::nanoseconds duration) {
+    using namespace std::chrono;
+    AccessRecord r;
+    r.time_ns = duration_cast<nanoseconds>(
+                    system_clock::now().time_since_epoch())
+                    .count();
+    r.duration_us = static_cast<std::uint32_t>(std::clamp<std::int64_t>(
+        duration_cast<microseconds>(duration).count(), 0, UINT32_MAX));
+    r.status = static_cast<std::uint16_t>(status);
+    r.method_size = static_cast<std::uint8_t>(
+        std::min(method.size(), max_method));
+    r.truncated = uri.size() > max_uri;
+    std::memcpy(r.method, method.data(), r.method_size);
+    auto n = std::min(uri.size(), max_uri);
+    std::memcpy(r.uri, uri.data(), n);
+    std::memset(r.uri + n, 0, max_uri - n);
+    return r;
+  }
+
+  std::string_view method_view() const { return {method, method_size}; }
+
+  std::string_view uri_view() const {
+    return {uri, static_cast<std::size_t>(
+                     std::find(uri, uri + max_uri, '\0') - uri)};
+  }
+};
+
+static_assert(std::is_trivially_copyable_v<AccessRecord>);
+static_assert(sizeof(AccessRecord) == 128);
+
+struct AccessLogOptions {
+  std::size_t ring_capacity = 4096; // Records per loop.
+  // How often the writer empties the rings, unless flush() asks.
+  std::chrono::milliseconds flush_interval{100};
+  std::size_t batch_size = 64 * 1024; // Bytes per write().
+};
+
+// An access log that doesn't block the loops. A loop pushes a record into a
+// ring of its own (see Ring), without a lock or a syscall; a thread of the
+// log formats the records of all rings and writes them in batches, one line
+// per request:
+//
+//   2026-10-17T07:38:01.123Z GET /home 200 41us
+//
+// When a ring is full, because the writer can't keep up, the record is
+// dropped and counted, in the ring and as Stat::ACCESS_LOG_DROPS.
+//
+// Like LoopStats, a ring is made current for a thread with a Scope, and
+// serve_connection() logs its requests into the current one, if any.
+class AccessLog {
+public:
+  // The records of one loop. Only that loop pushes.
+  class Ring {
+  public:
+    // The record is dropped if the ring is full.
+    bool push(AccessRecord const &record) {
+      if (ring_.try_push(record)) [[likely]] {
+        return true;
+      }
+      dropped_.store(dropped_.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+      count_stat(Stat::ACCESS_LOG_DROPS);
+      return false;
+    }
+
+    std::uint64_t dropped() const {
+      return dropped_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    friend class AccessLog;
+
+    explicit Ring(std::size_t capacity) : ring_(capacity) {}
+
+    SpscRing<AccessRecord> ring_;
+    std::atomic<std::uint64_t> dropped_{};
+  };
+
+  explicit AccessLog(FileDescriptor fd, AccessLogOptions options = {})
+      : fd_(std::move(fd)), options_(options), writer_([this] { run(); }) {}
+
+  // Appends to the file at `path`, which is created if needed.
+  explicit AccessLog(std::string const &path, AccessLogOptions options = {})
+      : AccessLog(open_file(path), options) {}
+
+  AccessLog(AccessLog const &) = delete;
+  AccessLog &operator=(AccessLog const &) = delete;
+
+  // Writes what's left in the rings. The loops must have stopped pushing.
+  ~AccessLog() {
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_one();
+    writer_.join();
+  }
+
+  // A ring for a new loop, alive as long as the log.
+  Ring &add_ring() {
+    std::lock_guard lock(mutex_);
+    return *rings_.emplace_back(new Ring(options_.ring_capacity));
+  }
+
+  // Returns once the records pushed so far, by any thread, are written.
+  void flush() {
+    std::unique_lock lock(mutex_);
+    auto target = ++flush_requests_;
+    wake_.notify_one();
+    flushed_cv_.wait(lock, [&] { return flushed_ >= target; });
+  }
+
+  // Lines written so far.
+  std::uint64_t written() const {
+    return written_.load(std::memory_order_relaxed);
+  }
+
+  // Records dropped by all the rings.
+  std::uint64_t dropped() const {
+    std::lock_guard lock(mutex_);
+    std::uint64_t n = 0;
+    for (auto const &ring : rings_) {
+      n += ring->dropped();
+    }
+    return n;
+  }
+
+  // Failed write()s, whose batches are lost.
+  std::uint64_t write_errors() const {
+    return write_errors_.load(std::memory_order_relaxed);
+  }
+
+  // Makes `r` the ring of the current thread while the scope is alive.
+  struct Scope {
+    explicit Scope(Ring &r) : prev_(std::exchange(current_, &r)) {}
+    Scope(Scope const &) = delete;
+    Scope &operator=(Scope const &) = delete;
+    ~Scope() { current_ = prev_; }
+
+  private:
+    Ring *prev_;
+  };
+
+  static Ring *current() { return current_; }
+
+private:
+  static FileDescriptor open_file(std::string const &path) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                  0644);
+    if (fd == -1) {
+      THROW_SYSCALL(("open " + path).c_str());
+    }
+    return FileDescriptor(fd);
+  }
+
+  void run() {
+    std::vector<Ring *> rings;
+    std::unique_lock lock(mutex_);
+    while (true) {
+      wake_.wait_for(lock, options_.flush_interval,
+                     [this] { return stop_ || flush_requests_ != flushed_; });
+      auto target = flush_requests_;
+      bool stop = stop_;
+      rings.clear();
+      for (auto const &ring : rings_) {
+        rings.push_back(ring.get());
+      }
+      lock.unlock();
+
+      for (auto *ring : rings) {
+        ring->ring_.consume([this](AccessRecord const &record) {
+          format(record);
+          if (batch_.size() >= options_.batch_size) {
+            write_batch();
+          }
+        });
+      }
+      write_batch();
+
+      lock.lock();
+      flushed_ = target;
+      flushed_cv_.notify_all();
+      if (stop) {
+        break;
+      }
+    }
+  }
+
+  void format(AccessRecord const &r) {
+    auto seconds = r.time_ns / 1'000'000'000;
+    if (seconds != second_) {
+      // The date changes once per second, so it's formatted once.
+      std::time_t t = seconds;
+      std::tm tm;
+      gmtime_r(&t, &tm);
+      second_ = seconds;
+      second_text_ = std::format("{:04}-{:02}-{:02}T{:02}:{:02}:{:02}",
+                                 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                                 tm.tm_hour, tm.tm_min, tm.tm_sec);
+    }
+    std::format_to(std::back_inserter(batch_), "{}.{:03}Z {} {}{} {} {}us\n",
+                   second_text_, r.time_ns / 1'000'000 % 1000,
+                   r.method_view(), r.uri_view(), r.truncated ? "..." : "",
+                   r.status, r.duration_us);
+    batch_lines_++;
+  }
+
+  void write_batch() {
+    std::string_view rest = batch_;
+    while (!rest.empty()) {
+      auto n = ::write(fd_.fd, rest.data(), rest.size());
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n == -1) {
+        write_errors_.fetch_add(1, std::memory_order_relaxed);
+        break;
+      }
+      rest.remove_prefix(n);
+    }
+    if (rest.empty()) {
+      written_.fetch_add(batch_lines_, std::memory_order_relaxed);
+    }
+    batch_.clear();
+    batch_lines_ = 0;
+  }
+
+  static inline thread_local Ring *current_ = nullptr;
+
+  FileDescriptor fd_;
+  AccessLogOptions options_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable flushed_cv_;
+  std::vector<std::unique_ptr<Ring>> rings_;
+  std::uint64_t flush_requests_{};
+  std::uint64_t flushed_{};
+  bool stop_{};
+
+  // The writer's.
+  std::string batch_;
+  std::size_t batch_lines_{};
+  std::int64_t second_ = -1;
+  std::string second_text_;
+  std::atomic<std::uint64_t> written_{};
+  std::atomic<std::uint64_t> write_errors_{};
+
+  std::thread writer_; // Last, so that it starts after the rest.
+};
+
+} // namespace coro
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstdio>
+#include <dirent.h>
+#include <linux/filter.h>
+#include <sched.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "aio.hpp"
+#include "socket.hpp"
+#include "utility.hpp"
+
+// Placement of loops on CPUs and of their memory on NUMA nodes, and steering
+// of connections to the loop of the CPU that received them. A loop that runs
+// on one CPU, allocates its buffers, frames and timers from its node, and
+// only serves connections whose packets that CPU handles doesn't share a
+// cache line with another loop (see Prefork).
+
+namespace coro {
+
+// The CPUs the calling thread may run on, in order.
+inline std::vector<int> allowed_cpus() {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CHECK_SYSCALL(sched_getaffinity(0, sizeof(set), &set));
+  std::vector<int> cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+// Only lets the calling thread run on `cpu`.
+inline void pin_to_cpu(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  CHECK_SYSCALL(sched_setaffinity(0, sizeof(set), &set));
+}
+
+// The NUMA node of `cpu`, as the kernel lists it under /sys, or -1 if it
+// doesn't (a kernel without NUMA).
+inline int numa_node_of_cpu(int cpu) {
+  auto path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  auto dir = opendir(path.c_str());
+  if (!dir) {
+    return -1;
+  }
+  int node = -1;
+  while (auto entry = readdir(dir)) {
+    if (std::sscanf(entry->d_name, "node%d", &node) == 1) {
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+// Makes the pages that the calling thread, and the threads it creates, touch
+// first come from `node` while it has free memory (MPOL_PREFERRED), rather
+// than from the node of whichever CPU they were on. Without libnuma, so
+// through syscall(). False if it's refused, e.g. by the seccomp profile of a
+// container: the pages are then only local as long as the thread is pinned.
+inline bool prefer_memory_of_node(int node) {
+  constexpr int mpol_preferred = 1;
+  constexpr std::size_t bits = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> mask(node / bits + 1);
+  mask[node / bits] = 1ul << (node % bits);
+  return syscall(SYS_set_mempolicy, mpol_preferred, mask.data(),
+                 mask.size() * bits + 1) == 0;
+}
+
+// `n` listening sockets in one SO_REUSEPORT group, where a connection goes to
+// socket `cpu % n`, `cpu` being the one that handled its SYN (a classic BPF
+// program: SO_INCOMING_CPU only tells it after accept). With socket i served
+// by a loop pinned to CPU i, as the workers of Prefork are when they may run
+// on CPUs 0 to n - 1, a connection stays on the CPU that received its packets.
+//
+// `first` is socket 0: a socket listening with SO_REUSEPORT already, e.g. the
+// one that found a free port. The others join it on its address, so the port
+// is never free in between and the backlog of `first` is kept.
+inline std::vector<AsyncFile> listen_by_cpu(AsyncFile first, int n,
+                                            int backlog = SOMAXCONN) {
+  SocketAddress bound;
+  bound.len_ = sizeof(bound.addr_);
+  CHECK_SYSCALL(getsockname(
+      first.fd_, reinterpret_cast<sockaddr *>(&bound.addr_), &bound.len_));
+  std::vector<AsyncFile> socks;
+  socks.push_back(std::move(first));
+  for (int i = 1; i < n; i++) {
+    AsyncFile sock(CHECK_SYSCALL(
+        socket(bound.addr_.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)));
+    int one = 1;
+    CHECK_SYSCALL(
+        setsockopt(sock.fd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)));
+    CHECK_SYSCALL(bind(sock.fd_,
+                       reinterpret_cast<sockaddr const *>(&bound.addr_),
+                       bound.len_));
+    CHECK_SYSCALL(listen(sock.fd_, backlog));
+    socks.push_back(std::move(sock));
+  }
+  // The program of the group, attached through any of its sockets.
+  sock_filter code[] = {
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0,
+       static_cast<__u32>(SKF_AD_OFF + SKF_AD_CPU)},
+      {BPF_ALU | BPF_MOD | BPF_K, 0, 0, static_cast<__u32>(n)},
+      {BPF_RET | BPF_A, 0, 0, 0},
+  };
+  sock_fprog prog{.len = std::size(code), .filter = code};
+  CHECK_SYSCALL(setsockopt(socks[0].fd_, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                           &prog, sizeof(prog)));
+  return socks;
+}
+
+// Same on `addr`. The others bind the port that the first got for port 0.
+inline std::vector<AsyncFile> listen_by_cpu(SocketAddress const &addr, int n,
+                                            int backlog = SOMAXCONN) {
+  AsyncFile first(CHECK_SYSCALL(
+      socket(addr.addr_.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)));
+  int one = 1;
+  CHECK_SYSCALL(
+      setsockopt(first.fd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)));
+  CHECK_SYSCALL(bind(first.fd_,
+                     reinterpret_cast<sockaddr const *>(&addr.addr_),
+                     addr.len_));
+  CHECK_SYSCALL(listen(first.fd_, backlog));
+  return listen_by_cpu(std::move(first), n, backlog);
+}
+
+// The CPU that handled the packets of `sock`, or -1 if it's unknown.
+inline int incoming_cpu(int sock) {
+  int cpu = -1;
+  socklen_t len = sizeof(cpu);
+  if (getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1) {
+    return -1;
+  }
+  return cpu;
+}
+
+} // namespace coro
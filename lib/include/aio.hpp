@@ -1,14 +1,19 @@
 #pragma once
 
+#include <algorithm>
+#include <concepts>
+#include <cstring>
 #include <fcntl.h>
 #include <memory>
 #include <span>
 #include <stdexcept>
 #include <string_view>
+#include <sys/types.h>
 #include <termios.h>
 #include <unistd.h>
 #include <utility>
 
+#include "io_buffer.hpp"
 #include "task.hpp"
 #include "utility.hpp"
 
@@ -36,8 +41,10 @@ struct AsyncFile {
     if (fd_ != -1) {
       assert(fd_ != other.fd_);
     }
+    // std::swap(temp, *this) would call this operator again.
     AsyncFile temp(std::move(other));
-    std::swap(temp, *this);
+    std::swap(fd_, temp.fd_);
+    std::swap(borrow_, temp.borrow_);
     return *this;
   }
 
@@ -198,7 +205,7 @@ struct EOFException : std::runtime_error {
 
 template <AsyncReader Reader> struct AsyncIStreamBase {
   explicit AsyncIStreamBase(std::size_t buffer_size = 8192)
-      : buffer_(new char[buffer_size]), capacity_(buffer_size) {}
+      : buffer_(make_io_buffer(buffer_size)), capacity_(buffer_size) {}
 
   Task<char> getchar() {
     if (empty()) [[unlikely]] {
@@ -222,8 +229,30 @@ template <AsyncReader Reader> struct AsyncIStreamBase {
     co_return s;
   }
 
+  // Reads exactly buf.size() bytes.
+  Task<> getn(std::span<char> buf) {
+    std::size_t i = 0;
+    while (i < buf.size()) {
+      if (empty()) [[unlikely]] {
+        co_await refill();
+      };
+      auto n = std::min(end_ - start_, buf.size() - i);
+      std::memcpy(buf.data() + i, &buffer_[start_], n);
+      start_ += n;
+      i += n;
+    }
+  }
+
   Task<std::string> getline(std::string_view eol) {
     std::string s;
+    co_await getline(eol, s);
+    co_return s;
+  }
+
+  // Appends the line to `s` instead of returning a new string, so that the
+  // caller decides where it's allocated (e.g. in a request's arena) and can
+  // reuse its capacity.
+  template <class String> Task<> getline(std::string_view eol, String &s) {
     while (true) {
       // char ch = co_await getchar();
       if (empty()) [[unlikely]] {
@@ -256,7 +285,31 @@ template <AsyncReader Reader> struct AsyncIStreamBase {
       }
       s.push_back(ch);
     }
-    co_return s;
+  }
+
+  // Waits until there is a byte to read, without consuming it.
+  Task<> fill() {
+    if (empty()) {
+      co_await refill();
+    }
+  }
+
+  // The bytes read but not consumed yet, e.g. a pipelined request.
+  std::span<char const> unread() const {
+    return {buffer_.get() + start_, end_ - start_};
+  }
+
+protected:
+  // Forgets the bytes read but not consumed yet.
+  void drop_unread() { start_ = end_ = 0; }
+
+  // Makes `bytes` the next ones consumed, as if they had just been read, in
+  // place of those read before.
+  void restore_unread(std::span<char const> bytes) {
+    assert(bytes.size() <= capacity_);
+    std::memcpy(buffer_.get(), bytes.data(), bytes.size());
+    start_ = 0;
+    end_ = bytes.size();
   }
 
 private:
@@ -274,7 +327,7 @@ private:
     }
   }
 
-  std::unique_ptr<char[]> buffer_;
+  IOBuffer buffer_;
   std::size_t capacity_{};
   std::size_t start_{};
   std::size_t end_{};
@@ -282,7 +335,7 @@ private:
 
 template <AsyncWriter Writer> struct AsyncOStreamBase {
   explicit AsyncOStreamBase(std::size_t buffer_size = 8192)
-      : buffer_(new char[buffer_size]), capacity_(buffer_size) {}
+      : buffer_(make_io_buffer(buffer_size)), capacity_(buffer_size) {}
 
   Task<> putchar(char ch) {
     if (full()) {
@@ -325,6 +378,32 @@ template <AsyncWriter Writer> struct AsyncOStreamBase {
     }
   }
 
+  // Copies all the pieces into the buffer if there's room for them, without
+  // creating a coroutine. Otherwise nothing is copied and false is returned,
+  // so the caller can fall back to puts().
+  bool try_puts(std::span<std::string_view const> pieces) {
+    std::size_t n = 0;
+    for (auto sv : pieces) {
+      n += sv.size();
+    }
+    if (capacity_ - end_ < n) {
+      return false;
+    }
+    for (auto sv : pieces) {
+      std::memcpy(&buffer_[end_], sv.data(), sv.size());
+      end_ += sv.size();
+    }
+    return true;
+  }
+
+protected:
+  // The bytes written but not flushed yet, for writers that send them along
+  // with other data (e.g. with writev()). drop_buffered() forgets them once
+  // they are sent.
+  std::span<char const> buffered() const { return {buffer_.get(), end_}; }
+
+  void drop_buffered() { end_ = 0; }
+
 private:
   bool full() { return end_ == capacity_; }
 
@@ -344,7 +423,7 @@ private:
     }
   }
 
-  std::unique_ptr<char[]> buffer_;
+  IOBuffer buffer_;
   std::size_t capacity_{};
   std::size_t end_{};
 };
@@ -357,4 +436,17 @@ struct AsyncIOStreamBase : AsyncIStreamBase<ReadWriter>,
         AsyncOStreamBase<ReadWriter>(buffer_size) {}
 };
 
+// What the HTTP code needs from a connection: the buffered reads and writes of
+// AsyncIOStreamBase, plus writev() and sendfile() for the bodies that are not
+// copied through the buffer. AsyncFileBuffer is one over a socket, and
+// MemoryStream one over memory pipes.
+template <typename T>
+concept BufferedStream =
+    std::derived_from<T, AsyncIOStreamBase<T>> &&
+    requires(T t, std::span<std::string_view const> pieces, int fd,
+             off_t offset, std::size_t count) {
+      { t.writev(pieces) } -> std::same_as<Task<>>;
+      { t.sendfile(fd, offset, count) } -> std::same_as<Task<>>;
+    };
+
 } // namespace coro
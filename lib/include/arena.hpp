@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <new>
+
+namespace coro {
+
+// A monotonic memory resource for the data of one request (see
+// HTTPRequest::with_allocator()). Allocating bumps a pointer and deallocating
+// does nothing; reset() makes everything free again at once.
+//
+// Unlike std::pmr::monotonic_buffer_resource, whose release() gives the
+// blocks back to the heap, reset() keeps them. A connection resets its arena
+// between requests, so once it has seen its largest request the next ones are
+// served from the same blocks without touching the heap.
+//
+// It's not thread-safe. A connection's arena is only used by its loop.
+class Arena : public std::pmr::memory_resource {
+public:
+  explicit Arena(std::size_t block_size = 4096) : block_size_(block_size) {}
+
+  Arena(Arena const &) = delete;
+  Arena &operator=(Arena const &) = delete;
+
+  ~Arena() override {
+    while (head_) {
+      auto next = head_->next;
+      ::operator delete(head_);
+      head_ = next;
+    }
+  }
+
+  // Everything allocated so far must not be used anymore.
+  void reset() noexcept {
+    for (auto b = head_; b; b = b->next) {
+      b->used = 0;
+    }
+    current_ = head_;
+    allocated_ = 0;
+  }
+
+  // Frees the blocks after the first ones that fit in `max_capacity` bytes,
+  // so that a large request doesn't pin its memory for good. Call it after
+  // reset().
+  void trim(std::size_t max_capacity) noexcept {
+    Block **link = &head_;
+    Block *last = nullptr;
+    std::size_t n = 0;
+    while (*link && n + (*link)->size <= max_capacity) {
+      n += (*link)->size;
+      last = *link;
+      link = &last->next;
+    }
+    while (*link) {
+      auto next = (*link)->next;
+      ::operator delete(*link);
+      *link = next;
+    }
+    current_ = head_;
+    last_size_ = last ? last->size : 0;
+  }
+
+  // The bytes handed out since the last reset().
+  std::size_t allocated() const { return allocated_; }
+
+  // The bytes of all the blocks.
+  std::size_t capacity() const {
+    std::size_t n = 0;
+    for (auto b = head_; b; b = b->next) {
+      n += b->size;
+    }
+    return n;
+  }
+
+  std::size_t blocks() const {
+    std::size_t n = 0;
+    for (auto b = head_; b; b = b->next) {
+      ++n;
+    }
+    return n;
+  }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+    // Blocks that are too small are skipped. After a reset() the requests
+    // come in the same order, so they're skipped again and nothing new is
+    // allocated.
+    for (auto b = current_; b; b = b->next) {
+      if (auto p = b->take(bytes, alignment)) {
+        current_ = b;
+        allocated_ += bytes;
+        return p;
+      }
+    }
+    auto b = add_block(bytes + alignment);
+    current_ = b;
+    allocated_ += bytes;
+    return b->take(bytes, alignment);
+  }
+
+  void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+  bool do_is_equal(memory_resource const &other) const noexcept override {
+    return this == &other;
+  }
+
+private:
+  struct alignas(std::max_align_t) Block {
+    Block *next;
+    std::size_t size; // Excluding this header.
+    std::size_t used;
+
+    char *data() { return reinterpret_cast<char *>(this + 1); }
+
+    void *take(std::size_t bytes, std::size_t alignment) {
+      void *p = data() + used;
+      std::size_t space = size - used;
+      if (!std::align(alignment, bytes, p, space)) {
+        return nullptr;
+      }
+      used = static_cast<char *>(p) - data() + bytes;
+      return p;
+    }
+  };
+
+  // Each block is twice as large as the last one, and inserted after the
+  // current one, so that the order of the blocks is the order of use.
+  Block *add_block(std::size_t min_size) {
+    std::size_t size = std::max(block_size_, min_size);
+    if (last_size_) {
+      size = std::max(size, last_size_ * 2);
+    }
+    auto b = static_cast<Block *>(::operator new(sizeof(Block) + size));
+    b->size = size;
+    b->used = 0;
+    if (current_) {
+      b->next = current_->next;
+      current_->next = b;
+    } else {
+      b->next = head_;
+      head_ = b;
+    }
+    last_size_ = size;
+    return b;
+  }
+
+  std::size_t block_size_;
+  std::size_t last_size_{};
+  std::size_t allocated_{};
+  Block *head_{};
+  Block *current_{};
+};
+
+} // namespace coro
@@ -0,0 +1,267 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <utility>
+#include <vector>
+
+#include "aio.hpp"
+#include "epoll.hpp"
+#include "stats.hpp"
+#include "task.hpp"
+#include "utility.hpp"
+
+// Moves connections from the loops that serve the most to the one that serves
+// the fewest. A loop keeps the connections it accepts, so with SO_REUSEPORT or
+// a shared socket, long-lived keep-alive connections can load one loop far
+// more than another for as long as they live.
+//
+// - Each loop counts the connections it serves on a board in shared memory,
+//   which the loops of all the processes forked after the Balancer was made
+//   see (e.g. the workers of Prefork), as well as those of other threads.
+// - Every `interval`, a loop that serves at least `min_gap` more connections
+//   than the least loaded one plans to move half the difference there.
+// - It moves them as they become quiescent, between two requests, once the
+//   response is sent (see serve_connection()). The socket goes to the inbox of
+//   the other loop, a Unix socket, with SCM_RIGHTS, along with the bytes read
+//   from it but not consumed yet (a pipelined request).
+// - The other loop receives it with accept() and serves it like one it has
+//   accepted. No epoll has it in between: a loop only registers a socket while
+//   a coroutine waits on it.
+
+namespace coro {
+
+struct BalancerOptions {
+  std::chrono::milliseconds interval{100};
+  int min_gap = 2; // Connections more than the least loaded loop.
+};
+
+// A connection that another loop has moved to this one.
+struct MigratedConnection {
+  AsyncFile file;
+  std::string unread;
+};
+
+class Balancer {
+  struct alignas(64) Slot {
+    std::atomic<std::int64_t> connections;
+  };
+  static_assert(std::atomic<std::int64_t>::is_always_lock_free,
+                "the board is shared by processes");
+
+  // Messages are a byte, then the unread bytes.
+  static constexpr std::size_t max_unread = 4096;
+
+public:
+  // The balancer as seen by one loop. Only used by the thread of the loop.
+  class Loop {
+  public:
+    Loop(Balancer &balancer, int index) : balancer_(&balancer), index_(index) {}
+
+    int index() const { return index_; }
+
+    // Adds to the connections this loop serves.
+    void add_connections(std::int64_t n) {
+      balancer_->slots_[index_].connections.fetch_add(
+          n, std::memory_order_relaxed);
+    }
+
+    // Moves `conn` to another loop if this one has planned to, and closes it
+    // here. It must be quiescent: nothing buffered to write, and no coroutine
+    // waiting on it. False if it stays.
+    bool migrate(AsyncFileBuffer &conn) {
+      auto now = Clock::now();
+      if (now >= next_plan_) {
+        plan(now);
+      }
+      auto unread = conn.unread();
+      if (!quota_ || unread.size() > max_unread) {
+        return false;
+      }
+      if (!send(balancer_->inboxes_[target_].send.fd, conn.file_.fd_,
+                unread)) {
+        return false; // The inbox is full.
+      }
+      quota_--;
+      migrated_++;
+      count_stat(Stat::MIGRATIONS);
+      conn.clear();
+      return true;
+    }
+
+    // The next connection moved to this loop.
+    Task<MigratedConnection> accept(EpollScheduler &sched) {
+      AsyncFile inbox(balancer_->inboxes_[index_].receive.fd, false, true);
+      while (true) {
+        if (auto conn = receive(inbox.fd_)) {
+          co_return std::move(*conn);
+        }
+        co_await wait_file_event(sched, inbox, EPOLLIN);
+      }
+    }
+
+    // Connections this loop has moved to others.
+    std::uint64_t migrated() const { return migrated_; }
+
+  private:
+    void plan(Clock::time_point now) {
+      next_plan_ = now + balancer_->options_.interval;
+      quota_ = 0;
+      int least = index_;
+      for (int i = 0; i < balancer_->loops(); i++) {
+        if (balancer_->connections(i) < balancer_->connections(least)) {
+          least = i;
+        }
+      }
+      auto gap =
+          balancer_->connections(index_) - balancer_->connections(least);
+      if (gap >= balancer_->options_.min_gap) {
+        target_ = least;
+        quota_ = gap / 2;
+      }
+    }
+
+    static bool send(int inbox, int fd, std::span<char const> unread) {
+      char header = 0;
+      iovec iov[2] = {{.iov_base = &header, .iov_len = 1},
+                      {.iov_base = const_cast<char *>(unread.data()),
+                       .iov_len = unread.size()}};
+      char control[CMSG_SPACE(sizeof(int))]{};
+      msghdr msg{};
+      msg.msg_iov = iov;
+      msg.msg_iovlen = unread.empty() ? 1 : 2;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      auto cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+      while (sendmsg(inbox, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          return false;
+        }
+        if (errno != EINTR) {
+          THROW_SYSCALL("sendmsg");
+        }
+      }
+      return true;
+    }
+
+    static std::optional<MigratedConnection> receive(int inbox) {
+      std::string data(1 + max_unread, '\0');
+      iovec iov{.iov_base = data.data(), .iov_len = data.size()};
+      char control[CMSG_SPACE(sizeof(int))];
+      msghdr msg{};
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      ssize_t n;
+      while ((n = recvmsg(inbox, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) ==
+             -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          return std::nullopt;
+        }
+        if (errno != EINTR) {
+          THROW_SYSCALL("recvmsg");
+        }
+      }
+      auto cmsg = CMSG_FIRSTHDR(&msg);
+      if (n < 1 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+        throw std::runtime_error("balancer: no connection received\n" +
+                                 SOURCE_LOCATION());
+      }
+      int fd;
+      std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+      data.resize(n);
+      data.erase(0, 1);
+      return MigratedConnection{AsyncFile(fd), std::move(data)};
+    }
+
+    Balancer *balancer_;
+    int index_;
+    Clock::time_point next_plan_{};
+    int target_{};
+    std::int64_t quota_{}; // Connections left to move to target_.
+    std::uint64_t migrated_{};
+  };
+
+  explicit Balancer(int loops, BalancerOptions options = {})
+      : options_(options), loops_(loops) {
+    auto p = mmap(nullptr, sizeof(Slot) * loops, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      THROW_SYSCALL("mmap");
+    }
+    slots_ = static_cast<Slot *>(p);
+    for (int i = 0; i < loops; i++) {
+      new (&slots_[i]) Slot{};
+      int fds[2];
+      CHECK_SYSCALL(socketpair(AF_UNIX,
+                               SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                               0, fds));
+      inboxes_.push_back({FileDescriptor(fds[0]), FileDescriptor(fds[1])});
+    }
+  }
+
+  Balancer(Balancer const &) = delete;
+  Balancer &operator=(Balancer const &) = delete;
+
+  ~Balancer() { munmap(slots_, sizeof(Slot) * loops_); }
+
+  int loops() const { return loops_; }
+
+  // The view of loop `index`, from 0.
+  Loop loop(int index) { return Loop(*this, index); }
+
+  // Connections served by loop `index`. A loop that crashed keeps counting
+  // those it had until reset().
+  std::int64_t connections(int index) const {
+    return slots_[index].connections.load(std::memory_order_relaxed);
+  }
+
+  // Forgets the connections of loop `index`, e.g. before the process of a
+  // loop that crashed is started again (see PreforkOptions::on_respawn).
+  void reset(int index) {
+    slots_[index].connections.store(0, std::memory_order_relaxed);
+  }
+
+  // Makes `l` the loop of the current thread while the scope is alive.
+  struct Scope {
+    explicit Scope(Loop &l) : prev_(std::exchange(current_, &l)) {}
+    Scope(Scope const &) = delete;
+    Scope &operator=(Scope const &) = delete;
+    ~Scope() { current_ = prev_; }
+
+  private:
+    Loop *prev_;
+  };
+
+  static Loop *current() { return current_; }
+
+private:
+  struct Inbox {
+    FileDescriptor receive;
+    FileDescriptor send;
+  };
+
+  static inline thread_local Loop *current_ = nullptr;
+
+  BalancerOptions options_;
+  int loops_;
+  Slot *slots_;
+  std::vector<Inbox> inboxes_;
+};
+
+} // namespace coro
@@ -0,0 +1,582 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "etag.hpp"
+#include "http.hpp"
+#include "task.hpp"
+#include "utility.hpp"
+
+namespace coro {
+
+// method '\0' path '\0' (param=value '&')* '\0' (header value '\0')*
+//
+// Only the selected query parameters and headers take part in the key. They are
+// visited in the given order, so the key does not depend on the order of
+// parameters in the request.
+inline std::string request_key(HTTPRequest const &req,
+                               std::span<std::string const> query_params,
+                               std::span<std::string const> vary) {
+  std::string k{req.method};
+  k += '\0';
+  k += normalize_path(req.uri);
+  k += '\0';
+  if (!query_params.empty()) {
+    auto uri = req.parse_uri();
+    for (auto const &name : query_params) {
+      if (auto it = uri.params.find(name); it != uri.params.end()) {
+        k += name;
+        k += '=';
+        k += it->second;
+      }
+      k += '&';
+    }
+  }
+  k += '\0';
+  for (auto const &name : vary) {
+    if (auto it = req.headers.find(name); it != req.headers.end()) {
+      k += it->second;
+    }
+    k += '\0';
+  }
+  return k;
+}
+
+struct RequestCoalescerOptions {
+  // See request_key().
+  std::vector<std::string> query_params{};
+  std::vector<std::string> vary{};
+};
+
+struct RequestCoalescerStats {
+  std::size_t invocations{}; // How many times the handler ran.
+  std::size_t coalesced{};   // Requests that waited for another one instead.
+};
+
+// Singleflight: while a handler runs for a key, identical requests wait for it
+// and share its response instead of running the handler again. The response is
+// serialized once and the waiters get the same bytes, except for a file body,
+// which the waiters share and send from the file.
+//
+// Waiters are put back to the ready queue of the scheduler all at once if there
+// is a scheduler, or resumed one by one before the leader returns otherwise.
+//
+// It's not thread-safe: use one per loop.
+struct RequestCoalescer {
+  RequestCoalescer(HTTPHandler handler, RequestCoalescerOptions options = {},
+                   TimedScheduler *sched = nullptr)
+      : handler_(std::move(handler)), options_(std::move(options)),
+        sched_(sched) {
+    if (handler_ == nullptr) {
+      throw std::runtime_error("handler cannot be empty!\n" +
+                               SOURCE_LOCATION());
+    }
+  }
+
+  RequestCoalescer(RequestCoalescer &&) = delete;
+
+  Task<HTTPResponse> handle(HTTPRequest req) {
+    auto k = key(req);
+    co_return co_await run(std::move(k), std::move(req));
+  }
+
+  // Runs the handler for `req` unless another request with key `k` is in
+  // flight, in which case its response is shared.
+  Task<HTTPResponse> run(std::string k, HTTPRequest req) {
+    if (auto it = flights_.find(k); it != flights_.end()) {
+      ++stats_.coalesced;
+      auto flight = it->second;
+      co_await FlightAwaiter{*flight, sched_};
+      if (flight->error) {
+        std::rethrow_exception(flight->error);
+      }
+      co_return flight->response();
+    }
+
+    auto flight = std::make_shared<Flight>();
+    flights_.emplace(k, flight);
+    ++stats_.invocations;
+    // If the leader is destroyed before the handler returns, the waiters
+    // would wait forever. Fail them instead.
+    Defer cancel([&] {
+      if (!flight->done) {
+        flights_.erase(k);
+        flight->error = std::make_exception_ptr(std::runtime_error(
+            "coalesced request cancelled\n" + SOURCE_LOCATION()));
+        wake(*flight);
+      }
+    });
+    std::optional<HTTPResponse> res;
+    try {
+      res.emplace(co_await handler_(req));
+      // Serialize once for everyone, but only if someone is waiting. A file
+      // stays in the file: the waiters share it and send it themselves.
+      if (auto file = res->body.file(); file && !flight->waiters.empty()) {
+        flight->status = res->status;
+        flight->headers = res->headers;
+        flight->file = *file;
+      } else if (!flight->waiters.empty()) {
+        if (auto next = res->body.generator()) {
+          // The waiters need the bytes, so a generated body is read to the
+          // end.
+          res->body = co_await collect_body(*next);
+        }
+        flight->status = res->status;
+        flight->headers = res->headers;
+        flight->bytes = res->serialized ? res->serialized
+                                        : std::make_shared<const std::string>(
+                                              res->to_string());
+        *res = flight->response();
+      }
+    } catch (...) {
+      flight->error = std::current_exception();
+    }
+    flights_.erase(k);
+    wake(*flight);
+    if (flight->error) {
+      std::rethrow_exception(flight->error);
+    }
+    co_return std::move(*res);
+  }
+
+  std::string key(HTTPRequest const &req) const {
+    return request_key(req, options_.query_params, options_.vary);
+  }
+
+  RequestCoalescerStats const &stats() const { return stats_; }
+
+  // Number of keys that have a handler running.
+  std::size_t in_flight() const { return flights_.size(); }
+
+private:
+  struct Flight {
+    // The headers are not written (the bytes have them), but they tell the
+    // callers about the response, e.g. its validators.
+    HTTPResponse response() const {
+      HTTPResponse res;
+      res.status = status;
+      res.headers = headers;
+      if (file) {
+        res.body = *file;
+      } else {
+        res.serialized = bytes;
+      }
+      return res;
+    }
+
+    std::vector<std::coroutine_handle<>> waiters;
+    int status{};
+    HTTPHeaders headers;
+    std::shared_ptr<const std::string> bytes;
+    std::optional<FileBody> file; // Instead of the bytes.
+    std::exception_ptr error;
+    bool done{};
+  };
+
+  struct FlightAwaiter {
+    bool await_ready() const noexcept { return flight_.done; }
+
+    void await_suspend(std::coroutine_handle<> h) {
+      flight_.waiters.push_back(h);
+      h_ = h;
+      note_frame_wait(h, FrameWait::other("a coalesced request"));
+    }
+
+    void await_resume() noexcept {
+      note_frame_wait(h_, {});
+      h_ = nullptr;
+    }
+
+    // A waiter that is destroyed while suspended (e.g. by when_any) must not
+    // be resumed later: neither by wake() nor, once woken, by the scheduler.
+    ~FlightAwaiter() {
+      if (h_) {
+        std::erase(flight_.waiters, h_);
+        if (flight_.done && sched_) {
+          sched_->ready_coros_.erase(h_);
+        }
+      }
+    }
+
+    Flight &flight_;
+    TimedScheduler *sched_;
+    std::coroutine_handle<> h_{};
+  };
+
+  void wake(Flight &flight) {
+    flight.done = true;
+    if (sched_) {
+      auto waiters = std::exchange(flight.waiters, {});
+      sched_->ready_coros_.insert(waiters.begin(), waiters.end());
+      return;
+    }
+    // A waiter may destroy another one when it's resumed, which then leaves
+    // the list.
+    while (!flight.waiters.empty()) {
+      auto h = flight.waiters.front();
+      flight.waiters.erase(flight.waiters.begin());
+      h.resume();
+    }
+  }
+
+  HTTPHandler handler_;
+  RequestCoalescerOptions options_;
+  TimedScheduler *sched_;
+  std::unordered_map<std::string, std::shared_ptr<Flight>,
+                     cmp::CaseSensitiveHash, cmp::CaseSensitiveEqual>
+      flights_;
+  RequestCoalescerStats stats_;
+};
+
+struct ResponseCacheOptions {
+  // How long an entry is served as fresh.
+  Clock::duration ttl{std::chrono::seconds(1)};
+  // How long an expired entry may still be served while a single background
+  // refresh runs. Zero disables stale-while-revalidate.
+  Clock::duration stale_while_revalidate{};
+  // Query parameters that take part in the key. Others are ignored, so
+  // "/a?x=1&utm=2" and "/a?x=1" share an entry if only "x" is selected.
+  std::vector<std::string> query_params{};
+  // Request headers that take part in the key (like the "Vary" header).
+  std::vector<std::string> vary{};
+  // LRU bounds. An entry is evicted when either of them is exceeded.
+  std::size_t max_entries{1024};
+  std::size_t max_bytes{std::size_t{64} << 20};
+  // Adds an ETag made from the body to responses that have none. Entries with
+  // an ETag or a Last-Modified header answer conditional requests with 304.
+  ETagMode etag{ETagMode::STRONG};
+};
+
+struct ResponseCacheStats {
+  std::size_t hits{};
+  std::size_t stale_hits{};
+  std::size_t misses{};
+  std::size_t refreshes{};
+  std::size_t evictions{};
+  std::size_t uncacheable{};
+  std::size_t not_modified{}; // 304s answered from entries.
+};
+
+// A per-route cache in front of an HTTPHandler. It stores the serialized
+// response so that a hit is written with a single puts() and without rebuilding
+// the headers. Concurrent misses for the same key are coalesced, so the handler
+// runs once for all of them.
+//
+// It's not thread-safe: use one cache (and one router) per loop.
+struct ResponseCache {
+  ResponseCache(HTTPHandler handler, ResponseCacheOptions options = {},
+                TimedScheduler *sched = nullptr)
+      : handler_(std::move(handler)), options_(std::move(options)),
+        sched_(sched),
+        flights_([this](HTTPRequest const &req) { return tagged(req); }, {},
+                 sched) {}
+
+  ResponseCache(ResponseCache &&) = delete;
+
+  Task<HTTPResponse> handle(HTTPRequest req) {
+    reap_refreshes();
+    auto k = key(req);
+    auto now = Clock::now();
+    if (auto it = index_.find(k); it != index_.end()) {
+      auto &entry = *it->second;
+      if (now < entry.expire) {
+        ++stats_.hits;
+        touch(it->second);
+        co_return respond(entry, req);
+      }
+      if (now < entry.expire + options_.stale_while_revalidate) {
+        ++stats_.stale_hits;
+        touch(it->second);
+        // Without a scheduler the refresh may finish inline and replace the
+        // entry, so take the stale response first.
+        auto res = respond(entry, req);
+        if (!entry.refreshing) {
+          entry.refreshing = true;
+          start_refresh(std::move(k), std::move(req));
+        }
+        co_return res;
+      }
+    }
+    ++stats_.misses;
+    // The request is given away, so keep what the preconditions need.
+    HTTPRequest conditional;
+    conditional.method = req.method;
+    for (auto name : {"If-None-Match", "If-Modified-Since"}) {
+      if (auto it = req.headers.find(name); it != req.headers.end()) {
+        conditional.headers.emplace(*it);
+      }
+    }
+    auto res = co_await flights_.run(k, std::move(req));
+    auto it = index_.find(k);
+    // Requests that shared a flight get the bytes the first one has stored.
+    if (!(res.serialized && it != index_.end() &&
+          it->second->bytes == res.serialized)) {
+      res = store(k, std::move(res));
+      it = index_.find(k);
+    }
+    if (it == index_.end()) {
+      evaluate_conditional(conditional, res);
+      co_return res;
+    }
+    co_return respond(*it->second, conditional);
+  }
+
+  std::string key(HTTPRequest const &req) const {
+    return request_key(req, options_.query_params, options_.vary);
+  }
+
+  void clear() {
+    lru_.clear();
+    index_.clear();
+    bytes_ = 0;
+  }
+
+  ResponseCacheStats const &stats() const { return stats_; }
+
+  RequestCoalescerStats const &coalescing_stats() const {
+    return flights_.stats();
+  }
+
+  std::size_t size() const { return lru_.size(); }
+
+  std::size_t bytes() const { return bytes_; }
+
+  // https://www.rfc-editor.org/rfc/rfc9111#section-4.2.2 (heuristically
+  // cacheable status codes), minus 206 which depends on the request.
+  static bool cacheable(HTTPResponse const &res) {
+    switch (res.status) {
+    case 200:
+    case 203:
+    case 204:
+    case 300:
+    case 301:
+    case 308:
+    case 404:
+    case 405:
+    case 410:
+    case 414:
+    case 501:
+      break;
+    default:
+      return false;
+    }
+    if (auto it = res.headers.find("Cache-Control"); it != res.headers.end()) {
+      std::string_view v = it->second;
+      if (v.contains("no-store") || v.contains("private")) {
+        return false;
+      }
+    }
+    // A generated body is meant to be streamed, and a file body to be sent
+    // from the file, not stored.
+    return !res.body.generator() && !res.body.file();
+  }
+
+private:
+  struct Entry {
+    HTTPResponse response() const {
+      HTTPResponse res;
+      res.status = status;
+      res.serialized = bytes;
+      return res;
+    }
+
+    std::string key;
+    int status{};
+    std::shared_ptr<const std::string> bytes;
+    Clock::time_point expire;
+    bool refreshing{};
+    // Validators, and the 304 response made from them.
+    std::string etag;
+    std::string last_modified;
+    std::shared_ptr<const std::string> not_modified;
+  };
+
+  HTTPResponse respond(Entry const &entry, HTTPRequest const &req) {
+    if (!entry.not_modified) {
+      return entry.response();
+    }
+    switch (evaluate_preconditions(req, entry.etag, entry.last_modified)) {
+    case 304: {
+      ++stats_.not_modified;
+      HTTPResponse res;
+      res.status = 304;
+      res.serialized = entry.not_modified;
+      return res;
+    }
+    case 412:
+      return precondition_response(412, {});
+    default:
+      return entry.response();
+    }
+  }
+
+  using LRU = std::list<Entry>;
+
+  void maybe_add_etag(HTTPResponse &res) const {
+    if (options_.etag != ETagMode::NONE && res.status == 200 &&
+        cacheable(res)) {
+      add_etag(res, options_.etag == ETagMode::WEAK);
+    }
+  }
+
+  // The handler behind the coalescer. The ETag is added before the coalescer
+  // serializes the response for its waiters.
+  Task<HTTPResponse> tagged(HTTPRequest const &req) {
+    auto res = co_await handler_(req);
+    maybe_add_etag(res);
+    co_return res;
+  }
+
+  HTTPResponse store(std::string k, HTTPResponse res) {
+    if (!cacheable(res)) {
+      ++stats_.uncacheable;
+      erase(k);
+      return res;
+    }
+    maybe_add_etag(res);
+    auto bytes = res.serialized ? res.serialized
+                                : std::make_shared<const std::string>(
+                                      res.to_string());
+    erase(k);
+    if (bytes->size() + k.size() > options_.max_bytes) {
+      ++stats_.uncacheable;
+      return res;
+    }
+    bytes_ += bytes->size() + k.size();
+    Entry entry;
+    entry.key = std::move(k);
+    entry.status = res.status;
+    entry.bytes = bytes;
+    entry.expire = Clock::now() + options_.ttl;
+    // A serialized response keeps its headers next to the bytes, see
+    // RequestCoalescer.
+    if (res.status == 200) {
+      if (auto it = res.headers.find("ETag"); it != res.headers.end()) {
+        entry.etag = it->second;
+      }
+      if (auto it = res.headers.find("Last-Modified");
+          it != res.headers.end()) {
+        entry.last_modified = it->second;
+      }
+      if (!entry.etag.empty() || !entry.last_modified.empty()) {
+        entry.not_modified = std::make_shared<const std::string>(
+            precondition_response(304, res.headers).to_string());
+      }
+    }
+    lru_.push_front(std::move(entry));
+    index_.emplace(lru_.front().key, lru_.begin());
+    evict();
+    return lru_.empty() ? res : lru_.front().response();
+  }
+
+  void erase(std::string const &k) {
+    if (auto it = index_.find(k); it != index_.end()) {
+      bytes_ -= it->second->bytes->size() + it->second->key.size();
+      auto pos = it->second;
+      index_.erase(it);
+      lru_.erase(pos);
+    }
+  }
+
+  void touch(LRU::iterator it) { lru_.splice(lru_.begin(), lru_, it); }
+
+  void evict() {
+    while (!lru_.empty() &&
+           (lru_.size() > options_.max_entries || bytes_ > options_.max_bytes)) {
+      ++stats_.evictions;
+      // Copy the key: erase() destroys the entry that owns it.
+      erase(std::string{lru_.back().key});
+    }
+  }
+
+  Task<> refresh(std::string k, HTTPRequest req) {
+    ++stats_.refreshes;
+    try {
+      auto res = co_await handler_(req);
+      store(k, std::move(res));
+    } catch (...) {
+      // Keep serving the stale entry until it's out of its window.
+      if (auto it = index_.find(k); it != index_.end()) {
+        it->second->refreshing = false;
+      }
+      try {
+        throw;
+      } catch (std::exception &e) {
+        LOG_DEBUG << "cache refresh failed: " << e.what() << "\n";
+      } catch (...) {
+        LOG_DEBUG << "cache refresh failed\n";
+      }
+    }
+  }
+
+  // The refresh is deferred to the ready queue of the loop if there is one,
+  // so the stale response goes out first. Otherwise it starts immediately and
+  // runs until its first suspension.
+  void start_refresh(std::string k, HTTPRequest req) {
+    auto task = refresh(std::move(k), std::move(req));
+    auto a = task.operator co_await();
+    auto h = a.await_suspend(std::noop_coroutine());
+    if (sched_) {
+      sched_->ready_coros_.insert(h);
+    } else {
+      h.resume();
+    }
+    refreshes_.push_back(std::move(task));
+  }
+
+  void reap_refreshes() {
+    std::erase_if(refreshes_, [](Task<> const &t) { return t.coro_.done(); });
+  }
+
+  HTTPHandler handler_;
+  ResponseCacheOptions options_;
+  TimedScheduler *sched_;
+  LRU lru_;
+  std::unordered_map<std::string, LRU::iterator, cmp::CaseSensitiveHash,
+                     cmp::CaseSensitiveEqual>
+      index_;
+  std::size_t bytes_{};
+  ResponseCacheStats stats_;
+  std::vector<Task<>> refreshes_;
+  RequestCoalescer flights_;
+};
+
+// Registers `handler` behind a ResponseCache. Keep the returned pointer to read
+// the statistics.
+inline std::shared_ptr<ResponseCache>
+route_cached(HTTPRouter &router, HTTPMethod method, std::string_view uri,
+             HTTPHandler handler, ResponseCacheOptions options = {},
+             TimedScheduler *sched = nullptr) {
+  auto cache = std::make_shared<ResponseCache>(std::move(handler),
+                                               std::move(options), sched);
+  router.route(method, uri, [cache](HTTPRequest req) {
+    return cache->handle(std::move(req));
+  });
+  return cache;
+}
+
+// Registers `handler` behind a RequestCoalescer. Keep the returned pointer to
+// read the statistics.
+inline std::shared_ptr<RequestCoalescer>
+route_coalesced(HTTPRouter &router, HTTPMethod method, std::string_view uri,
+                HTTPHandler handler, RequestCoalescerOptions options = {},
+                TimedScheduler *sched = nullptr) {
+  auto flights = std::make_shared<RequestCoalescer>(std::move(handler),
+                                                    std::move(options), sched);
+  router.route(method, uri, [flights](HTTPRequest req) {
+    return flights->handle(std::move(req));
+  });
+  return flights;
+}
+
+} // namespace coro
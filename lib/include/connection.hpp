@@ -0,0 +1,270 @@
+#pragma once
+
+#include <chrono>
+#include <concepts>
+#include <cstddef>
+#include <string_view>
+#include <utility>
+
+#include "access_log.hpp"
+#include "arena.hpp"
+#include "balancer.hpp"
+#include "epoll.hpp"
+#include "etag.hpp"
+#include "http.hpp"
+#include "latency.hpp"
+#include "loop_monitor.hpp"
+#include "object_pool.hpp"
+#include "range.hpp"
+#include "shutdown.hpp"
+#include "static_response.hpp"
+#include "stats.hpp"
+#include "task.hpp"
+
+namespace coro {
+
+struct ConnectionOptions {
+  bool keep_alive = true;             // Otherwise one request per connection.
+  std::size_t arena_block_size = 4096; // See Arena.
+  std::size_t max_idle_arena = 65536;  // See ConnectionState.
+};
+
+// The memory a connection keeps while it's open: the I/O buffers and the
+// arena of its requests. A loop keeps those of closed connections in a
+// ConnectionPool and gives them to the next ones, so accepting a connection
+// doesn't allocate them again. An idle state keeps at most `max_idle_arena`
+// bytes of arena blocks, so that one large request doesn't pin its memory in
+// the pool.
+struct ConnectionState {
+  explicit ConnectionState(std::size_t buffer_size = 8192,
+                           std::size_t arena_block_size = 4096,
+                           std::size_t max_idle_arena = 65536)
+      : buffer(buffer_size), arena(arena_block_size),
+        max_idle_arena(max_idle_arena) {}
+
+  // Called when the state goes back to the pool. The file is closed here.
+  void clear() {
+    buffer.clear();
+    arena.reset();
+    arena.trim(max_idle_arena);
+  }
+
+  AsyncFileBuffer buffer;
+  Arena arena;
+  std::size_t max_idle_arena;
+};
+
+using ConnectionPool = ObjectPool<ConnectionState>;
+
+namespace detail {
+// Counts a connection as open while it's alive.
+struct OpenConnection {
+  OpenConnection(LoopStats *stats, Balancer::Loop *balancer)
+      : stats_(stats), balancer_(balancer) {
+    if (stats_) {
+      stats_->add(Stat::OPEN_CONNECTIONS);
+    }
+    if (balancer_) {
+      balancer_->add_connections(1);
+    }
+  }
+
+  OpenConnection(OpenConnection const &) = delete;
+  OpenConnection &operator=(OpenConnection const &) = delete;
+
+  ~OpenConnection() {
+    if (stats_) {
+      stats_->add(Stat::OPEN_CONNECTIONS, -1);
+    }
+    if (balancer_) {
+      balancer_->add_connections(-1);
+    }
+  }
+
+  LoopStats *stats_;
+  Balancer::Loop *balancer_;
+};
+} // namespace detail
+
+// Serves the requests of a connection until the client closes it, or the
+// client or a response asks to (see HTTPRequest::keep_alive() and
+// HTTPResponse::keep_alive()), or the process is asked to stop (see
+// stop_requested()). EOFException is thrown when the client closes the
+// connection.
+//
+// Each request is read into `arena`, which is reset once its response is
+// sent. Handlers that make their responses with the request's allocator
+// (HTTPResponse::with_allocator(req.get_allocator())) put those in the arena
+// too. Together with the recycled coroutine frames (see FrameCache), a request
+// to such a handler allocates nothing from the heap once the connection has
+// served one like it.
+//
+// If the thread has a current LatencyRecorder, the phases of each request are
+// recorded in it under the pattern of its route. If it has current LoopStats,
+// the connection, its requests and their statuses are counted there. If it has
+// a current LoopMonitor, the resumes that run a route are annotated with its
+// pattern. If it has a current AccessLog::Ring, each request is logged there.
+// If it has a current Balancer::Loop, the connection may be moved to another
+// loop between two requests, and then closed here.
+//
+// `conn` is usually an AsyncFileBuffer, but any BufferedStream will do (e.g. a
+// MemoryStream, to serve requests without the kernel). The stream waits on its
+// own loop, so the scheduler is only taken to match the other overloads.
+template <BufferedStream Stream>
+Task<> serve_connection(EpollScheduler &, Stream &conn, Arena &arena,
+                        HTTPRouter const &router,
+                        ConnectionOptions options = {}) {
+  using namespace std::literals;
+
+  auto latency = LatencyRecorder::current();
+  auto stats = LoopStats::current();
+  auto monitor = LoopMonitor::current();
+  auto access = AccessLog::current();
+  auto balancer = Balancer::current();
+  detail::OpenConnection open(stats, balancer);
+  PhaseTimer timer(latency != nullptr);
+  timer.start();
+  bool first = true;
+  bool keep_alive = true;
+  try {
+    while (keep_alive) {
+      {
+        auto req = HTTPRequest::with_allocator(&arena);
+        Clock::time_point start;
+        if (timer.enabled() || access) {
+          // The time between requests isn't a phase.
+          co_await conn.fill();
+          if (access) {
+            start = Clock::now();
+          }
+        }
+        if (timer.enabled()) {
+          if (std::exchange(first, false)) {
+            timer.mark(Phase::ACCEPT_TO_FIRST_BYTE);
+          } else {
+            timer.start();
+          }
+        }
+        co_await req.read_from(conn);
+        timer.mark(Phase::HEADER_PARSE);
+        keep_alive =
+            options.keep_alive && req.keep_alive() && !stop_requested();
+
+        std::string_view pattern;
+        Stat route;
+        int status;
+        auto s = router.find_static(http_method(req.method), req.uri);
+        if (s) {
+          if (timer.enabled() || monitor) {
+            pattern = router.pattern_of(s);
+          }
+          s = s->select(req);
+        }
+        if (s) {
+          timer.mark(Phase::ROUTE_LOOKUP);
+          if (monitor) {
+            monitor->annotate(pattern);
+          }
+          route = Stat::ROUTE_STATIC_HITS;
+          status = s->response().status;
+          keep_alive = keep_alive && s->response().keep_alive();
+          co_await s->write_to(conn, keep_alive);
+        } else if (auto const &r = router.find_route(req.method, req.uri)) {
+          if (timer.enabled() || monitor) {
+            pattern = router.pattern_of(&r);
+          }
+          timer.mark(Phase::ROUTE_LOOKUP);
+          route = Stat::ROUTE_HANDLER_HITS;
+          // Before the handler runs, and again in the resume where it returns.
+          if (monitor) {
+            monitor->annotate(pattern);
+          }
+          auto res = co_await r(req);
+          timer.mark(Phase::HANDLER);
+          if (monitor) {
+            monitor->annotate(pattern);
+          }
+          evaluate_conditional(req, res) || evaluate_range(req, res);
+          status = res.status;
+          // The template writes the Connection field, so a handler's own
+          // "Connection: close" is honored here.
+          keep_alive = keep_alive && res.keep_alive();
+          co_await res.write_to(conn, "", keep_alive);
+        } else {
+          timer.mark(Phase::ROUTE_LOOKUP);
+          route = Stat::ROUTE_MISSES;
+          auto res = HTTPResponse::with_allocator(req.get_allocator());
+          res.headers["Content-Type"] = "application/json";
+          res.status = status = 404;
+          res.body = R"({ "message": "Cannot find a route." })"sv;
+          co_await res.write_to(conn, "", keep_alive);
+        }
+        timer.mark(Phase::SERIALIZATION);
+        co_await conn.flush();
+        timer.mark(Phase::FLUSH);
+        if (latency) {
+          latency->record(pattern, timer);
+          timer.clear();
+        }
+        if (stats) {
+          stats->add(Stat::REQUESTS);
+          stats->add(route);
+          stats->add_response(status);
+        }
+        if (access) {
+          access->push(AccessRecord::make(req.method, req.uri, status,
+                                          Clock::now() - start));
+        }
+      }
+      arena.reset();
+      if constexpr (std::same_as<Stream, AsyncFileBuffer>) {
+        if (keep_alive && balancer && balancer->migrate(conn)) {
+          break;
+        }
+      }
+    }
+  } catch (EOFException &) {
+    throw;
+  } catch (...) {
+    if (stats) {
+      stats->add(Stat::EXCEPTIONS);
+    }
+    throw;
+  }
+}
+
+// Same as above with an arena of its own.
+template <BufferedStream Stream>
+Task<> serve_connection(EpollScheduler &sched, Stream &conn,
+                        HTTPRouter const &router,
+                        ConnectionOptions options = {}) {
+  Arena arena(options.arena_block_size);
+  co_await serve_connection(sched, conn, arena, router, options);
+}
+
+// Serves `file` with a state from `pool`, which gets it back when the
+// connection is closed.
+inline Task<> serve_connection(EpollScheduler &sched, ConnectionPool &pool,
+                               AsyncFile file, HTTPRouter const &router,
+                               ConnectionOptions options = {}) {
+  auto state = pool.acquire(8192, options.arena_block_size,
+                            options.max_idle_arena);
+  state->buffer.open(sched, std::move(file));
+  co_await serve_connection(sched, state->buffer, state->arena, router,
+                            options);
+}
+
+// Same with a connection moved from another loop (see Balancer), whose unread
+// bytes are read first.
+inline Task<> serve_connection(EpollScheduler &sched, ConnectionPool &pool,
+                               MigratedConnection conn,
+                               HTTPRouter const &router,
+                               ConnectionOptions options = {}) {
+  auto state = pool.acquire(8192, options.arena_block_size,
+                            options.max_idle_arena);
+  state->buffer.open(sched, std::move(conn.file), conn.unread);
+  co_await serve_connection(sched, state->buffer, state->arena, router,
+                            options);
+}
+
+} // namespace coro
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cassert>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "http_date.hpp"
+#include "utility.hpp"
+
+namespace coro {
+
+struct HeaderTemplateOptions {
+  std::string server = "coro";     // Empty: no Server header.
+  std::string connection = "close"; // Empty: no Connection header.
+};
+
+// The headers every response gets, kept as one block so that a response
+// appends them with a single memcpy:
+//
+//   "Server: coro\r\nConnection: close\r\nDate: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+//
+// The date has a fixed length, so refresh() rewrites it in place, at most once
+// a second. A second block without the Connection field is kept for
+// connections that stay open, since HTTP/1.1 connections are persistent by
+// default.
+//
+// A template is owned by an event loop and only used by the loop's thread. In
+// a server with several loops each one has its own, so refreshing needs no
+// locking and a response never sees a date being rewritten.
+class HeaderTemplate {
+public:
+  explicit HeaderTemplate(HeaderTemplateOptions const &options = {}) {
+    using namespace std::literals;
+    if (!options.server.empty()) {
+      bytes_ += "Server: "sv;
+      bytes_ += options.server;
+      bytes_ += "\r\n"sv;
+    }
+    if (!options.connection.empty()) {
+      bytes_ += "Connection: "sv;
+      bytes_ += options.connection;
+      bytes_ += "\r\n"sv;
+    }
+    bytes_ += "Date: "sv;
+    date_ = bytes_.size();
+    bytes_.append(date_size, ' ');
+    bytes_ += "\r\n"sv;
+
+    if (!options.server.empty()) {
+      keep_alive_bytes_ += "Server: "sv;
+      keep_alive_bytes_ += options.server;
+      keep_alive_bytes_ += "\r\n"sv;
+    }
+    keep_alive_bytes_ += "Date: "sv;
+    keep_alive_date_ = keep_alive_bytes_.size();
+    keep_alive_bytes_.append(date_size, ' ');
+    keep_alive_bytes_ += "\r\n"sv;
+    refresh();
+  }
+
+  // Rewrites the date if the second has changed since the last call.
+  void refresh(std::time_t now = std::time(nullptr)) {
+    if (now == last_) {
+      return;
+    }
+    last_ = now;
+    auto date = format_http_date(now);
+    assert(date.size() == date_size);
+    std::memcpy(bytes_.data() + date_, date.data(), date_size);
+    std::memcpy(keep_alive_bytes_.data() + keep_alive_date_, date.data(),
+                date_size);
+  }
+
+  std::string_view bytes(bool keep_alive = false) const {
+    return keep_alive ? keep_alive_bytes_ : bytes_;
+  }
+
+  std::string_view date() const { return {bytes_.data() + date_, date_size}; }
+
+  // The headers the template provides. A response's own fields with these
+  // names are not written; serve_connection() turns a response's "Connection:
+  // close" into the template's.
+  static bool provides(std::string_view name) {
+    cmp::CaseInsensitiveEqual eq;
+    return eq(name, "Date") || eq(name, "Server") || eq(name, "Connection");
+  }
+
+  // Makes `t` the template of the current thread while the scope is alive.
+  struct Scope {
+    explicit Scope(HeaderTemplate &t) : prev_(std::exchange(current_, &t)) {}
+    Scope(Scope const &) = delete;
+    Scope &operator=(Scope const &) = delete;
+    ~Scope() { current_ = prev_; }
+
+  private:
+    HeaderTemplate *prev_;
+  };
+
+  static HeaderTemplate *current() { return current_; }
+
+private:
+  // "Sun, 06 Nov 1994 08:49:37 GMT"
+  static constexpr std::size_t date_size = 29;
+
+  static inline thread_local HeaderTemplate *current_ = nullptr;
+
+  std::string bytes_;
+  std::size_t date_{};
+  std::string keep_alive_bytes_;
+  std::size_t keep_alive_date_{};
+  std::time_t last_ = -1;
+};
+
+// The default headers for responses written on this thread: those of the
+// event loop running on it, or, outside of a loop, a thread-local template
+// refreshed on each call. `keep_alive` leaves out "Connection: close".
+inline std::string_view default_response_headers(bool keep_alive = false) {
+  if (auto t = HeaderTemplate::current()) {
+    return t->bytes(keep_alive);
+  }
+  thread_local HeaderTemplate t;
+  t.refresh();
+  return t.bytes(keep_alive);
+}
+
+} // namespace coro
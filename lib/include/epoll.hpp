@@ -1,17 +1,27 @@
 #pragma once
 
+#include <algorithm>
 #include <cerrno>
 #include <chrono>
+#include <climits>
 #include <coroutine>
 #include <cstddef>
 #include <cstdio>
 #include <fcntl.h>
+#include <functional>
 #include <string>
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <utility>
+#include <vector>
 
 #include "aio.hpp"
+#include "frame_registry.hpp"
+#include "loop_monitor.hpp"
+#include "stats.hpp"
+#include "syscall.hpp"
 #include "task.hpp"
 #include "utility.hpp"
 
@@ -24,6 +34,10 @@ struct EpollScheduler;
 struct EpollFileAwaiter;
 
 struct EpollFilePromise : Promise<EpollEventMask> {
+  EpollFilePromise(
+      std::source_location where = std::source_location::current())
+      : Promise(where) {}
+
   auto get_return_object() {
     return std::coroutine_handle<EpollFilePromise>::from_promise(*this);
   }
@@ -51,14 +65,31 @@ struct EpollScheduler {
       using namespace std::chrono;
       timeout = duration_cast<milliseconds>(*timeout_opt).count();
     }
+    auto monitor = LoopMonitor::current();
+    if (monitor) {
+      monitor->before_wait();
+    }
     struct epoll_event ebuf[1024];
-    int res = epoll_wait(epoll_, ebuf, std::size(ebuf), timeout);
+    int res = sys::epoll_wait(epoll_, ebuf, std::size(ebuf), timeout);
+    if (monitor) {
+      monitor->after_wait();
+    }
     if (res == -1 && errno == EINTR) {
       res = 0;
     }
     if (res == -1) {
       THROW_SYSCALL("epoll_wait");
     }
+    if constexpr (frame_registry_enabled) {
+      if (frame_dump_requested()) {
+        std::cerr << dump_frames();
+      }
+    }
+    count_stat(Stat::EPOLL_WAKEUPS);
+    count_stat(Stat::EPOLL_EVENTS, res);
+    if (res > 0 && on_wake) {
+      on_wake();
+    }
     for (int i = 0; i < res; i++) {
       auto &event = ebuf[i];
 
@@ -76,7 +107,8 @@ struct EpollScheduler {
       // When epoll gives us an event, we get a coroutine handle from data.ptr
       // and resume it.
       auto h = std::coroutine_handle<EpollFilePromise>::from_promise(promise);
-      h.resume();
+      note_frame_wait(h, {});
+      resume_monitored(monitor, h);
     }
   }
 
@@ -98,6 +130,10 @@ struct EpollScheduler {
 
   int epoll_{CHECK_SYSCALL2(epoll_create1(STDIN_FILENO))};
   int registered_cnt_{};
+
+  // Called when epoll_wait returns events, before any coroutine is resumed.
+  // The wait may have been long, so a loop refreshes its per-tick state here.
+  std::function<void()> on_wake;
 };
 
 struct EpollFileAwaiter {
@@ -112,6 +148,7 @@ struct EpollFileAwaiter {
       promise.awaiter_ = nullptr;
       THROW_SYSCALL("epoll_ctl");
     }
+    note_frame_wait(coroutine, FrameWait::file(fd_, events_));
     return suspend;
   }
 
@@ -144,7 +181,7 @@ bool EpollScheduler::add_listener(EpollFilePromise &promise, int epoll_op) {
   // DEBUG() << std::format("add_lister: epoll_ctl: fd={} ev=0x{:x}\n",
   //                        promise.awaiter_->fd_, promise.awaiter_->events_);
 
-  auto ret = epoll_ctl(epoll_, epoll_op, promise.awaiter_->fd_, &event);
+  auto ret = sys::epoll_ctl(epoll_, epoll_op, promise.awaiter_->fd_, &event);
   if (ret == -1) {
     return false;
   }
@@ -157,7 +194,8 @@ bool EpollScheduler::add_listener(EpollFilePromise &promise, int epoll_op) {
 void EpollScheduler::remove_listener(EpollFilePromise &promise) {
   // DEBUG() << std::format("remove_lister: epoll_ctl: fd={}\n",
   //                        promise.awaiter_->fd_);
-  CHECK_SYSCALL(epoll_ctl(epoll_, EPOLL_CTL_DEL, promise.awaiter_->fd_, NULL));
+  CHECK_SYSCALL(
+      sys::epoll_ctl(epoll_, EPOLL_CTL_DEL, promise.awaiter_->fd_, NULL));
   --registered_cnt_;
 }
 
@@ -167,7 +205,7 @@ wait_file_event(EpollScheduler &sched, AsyncFile &file, EpollEventMask events) {
 }
 
 inline std::size_t read_file_sync(AsyncFile &file, std::span<char> buffer) {
-  auto ret = read(file.fd_, buffer.data(), buffer.size());
+  auto ret = sys::read(file.fd_, buffer.data(), buffer.size());
   int err = errno;
   // EAGAIN and EWOULDBLOCK can be different.
   if (ret == -1 && (err == EAGAIN || err == EWOULDBLOCK)) {
@@ -182,7 +220,7 @@ inline std::size_t read_file_sync(AsyncFile &file, std::span<char> buffer) {
 
 inline std::size_t write_file_sync(AsyncFile &file,
                                    std::span<char const> buffer) {
-  auto ret = write(file.fd_, buffer.data(), buffer.size());
+  auto ret = sys::write(file.fd_, buffer.data(), buffer.size());
   int err = errno;
   // EAGAIN and EWOULDBLOCK can be different.
   if (ret == -1 && (err == EAGAIN || err == EWOULDBLOCK)) {
@@ -197,6 +235,74 @@ inline std::size_t write_file_sync(AsyncFile &file,
   return ret;
 }
 
+// Sends `count` bytes of `in_fd` from `offset` to `out` with sendfile(), waiting
+// whenever the socket buffer is full.
+inline Task<> send_file(EpollScheduler &sched, AsyncFile &out, int in_fd,
+                        off_t offset, std::size_t count) {
+  while (count) {
+    auto ret = sys::sendfile(out.fd_, in_fd, &offset, count);
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      auto ev = co_await wait_file_event(sched, out, EPOLLOUT);
+      if (ev & (EPOLLERR | EPOLLHUP)) { // Those 2 events are always waited.
+        throw EOFException("Write-end hung up\n" + SOURCE_LOCATION());
+      }
+      continue;
+    }
+    if (ret == -1 && (errno == ECONNRESET || errno == EPIPE)) {
+      throw EOFException("Write-end ECONNRESET\n" + SOURCE_LOCATION());
+    }
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    }
+    if (ret == -1) {
+      THROW_SYSCALL("sendfile");
+    }
+    if (ret == 0) {
+      throw std::runtime_error("file is truncated\n" + SOURCE_LOCATION());
+    }
+    // sendfile() has moved the offset.
+    count -= ret;
+  }
+}
+
+// Writes all of `iov` with writev(), waiting whenever the socket buffer is
+// full. The entries are advanced past what has been written.
+inline Task<> write_vectored(EpollScheduler &sched, AsyncFile &out,
+                             std::span<iovec> iov) {
+  while (!iov.empty()) {
+    auto ret = sys::writev(
+        out.fd_, iov.data(),
+        static_cast<int>(std::min<std::size_t>(iov.size(), IOV_MAX)));
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      auto ev = co_await wait_file_event(sched, out, EPOLLOUT);
+      if (ev & (EPOLLERR | EPOLLHUP)) { // Those 2 events are always waited.
+        throw EOFException("Write-end hung up\n" + SOURCE_LOCATION());
+      }
+      continue;
+    }
+    if (ret == -1 && (errno == ECONNRESET || errno == EPIPE)) {
+      throw EOFException("Write-end ECONNRESET\n" + SOURCE_LOCATION());
+    }
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    }
+    if (ret == -1) {
+      THROW_SYSCALL("writev");
+    }
+    auto n = static_cast<std::size_t>(ret);
+    while (!iov.empty() && n >= iov.front().iov_len) {
+      n -= iov.front().iov_len;
+      iov = iov.subspan(1);
+    }
+    if (n) {
+      iov.front().iov_base = static_cast<char *>(iov.front().iov_base) + n;
+      iov.front().iov_len -= n;
+    } else if (ret == 0 && !iov.empty()) {
+      throw EOFException("Write EOF\n" + SOURCE_LOCATION());
+    }
+  }
+}
+
 inline Task<IOResult<std::size_t>>
 read_file_best_effort(EpollScheduler &sched, AsyncFile &file,
                       std::span<char> buffer) {
@@ -333,18 +439,73 @@ struct AsyncFileBuffer : AsyncIOStreamBase<AsyncFileBuffer> {
       : AsyncIOStreamBase<AsyncFileBuffer>(buffer_size), sched_(&loop),
         file_(std::move(file)) {}
 
-  AsyncFileBuffer() noexcept : sched_(nullptr) {}
+  // Not open yet (see open()).
+  explicit AsyncFileBuffer(std::size_t buffer_size = 8192)
+      : AsyncIOStreamBase<AsyncFileBuffer>(buffer_size), sched_(nullptr) {}
+
+  // Closes the file and forgets the buffered bytes, keeping the buffers, so
+  // that a pool can give it to another connection with open().
+  void clear() {
+    drop_unread();
+    drop_buffered();
+    file_ = AsyncFile();
+  }
+
+  void open(EpollScheduler &loop, AsyncFile file) {
+    sched_ = &loop;
+    file_ = std::move(file);
+  }
+
+  // Same, with `unread` as the first bytes read, e.g. those that another loop
+  // had read from the file (see Balancer).
+  void open(EpollScheduler &loop, AsyncFile file,
+            std::span<char const> unread) {
+    open(loop, std::move(file));
+    restore_unread(unread);
+  }
 
   Task<std::size_t> read(std::span<char> buffer) {
     auto res = co_await read_file_best_effort(*sched_, file_, buffer);
+    count_stat(Stat::BYTES_READ, res.result);
     co_return res.result; // Ignore .hup
   }
 
   Task<std::size_t> write(std::span<char const> buffer) {
     auto res = co_await write_file_best_effort(*sched_, file_, buffer);
+    count_stat(Stat::BYTES_WRITTEN, res.result);
     co_return res.result; // Ignore .hup
   }
 
+  // Sends a region of another file without copying it through the buffer.
+  Task<> sendfile(int in_fd, off_t offset, std::size_t count) {
+    co_await flush();
+    co_await send_file(*sched_, file_, in_fd, offset, count);
+    count_stat(Stat::BYTES_WRITTEN, count);
+  }
+
+  // Sends the buffered bytes and then `pieces` with writev(), so large bodies
+  // are not copied through the buffer and go out with the headers.
+  Task<> writev(std::span<std::string_view const> pieces) {
+    std::vector<iovec> iov;
+    iov.reserve(pieces.size() + 1);
+    auto pending = buffered();
+    if (!pending.empty()) {
+      iov.push_back({const_cast<char *>(pending.data()), pending.size()});
+    }
+    for (auto sv : pieces) {
+      if (!sv.empty()) {
+        iov.push_back({const_cast<char *>(sv.data()), sv.size()});
+      }
+    }
+    std::size_t size = 0;
+    for (auto const &v : iov) {
+      size += v.iov_len;
+    }
+    co_await write_vectored(*sched_, file_, iov);
+    count_stat(Stat::BYTES_WRITTEN, size);
+    drop_buffered();
+  }
+
   EpollScheduler *sched_;
   AsyncFile file_;
 };
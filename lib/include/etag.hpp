@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstdint>
+#include <format>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "hash.hpp"
+#include "http.hpp"
+#include "http_date.hpp"
+#include "utility.hpp"
+
+namespace coro {
+
+enum class ETagMode {
+  NONE,
+  WEAK,   // W/"...": the body is equivalent, e.g. generated.
+  STRONG, // "...": the body is byte-for-byte the same.
+};
+
+// An entity tag made of the XXH64 of the body.
+inline std::string make_etag(std::string_view body, bool weak = false) {
+  return std::format("{}\"{:016x}\"", weak ? "W/" : "", xxhash64(body));
+}
+
+// Weak comparison: W/"x" matches "x".
+// https://www.rfc-editor.org/rfc/rfc9110#section-8.8.3.2
+inline bool etag_weak_equal(std::string_view a, std::string_view b) {
+  if (a.starts_with("W/")) {
+    a.remove_prefix(2);
+  }
+  if (b.starts_with("W/")) {
+    b.remove_prefix(2);
+  }
+  return a == b;
+}
+
+// Whether an If-None-Match field value ("*" or a list of entity tags) matches
+// `etag`.
+inline bool etag_list_matches(std::string_view list, std::string_view etag) {
+  while (!list.empty()) {
+    auto pos = list.find(',');
+    auto item = list.substr(0, pos);
+    while (!item.empty() && std::isspace((unsigned char)item.front())) {
+      item.remove_prefix(1);
+    }
+    while (!item.empty() && std::isspace((unsigned char)item.back())) {
+      item.remove_suffix(1);
+    }
+    if (item == "*" || (!etag.empty() && etag_weak_equal(item, etag))) {
+      return true;
+    }
+    if (pos == std::string_view::npos) {
+      break;
+    }
+    list.remove_prefix(pos + 1);
+  }
+  return false;
+}
+
+// Evaluates If-None-Match and If-Modified-Since against the validators of the
+// selected representation. Returns the status to answer instead of it (304 or
+// 412), or 0 if the full response should be sent.
+//
+// https://www.rfc-editor.org/rfc/rfc9110#section-13.2.2
+inline int evaluate_preconditions(HTTPRequest const &req, std::string_view etag,
+                                  std::string_view last_modified) {
+  auto m = http_method(req.method);
+  bool get_or_head = m == HTTPMethod::GET || m == HTTPMethod::HEAD;
+  if (auto it = req.headers.find("If-None-Match"); it != req.headers.end()) {
+    if (!etag_list_matches(it->second, etag)) {
+      return 0;
+    }
+    return get_or_head ? 304 : 412;
+  }
+  if (!get_or_head || last_modified.empty()) {
+    return 0;
+  }
+  if (auto it = req.headers.find("If-Modified-Since");
+      it != req.headers.end()) {
+    auto since = parse_http_date(it->second);
+    auto modified = parse_http_date(last_modified);
+    if (since && modified && *modified <= *since) {
+      return 304;
+    }
+  }
+  return 0;
+}
+
+// A bodiless response for `status` (304 or 412) that keeps the headers a cache
+// needs to update its stored response. It uses the allocator of `headers`.
+// https://www.rfc-editor.org/rfc/rfc9110#section-15.4.5
+inline HTTPResponse precondition_response(int status,
+                                          HTTPHeaders const &headers) {
+  auto res = HTTPResponse::with_allocator(headers.get_allocator());
+  res.status = status;
+  if (status == 304) {
+    for (auto name : {"Cache-Control", "Content-Location", "Date", "ETag",
+                      "Expires", "Last-Modified", "Vary"}) {
+      if (auto it = headers.find(name); it != headers.end()) {
+        res.headers.emplace(*it);
+      }
+    }
+  }
+  return res;
+}
+
+// Adds an ETag computed from the body unless there is one already. Bodies
+// that are not in memory are left alone.
+inline void add_etag(HTTPResponse &res, bool weak = false) {
+  if (res.serialized || !res.body.in_memory() ||
+      res.headers.contains("ETag")) {
+    return;
+  }
+  res.headers["ETag"] = make_etag(res.body.view(), weak);
+}
+
+// Turns a 200 response into 304/412 if the request's preconditions say the
+// client already has it. Call it before the response is written, so the body
+// is never sent. Returns whether the response has been replaced.
+inline bool evaluate_conditional(HTTPRequest const &req, HTTPResponse &res) {
+  if (res.status != 200 || res.serialized) {
+    return false;
+  }
+  if (!req.headers.contains("If-None-Match") &&
+      !req.headers.contains("If-Modified-Since")) {
+    return false;
+  }
+  std::string_view etag, last_modified;
+  if (auto it = res.headers.find("ETag"); it != res.headers.end()) {
+    etag = it->second;
+  }
+  if (auto it = res.headers.find("Last-Modified"); it != res.headers.end()) {
+    last_modified = it->second;
+  }
+  auto status = evaluate_preconditions(req, etag, last_modified);
+  if (status == 0) {
+    return false;
+  }
+  res = precondition_response(status, res.headers);
+  return true;
+}
+
+} // namespace coro
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <source_location>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// The frame profiler counts the coroutine frames made by each coroutine
+// function, with their bytes and how many came from operator new rather than
+// the FrameCache. A coroutine that's created for every byte or every header
+// shows up at the top of the report (see doc/puts_throughput.md for what such
+// a coroutine costs). It's opt-in: build with CORO_FRAME_PROFILE defined (the
+// CMake option of the same name) to enable it; the hooks are empty otherwise.
+
+namespace coro {
+
+#ifdef CORO_FRAME_PROFILE
+inline constexpr bool frame_profile_enabled = true;
+#else
+inline constexpr bool frame_profile_enabled = false;
+#endif
+
+// The frames of one coroutine function.
+struct FrameSite {
+  std::string_view function; // As given by std::source_location.
+  std::string_view file;
+  unsigned line{};
+  std::uint64_t frames{};
+  std::uint64_t bytes{};       // Requested by the compiler.
+  std::uint64_t allocations{}; // Frames not found in the FrameCache.
+  std::size_t max_size{};
+};
+
+struct FrameProfile {
+  std::chrono::duration<double> elapsed{}; // Since the start or a reset.
+  // By frames, then bytes, most first.
+  std::vector<FrameSite> sites;
+
+  std::uint64_t frames() const {
+    std::uint64_t n = 0;
+    for (auto const &site : sites) {
+      n += site.frames;
+    }
+    return n;
+  }
+};
+
+namespace detail {
+// The counts of a thread. Only the thread itself writes them, so the mutex is
+// only contended by a reader (see LatencyRecorder).
+class FrameProfiler {
+public:
+  FrameProfiler() {
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+    r.profilers.push_back(this);
+  }
+
+  FrameProfiler(FrameProfiler const &) = delete;
+  FrameProfiler &operator=(FrameProfiler const &) = delete;
+
+  // The counts are kept for frame_profile().
+  ~FrameProfiler() {
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+    std::erase(r.profilers, this);
+    add_to(r.retired);
+  }
+
+  // Called by the FrameCache, right before the promise of the frame is
+  // constructed and calls record().
+  void allocated(std::size_t size, bool from_heap) {
+    size_ = size;
+    from_heap_ = from_heap;
+  }
+
+  void record(std::source_location where) {
+    std::lock_guard lock(mutex_);
+    auto &site = sites_[Key{where.function_name(), where.line()}];
+    if (!site.frames) {
+      site.function = where.function_name();
+      site.file = where.file_name();
+      site.line = where.line();
+    }
+    site.frames++;
+    site.bytes += size_;
+    site.allocations += from_heap_;
+    site.max_size = std::max(site.max_size, size_);
+    size_ = 0;
+    from_heap_ = false;
+  }
+
+  static FrameProfile merged() {
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+    auto sites = r.retired;
+    for (auto *profiler : r.profilers) {
+      profiler->add_to(sites);
+    }
+    FrameProfile profile;
+    profile.elapsed = std::chrono::steady_clock::now() - r.start;
+    for (auto &[key, site] : sites) {
+      profile.sites.push_back(site);
+    }
+    std::ranges::sort(profile.sites, [](auto const &a, auto const &b) {
+      return a.frames != b.frames ? a.frames > b.frames : a.bytes > b.bytes;
+    });
+    return profile;
+  }
+
+  static void reset() {
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+    r.retired.clear();
+    for (auto *profiler : r.profilers) {
+      std::lock_guard lock(profiler->mutex_);
+      profiler->sites_.clear();
+    }
+    r.start = std::chrono::steady_clock::now();
+  }
+
+  // The profiler of the current thread, or null once the thread is exiting.
+  static inline FrameProfiler *local();
+
+private:
+  // A frame is counted under the address of its function's name, which
+  // isn't hashed. A function defined in a header may have a copy of the name
+  // per translation unit, so the sites are merged by name for the report.
+  struct Key {
+    char const *function;
+    unsigned line;
+
+    bool operator==(Key const &) const = default;
+  };
+
+  struct KeyHash {
+    std::size_t operator()(Key const &key) const {
+      return std::hash<char const *>()(key.function) ^ key.line;
+    }
+  };
+
+  using Sites = std::unordered_map<Key, FrameSite, KeyHash>;
+  using MergedSites =
+      std::map<std::pair<std::string_view, unsigned>, FrameSite>;
+
+  struct Registry {
+    std::mutex mutex;
+    std::vector<FrameProfiler *> profilers;
+    MergedSites retired;
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+  };
+
+  static Registry &registry() {
+    static Registry r;
+    return r;
+  }
+
+  void add_to(MergedSites &sites) const {
+    std::lock_guard lock(mutex_);
+    for (auto const &[key, site] : sites_) {
+      auto &dst = sites[{site.function, site.line}];
+      if (!dst.frames) {
+        dst = site;
+        continue;
+      }
+      dst.frames += site.frames;
+      dst.bytes += site.bytes;
+      dst.allocations += site.allocations;
+      dst.max_size = std::max(dst.max_size, site.max_size);
+    }
+  }
+
+  static inline thread_local bool exited_ = false;
+
+  mutable std::mutex mutex_;
+  Sites sites_;
+  std::size_t size_{};
+  bool from_heap_{};
+};
+
+FrameProfiler *FrameProfiler::local() {
+  struct Holder {
+    FrameProfiler profiler;
+    ~Holder() { exited_ = true; }
+  };
+  thread_local Holder holder;
+  return exited_ ? nullptr : &holder.profiler;
+}
+} // namespace detail
+
+// Hooks of FrameCache and Promise. They compile to nothing without
+// CORO_FRAME_PROFILE.
+inline void note_frame_allocation([[maybe_unused]] std::size_t size,
+                                  [[maybe_unused]] bool from_heap) {
+#ifdef CORO_FRAME_PROFILE
+  if (auto p = detail::FrameProfiler::local()) {
+    p->allocated(size, from_heap);
+  }
+#endif
+}
+
+inline void profile_frame([[maybe_unused]] std::source_location where) {
+#ifdef CORO_FRAME_PROFILE
+  if (auto p = detail::FrameProfiler::local()) {
+    p->record(where);
+  }
+#endif
+}
+
+// The frames of every thread of the process since the start or the last
+// reset_frame_profile(). Empty without CORO_FRAME_PROFILE.
+inline FrameProfile frame_profile() {
+#ifdef CORO_FRAME_PROFILE
+  return detail::FrameProfiler::merged();
+#else
+  return {};
+#endif
+}
+
+inline void reset_frame_profile() {
+#ifdef CORO_FRAME_PROFILE
+  detail::FrameProfiler::reset();
+#endif
+}
+
+// A table of the `top` coroutine functions that make the most frames, with
+// their rates over the elapsed time of the profile.
+inline std::string format_frame_profile(FrameProfile const &profile,
+                                        std::size_t top = 20) {
+  if (!frame_profile_enabled) {
+    return "the frame profiler is disabled, build with CORO_FRAME_PROFILE\n";
+  }
+  auto seconds = std::max(profile.elapsed.count(), 1e-9);
+  std::string s = std::format(
+      "{} frames in {:.3f} s\n{:>10} {:>12} {:>10} {:>12} {:>8} {:>8}  {}\n",
+      profile.frames(), profile.elapsed.count(), "frames", "frames/s",
+      "allocs", "allocs/s", "avg B", "max B", "coroutine");
+  auto out = std::back_inserter(s);
+  for (auto const &site : profile.sites) {
+    if (top-- == 0) {
+      break;
+    }
+    std::format_to(out, "{:>10} {:>12.0f} {:>10} {:>12.0f} {:>8} {:>8}  {}\n",
+                   site.frames, site.frames / seconds, site.allocations,
+                   site.allocations / seconds, site.bytes / site.frames,
+                   site.max_size, site.function);
+    std::format_to(out, "{:>67}{}:{}\n", "", site.file, site.line);
+  }
+  return s;
+}
+
+} // namespace coro
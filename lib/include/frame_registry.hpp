@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <csignal>
+#include <cstdint>
+#include <format>
+#include <iterator>
+#include <source_location>
+#include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// The frame registry keeps the coroutines alive on each thread, to dump their
+// async stacks when a server hangs. It's opt-in: build with
+// CORO_FRAME_REGISTRY defined (the CMake option of the same name) to enable
+// it. Without it, the hooks below are empty and the promises only carry an
+// unused constructor argument.
+
+namespace coro {
+
+// What a suspended coroutine waits for. Set by the awaiters that know (see
+// note_frame_wait()).
+struct FrameWait {
+  enum Kind : std::uint8_t { NONE, FD, TIMER, OTHER };
+
+  Kind kind{NONE};
+  int fd{-1};
+  std::uint32_t events{}; // FD: the epoll events.
+  std::chrono::steady_clock::time_point expire{}; // TIMER
+  std::string_view what{};                        // OTHER, e.g. "flight".
+
+  static FrameWait file(int fd, std::uint32_t events) {
+    return {.kind = FD, .fd = fd, .events = events};
+  }
+
+  static FrameWait timer(std::chrono::steady_clock::time_point expire) {
+    return {.kind = TIMER, .expire = expire};
+  }
+
+  static FrameWait other(std::string_view what) {
+    return {.kind = OTHER, .what = what};
+  }
+};
+
+#ifdef CORO_FRAME_REGISTRY
+inline constexpr bool frame_registry_enabled = true;
+#else
+inline constexpr bool frame_registry_enabled = false;
+#endif
+
+namespace detail {
+// The live frames of a thread, by address. Promise<T> adds itself when it's
+// constructed and removes itself when it's destroyed; a frame is found from
+// its address, so type-erased handles (prev_, waiters) can be followed.
+class FrameRegistry {
+public:
+  struct Frame {
+    std::uint64_t id; // In the order of creation on the thread.
+    std::source_location where;
+    std::coroutine_handle<> const *prev; // The promise's continuation.
+    FrameWait wait;
+  };
+
+  void add(void *frame, std::source_location where,
+           std::coroutine_handle<> const *prev) {
+    frames_.insert_or_assign(frame, Frame{next_id_++, where, prev, {}});
+  }
+
+  void remove(void *frame) { frames_.erase(frame); }
+
+  void set_wait(void *frame, FrameWait const &wait) {
+    if (auto it = frames_.find(frame); it != frames_.end()) {
+      it->second.wait = wait;
+    }
+  }
+
+  // Every async stack, from the innermost frame (which awaits no registered
+  // coroutine) up through the prev_ of each frame, with what the innermost
+  // one waits for and each frame's address, id and creation site.
+  std::string dump() const {
+    std::unordered_set<void *> awaiting;
+    for (auto const &[address, frame] : frames_) {
+      if (*frame.prev) {
+        awaiting.insert(frame.prev->address());
+      }
+    }
+    std::vector<std::pair<void *, Frame const *>> leaves;
+    for (auto const &[address, frame] : frames_) {
+      if (!awaiting.contains(address)) {
+        leaves.emplace_back(address, &frame);
+      }
+    }
+    std::ranges::sort(leaves, {}, [](auto const &p) { return p.second->id; });
+
+    auto now = std::chrono::steady_clock::now();
+    std::string s = std::format("{} coroutine frames, {} stacks\n",
+                                frames_.size(), leaves.size());
+    auto out = std::back_inserter(s);
+    for (auto [address, frame] : leaves) {
+      s += '\n';
+      format_wait(out, frame->wait, now);
+      for (int depth = 0; frame; depth++) {
+        std::format_to(out, "  #{} {} [{}] {} at {}:{}\n", depth, address,
+                       frame->id, frame->where.function_name(),
+                       frame->where.file_name(), frame->where.line());
+        address = *frame->prev ? frame->prev->address() : nullptr;
+        if (!address) {
+          break;
+        }
+        auto it = frames_.find(address);
+        if (it == frames_.end()) {
+          // e.g. the helpers of when_all(), which have no Promise.
+          std::format_to(out, "  #{} {} (not registered)\n", depth + 1,
+                         address);
+          break;
+        }
+        frame = &it->second;
+      }
+    }
+    return s;
+  }
+
+  std::size_t size() const { return frames_.size(); }
+
+  // The registry of the current thread, or null once the thread is exiting.
+  static inline FrameRegistry *local();
+
+  static inline std::atomic<unsigned> dump_requests_{};
+
+private:
+
+  template <class Out>
+  static void format_wait(Out out, FrameWait const &wait,
+                          std::chrono::steady_clock::time_point now) {
+    switch (wait.kind) {
+    case FrameWait::NONE:
+      std::format_to(out, "not waiting on a known event:\n");
+      break;
+    case FrameWait::FD: {
+      std::string events;
+      static constexpr std::pair<std::uint32_t, std::string_view> names[] = {
+          {EPOLLIN, "IN"},   {EPOLLOUT, "OUT"}, {EPOLLRDHUP, "RDHUP"},
+          {EPOLLPRI, "PRI"}, {EPOLLET, "ET"},   {EPOLLONESHOT, "ONESHOT"}};
+      for (auto [bit, name] : names) {
+        if (wait.events & bit) {
+          events += events.empty() ? "" : "|";
+          events += name;
+        }
+      }
+      std::format_to(out, "waiting for fd {} ({}):\n", wait.fd, events);
+      break;
+    }
+    case FrameWait::TIMER: {
+      using namespace std::chrono;
+      auto left = duration<double, std::milli>(wait.expire - now).count();
+      std::format_to(out, "waiting for a timer, due in {:.3f} ms:\n", left);
+      break;
+    }
+    case FrameWait::OTHER:
+      std::format_to(out, "waiting for {}:\n", wait.what);
+      break;
+    }
+  }
+
+  static inline thread_local bool exited_ = false;
+
+  std::unordered_map<void *, Frame> frames_;
+  std::uint64_t next_id_{};
+};
+
+FrameRegistry *FrameRegistry::local() {
+  struct Holder {
+    FrameRegistry registry;
+    ~Holder() { exited_ = true; }
+  };
+  thread_local Holder holder;
+  return exited_ ? nullptr : &holder.registry;
+}
+} // namespace detail
+
+// Hooks of the promises. They compile to nothing without CORO_FRAME_REGISTRY.
+inline void
+register_frame([[maybe_unused]] void *frame,
+               [[maybe_unused]] std::source_location where,
+               [[maybe_unused]] std::coroutine_handle<> const *prev) {
+#ifdef CORO_FRAME_REGISTRY
+  if (auto r = detail::FrameRegistry::local()) {
+    r->add(frame, where, prev);
+  }
+#endif
+}
+
+inline void unregister_frame([[maybe_unused]] void *frame) {
+#ifdef CORO_FRAME_REGISTRY
+  if (auto r = detail::FrameRegistry::local()) {
+    r->remove(frame);
+  }
+#endif
+}
+
+// Records what `h` is suspended on, for dump_frames(). Awaiters call it in
+// await_suspend(), and with {} when `h` is woken.
+inline void note_frame_wait([[maybe_unused]] std::coroutine_handle<> h,
+                            [[maybe_unused]] FrameWait const &wait) {
+#ifdef CORO_FRAME_REGISTRY
+  if (auto r = detail::FrameRegistry::local()) {
+    r->set_wait(h.address(), wait);
+  }
+#endif
+}
+
+// The async stacks of the coroutines alive on the current thread.
+inline std::string dump_frames() {
+#ifdef CORO_FRAME_REGISTRY
+  if (auto r = detail::FrameRegistry::local()) {
+    return r->dump();
+  }
+  return {};
+#else
+  return "the frame registry is disabled, build with CORO_FRAME_REGISTRY\n";
+#endif
+}
+
+// Makes `sig` ask every loop for a dump: an EpollScheduler prints
+// dump_frames() to std::cerr after its next epoll_wait(). The signal handler
+// only bumps an atomic counter. Does nothing without CORO_FRAME_REGISTRY.
+inline void dump_frames_on_signal([[maybe_unused]] int sig) {
+#ifdef CORO_FRAME_REGISTRY
+  std::signal(sig, [](int) {
+    detail::FrameRegistry::dump_requests_.fetch_add(1,
+                                                    std::memory_order_relaxed);
+  });
+#endif
+}
+
+// True once on each thread after each signal of dump_frames_on_signal().
+inline bool frame_dump_requested() {
+  auto &requests = detail::FrameRegistry::dump_requests_;
+  thread_local unsigned seen = requests.load(std::memory_order_relaxed);
+  auto now = requests.load(std::memory_order_relaxed);
+  return std::exchange(seen, now) != now;
+}
+
+} // namespace coro
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+#include "aio.hpp"
+#include "epoll.hpp"
+#include "shutdown.hpp"
+#include "socket.hpp"
+#include "task.hpp"
+#include "utility.hpp"
+
+// A restart without refusing a connection: the running process hands its
+// listening sockets to the new one over a Unix socket, with SCM_RIGHTS, so the
+// sockets, and the connections waiting in their backlogs, are never closed.
+//
+//   old                                 new
+//   serve_handoff(path) ...
+//                         <- connect -- take_over(path)
+//   -- fds (SCM_RIGHTS) ->
+//                                       sets up its loop
+//                         <-- ready --- Handoff::ready()
+//   request_stop(), drains and exits    accepts
+//
+// The old process accepts until the new one is ready. If the new one goes
+// away before that, or isn't ready in time, the old one keeps serving.
+
+namespace coro {
+
+// Sends `fds` with one byte of data, as SCM_RIGHTS.
+inline void send_fds(int sock, std::span<int const> fds) {
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+  char byte = static_cast<char>(fds.size());
+  iovec iov{.iov_base = &byte, .iov_len = 1};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+  std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+  while (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+    if (errno != EINTR) {
+      THROW_SYSCALL("sendmsg");
+    }
+  }
+}
+
+// Receives what send_fds() sent: up to `max` fds, made close-on-exec.
+inline std::vector<FileDescriptor> receive_fds(int sock, std::size_t max = 16) {
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * max));
+  char byte;
+  iovec iov{.iov_base = &byte, .iov_len = 1};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  ssize_t n;
+  while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1) {
+    if (errno != EINTR) {
+      THROW_SYSCALL("recvmsg");
+    }
+  }
+  std::vector<FileDescriptor> fds;
+  for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    auto count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (std::size_t i = 0; i < count; i++) {
+      int fd;
+      std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      fds.emplace_back(fd);
+    }
+  }
+  if (n == 0 || msg.msg_flags & MSG_CTRUNC) {
+    throw std::runtime_error("handoff: no fds received\n" + SOURCE_LOCATION());
+  }
+  return fds;
+}
+
+// The sockets taken over from the previous process, which keeps accepting
+// until ready() is called.
+struct Handoff {
+  std::vector<FileDescriptor> fds;
+  FileDescriptor conn;
+
+  // Tells the previous process to stop accepting and drain.
+  void ready() {
+    char byte = 1;
+    while (::write(conn.fd, &byte, 1) == -1 && errno == EINTR) {
+    }
+    close(conn.release());
+  }
+};
+
+// Takes the sockets of the process that serves handoffs at `path`, if there
+// is one.
+inline std::optional<Handoff> take_over(std::string const &path) {
+  FileDescriptor conn(
+      CHECK_SYSCALL(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)));
+  SocketAddress addr(path.c_str());
+  if (connect(conn.fd, reinterpret_cast<sockaddr *>(&addr.addr_),
+              addr.len_) == -1) {
+    if (errno == ENOENT || errno == ECONNREFUSED) {
+      return std::nullopt;
+    }
+    THROW_SYSCALL("connect");
+  }
+  auto fds = receive_fds(conn.fd);
+  return Handoff{std::move(fds), std::move(conn)};
+}
+
+namespace detail {
+// Completes after `timeout`. It's a timerfd, so that it only needs the epoll
+// loop.
+inline Task<> wait_timeout(EpollScheduler &sched, Clock::duration timeout) {
+  AsyncFile timer(
+      CHECK_SYSCALL(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)));
+  auto ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count();
+  // A zero it_value would disarm the timer.
+  ns = std::max<decltype(ns)>(ns, 1);
+  itimerspec spec{};
+  spec.it_value.tv_sec = static_cast<time_t>(ns / 1'000'000'000);
+  spec.it_value.tv_nsec = static_cast<long>(ns % 1'000'000'000);
+  CHECK_SYSCALL(timerfd_settime(timer.fd_, 0, &spec, nullptr));
+  co_await wait_file_event(sched, timer, EPOLLIN);
+}
+} // namespace detail
+
+// Serves handoffs of `fds` at `path`, until the process is asked to stop,
+// which it is once a new process is ready (see Handoff::ready()). The socket
+// file is replaced if it exists, e.g. by the process this one took over. A new
+// process that isn't ready `ready_timeout` after it connected is dropped, so
+// that it doesn't hold up the handoffs that follow.
+inline Task<> serve_handoff(EpollScheduler &sched, std::string path,
+                            std::vector<int> fds,
+                            Clock::duration ready_timeout =
+                                std::chrono::seconds(10)) {
+  AsyncFile listener(
+      CHECK_SYSCALL(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)));
+  SocketAddress addr(path.c_str());
+  unlink(path.c_str());
+  CHECK_SYSCALL(bind(listener.fd_, reinterpret_cast<sockaddr *>(&addr.addr_),
+                     addr.len_));
+  CHECK_SYSCALL(listen(listener.fd_, 4));
+
+  while (!stop_requested()) {
+    auto next = co_await when_any(
+        socket_accept(sched, listener, nullptr, nullptr), wait_for_stop(sched));
+    if (next.index() == 1) {
+      break;
+    }
+    auto conn = std::get<0>(std::move(next));
+    send_fds(conn.fd_, fds);
+    // The new process says it's ready, or closes the connection if it fails.
+    auto ready = co_await when_any(wait_file_event(sched, conn, EPOLLIN),
+                                   detail::wait_timeout(sched, ready_timeout),
+                                   wait_for_stop(sched));
+    if (ready.index() != 0) {
+      continue; // The connection is closed.
+    }
+    char byte;
+    if (::read(conn.fd_, &byte, 1) == 1) {
+      request_stop();
+    }
+  }
+}
+
+} // namespace coro
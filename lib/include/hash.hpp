@@ -0,0 +1,108 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+namespace coro {
+
+// XXH64 (https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md).
+//
+// It's fast because the four lanes are independent and keep the multipliers
+// busy, and it runs at memory bandwidth for large bodies. It's not meant to
+// resist collisions made on purpose.
+namespace detail::xxh64 {
+inline constexpr std::uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+inline constexpr std::uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+inline constexpr std::uint64_t prime3 = 0x165667B19E3779F9ULL;
+inline constexpr std::uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+inline constexpr std::uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+inline std::uint64_t read64(char const *p) {
+  std::uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  if constexpr (std::endian::native == std::endian::big) {
+    v = __builtin_bswap64(v);
+  }
+  return v;
+}
+
+inline std::uint32_t read32(char const *p) {
+  std::uint32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  if constexpr (std::endian::native == std::endian::big) {
+    v = __builtin_bswap32(v);
+  }
+  return v;
+}
+
+inline std::uint64_t round(std::uint64_t acc, std::uint64_t input) {
+  acc += input * prime2;
+  acc = std::rotl(acc, 31);
+  return acc * prime1;
+}
+
+inline std::uint64_t merge_round(std::uint64_t acc, std::uint64_t val) {
+  acc ^= round(0, val);
+  return acc * prime1 + prime4;
+}
+} // namespace detail::xxh64
+
+inline std::uint64_t xxhash64(std::string_view data, std::uint64_t seed = 0) {
+  using namespace detail::xxh64;
+  char const *p = data.data();
+  char const *end = p + data.size();
+  std::uint64_t h;
+
+  if (data.size() >= 32) {
+    std::uint64_t v1 = seed + prime1 + prime2;
+    std::uint64_t v2 = seed + prime2;
+    std::uint64_t v3 = seed;
+    std::uint64_t v4 = seed - prime1;
+    char const *limit = end - 32;
+    do {
+      v1 = round(v1, read64(p));
+      v2 = round(v2, read64(p + 8));
+      v3 = round(v3, read64(p + 16));
+      v4 = round(v4, read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+    h = std::rotl(v1, 1) + std::rotl(v2, 7) + std::rotl(v3, 12) +
+        std::rotl(v4, 18);
+    h = merge_round(h, v1);
+    h = merge_round(h, v2);
+    h = merge_round(h, v3);
+    h = merge_round(h, v4);
+  } else {
+    h = seed + prime5;
+  }
+
+  h += data.size();
+
+  while (p + 8 <= end) {
+    h ^= round(0, read64(p));
+    h = std::rotl(h, 27) * prime1 + prime4;
+    p += 8;
+  }
+  if (p + 4 <= end) {
+    h ^= std::uint64_t{read32(p)} * prime1;
+    h = std::rotl(h, 23) * prime2 + prime3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= static_cast<unsigned char>(*p) * prime5;
+    h = std::rotl(h, 11) * prime1;
+    ++p;
+  }
+
+  h ^= h >> 33;
+  h *= prime2;
+  h ^= h >> 29;
+  h *= prime3;
+  h ^= h >> 32;
+  return h;
+}
+
+} // namespace coro
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace coro {
+
+// A histogram of 64-bit values (e.g. latencies in nanoseconds) in the manner
+// of HdrHistogram: each power of 2 is split into 64 buckets of equal width, so
+// a recorded value is known to within 1/64 (1.6%) of itself, from 1 to 2^64.
+// Values below 128 are kept exactly.
+//
+// Recording is an index computation and an increment, with no allocation.
+// Histograms of several threads are combined with merge().
+class Histogram {
+public:
+  static constexpr int sub_bucket_bits = 7;
+  static constexpr std::size_t half = std::size_t{1} << (sub_bucket_bits - 1);
+  static constexpr std::size_t bucket_count = (64 - sub_bucket_bits + 2) * half;
+
+  void record(std::uint64_t value, std::uint64_t count = 1) {
+    counts_[index(value)] += count;
+    count_ += count;
+    sum_ += value * count;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+  }
+
+  void merge(Histogram const &other) {
+    for (std::size_t i = 0; i < bucket_count; i++) {
+      counts_[i] += other.counts_[i];
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+  }
+
+  void clear() { *this = Histogram(); }
+
+  std::uint64_t count() const { return count_; }
+  std::uint64_t min() const { return count_ ? min_ : 0; }
+  std::uint64_t max() const { return max_; }
+  double mean() const { return count_ ? double(sum_) / count_ : 0; }
+
+  // The value below which `percentile` percent of the values are, as the
+  // highest value of its bucket (but not above max()).
+  std::uint64_t percentile(double percentile) const {
+    if (!count_) {
+      return 0;
+    }
+    auto rank = static_cast<std::uint64_t>(
+        std::ceil(std::clamp(percentile, 0.0, 100.0) / 100 * count_));
+    rank = std::max<std::uint64_t>(rank, 1);
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < bucket_count; i++) {
+      seen += counts_[i];
+      if (seen >= rank) {
+        return std::min(highest_value(i), max_);
+      }
+    }
+    return max_;
+  }
+
+  static std::size_t index(std::uint64_t value) {
+    int shift =
+        std::max(0, static_cast<int>(std::bit_width(value)) - sub_bucket_bits);
+    return (static_cast<std::size_t>(shift) << (sub_bucket_bits - 1)) +
+           (value >> shift);
+  }
+
+  // The largest value whose index() is `i`.
+  static std::uint64_t highest_value(std::size_t i) {
+    if (i < half) {
+      return i;
+    }
+    auto shift = i / half - 1;
+    auto m = i - shift * half;
+    return ((m + 1) << shift) - 1;
+  }
+
+private:
+  std::array<std::uint64_t, bucket_count> counts_{};
+  std::uint64_t count_{};
+  std::uint64_t sum_{};
+  std::uint64_t min_{std::numeric_limits<std::uint64_t>::max()};
+  std::uint64_t max_{};
+};
+
+} // namespace coro
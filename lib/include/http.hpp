@@ -1,21 +1,35 @@
 #pragma once
 
+#include <array>
 #include <cctype>
+#include <charconv>
+#include <concepts>
 #include <cstddef>
 #include <cstdint>
+#include <ctime>
+#include <fcntl.h>
 #include <functional>
 #include <map>
 #include <memory>
+#include <memory_resource>
+#include <optional>
 #include <ranges>
 #include <span>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <sys/stat.h>
 #include <tuple>
+#include <unordered_map>
+#include <unistd.h>
+#include <variant>
+#include <vector>
 
 #include "aio.hpp"
+#include "default_headers.hpp"
 #include "epoll.hpp"
+#include "http_date.hpp"
 #include "task.hpp"
 #include "utility.hpp"
 
@@ -86,12 +100,46 @@ inline bool valid_http_method(HTTPMethod method, bool allow_wildcard = false) {
          (allow_wildcard && method == HTTPMethod::ANY);
 }
 
+// The fields of requests and responses take an allocator, so that a request
+// and its response can live in an arena (see HTTPRequest::with_allocator()).
 using HTTPHeaders =
-    std::map<std::string, std::string, cmp::CaseInsensitiveLess>;
+    std::pmr::map<std::pmr::string, std::pmr::string, cmp::CaseInsensitiveLess>;
 
 struct HTTPHeaderBody {
+  static std::size_t parse_content_length(std::string_view value) {
+    std::size_t len{};
+    auto [end, ec] = std::from_chars(value.begin(), value.end(), len);
+    if (ec != std::errc{} || end != value.end()) {
+      throw std::runtime_error("invalid Content-Length: " + escape(value) +
+                               "\n" + SOURCE_LOCATION());
+    }
+    return len;
+  }
+
+  // False if the Connection field has the "close" option.
+  static bool keep_alive(HTTPHeaders const &headers) {
+    auto it = headers.find("Connection");
+    if (it == headers.end()) {
+      return true;
+    }
+    for (auto option : std::views::split(std::string_view{it->second}, ',')) {
+      auto sv = std::string_view{option};
+      while (!sv.empty() && std::isspace(sv.front())) {
+        sv.remove_prefix(1);
+      }
+      while (!sv.empty() && std::isspace(sv.back())) {
+        sv.remove_suffix(1);
+      }
+      if (cmp::CaseInsensitiveEqual{}(sv, "close")) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  template <class String>
   static Task<> read_from(EpollScheduler &sched, AsyncFileStream &f,
-                          HTTPHeaders &headers, std::string &body) {
+                          HTTPHeaders &headers, String &body) {
     using namespace std::literals;
 
     while (true) {
@@ -149,10 +197,12 @@ struct HTTPHeaderBody {
       // - emplace does not overwrite an existing record.
       // - operator[] requires the value to be default-constructible.
       // - insert_or_assign overwrites an existing record.
-      headers.insert_or_assign(field_name, field_value);
+      headers.insert_or_assign(
+          HTTPHeaders::key_type(field_name, headers.get_allocator()),
+          field_value);
     }
     if (auto p = headers.find("Content-Length"); p != headers.end()) {
-      auto len = std::stoi(p->second);
+      auto len = parse_content_length(p->second);
       body.resize(len);
       auto buf = std::span<char>(body.data(), body.size());
       auto res = co_await read_buffer(sched, f, buf);
@@ -164,13 +214,18 @@ struct HTTPHeaderBody {
     }
   }
 
-  static Task<> read_from(EpollScheduler &sched, AsyncFileBuffer &f,
-                          HTTPHeaders &headers, std::string &body) {
+  // The lines are read into one string allocated like the headers, and the
+  // fields are copied from it, so nothing is allocated elsewhere.
+  template <BufferedStream Stream, class String>
+  static Task<> read_from(Stream &f, HTTPHeaders &headers, String &body) {
     using namespace std::literals;
 
+    std::pmr::string buffer(headers.get_allocator());
     while (true) {
       // auto line = co_await getline(sched, f, "\r\n"sv);
-      auto line = co_await f.getline("\r\n"sv);
+      buffer.clear();
+      co_await f.getline("\r\n"sv, buffer);
+      std::string_view line = buffer;
       if (!headers.empty() && line.empty()) {
         break;
       }
@@ -197,7 +252,7 @@ struct HTTPHeaderBody {
       // Ok as long as j <= line.size().
       auto field_value = line.substr(j);
       while (!field_value.empty() && std::isspace(field_value.back())) {
-        field_value.pop_back();
+        field_value.remove_suffix(1);
       }
       if (field_value.empty()) {
         throw std::runtime_error("invalid response: empty field value\n" +
@@ -222,17 +277,18 @@ struct HTTPHeaderBody {
       // - emplace does not overwrite an existing record.
       // - operator[] requires the value to be default-constructible.
       // - insert_or_assign overwrites an existing record.
-      headers.insert_or_assign(field_name, field_value);
+      headers.insert_or_assign(
+          HTTPHeaders::key_type(field_name, headers.get_allocator()),
+          field_value);
     }
     if (auto p = headers.find("Content-Length"); p != headers.end()) {
-      auto len = std::stoi(p->second);
-      body.resize(len);
-      co_await f.puts(body);
+      body.resize(parse_content_length(p->second));
+      co_await f.getn(std::span<char>(body.data(), body.size()));
     }
   }
 
   static Task<> write_to(EpollScheduler &sched, AsyncFileStream &f,
-                         HTTPHeaders const &headers, std::string const &body,
+                         HTTPHeaders const &headers, std::string_view body,
                          std::string_view line_start = "") {
     using namespace std::literals;
 
@@ -310,9 +366,11 @@ struct HTTPHeaderBody {
     }
   }
 
-  static Task<> write_to(EpollScheduler &sched, AsyncFileBuffer &f,
-                         HTTPHeaders const &headers, std::string const &body,
-                         std::string_view line_start = "") {
+  template <BufferedStream Stream>
+  static Task<> write_to(Stream &f, HTTPHeaders const &headers,
+                         std::string_view body,
+                         std::string_view line_start = "",
+                         std::string_view defaults = "") {
     using namespace std::literals;
 
     // Write the headers, excluding "Content-Length" if it exists
@@ -320,6 +378,9 @@ struct HTTPHeaderBody {
       if (cmp::CaseInsensitiveEqual{}(k, "Content-Length")) {
         continue;
       }
+      if (!defaults.empty() && HeaderTemplate::provides(k)) {
+        continue;
+      }
       if (!line_start.empty())
         co_await f.puts(line_start);
       co_await f.puts(k);
@@ -337,6 +398,11 @@ struct HTTPHeaderBody {
       co_await f.puts("\r\n"sv);
     }
 
+    // The default headers, as one block.
+    if (!defaults.empty()) {
+      co_await f.puts(defaults);
+    }
+
     // End of headers
     if (!line_start.empty())
       co_await f.puts(line_start);
@@ -364,32 +430,70 @@ struct HTTPHeaderBody {
     }
   }
 
-  static void append_string(std::string &s, HTTPHeaders const &headers,
-                            std::string const &body) {
+  // The headers and the empty line. Content-Length is written only if the
+  // body is not empty, and std::nullopt means a chunked body. `defaults` (see
+  // HeaderTemplate) goes last.
+  template <class String>
+  static void append_head(String &s, HTTPHeaders const &headers,
+                          std::optional<std::size_t> content_length,
+                          std::string_view defaults = "") {
     using namespace std::literals;
     for (auto const &[k, v] : headers) {
       if (cmp::CaseInsensitiveEqual{}(k, "Content-Length")) {
         continue;
       }
+      if (!defaults.empty() && HeaderTemplate::provides(k)) {
+        continue;
+      }
       s += k;
       s += ": "sv;
       s += v;
       s += "\r\n"sv;
     }
 
-    // Write the Content-Length header if there is a body
-    if (!body.empty()) {
+    // Write the Content-Length header if there is a body. Without a length
+    // the body is chunked.
+    if (!content_length) {
+      s += "Transfer-Encoding: chunked\r\n"sv;
+    } else if (*content_length) {
+      char digits[20];
+      auto [end, _] = std::to_chars(std::begin(digits), std::end(digits),
+                                    *content_length);
       s += "Content-Length: "sv;
-      s += std::to_string(body.size());
+      s += std::string_view(digits, end);
       s += "\r\n"sv;
     }
 
+    s += defaults;
+
     // End of headers
     s += "\r\n"sv;
+  }
+
+  static void append_string(std::string &s, HTTPHeaders const &headers,
+                            std::string const &body) {
+    append_head(s, headers, body.size());
     s += body;
   }
 };
+
+// A request is an aggregate, and its fields use the default memory resource
+// unless it's made by with_allocator(). Copies always use the default one, so
+// a copy can outlive the arena of the original.
 struct HTTPRequest {
+  using allocator_type = std::pmr::polymorphic_allocator<>;
+
+  static HTTPRequest with_allocator(allocator_type alloc) {
+    return HTTPRequest{
+        .method = std::pmr::string(alloc),
+        .uri = std::pmr::string(alloc),
+        .headers = HTTPHeaders(alloc),
+        .body = std::pmr::string(alloc),
+    };
+  }
+
+  allocator_type get_allocator() const { return headers.get_allocator(); }
+
   Task<> read_from(EpollScheduler &sched, AsyncFileStream &f) {
     using namespace std::literals;
     clear();
@@ -406,23 +510,23 @@ struct HTTPRequest {
       throw std::runtime_error("invalid request: cannot find \"HTTP/1.1\"\n" +
                                SOURCE_LOCATION());
     }
-    {
-      std::stringstream ss(line.result);
-      ss >> method >> uri;
-    }
+    split_request_line(line.result);
     if (http_method(method) == HTTPMethod::INVALID) {
-      throw std::runtime_error("invalid http method: " + method + "\n" +
-                               SOURCE_LOCATION());
+      throw std::runtime_error("invalid http method: " + escape(method) +
+                               "\n" + SOURCE_LOCATION());
     }
 
     co_await HTTPHeaderBody::read_from(sched, f, headers, body);
   }
 
-  Task<> read_from(EpollScheduler &sched, AsyncFileBuffer &f) {
+  // Everything is allocated with get_allocator().
+  template <BufferedStream Stream>
+  Task<> read_from(Stream &f) {
     using namespace std::literals;
     clear();
 
-    auto line = co_await f.getline("\r\n"sv);
+    std::pmr::string line(get_allocator());
+    co_await f.getline("\r\n"sv, line);
 
     while (!line.empty() && std::isspace(line.back())) {
       line.pop_back();
@@ -431,16 +535,13 @@ struct HTTPRequest {
       throw std::runtime_error("invalid request: cannot find \"HTTP/1.1\"\n" +
                                SOURCE_LOCATION());
     }
-    {
-      std::stringstream ss(line);
-      ss >> method >> uri;
-    }
+    split_request_line(line);
     if (http_method(method) == HTTPMethod::INVALID) {
-      throw std::runtime_error("invalid http method: " + method + "\n" +
-                               SOURCE_LOCATION());
+      throw std::runtime_error("invalid http method: " + escape(method) +
+                               "\n" + SOURCE_LOCATION());
     }
 
-    co_await HTTPHeaderBody::read_from(sched, f, headers, body);
+    co_await HTTPHeaderBody::read_from(f, headers, body);
   }
 
   void read_from(FILE *f) {
@@ -481,13 +582,12 @@ struct HTTPRequest {
     }
 
     // Parse the request line
-    std::stringstream ss(s);
-    ss >> method >> uri;
+    split_request_line(s);
 
     // Validate the HTTP method
     if (http_method(method) == HTTPMethod::INVALID) {
-      throw std::runtime_error("invalid http method: " + method + "\n" +
-                               SOURCE_LOCATION());
+      throw std::runtime_error("invalid http method: " + escape(method) +
+                               "\n" + SOURCE_LOCATION());
     }
 
     // Read headers
@@ -532,12 +632,14 @@ struct HTTPRequest {
       }
 
       // Insert or assign the header
-      headers.insert_or_assign(field_name, field_value);
+      headers.insert_or_assign(
+          HTTPHeaders::key_type(field_name, headers.get_allocator()),
+          field_value);
     }
 
     // Read body if Content-Length is present
     if (auto p = headers.find("Content-Length"); p != headers.end()) {
-      auto len = std::stoi(p->second);
+      auto len = HTTPHeaderBody::parse_content_length(p->second);
       body.resize(len);
       if (fread(body.data(), 1, len, f) != len) {
         throw std::runtime_error("invalid response: premature EOF\n" +
@@ -559,8 +661,8 @@ struct HTTPRequest {
     co_await HTTPHeaderBody::write_to(sched, f, headers, body, line_start);
   }
 
-  Task<> write_to(EpollScheduler &sched, AsyncFileBuffer &f,
-                  std::string_view line_start = "") const {
+  template <BufferedStream Stream>
+  Task<> write_to(Stream &f, std::string_view line_start = "") const {
     using namespace std::literals;
     std::string s;
     s += line_start;
@@ -569,7 +671,7 @@ struct HTTPRequest {
     s += uri.empty() ? "<empty>"sv : uri;
     s += " HTTP/1.1\r\n"sv;
     co_await f.puts(s);
-    co_await HTTPHeaderBody::write_to(sched, f, headers, body, line_start);
+    co_await HTTPHeaderBody::write_to(f, headers, body, line_start);
   }
 
   auto to_tuple() const { return std::make_tuple(method, uri, headers, body); }
@@ -583,12 +685,16 @@ struct HTTPRequest {
       ASTERISK,  // Only for server-side OPTIONS. e.g. *
       INVALID,
     };
-    TargetType type;
-    std::string path;
-    std::unordered_map<std::string, std::string> params;
+    using Params =
+        std::pmr::unordered_map<std::pmr::string, std::pmr::string,
+                                cmp::CaseSensitiveHash, cmp::CaseSensitiveEqual>;
+
+    TargetType type{};
+    std::pmr::string path;
+    Params params;
 
-    static ParsedURI from(std::string_view s) {
-      ParsedURI res;
+    static ParsedURI from(std::string_view s, allocator_type alloc = {}) {
+      ParsedURI res{.path = std::pmr::string(alloc), .params = Params(alloc)};
 
       if (s.empty()) {
         res.type = TargetType::INVALID;
@@ -631,15 +737,13 @@ struct HTTPRequest {
       query_str.remove_prefix(query_start + 1);
 
       // Parse query params
-      std::stringstream param_stream;
-      param_stream << query_str;
-      std::string pair;
-      while (std::getline(param_stream, pair, '&')) {
+      for (auto part : std::views::split(query_str, '&')) {
+        auto pair = std::string_view{part};
         size_t equal_pos = pair.find('=');
         if (equal_pos != std::string::npos) {
-          std::string key = pair.substr(0, equal_pos);
-          std::string value = pair.substr(equal_pos + 1);
-          res.params[key] = value;
+          auto key = pair.substr(0, equal_pos);
+          auto value = pair.substr(equal_pos + 1);
+          res.params.insert_or_assign(std::pmr::string(key, alloc), value);
         }
       }
 
@@ -653,7 +757,10 @@ struct HTTPRequest {
     }
   };
 
-  ParsedURI parse_uri() const { return ParsedURI::from(uri); }
+  ParsedURI parse_uri() const { return ParsedURI::from(uri, get_allocator()); }
+
+  // HTTP/1.1 connections are persistent unless "Connection: close" is sent.
+  bool keep_alive() const { return HTTPHeaderBody::keep_alive(headers); }
 
   void clear() {
     method.clear();
@@ -662,15 +769,253 @@ struct HTTPRequest {
     body.clear();
   }
 
-  std::string method;
-  std::string uri; // Request Target:
-                   // https://datatracker.ietf.org/doc/html/rfc7230#section-5.3
+  std::pmr::string method{};
+  std::pmr::string uri{}; // Request Target:
+                          // https://datatracker.ietf.org/doc/html/rfc7230#section-5.3
+
+  HTTPHeaders headers{};
+  std::pmr::string body{};
+
+private:
+  // "<method> <uri> HTTP/1.1"
+  void split_request_line(std::string_view line) {
+    auto next = [&line] {
+      while (!line.empty() && std::isspace(line.front())) {
+        line.remove_prefix(1);
+      }
+      auto n = std::min(line.find(' '), line.size());
+      auto token = line.substr(0, n);
+      line.remove_prefix(n);
+      return token;
+    };
+    method = next();
+    uri = next();
+  }
+};
+
+// A body that stays in a file. Only the parts are sent, each after its header
+// (used by multipart responses), and then the trailer. They're sent with
+// sendfile() when the writer is a socket, so the file is never read into
+// memory as a whole.
+struct FileBody {
+  struct Part {
+    std::string header{};
+    off_t offset{};
+    std::size_t length{};
+  };
+
+  static FileBody open(char const *path) {
+    using namespace std::literals;
+    FileBody body;
+    int fd = open_file(path);
+    body.file = std::make_shared<FileDescriptor>(fd);
+    struct stat st;
+    CHECK_SYSCALL(fstat(fd, &st));
+    if (!S_ISREG(st.st_mode)) {
+      throw std::runtime_error("not a regular file: "s + path + "\n" +
+                               SOURCE_LOCATION());
+    }
+    body.size = st.st_size;
+    body.mtime = st.st_mtime;
+    body.parts.push_back(Part{.length = body.size});
+    return body;
+  }
+
+  std::size_t content_length() const {
+    std::size_t n = trailer.size();
+    for (auto const &part : parts) {
+      n += part.header.size() + part.length;
+    }
+    return n;
+  }
+
+  // Reads a part into memory. It's the fallback for writers that are not
+  // sockets.
+  void read_part(Part const &part, std::string &s) const {
+    auto start = s.size();
+    s.resize(start + part.length);
+    std::size_t done = 0;
+    while (done < part.length) {
+      auto n = pread(file->fd, s.data() + start + done, part.length - done,
+                     part.offset + done);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n == -1) {
+        THROW_SYSCALL("pread");
+      }
+      if (n == 0) {
+        throw std::runtime_error("file is truncated\n" + SOURCE_LOCATION());
+      }
+      done += n;
+    }
+  }
+
+  std::shared_ptr<FileDescriptor> file;
+  std::vector<Part> parts;
+  std::string trailer;
+  std::size_t size{}; // The whole file.
+  std::time_t mtime{};
+
+private:
+  static int open_file(char const *path) {
+    using namespace std::literals;
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      THROW_SYSCALL(("open "s + path).c_str());
+    }
+    return fd;
+  }
+};
+
+// Produces a body while it's being sent, a chunk at a time. An empty chunk
+// ends the body. It's sent with the chunked transfer coding, so the whole body
+// never has to exist at once.
+using BodyGenerator = std::function<Task<std::string>()>;
+
+// Reads a generated body to the end.
+inline Task<std::string> collect_body(BodyGenerator const &next) {
+  std::string s;
+  while (true) {
+    auto chunk = co_await next();
+    if (chunk.empty()) {
+      break;
+    }
+    s += chunk;
+  }
+  co_return s;
+}
+
+// The body of a response. Each kind is written the cheapest way:
+//
+// - OWNED (std::string) and VIEW (std::string_view, e.g. of a literal; the
+//   bytes must outlive the response): copied into the connection buffer, or
+//   sent with writev() along with the buffered headers if they don't fit.
+// - SHARED (std::shared_ptr<const std::string>): bytes shared by many
+//   responses, sent like VIEW without being copied first.
+// - FILE (FileBody): sendfile().
+// - GENERATOR (BodyGenerator): chunked.
+//
+// Assigning a std::string_view makes a VIEW, so `res.body = "..."sv` doesn't
+// copy the literal.
+class HTTPBody {
+public:
+  enum class Kind { OWNED, VIEW, SHARED, FILE, GENERATOR };
+
+  using Shared = std::shared_ptr<const std::string>;
+
+  HTTPBody() = default;
+  HTTPBody(std::string s) : v_(std::move(s)) {}
+  HTTPBody(char const *s) : v_(std::string(s)) {}
+  HTTPBody(std::string_view sv) : v_(sv) {}
+  HTTPBody(Shared p) : v_(std::move(p)) {}
+  HTTPBody(FileBody f) : v_(std::move(f)) {}
+  HTTPBody(BodyGenerator g) : v_(std::move(g)) {}
+
+  Kind kind() const { return static_cast<Kind>(v_.index()); }
+
+  // OWNED, VIEW and SHARED bodies are in memory and have a view().
+  bool in_memory() const {
+    auto k = kind();
+    return k == Kind::OWNED || k == Kind::VIEW || k == Kind::SHARED;
+  }
+
+  std::string_view view() const {
+    switch (kind()) {
+    case Kind::OWNED:
+      return std::get<std::string>(v_);
+    case Kind::VIEW:
+      return std::get<std::string_view>(v_);
+    case Kind::SHARED: {
+      auto const &p = std::get<Shared>(v_);
+      return p ? std::string_view{*p} : std::string_view{};
+    }
+    default:
+      throw std::logic_error("the body is not in memory\n" +
+                             SOURCE_LOCATION());
+    }
+  }
+
+  // The body as an owned string, copied first if it's a VIEW or SHARED, so
+  // that it can be changed.
+  std::string &str() {
+    if (kind() != Kind::OWNED) {
+      v_ = std::string(view());
+    }
+    return std::get<std::string>(v_);
+  }
+
+  HTTPBody &operator+=(std::string_view sv) {
+    str() += sv;
+    return *this;
+  }
+
+  FileBody *file() { return std::get_if<FileBody>(&v_); }
+  FileBody const *file() const { return std::get_if<FileBody>(&v_); }
+
+  BodyGenerator const *generator() const {
+    return std::get_if<BodyGenerator>(&v_);
+  }
+
+  // The length of the bytes to send, or std::nullopt for a GENERATOR.
+  std::optional<std::size_t> content_length() const {
+    if (auto f = file()) {
+      return f->content_length();
+    }
+    if (generator()) {
+      return std::nullopt;
+    }
+    return view().size();
+  }
+
+  std::size_t size() const { return content_length().value_or(0); }
+
+  bool empty() const {
+    return in_memory() ? view().empty() : false;
+  }
 
-  HTTPHeaders headers;
-  std::string body;
+  void clear() { v_ = std::string(); }
+
+  template <class T>
+    requires std::convertible_to<T const &, std::string_view>
+  bool operator==(T const &s) const {
+    return in_memory() && view() == std::string_view{s};
+  }
+
+  bool operator==(HTTPBody const &other) const {
+    if (in_memory() && other.in_memory()) {
+      return view() == other.view();
+    }
+    return false;
+  }
+
+  friend std::ostream &operator<<(std::ostream &os, HTTPBody const &body) {
+    if (body.in_memory()) {
+      return os << body.view();
+    }
+    return os << (body.file() ? "<file>" : "<generator>");
+  }
+
+private:
+  std::variant<std::string, std::string_view, Shared, FileBody, BodyGenerator>
+      v_;
 };
 
+// Like HTTPRequest, an aggregate that takes an allocator with
+// with_allocator(). A handler can give its response the allocator of the
+// request to put the headers in the request's arena.
 struct HTTPResponse {
+  using allocator_type = std::pmr::polymorphic_allocator<>;
+
+  static HTTPResponse with_allocator(allocator_type alloc) {
+    return HTTPResponse{.headers = HTTPHeaders(alloc)};
+  }
+
+  allocator_type get_allocator() const { return headers.get_allocator(); }
+
+  // serve_connection() closes the connection after a response with
+  // "Connection: close".
+  bool keep_alive() const { return HTTPHeaderBody::keep_alive(headers); }
 
   Task<> read_from(EpollScheduler &sched, AsyncFileStream &f) {
     using namespace std::literals;
@@ -683,10 +1028,11 @@ struct HTTPResponse {
     }
     status = std::stoi(line.result.substr("HTTP/1.1 "sv.size()));
 
-    co_await HTTPHeaderBody::read_from(sched, f, headers, body);
+    co_await HTTPHeaderBody::read_from(sched, f, headers, body.str());
   }
 
-  Task<> read_from(EpollScheduler &sched, AsyncFileBuffer &f) {
+  template <BufferedStream Stream>
+  Task<> read_from(Stream &f) {
     using namespace std::literals;
     clear();
 
@@ -697,50 +1043,201 @@ struct HTTPResponse {
     }
     status = std::stoi(line.substr("HTTP/1.1 "sv.size()));
 
-    co_await HTTPHeaderBody::read_from(sched, f, headers, body);
+    co_await HTTPHeaderBody::read_from(f, headers, body.str());
   }
 
   Task<> write_to(EpollScheduler &sched, AsyncFileStream &f,
                   std::string_view line_start = "") const {
     using namespace std::literals;
+    if (serialized) {
+      co_await print(sched, f, *serialized);
+      co_return;
+    }
+    if (!body.in_memory()) {
+      // There's no sendfile() for a FILE *, so this reads the parts.
+      co_await print(sched, f, to_string());
+      co_return;
+    }
     co_await print(sched, f,
                    std::format("{}HTTP/1.1 {} {}\r\n", line_start, status,
                                status_message(status)));
-    co_await HTTPHeaderBody::write_to(sched, f, headers, body, line_start);
+    co_await HTTPHeaderBody::write_to(sched, f, headers, body.view(),
+                                      line_start);
   }
 
-  Task<> write_to(EpollScheduler &sched, AsyncFileBuffer &f,
-                  std::string_view line_start = "") const {
+  // Responses written to a connection get the default headers of the thread's
+  // event loop (Date, Server and, unless `keep_alive`, Connection). The head
+  // is formatted in memory from get_allocator().
+  template <BufferedStream Stream>
+  Task<> write_to(Stream &f, std::string_view line_start = "",
+                  bool keep_alive = false) const {
     using namespace std::literals;
-    co_await f.puts(std::format("{}HTTP/1.1 {} {}\r\n", line_start, status,
-                                status_message(status)));
-    co_await HTTPHeaderBody::write_to(sched, f, headers, body, line_start);
+    auto defaults = default_response_headers(keep_alive);
+    if (serialized) {
+      auto pieces = splice_head(*serialized, defaults);
+      if (!f.try_puts(pieces)) {
+        co_await f.writev(pieces);
+      }
+      co_return;
+    }
+    if (!line_start.empty() && body.in_memory()) {
+      co_await f.puts(std::format("{}HTTP/1.1 {} {}\r\n", line_start, status,
+                                  status_message(status)));
+      co_await HTTPHeaderBody::write_to(f, headers, body.view(), line_start,
+                                        defaults);
+      co_return;
+    }
+
+    std::pmr::string s(get_allocator());
+    append_head(s, defaults);
+    if (auto file = body.file()) {
+      co_await f.puts(s);
+      for (auto const &part : file->parts) {
+        co_await f.puts(part.header);
+        co_await f.sendfile(file->file->fd, part.offset, part.length);
+      }
+      co_await f.puts(file->trailer);
+    } else if (auto next = body.generator()) {
+      co_await f.puts(s);
+      while (true) {
+        auto chunk = co_await (*next)();
+        auto size = std::format("{:x}\r\n", chunk.size());
+        if (chunk.empty()) {
+          co_await f.puts("0\r\n\r\n"sv);
+          break;
+        }
+        std::array<std::string_view, 3> pieces{size, chunk, "\r\n"sv};
+        if (!f.try_puts(pieces)) {
+          co_await f.writev(pieces);
+        }
+      }
+    } else {
+      std::array<std::string_view, 2> pieces{s, body.view()};
+      if (!f.try_puts(pieces)) {
+        co_await f.writev(pieces);
+      }
+    }
   }
 
-  std::string to_string() const {
+  // Without `defaults` it gives the bytes to keep (e.g. in a cache); with them
+  // (see default_response_headers()) the bytes to send. A generated body can
+  // only be written.
+  std::string to_string(std::string_view defaults = "") const {
     using namespace std::literals;
+    if (serialized) {
+      if (defaults.empty()) {
+        return *serialized;
+      }
+      std::string s;
+      for (auto sv : splice_head(*serialized, defaults)) {
+        s += sv;
+      }
+      return s;
+    }
+    if (body.generator()) {
+      throw std::logic_error("a generated body can only be written\n" +
+                             SOURCE_LOCATION());
+    }
     std::string s;
-    s += std::format("HTTP/1.1 {} {}\r\n", status, status_message(status));
-    HTTPHeaderBody::append_string(s, headers, body);
+    append_head(s, defaults);
+    if (auto file = body.file()) {
+      for (auto const &part : file->parts) {
+        s += part.header;
+        file->read_part(part, s);
+      }
+      s += file->trailer;
+      return s;
+    }
+    s += body.view();
     return s;
   }
 
+  // Splits serialized bytes where the header section ends, so that `defaults`
+  // can be written in between. Header fields can't contain an empty line, so
+  // the first one ends them.
+  static std::array<std::string_view, 3> splice_head(std::string_view bytes,
+                                                     std::string_view defaults) {
+    using namespace std::literals;
+    auto pos = bytes.find("\r\n\r\n"sv);
+    pos = pos == std::string_view::npos ? bytes.size() : pos + 2;
+    return {bytes.substr(0, pos), defaults, bytes.substr(pos)};
+  }
+
+  // The status line and the header section.
+  template <class String>
+  void append_head(String &s, std::string_view defaults) const {
+    using namespace std::literals;
+    std::format_to(std::back_inserter(s), "HTTP/1.1 {} {}\r\n", status,
+                   status_message(status));
+    auto length = body.content_length();
+    // Without a length an empty body would end when the connection is
+    // closed. 1xx, 204 and 304 responses never have a body.
+    if (length == 0 && status >= 200 && status != 204 && status != 304) {
+      s += "Content-Length: 0\r\n"sv;
+    }
+    HTTPHeaderBody::append_head(s, headers, length, defaults);
+  }
+
   auto to_tuple() const { return std::make_tuple(status, headers, body); }
 
   void clear() {
     status = 0;
     headers.clear();
     body.clear();
+    serialized.reset();
   }
 
-  static std::string status_message(int status);
+  static std::string_view status_message(int status);
 
-  int status;
-  HTTPHeaders headers;
-  std::string body;
+  int status{};
+  HTTPHeaders headers{};
+  HTTPBody body{};
+
+  // The whole response (status line, headers and body) serialized ahead of
+  // time, e.g. by a cache. When it's set, the writers send it verbatim and
+  // ignore the fields above (and line_start). It's shared so that a cache hit
+  // never copies the bytes.
+  std::shared_ptr<const std::string> serialized{};
 };
 
-using HTTPHandler = std::function<Task<HTTPResponse>(HTTPRequest)>;
+// A 200 response for a regular file, with validators made from its metadata so
+// that the file doesn't have to be read to answer conditional requests.
+inline HTTPResponse file_response(char const *path,
+                                  std::string_view content_type =
+                                      "application/octet-stream") {
+  HTTPResponse res;
+  res.status = 200;
+  auto file = FileBody::open(path);
+  res.headers["Content-Type"] = content_type;
+  res.headers["Last-Modified"] = format_http_date(file.mtime);
+  res.headers["ETag"] = std::format("\"{:x}-{:x}\"", file.mtime, file.size);
+  res.headers["Accept-Ranges"] = "bytes";
+  res.body = std::move(file);
+  return res;
+}
+
+// The request outlives the handler's task. A handler that takes the request by
+// value gets a copy that doesn't use the request's arena.
+using HTTPHandler = std::function<Task<HTTPResponse>(HTTPRequest const &)>;
+
+// Strips "?param=value" and collapses repeated slashes: //a/b// -> /a/b/
+inline std::string normalize_path(std::string_view uri) {
+  if (auto pos = uri.find('?'); pos != std::string_view::npos) {
+    uri = uri.substr(0, pos);
+  }
+  std::string s;
+  char last = '\0';
+  for (char ch : uri) {
+    if (last == '/' && ch == '/') {
+      continue;
+    }
+    s += ch;
+    last = ch;
+  }
+  return s;
+}
+
+struct StaticResponse;
 
 struct HTTPRouter {
   struct Node {
@@ -767,21 +1264,36 @@ struct HTTPRouter {
       throw std::runtime_error(std::format(
           "uri does not start with /: uri: {}\n{}", uri, SOURCE_LOCATION()));
     }
-    // Remove ?param=value.
+    auto path = normalize_path(uri);
+    auto &h = exact_matches[path][method];
+    h = handler;
+    patterns[&h] = std::move(path);
+  }
+
+  // Registers a response that doesn't depend on the request. It's serialized
+  // once here, and find_static() gives the bytes to the connection driver.
+  // find_route() still finds it, as a handler that returns a copy.
+  //
+  // Defined in static_response.hpp.
+  void route_static(HTTPMethod method, std::string_view uri,
+                    HTTPResponse response);
+
+  StaticResponse const *find_static(HTTPMethod m, std::string_view uri) const {
     if (auto pos = uri.find('?'); pos != std::string_view::npos) {
       uri = uri.substr(0, pos);
     }
-    // //a/b// -> /a/b/
-    std::string s;
-    char last = '\0';
-    for (char ch : uri) {
-      if (last == '/' && ch == '/') {
-        continue;
-      }
-      s += ch;
-      last = ch;
+    auto it = static_matches.find(uri);
+    if (it == static_matches.end()) {
+      return nullptr;
     }
-    exact_matches[s][method] = handler;
+    auto jt = it->second.find(m);
+    if (jt == it->second.end()) {
+      jt = it->second.find(HTTPMethod::ANY);
+    }
+    if (jt == it->second.end()) {
+      return nullptr;
+    }
+    return jt->second.get();
   }
 
   void route_prefix(std::string_view method, std::string_view uri,
@@ -843,44 +1355,58 @@ struct HTTPRouter {
       cur = it->second;
     }
     // DEBUG() << "\n";
-    cur.get()->handlers[method] = handler;
+    auto &h = cur.get()->handlers[method];
+    h = handler;
+    auto pattern = normalize_path(uri);
+    if (!pattern.ends_with('/')) {
+      pattern += '/';
+    }
+    patterns[&h] = pattern + '*';
   }
 
-  HTTPHandler find_route_exact(HTTPMethod m, std::string_view uri) const {
+  // The pattern a handler (or a StaticResponse) found here was registered
+  // with: the path of an exact route, or that of a prefix route followed by
+  // "/*". Empty if it isn't one of the router's, e.g. no_handler().
+  std::string_view pattern_of(void const *route) const {
+    auto it = patterns.find(route);
+    return it == patterns.end() ? std::string_view{} : it->second;
+  }
+
+  // The handlers found are references into the router, so that finding one
+  // doesn't copy it. An empty handler means there's none.
+  HTTPHandler const &find_route_exact(HTTPMethod m,
+                                      std::string_view uri) const {
     // Remove ?param=value.
     if (auto pos = uri.find('?'); pos != std::string_view::npos) {
       uri = uri.substr(0, pos);
     }
-    // Build key.
+    // Build key. Most paths are normalized already.
     std::string s;
-    char last = '\0';
-    for (char ch : uri) {
-      if (last == '/' && ch == '/') {
-        continue;
-      }
-      s += ch;
-      last = ch;
+    if (uri.find("//") != std::string_view::npos) {
+      s = normalize_path(uri);
+      uri = s;
     }
     // Search.
     auto it = exact_matches.find(uri);
     if (it == exact_matches.end()) {
-      return nullptr;
+      return no_handler();
     }
     auto jt = it->second.find(m);
     if (jt == it->second.end()) {
       jt = it->second.find(HTTPMethod::ANY);
     }
     if (jt == it->second.end()) {
-      return nullptr;
+      return no_handler();
     }
     return jt->second;
   }
 
-  HTTPHandler find_route(std::string_view method, std::string_view uri) const {
+  HTTPHandler const &find_route(std::string_view method,
+                                std::string_view uri) const {
     return find_route(http_method(method), uri);
   }
 
-  HTTPHandler find_route(HTTPMethod method, std::string_view uri) const {
+  HTTPHandler const &find_route(HTTPMethod method, std::string_view uri) const {
     using namespace std::literals;
     // Check method.
     if (!valid_http_method(method)) {
@@ -898,27 +1424,26 @@ struct HTTPRouter {
       uri = uri.substr(0, pos);
     }
     // Try exact match first.
-    HTTPHandler h = find_route_exact(method, uri);
-    if (h) {
+    if (auto const &h = find_route_exact(method, uri)) {
       return h;
     }
     if (!uri.ends_with('/')) {
       std::string uri2;
       uri2 = uri;
       uri2 += '/';
-      h = find_route_exact(method, uri2);
-    }
-    if (h) {
-      return h;
+      if (auto const &h = find_route_exact(method, uri2)) {
+        return h;
+      }
     }
     // Try prefix match.
+    HTTPHandler const *h = &no_handler();
     std::reference_wrapper<const std::unique_ptr<Node>> cur = trie;
     auto jt = cur.get()->handlers.find(method);
     if (jt == cur.get()->handlers.end()) {
       jt = cur.get()->handlers.find(HTTPMethod::ANY);
     }
     if (jt != cur.get()->handlers.end()) {
-      h = jt->second;
+      h = &jt->second;
     }
     // Try longer components.
     for (auto com : std::views::split(uri, "/"sv)) {
@@ -937,16 +1462,29 @@ struct HTTPRouter {
         jt = cur.get()->handlers.find(HTTPMethod::ANY);
       }
       if (jt != cur.get()->handlers.end()) {
-        h = jt->second; // Longest possible match.
+        h = &jt->second; // Longest possible match.
       }
     }
-    return h;
+    return *h;
+  }
+
+  static HTTPHandler const &no_handler() {
+    static HTTPHandler const none;
+    return none;
   }
 
   std::unique_ptr<Node> trie = std::make_unique<Node>();
   std::unordered_map<std::string, std::unordered_map<HTTPMethod, HTTPHandler>,
                      cmp::CaseSensitiveHash, cmp::CaseSensitiveEqual>
       exact_matches;
+  std::unordered_map<
+      std::string,
+      std::unordered_map<HTTPMethod, std::shared_ptr<StaticResponse const>>,
+      cmp::CaseSensitiveHash, cmp::CaseSensitiveEqual>
+      static_matches;
+  // See pattern_of(). The handlers are nodes of the maps above, so their
+  // addresses don't change.
+  std::unordered_map<void const *, std::string> patterns;
 };
 
 } // namespace coro
\ No newline at end of file
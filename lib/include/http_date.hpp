@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <cstdio>
+#include <ctime>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace coro {
+
+namespace detail::http_date {
+inline constexpr std::array<char const *, 7> days = {"Sun", "Mon", "Tue", "Wed",
+                                                     "Thu", "Fri", "Sat"};
+inline constexpr std::array<char const *, 12> months = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+} // namespace detail::http_date
+
+// IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+// https://www.rfc-editor.org/rfc/rfc9110#section-5.6.7
+inline std::string format_http_date(std::time_t t) {
+  using namespace detail::http_date;
+  std::tm tm{};
+  gmtime_r(&t, &tm);
+  char buf[32];
+  auto n = std::snprintf(buf, sizeof(buf), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                         days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon],
+                         tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+  return std::string(buf, n);
+}
+
+// Only IMF-fixdate is accepted. The obsolete formats give std::nullopt, and a
+// date that cannot be parsed makes a conditional header be ignored, which is
+// always safe.
+inline std::optional<std::time_t> parse_http_date(std::string_view s) {
+  using namespace detail::http_date;
+  // "Sun, 06 Nov 1994 08:49:37 GMT"
+  if (s.size() != 29 || s[3] != ',' || s[4] != ' ' || s[7] != ' ' ||
+      s[11] != ' ' || s[16] != ' ' || s[19] != ':' || s[22] != ':' ||
+      s.substr(25) != " GMT") {
+    return std::nullopt;
+  }
+  auto number = [&](std::size_t pos, std::size_t len) -> int {
+    int v = 0;
+    for (std::size_t i = pos; i < pos + len; i++) {
+      if (s[i] < '0' || s[i] > '9') {
+        return -1;
+      }
+      v = v * 10 + (s[i] - '0');
+    }
+    return v;
+  };
+  std::tm tm{};
+  tm.tm_mday = number(5, 2);
+  tm.tm_mon = -1;
+  for (int i = 0; i < 12; i++) {
+    if (s.substr(8, 3) == months[i]) {
+      tm.tm_mon = i;
+    }
+  }
+  tm.tm_year = number(12, 4) - 1900;
+  tm.tm_hour = number(17, 2);
+  tm.tm_min = number(20, 2);
+  tm.tm_sec = number(23, 2);
+  if (tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_mon < 0 || tm.tm_year < 0 ||
+      tm.tm_hour < 0 || tm.tm_hour > 23 || tm.tm_min < 0 || tm.tm_min > 59 ||
+      tm.tm_sec < 0 || tm.tm_sec > 60) {
+    return std::nullopt;
+  }
+  return timegm(&tm);
+}
+
+} // namespace coro
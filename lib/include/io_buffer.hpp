@@ -0,0 +1,203 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <linux/mempolicy.h>
+#include <memory>
+#include <new>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+namespace coro {
+
+struct IOBufferStats {
+  std::size_t hugetlb_regions{}; // Backed by reserved huge pages.
+  std::size_t thp_regions{};     // Fell back to transparent huge pages.
+  std::size_t buffers{};         // Given out and not freed yet.
+  std::size_t bytes{};           // Of all the regions.
+};
+
+// Carves the buffers of the streams (see AsyncIStreamBase) out of 2 MiB
+// regions, instead of getting each one from the heap. With many connections
+// their buffers then sit in a few huge pages, and touching them doesn't miss
+// the TLB as much as when they're scattered over the heap.
+//
+// A region is mapped with MAP_HUGETLB if huge pages are reserved
+// (/proc/sys/vm/nr_hugepages). Otherwise it's aligned to 2 MiB and the kernel
+// is asked for transparent huge pages with madvise(); stats() tells which one
+// was used. Regions are placed on the NUMA node of the thread that maps them.
+//
+// Each thread has its own slab, so a loop's buffers are local to its node and
+// no locking is needed. A buffer must be freed on the thread that made it.
+// Sizes are rounded up to powers of 2 from 4 KiB to 64 KiB. Larger buffers
+// come from the heap.
+class IOBufferSlab {
+public:
+  static constexpr std::size_t region_size = 2 << 20;
+  static constexpr std::size_t min_size = 4 << 10;
+  static constexpr std::size_t max_size = 64 << 10;
+  static constexpr std::size_t cache_line = 64;
+
+  // The slab of the current thread.
+  static IOBufferSlab &local() {
+    thread_local Owner owner;
+    return *owner.slab;
+  }
+
+  char *allocate(std::size_t size) {
+    auto c = size_class(size);
+    auto &list = free_[c];
+    ++stats_.buffers;
+    if (auto b = list) {
+      list = b->next;
+      return reinterpret_cast<char *>(b);
+    }
+    // The buffers are a cache line apart, so that their beginnings, which are
+    // used the most, don't all map to the same cache sets.
+    auto bytes = (min_size << c) + cache_line;
+    if (region_left_ < bytes) {
+      add_region();
+    }
+    auto p = region_next_;
+    region_next_ += bytes;
+    region_left_ -= bytes;
+    return p;
+  }
+
+  void deallocate(char *p, std::size_t size) noexcept {
+    auto c = size_class(size);
+    free_[c] = ::new (p) FreeBuffer{free_[c]};
+    --stats_.buffers;
+    if (orphaned_ && stats_.buffers == 0) {
+      delete this;
+    }
+  }
+
+  IOBufferStats const &stats() const { return stats_; }
+
+private:
+  struct FreeBuffer {
+    FreeBuffer *next;
+  };
+
+  // The slab outlives its thread if buffers are still used, e.g. by objects
+  // with static storage that are destroyed after the thread-local ones. The
+  // last one deletes it then.
+  struct Owner {
+    Owner() : slab(new IOBufferSlab) {}
+
+    ~Owner() {
+      slab->orphaned_ = true;
+      if (slab->stats_.buffers == 0) {
+        delete slab;
+      }
+    }
+
+    IOBufferSlab *slab;
+  };
+
+  static constexpr std::size_t classes =
+      std::countr_zero(max_size) - std::countr_zero(min_size) + 1;
+
+  IOBufferSlab() = default;
+  IOBufferSlab(IOBufferSlab const &) = delete;
+  IOBufferSlab &operator=(IOBufferSlab const &) = delete;
+
+  ~IOBufferSlab() {
+    for (auto region : regions_) {
+      munmap(region, region_size);
+    }
+  }
+
+  static std::size_t size_class(std::size_t size) {
+    size = std::bit_ceil(std::max(size, min_size));
+    return std::countr_zero(size) - std::countr_zero(min_size);
+  }
+
+  void add_region() {
+    void *p = mmap(nullptr, region_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      ++stats_.hugetlb_regions;
+    } else {
+      p = map_aligned();
+      madvise(p, region_size, MADV_HUGEPAGE);
+      ++stats_.thp_regions;
+    }
+    bind_to_local_node(p);
+    regions_.push_back(p);
+    stats_.bytes += region_size;
+    // The end of the last region is wasted if a larger buffer is asked for.
+    region_next_ = static_cast<char *>(p);
+    region_left_ = region_size;
+  }
+
+  // Transparent huge pages are only used for aligned 2 MiB ranges, so twice as
+  // much is mapped and the ends are unmapped.
+  static void *map_aligned() {
+    void *p = mmap(nullptr, 2 * region_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    auto begin = reinterpret_cast<std::uintptr_t>(p);
+    auto aligned = (begin + region_size - 1) & ~(region_size - 1);
+    if (aligned != begin) {
+      munmap(p, aligned - begin);
+    }
+    munmap(reinterpret_cast<void *>(aligned + region_size),
+           begin + region_size - aligned);
+    return reinterpret_cast<void *>(aligned);
+  }
+
+  // The pages would be placed on the node of the thread that touches them
+  // first anyway; this keeps them there if another thread does. Kernels
+  // without NUMA support fail with ENOSYS, which is fine.
+  static void bind_to_local_node(void *p) {
+    unsigned cpu, node;
+    if (getcpu(&cpu, &node) != 0 || node >= sizeof(unsigned long) * 8) {
+      return;
+    }
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, p, region_size, MPOL_PREFERRED, &mask,
+            sizeof(mask) * 8, 0);
+  }
+
+  FreeBuffer *free_[classes]{};
+  char *region_next_{};
+  std::size_t region_left_{};
+  std::vector<void *> regions_;
+  IOBufferStats stats_;
+  bool orphaned_{};
+};
+
+// Frees a buffer made by make_io_buffer().
+struct IOBufferDeleter {
+  void operator()(char *p) const noexcept {
+    if (slab) {
+      slab->deallocate(p, size);
+    } else {
+      delete[] p;
+    }
+  }
+
+  IOBufferSlab *slab{};
+  std::size_t size{};
+};
+
+using IOBuffer = std::unique_ptr<char[], IOBufferDeleter>;
+
+inline IOBuffer make_io_buffer(std::size_t size) {
+  if (size > IOBufferSlab::max_size) {
+    return IOBuffer(new char[size]);
+  }
+  auto &slab = IOBufferSlab::local();
+  return IOBuffer(slab.allocate(size), IOBufferDeleter{&slab, size});
+}
+
+} // namespace coro
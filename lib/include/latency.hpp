@@ -0,0 +1,233 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "histogram.hpp"
+#include "utility.hpp"
+
+namespace coro {
+
+// The phases of a request, as timed by serve_connection().
+enum class Phase : std::uint8_t {
+  ACCEPT_TO_FIRST_BYTE, // First request of a connection only.
+  HEADER_PARSE,         // From the first byte until the body is read too.
+  ROUTE_LOOKUP,
+  HANDLER,       // Including its suspensions. Static responses have none.
+  SERIALIZATION, // Into the buffer, which is flushed when it's full.
+  FLUSH,         // Whatever is left in the buffer.
+};
+
+inline constexpr std::size_t phase_count = 6;
+
+inline std::string_view phase_name(Phase phase) {
+  static constexpr std::array<std::string_view, phase_count> names = {
+      "accept_to_first_byte", "header_parse",  "route_lookup",
+      "handler",              "serialization", "flush",
+  };
+  return names[static_cast<std::size_t>(phase)];
+}
+
+// Latencies of one route in nanoseconds, indexed by Phase.
+using PhaseHistograms = std::array<Histogram, phase_count>;
+
+// Times the phases of a request: mark(p) ends phase `p`, which began at the
+// previous mark() or at start(). A disabled timer doesn't read the clock.
+class PhaseTimer {
+public:
+  explicit PhaseTimer(bool enabled = true) : enabled_(enabled) {}
+
+  bool enabled() const { return enabled_; }
+
+  void start() {
+    if (enabled_) {
+      last_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  void mark(Phase phase) {
+    if (!enabled_) {
+      return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    auto i = static_cast<std::size_t>(phase);
+    ns_[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_)
+                 .count();
+    marked_ |= 1u << i;
+    last_ = now;
+  }
+
+  // Forgets the phases of the last request, not the time of the last mark.
+  void clear() { marked_ = 0; }
+
+  bool marked(Phase phase) const {
+    return marked_ & (1u << static_cast<std::size_t>(phase));
+  }
+
+  std::uint64_t nanoseconds(Phase phase) const {
+    return ns_[static_cast<std::size_t>(phase)];
+  }
+
+private:
+  bool enabled_;
+  unsigned marked_{};
+  std::chrono::steady_clock::time_point last_{};
+  std::array<std::uint64_t, phase_count> ns_{};
+};
+
+// Latency histograms per route pattern (see HTTPRouter::pattern_of()) and
+// phase. Like a HeaderTemplate, a recorder belongs to an event loop and is
+// made current on its thread with a Scope; serve_connection() records into the
+// current one, if any.
+//
+// Only the loop's thread records, so the mutex is never contended but by a
+// reader: merged() takes it briefly on every recorder of the process and
+// adds up their histograms. A request is recorded under one lock.
+class LatencyRecorder {
+public:
+  using Snapshot = std::map<std::string, PhaseHistograms, std::less<>>;
+
+  LatencyRecorder() {
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+    r.recorders.push_back(this);
+  }
+
+  LatencyRecorder(LatencyRecorder const &) = delete;
+  LatencyRecorder &operator=(LatencyRecorder const &) = delete;
+
+  // The histograms are kept for merged().
+  ~LatencyRecorder() {
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+    std::erase(r.recorders, this);
+    add_to(r.retired);
+  }
+
+  void record(std::string_view route, PhaseTimer const &timer) {
+    std::lock_guard lock(mutex_);
+    auto &h = histograms(route);
+    for (std::size_t i = 0; i < phase_count; i++) {
+      if (timer.marked(static_cast<Phase>(i))) {
+        h[i].record(timer.nanoseconds(static_cast<Phase>(i)));
+      }
+    }
+  }
+
+  // This recorder's histograms.
+  Snapshot snapshot() const {
+    Snapshot s;
+    add_to(s);
+    return s;
+  }
+
+  // The histograms of every recorder of the process, including those
+  // destroyed.
+  static Snapshot merged() {
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+    Snapshot s = r.retired;
+    for (auto *recorder : r.recorders) {
+      recorder->add_to(s);
+    }
+    return s;
+  }
+
+  // Makes `r` the recorder of the current thread while the scope is alive.
+  struct Scope {
+    explicit Scope(LatencyRecorder &r) : prev_(std::exchange(current_, &r)) {}
+    Scope(Scope const &) = delete;
+    Scope &operator=(Scope const &) = delete;
+    ~Scope() { current_ = prev_; }
+
+  private:
+    LatencyRecorder *prev_;
+  };
+
+  static LatencyRecorder *current() { return current_; }
+
+private:
+  struct Registry {
+    std::mutex mutex;
+    std::vector<LatencyRecorder *> recorders;
+    Snapshot retired;
+  };
+
+  static Registry &registry() {
+    static Registry r;
+    return r;
+  }
+
+  // Requests of a connection usually go to the same route, so the last one
+  // is looked up first.
+  PhaseHistograms &histograms(std::string_view route) {
+    if (last_ && last_->first == route) {
+      return *last_->second;
+    }
+    auto it = routes_.find(route);
+    if (it == routes_.end()) {
+      it = routes_
+               .emplace(std::string(route),
+                        std::make_unique<PhaseHistograms>())
+               .first;
+    }
+    last_ = &*it;
+    return *it->second;
+  }
+
+  void add_to(Snapshot &s) const {
+    std::lock_guard lock(mutex_);
+    for (auto const &[route, h] : routes_) {
+      auto &dst = s[route];
+      for (std::size_t i = 0; i < phase_count; i++) {
+        dst[i].merge((*h)[i]);
+      }
+    }
+  }
+
+  static inline thread_local LatencyRecorder *current_ = nullptr;
+
+  mutable std::mutex mutex_;
+  // A route's histograms take ~180 KiB, so they are allocated apart and
+  // their addresses are stable.
+  std::unordered_map<std::string, std::unique_ptr<PhaseHistograms>,
+                     cmp::CaseSensitiveHash, cmp::CaseSensitiveEqual>
+      routes_;
+  std::pair<std::string const, std::unique_ptr<PhaseHistograms>> *last_{};
+};
+
+// A table of the count and percentiles (in microseconds) of each route and
+// phase that has samples.
+inline std::string format_latency(LatencyRecorder::Snapshot const &snapshot) {
+  std::string s = std::format("{:<24} {:<20} {:>10} {:>10} {:>10} {:>10} "
+                              "{:>10}\n",
+                              "route", "phase", "count", "p50 us", "p90 us",
+                              "p99 us", "max us");
+  for (auto const &[route, h] : snapshot) {
+    for (std::size_t i = 0; i < phase_count; i++) {
+      if (!h[i].count()) {
+        continue;
+      }
+      s += std::format("{:<24} {:<20} {:>10} {:>10.1f} {:>10.1f} {:>10.1f} "
+                       "{:>10.1f}\n",
+                       route.empty() ? "(none)" : route,
+                       phase_name(static_cast<Phase>(i)), h[i].count(),
+                       h[i].percentile(50) / 1e3, h[i].percentile(90) / 1e3,
+                       h[i].percentile(99) / 1e3, h[i].max() / 1e3);
+    }
+  }
+  return s;
+}
+
+} // namespace coro
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "histogram.hpp"
+#include "stats.hpp"
+#include "type_name.hpp"
+
+namespace coro {
+
+// A resume that took longer than LoopMonitorOptions::slow_resume.
+struct SlowResume {
+  std::chrono::nanoseconds duration;
+  std::string_view type; // The promise type of the resumed frame, if known.
+  void const *frame;     // The address of the resumed frame.
+  std::string_view what; // See LoopMonitor::annotate(). May be empty.
+};
+
+// Prints `r` on one line to std::cerr.
+inline void log_slow_resume(SlowResume const &r) {
+  auto s = std::format("slow resume: {:.3f} ms in {} (frame {})",
+                       r.duration.count() / 1e6, r.type, r.frame);
+  if (!r.what.empty()) {
+    s += std::format(" at {}", r.what);
+  }
+  s += '\n';
+  std::cerr << s;
+}
+
+struct LoopMonitorOptions {
+  std::chrono::nanoseconds slow_resume = std::chrono::milliseconds(10);
+  std::function<void(SlowResume const &)> on_slow_resume = log_slow_resume;
+};
+
+// Watches an event loop for work that keeps it from polling: each resume of
+// the schedulers (see resume()) is timed, and so is each iteration, from the
+// return of epoll_wait() to the next call (the loop lag: how long an event
+// that just came may wait). Resumes longer than the slow_resume of the
+// options are reported to their on_slow_resume and counted as
+// Stat::SLOW_RESUMES.
+//
+// Like a LatencyRecorder, a monitor belongs to a loop and is made current on
+// its thread with a Scope, and merged() adds up those of all threads. A resume
+// costs two reads of the clock; its duration is buffered and the buffer is
+// added to the histogram under the lock once per iteration.
+class LoopMonitor {
+public:
+  // Durations in nanoseconds.
+  struct Snapshot {
+    Histogram lag;
+    Histogram resume;
+  };
+
+  explicit LoopMonitor(LoopMonitorOptions options = {}) : options_(std::move(options)) {
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+    r.monitors.push_back(this);
+  }
+
+  LoopMonitor(LoopMonitor const &) = delete;
+  LoopMonitor &operator=(LoopMonitor const &) = delete;
+
+  // The histograms are kept for merged().
+  ~LoopMonitor() {
+    flush();
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+    std::erase(r.monitors, this);
+    add_to(r.retired);
+  }
+
+  // Resumes `h` and times it. A resume within a resume is part of the outer
+  // one and isn't timed.
+  template <class P> void resume(std::coroutine_handle<P> h) {
+    if (resuming_) {
+      h.resume();
+      return;
+    }
+    resuming_ = true;
+    what_ = {};
+    auto start = std::chrono::steady_clock::now();
+    try {
+      h.resume();
+    } catch (...) {
+      resuming_ = false;
+      throw;
+    }
+    auto duration = std::chrono::steady_clock::now() - start;
+    resuming_ = false;
+    pending_[pending_count_++] = duration.count();
+    if (pending_count_ == pending_.size()) {
+      flush();
+    }
+    if (duration >= options_.slow_resume) {
+      slow(SlowResume{duration, promise_name<P>(), h.address(), what_});
+    }
+  }
+
+  // Says what the current resume is doing, e.g. serve_connection() gives the
+  // pattern of the route. `what` must outlive the resume.
+  void annotate(std::string_view what) { what_ = what; }
+
+  // Called by the loop right before it waits for events, and right after.
+  void before_wait() {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard lock(mutex_);
+    flush_locked();
+    if (woke_) {
+      lag_.record((now - *woke_).count());
+      woke_.reset();
+    }
+  }
+
+  void after_wait() { woke_ = std::chrono::steady_clock::now(); }
+
+  Snapshot snapshot() const {
+    Snapshot s;
+    add_to(s);
+    return s;
+  }
+
+  // The histograms of every monitor of the process, including those
+  // destroyed. The durations of an iteration in progress are not in yet.
+  static Snapshot merged() {
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+    Snapshot s = r.retired;
+    for (auto *monitor : r.monitors) {
+      monitor->add_to(s);
+    }
+    return s;
+  }
+
+  // Makes `m` the monitor of the current thread while the scope is alive.
+  struct Scope {
+    explicit Scope(LoopMonitor &m) : prev_(std::exchange(current_, &m)) {}
+    Scope(Scope const &) = delete;
+    Scope &operator=(Scope const &) = delete;
+    ~Scope() { current_ = prev_; }
+
+  private:
+    LoopMonitor *prev_;
+  };
+
+  static LoopMonitor *current() { return current_; }
+
+private:
+  struct Registry {
+    std::mutex mutex;
+    std::vector<LoopMonitor *> monitors;
+    Snapshot retired;
+  };
+
+  static Registry &registry() {
+    static Registry r;
+    return r;
+  }
+
+  // type_name() ends with a newline.
+  template <class P> static std::string_view promise_name() {
+    if constexpr (std::is_void_v<P>) {
+      return "a coroutine";
+    } else {
+      auto name = type_name<P>();
+      if (name.ends_with('\n')) {
+        name.remove_suffix(1);
+      }
+      return name;
+    }
+  }
+
+  void slow(SlowResume const &r) {
+    count_stat(Stat::SLOW_RESUMES);
+    if (options_.on_slow_resume) {
+      options_.on_slow_resume(r);
+    }
+  }
+
+  void flush() {
+    std::lock_guard lock(mutex_);
+    flush_locked();
+  }
+
+  void flush_locked() {
+    for (std::size_t i = 0; i < pending_count_; i++) {
+      resume_.record(pending_[i]);
+    }
+    pending_count_ = 0;
+  }
+
+  void add_to(Snapshot &s) const {
+    std::lock_guard lock(mutex_);
+    s.lag.merge(lag_);
+    s.resume.merge(resume_);
+  }
+
+  static inline thread_local LoopMonitor *current_ = nullptr;
+
+  LoopMonitorOptions options_;
+  bool resuming_ = false;
+  std::string_view what_;
+  std::optional<std::chrono::steady_clock::time_point> woke_;
+  std::array<std::uint64_t, 256> pending_;
+  std::size_t pending_count_ = 0;
+
+  mutable std::mutex mutex_;
+  Histogram lag_;
+  Histogram resume_;
+};
+
+// Resumes `h` through `monitor`, if not null.
+template <class P>
+void resume_monitored(LoopMonitor *monitor, std::coroutine_handle<P> h) {
+  if (monitor) {
+    monitor->resume(h);
+  } else {
+    h.resume();
+  }
+}
+
+} // namespace coro
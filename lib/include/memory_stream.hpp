@@ -0,0 +1,188 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "aio.hpp"
+#include "task.hpp"
+#include "utility.hpp"
+
+namespace coro {
+
+// A bounded byte queue between coroutines of one thread, in the manner of a
+// pipe: a reader waits while it's empty and a writer while it's full. The
+// other side wakes a waiting coroutine by putting it in the ready queue of
+// `sched`, so it runs the next time the scheduler runs, not inside the call
+// that woke it.
+//
+// The pipe must outlive the coroutines that wait on it.
+class MemoryPipe {
+public:
+  explicit MemoryPipe(TimedScheduler &sched, std::size_t capacity = 65536)
+      : sched_(sched), buffer_(std::make_unique<char[]>(capacity)),
+        capacity_(capacity) {}
+
+  MemoryPipe(MemoryPipe const &) = delete;
+  MemoryPipe &operator=(MemoryPipe const &) = delete;
+
+  // Reads at most buffer.size() bytes, once there are some. 0 means the pipe
+  // is closed and empty.
+  Task<std::size_t> read(std::span<char> buffer) {
+    while (size_ == 0 && !closed_) {
+      co_await Waiter{reader_};
+    }
+    auto n = std::min(buffer.size(), size_);
+    // The bytes may wrap around the end of the ring.
+    auto first = std::min(n, capacity_ - head_);
+    std::memcpy(buffer.data(), &buffer_[head_], first);
+    std::memcpy(buffer.data() + first, &buffer_[0], n - first);
+    head_ = (head_ + n) % capacity_;
+    size_ -= n;
+    wake(writer_);
+    co_return n;
+  }
+
+  // Writes as many bytes as there is room for, once there is some. 0 means
+  // the pipe is closed.
+  Task<std::size_t> write(std::span<char const> buffer) {
+    while (size_ == capacity_ && !closed_) {
+      co_await Waiter{writer_};
+    }
+    if (closed_) {
+      co_return 0;
+    }
+    auto n = std::min(buffer.size(), capacity_ - size_);
+    auto tail = (head_ + size_) % capacity_;
+    auto first = std::min(n, capacity_ - tail);
+    std::memcpy(&buffer_[tail], buffer.data(), first);
+    std::memcpy(&buffer_[0], buffer.data() + first, n - first);
+    size_ += n;
+    wake(reader_);
+    co_return n;
+  }
+
+  // Like closing the write end of a pipe: the reader gets what's left and
+  // then EOF. Writing fails from now on.
+  void close() {
+    closed_ = true;
+    wake(reader_);
+    wake(writer_);
+  }
+
+  bool closed() const { return closed_; }
+  std::size_t size() const { return size_; }
+  std::size_t capacity() const { return capacity_; }
+
+private:
+  struct Waiter {
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> h) noexcept {
+      waiting_ = h;
+      note_frame_wait(h, FrameWait::other("a memory pipe"));
+    }
+
+    void await_resume() const noexcept {}
+
+    std::coroutine_handle<> &waiting_;
+  };
+
+  void wake(std::coroutine_handle<> &h) {
+    if (h) {
+      note_frame_wait(h, {});
+      sched_.ready_coros_.insert(std::exchange(h, nullptr));
+    }
+  }
+
+  TimedScheduler &sched_;
+  std::unique_ptr<char[]> buffer_;
+  std::size_t capacity_;
+  std::size_t head_{};
+  std::size_t size_{};
+  bool closed_{};
+  std::coroutine_handle<> reader_;
+  std::coroutine_handle<> writer_;
+};
+
+// A BufferedStream that reads from one MemoryPipe and writes to another, so
+// that the HTTP code (HTTPRequest::read_from(), HTTPResponse::write_to(),
+// serve_connection()...) runs without the kernel. See MemoryConnection.
+struct MemoryStream : AsyncIOStreamBase<MemoryStream> {
+  MemoryStream(MemoryPipe &in, MemoryPipe &out, std::size_t buffer_size = 8192)
+      : AsyncIOStreamBase<MemoryStream>(buffer_size), in_(&in), out_(&out) {}
+
+  Task<std::size_t> read(std::span<char> buffer) { return in_->read(buffer); }
+
+  Task<std::size_t> write(std::span<char const> buffer) {
+    return out_->write(buffer);
+  }
+
+  // There's no copy to save here, so the pieces go through the buffer.
+  Task<> writev(std::span<std::string_view const> pieces) {
+    for (auto sv : pieces) {
+      co_await puts(sv);
+    }
+    co_await flush();
+  }
+
+  // Reads the region of the file with pread() and writes it.
+  Task<> sendfile(int in_fd, off_t offset, std::size_t count) {
+    co_await flush();
+    std::vector<char> chunk(std::min<std::size_t>(count, 65536));
+    while (count) {
+      auto ret = ::pread(in_fd, chunk.data(), std::min(count, chunk.size()),
+                         offset);
+      if (ret == -1 && errno == EINTR) {
+        continue;
+      }
+      if (ret == -1) {
+        THROW_SYSCALL("pread");
+      }
+      if (ret == 0) {
+        throw std::runtime_error("file is truncated\n" + SOURCE_LOCATION());
+      }
+      co_await puts(std::string_view(chunk.data(), ret));
+      offset += ret;
+      count -= ret;
+    }
+    co_await flush();
+  }
+
+  // Like shutdown(SHUT_WR): the other side reads EOF after the bytes already
+  // flushed.
+  void shutdown() { out_->close(); }
+
+  MemoryPipe *in_;
+  MemoryPipe *out_;
+};
+
+// Two MemoryStreams connected to each other like the sockets of socketpair():
+// what `client` writes `server` reads, and the other way around.
+struct MemoryConnection {
+  explicit MemoryConnection(TimedScheduler &sched,
+                            std::size_t capacity = 65536,
+                            std::size_t buffer_size = 8192)
+      : to_server(sched, capacity), to_client(sched, capacity),
+        client(to_client, to_server, buffer_size),
+        server(to_server, to_client, buffer_size) {}
+
+  MemoryPipe to_server;
+  MemoryPipe to_client;
+  MemoryStream client;
+  MemoryStream server;
+};
+
+static_assert(BufferedStream<MemoryStream>);
+
+} // namespace coro
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cstddef>
+#include <format>
+#include <iterator>
+#include <string>
+#include <string_view>
+
+#include "frame_profile.hpp"
+#include "frame_registry.hpp"
+#include "http.hpp"
+#include "latency.hpp"
+#include "loop_monitor.hpp"
+#include "stats.hpp"
+#include "task.hpp"
+
+namespace coro {
+
+// A label value with \, " and newlines escaped.
+inline std::string prometheus_label(std::string_view value) {
+  std::string s;
+  s.reserve(value.size());
+  for (char ch : value) {
+    if (ch == '\\' || ch == '"') {
+      s += '\\';
+      s += ch;
+    } else if (ch == '\n') {
+      s += "\\n";
+    } else {
+      s += ch;
+    }
+  }
+  return s;
+}
+
+// The stats in the Prometheus text format (version 0.0.4). Every name starts
+// with "coro_". The gauges of the threads are added up like the counters.
+// The latencies are summaries in seconds, labeled with the route and phase,
+// and so are the loop lag and the resumes of the LoopMonitors.
+inline std::string format_prometheus(LoopStats::Snapshot const &stats,
+                                     LatencyRecorder::Snapshot const &latency,
+                                     LoopMonitor::Snapshot const &monitor) {
+  std::string s;
+  auto header = [&](std::string_view name, std::string_view help,
+                    std::string_view type) {
+    std::format_to(std::back_inserter(s), "# HELP coro_{} {}\n", name, help);
+    std::format_to(std::back_inserter(s), "# TYPE coro_{} {}\n", name, type);
+  };
+  // The samples of a summary of durations in nanoseconds.
+  auto summary = [&](std::string_view name, std::string_view labels,
+                     Histogram const &h) {
+    auto sep = labels.empty() ? "" : ",";
+    for (double q : {0.5, 0.9, 0.99}) {
+      std::format_to(std::back_inserter(s),
+                     "coro_{}{{{}{}quantile=\"{}\"}} {}\n", name, labels, sep,
+                     q, h.percentile(q * 100) / 1e9);
+    }
+    auto braced = labels.empty() ? std::string() : std::format("{{{}}}", labels);
+    std::format_to(std::back_inserter(s), "coro_{}_sum{} {}\n", name, braced,
+                   h.mean() * h.count() / 1e9);
+    std::format_to(std::back_inserter(s), "coro_{}_count{} {}\n", name, braced,
+                   h.count());
+  };
+
+  header("threads", "Threads with stats.", "gauge");
+  std::format_to(std::back_inserter(s), "coro_threads {}\n", stats.threads);
+  for (std::size_t i = 0; i < stat_count; i++) {
+    auto const &info = stat_info(static_cast<Stat>(i));
+    header(info.name, info.help, info.gauge ? "gauge" : "counter");
+    std::format_to(std::back_inserter(s), "coro_{} {}\n", info.name,
+                   stats.values[i]);
+  }
+
+  header("responses_total", "Responses by status code.", "counter");
+  for (std::size_t i = 0; i < stats.responses.size(); i++) {
+    if (stats.responses[i]) {
+      std::format_to(std::back_inserter(s),
+                     "coro_responses_total{{code=\"{}\"}} {}\n", i,
+                     stats.responses[i]);
+    }
+  }
+
+  header("request_phase_seconds", "Time spent in each phase of a request.",
+         "summary");
+  for (auto const &[route, h] : latency) {
+    auto r = prometheus_label(route);
+    for (std::size_t i = 0; i < phase_count; i++) {
+      auto const &p = h[i];
+      if (!p.count()) {
+        continue;
+      }
+      auto labels = std::format("route=\"{}\",phase=\"{}\"", r,
+                                phase_name(static_cast<Phase>(i)));
+      summary("request_phase_seconds", labels, p);
+    }
+  }
+
+  header("loop_lag_seconds",
+         "Time from a return of epoll_wait() to the next call.", "summary");
+  summary("loop_lag_seconds", "", monitor.lag);
+  header("resume_seconds", "Time of each resume by the schedulers.",
+         "summary");
+  summary("resume_seconds", "", monitor.resume);
+  return s;
+}
+
+// Those of all the threads of the process.
+inline std::string format_prometheus() {
+  return format_prometheus(LoopStats::merged(), LatencyRecorder::merged(),
+                           LoopMonitor::merged());
+}
+
+// Serves format_prometheus() at `uri`. The stats are read while the loops
+// run: each thread's values are read with relaxed loads, so they are not taken
+// at the same instant.
+inline void route_metrics(HTTPRouter &router,
+                          std::string_view uri = "/metrics") {
+  using namespace std::literals;
+  router.route(HTTPMethod::GET, uri,
+               [](HTTPRequest const &req) -> Task<HTTPResponse> {
+                 auto res = HTTPResponse::with_allocator(req.get_allocator());
+                 res.status = 200;
+                 res.headers["Content-Type"] =
+                     "text/plain; version=0.0.4; charset=utf-8"sv;
+                 res.body = format_prometheus();
+                 co_return res;
+               });
+}
+
+// Serves dump_frames() at `uri`: the async stacks of the coroutines of the
+// loop that handles the request. Empty of stacks unless built with
+// CORO_FRAME_REGISTRY.
+inline void route_frames(HTTPRouter &router,
+                         std::string_view uri = "/debug/coroutines") {
+  using namespace std::literals;
+  router.route(HTTPMethod::GET, uri,
+               [](HTTPRequest const &req) -> Task<HTTPResponse> {
+                 auto res = HTTPResponse::with_allocator(req.get_allocator());
+                 res.status = 200;
+                 res.headers["Content-Type"] = "text/plain; charset=utf-8"sv;
+                 res.body = dump_frames();
+                 co_return res;
+               });
+}
+
+// Serves format_frame_profile() at `uri`, the coroutines that make the most
+// frames in the process. With "?reset=1" the profile starts over.
+inline void route_frame_profile(HTTPRouter &router,
+                                std::string_view uri = "/debug/frames") {
+  using namespace std::literals;
+  router.route(HTTPMethod::GET, uri,
+               [](HTTPRequest const &req) -> Task<HTTPResponse> {
+                 auto res = HTTPResponse::with_allocator(req.get_allocator());
+                 res.status = 200;
+                 res.headers["Content-Type"] = "text/plain; charset=utf-8"sv;
+                 res.body = format_frame_profile(frame_profile());
+                 if (req.parse_uri().params.contains("reset")) {
+                   reset_frame_profile();
+                 }
+                 co_return res;
+               });
+}
+
+} // namespace coro
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace coro {
+
+// The default reset hook of ObjectPool: calls `t.clear()` if T has one.
+struct ClearObject {
+  template <class T> void operator()(T &t) const {
+    if constexpr (requires { t.clear(); }) {
+      t.clear();
+    }
+  }
+};
+
+// A free list of objects that are expensive to make, e.g. those owning
+// buffers. An object that is released is reset by `Reset` and kept for the
+// next acquire(), so its memory stays allocated (and warm in the cache) instead
+// of going back to the heap.
+//
+// A pool belongs to an event loop and is only used by the loop's thread. It
+// must outlive the objects it gives out. At most `max_idle` released objects
+// are kept; the others are destroyed.
+template <class T, class Reset = ClearObject> class ObjectPool {
+public:
+  struct Release {
+    void operator()(T *t) const { pool_->release(t); }
+
+    ObjectPool *pool_;
+  };
+
+  // Gives the object back to the pool when it's destroyed.
+  using Handle = std::unique_ptr<T, Release>;
+
+  explicit ObjectPool(std::size_t max_idle = 256, Reset reset = {})
+      : max_idle_(max_idle), reset_(std::move(reset)) {}
+
+  ObjectPool(ObjectPool const &) = delete;
+  ObjectPool &operator=(ObjectPool const &) = delete;
+
+  // Takes an idle object, or makes one from `args` if there's none. An idle
+  // object was reset when it was released; `args` are not used for it.
+  template <class... Args> Handle acquire(Args &&...args) {
+    if (!idle_.empty()) {
+      auto t = idle_.back().release();
+      idle_.pop_back();
+      ++reused_;
+      return Handle(t, Release{this});
+    }
+    ++created_;
+    return Handle(new T(std::forward<Args>(args)...), Release{this});
+  }
+
+  // Idle objects.
+  std::size_t size() const { return idle_.size(); }
+
+  // The objects made by acquire(), and those it gave out again.
+  std::size_t created() const { return created_; }
+  std::size_t reused() const { return reused_; }
+
+private:
+  void release(T *t) {
+    std::unique_ptr<T> p(t);
+    if (idle_.size() >= max_idle_) {
+      return;
+    }
+    reset_(*p);
+    idle_.push_back(std::move(p));
+  }
+
+  std::vector<std::unique_ptr<T>> idle_;
+  std::size_t max_idle_;
+  std::size_t created_{};
+  std::size_t reused_{};
+  [[no_unique_address]] Reset reset_;
+};
+
+} // namespace coro
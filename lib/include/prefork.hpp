@@ -0,0 +1,290 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <format>
+#include <functional>
+#include <optional>
+#include <string>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "affinity.hpp"
+#include "shutdown.hpp"
+#include "utility.hpp"
+
+// The pre-fork mode: a master process forks workers that each run a loop of
+// their own on the listening socket it bound before, so a worker that crashes
+// takes only its connections with it. The master only waits for signals:
+//
+// - a worker that exits is started again, after `respawn_delay` if it didn't
+//   live that long, so one that fails at start doesn't fork in a loop;
+// - SIGHUP reloads: a new generation of workers is started, then the old one
+//   is asked to stop (SIGTERM, see shutdown.hpp) and drains its connections;
+// - SIGTERM and SIGINT stop the workers the same way, then the master returns.
+//
+// A worker that is still running `drain_timeout` after it was asked to stop is
+// killed.
+//
+// A pinned worker only touches memory of its node, and with one listening
+// socket per worker from listen_by_cpu() it only serves the connections whose
+// packets its CPU handles.
+
+namespace coro {
+
+struct PreforkOptions {
+  int workers = 0;          // 0 for one per CPU the master may run on.
+  bool pin_workers = true;  // Worker i only runs on the i-th of those CPUs,
+  bool local_memory = true; // and allocates from the NUMA node of that CPU.
+  std::chrono::milliseconds respawn_delay{1000};
+  std::chrono::milliseconds drain_timeout{10000};
+  // Called in the master with the index of a worker that exited, before it's
+  // started again, e.g. to reset what it left in shared memory.
+  std::function<void(int index)> on_respawn{};
+};
+
+class Prefork {
+public:
+  // `worker` is called in each worker process with its index, from 0, and
+  // returns its exit status. It must not rely on threads of the master: only
+  // the thread that forked exists in the worker.
+  Prefork(PreforkOptions options, std::function<int(int index)> worker)
+      : options_(options), worker_(std::move(worker)) {
+    cpus_ = allowed_cpus();
+    if (options_.workers <= 0) {
+      options_.workers = std::max<int>(1, cpus_.size());
+    }
+  }
+
+  Prefork(Prefork const &) = delete;
+  Prefork &operator=(Prefork const &) = delete;
+
+  // Runs the master until it's stopped and all workers have exited.
+  int run() {
+    sigset_t signals, old;
+    sigemptyset(&signals);
+    for (int sig : {SIGCHLD, SIGHUP, SIGTERM, SIGINT}) {
+      sigaddset(&signals, sig);
+    }
+    CHECK_SYSCALL(sigprocmask(SIG_BLOCK, &signals, &old));
+    old_mask_ = old;
+    master_ = getpid();
+
+    for (int i = 0; i < options_.workers; i++) {
+      spawn(i);
+    }
+    while (!stopping_ || !workers_.empty()) {
+      auto timeout = next_deadline();
+      siginfo_t info;
+      int sig;
+      if (timeout) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::max(*timeout - Clock::now(), Clock::duration{}))
+                      .count();
+        timespec ts{.tv_sec = static_cast<time_t>(ns / 1'000'000'000),
+                    .tv_nsec = static_cast<long>(ns % 1'000'000'000)};
+        sig = sigtimedwait(&signals, &info, &ts);
+      } else {
+        sig = sigwaitinfo(&signals, &info);
+      }
+      if (sig == -1 && errno != EAGAIN && errno != EINTR) {
+        THROW_SYSCALL("sigtimedwait");
+      }
+      if (sig == SIGCHLD) {
+        reap();
+      } else if (sig == SIGHUP) {
+        reload();
+      } else if (sig == SIGTERM || sig == SIGINT) {
+        stop();
+      }
+      on_deadlines();
+    }
+
+    CHECK_SYSCALL(sigprocmask(SIG_SETMASK, &old, nullptr));
+    return 0;
+  }
+
+  // Workers alive, of all generations.
+  std::size_t workers() const { return workers_.size(); }
+
+  unsigned generation() const { return generation_; }
+
+private:
+  struct Worker {
+    pid_t pid;
+    int index;
+    unsigned generation;
+    Clock::time_point started;
+    std::optional<Clock::time_point> kill_at; // Once asked to stop.
+    bool killed{};
+  };
+
+  struct Respawn {
+    int index;
+    Clock::time_point at;
+  };
+
+  void spawn(int index) {
+    // Or the child would write what's buffered again.
+    std::fflush(nullptr);
+    pid_t pid = CHECK_SYSCALL(fork());
+    if (pid == 0) {
+      std::_Exit(run_worker(index));
+    }
+    workers_.push_back({pid, index, generation_, Clock::now(), std::nullopt});
+  }
+
+  // In the worker.
+  int run_worker(int index) {
+    int status = 1;
+    try {
+      for (int sig : {SIGCHLD, SIGHUP}) {
+        signal(sig, SIG_DFL);
+      }
+      CHECK_SYSCALL(sigprocmask(SIG_SETMASK, &old_mask_, nullptr));
+      install_stop_handler();
+      // A worker whose master is gone stops too.
+      CHECK_SYSCALL(prctl(PR_SET_PDEATHSIG, SIGTERM));
+      if (getppid() != master_) {
+        request_stop();
+      }
+      if (options_.pin_workers && !cpus_.empty()) {
+        int cpu = cpus_[index % cpus_.size()];
+        pin_to_cpu(cpu);
+        // Before the worker allocates its loop, buffers and frames.
+        if (int node = numa_node_of_cpu(cpu);
+            options_.local_memory && node >= 0) {
+          prefer_memory_of_node(node);
+        }
+      }
+      status = worker_(index);
+    } catch (std::exception &e) {
+      std::fprintf(stderr, "worker %d: %s\n", index, e.what());
+    }
+    // The objects of the master are copies, so their destructors aren't run.
+    std::fflush(nullptr);
+    return status;
+  }
+
+  void reap() {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      auto it = std::ranges::find(workers_, pid, &Worker::pid);
+      if (it == workers_.end()) {
+        continue;
+      }
+      auto worker = *it;
+      workers_.erase(it);
+      if (worker.kill_at) {
+        continue; // It was asked to stop.
+      }
+      std::fprintf(stderr, "worker %d (pid %d) %s\n", worker.index, pid,
+                   describe(status).c_str());
+      if (!stopping_ && worker.generation == generation_) {
+        auto now = Clock::now();
+        auto at = worker.started + options_.respawn_delay > now
+                      ? now + options_.respawn_delay
+                      : now;
+        respawns_.push_back({worker.index, at});
+      }
+    }
+  }
+
+  void reload() {
+    if (stopping_) {
+      return;
+    }
+    generation_++;
+    respawns_.clear();
+    auto old = workers_.size();
+    for (int i = 0; i < options_.workers; i++) {
+      spawn(i);
+    }
+    for (std::size_t i = 0; i < old; i++) {
+      ask_to_stop(workers_[i]);
+    }
+  }
+
+  void stop() {
+    stopping_ = true;
+    respawns_.clear();
+    for (auto &worker : workers_) {
+      ask_to_stop(worker);
+    }
+  }
+
+  void ask_to_stop(Worker &worker) {
+    if (!worker.kill_at) {
+      kill(worker.pid, SIGTERM);
+      worker.kill_at = Clock::now() + options_.drain_timeout;
+    }
+  }
+
+  std::optional<Clock::time_point> next_deadline() const {
+    std::optional<Clock::time_point> next;
+    auto earlier = [&](Clock::time_point t) {
+      if (!next || t < *next) {
+        next = t;
+      }
+    };
+    for (auto const &worker : workers_) {
+      if (worker.kill_at && !worker.killed) {
+        earlier(*worker.kill_at);
+      }
+    }
+    for (auto const &respawn : respawns_) {
+      earlier(respawn.at);
+    }
+    return next;
+  }
+
+  void on_deadlines() {
+    auto now = Clock::now();
+    for (auto &worker : workers_) {
+      if (worker.kill_at && !worker.killed && *worker.kill_at <= now) {
+        std::fprintf(stderr, "worker %d (pid %d) didn't drain in time\n",
+                     worker.index, worker.pid);
+        kill(worker.pid, SIGKILL);
+        worker.killed = true;
+      }
+    }
+    std::erase_if(respawns_, [&](Respawn const &respawn) {
+      if (respawn.at > now) {
+        return false;
+      }
+      if (options_.on_respawn) {
+        options_.on_respawn(respawn.index);
+      }
+      spawn(respawn.index);
+      return true;
+    });
+  }
+
+  static std::string describe(int status) {
+    if (WIFSIGNALED(status)) {
+      return std::format("was killed by signal {}", WTERMSIG(status));
+    }
+    return std::format("exited with status {}", WEXITSTATUS(status));
+  }
+
+  PreforkOptions options_;
+  std::function<int(int)> worker_;
+  std::vector<int> cpus_;
+  sigset_t old_mask_{};
+  pid_t master_{};
+  std::vector<Worker> workers_;
+  std::vector<Respawn> respawns_;
+  unsigned generation_{};
+  bool stopping_{};
+};
+
+} // namespace coro
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <format>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "hash.hpp"
+#include "http.hpp"
+#include "http_date.hpp"
+#include "utility.hpp"
+
+namespace coro {
+
+// [first, last], both inclusive as in Content-Range.
+struct ByteRange {
+  std::size_t first{};
+  std::size_t last{};
+
+  std::size_t length() const { return last - first + 1; }
+
+  bool operator==(ByteRange const &) const = default;
+};
+
+// More ranges than this are answered with the whole representation, so a
+// request cannot make us send the same bytes many times.
+inline constexpr std::size_t max_byte_ranges = 16;
+
+// Parses a Range field value against a representation of `size` bytes.
+//
+// - std::nullopt: the field is invalid or not in bytes, so it's ignored.
+// - an empty vector: no range is satisfiable (416).
+// - otherwise: sorted ranges, with overlapping and adjacent ones merged.
+//
+// https://www.rfc-editor.org/rfc/rfc9110#section-14.1.2
+inline std::optional<std::vector<ByteRange>> parse_range(std::string_view s,
+                                                         std::size_t size) {
+  auto trim = [](std::string_view v) {
+    while (!v.empty() && std::isspace((unsigned char)v.front())) {
+      v.remove_prefix(1);
+    }
+    while (!v.empty() && std::isspace((unsigned char)v.back())) {
+      v.remove_suffix(1);
+    }
+    return v;
+  };
+  auto number = [](std::string_view v) -> std::optional<std::size_t> {
+    if (v.empty() || v.size() > 19) {
+      return std::nullopt;
+    }
+    std::size_t n = 0;
+    for (char ch : v) {
+      if (ch < '0' || ch > '9') {
+        return std::nullopt;
+      }
+      n = n * 10 + (ch - '0');
+    }
+    return n;
+  };
+
+  s = trim(s);
+  if (!s.starts_with("bytes=")) {
+    return std::nullopt;
+  }
+  s.remove_prefix(6);
+
+  std::vector<ByteRange> ranges;
+  std::size_t count = 0;
+  for (auto com : std::views::split(s, ',')) {
+    auto spec = trim(std::string_view{com});
+    if (spec.empty()) {
+      continue;
+    }
+    if (++count > max_byte_ranges) {
+      return std::nullopt;
+    }
+    auto dash = spec.find('-');
+    if (dash == std::string_view::npos) {
+      return std::nullopt;
+    }
+    auto first = trim(spec.substr(0, dash));
+    auto last = trim(spec.substr(dash + 1));
+    if (first.empty()) {
+      // "-500": the last 500 bytes.
+      auto n = number(last);
+      if (!n) {
+        return std::nullopt;
+      }
+      if (*n != 0 && size != 0) {
+        ranges.push_back({size - std::min(*n, size), size - 1});
+      }
+      continue;
+    }
+    auto a = number(first);
+    if (!a) {
+      return std::nullopt;
+    }
+    std::size_t b = size ? size - 1 : 0;
+    if (!last.empty()) {
+      auto n = number(last);
+      if (!n || *n < *a) {
+        return std::nullopt;
+      }
+      b = std::min(*n, b);
+    }
+    if (*a < size) {
+      ranges.push_back({*a, b});
+    }
+  }
+  if (count == 0) {
+    return std::nullopt;
+  }
+
+  std::ranges::sort(ranges, {}, &ByteRange::first);
+  std::vector<ByteRange> merged;
+  for (auto const &r : ranges) {
+    if (!merged.empty() && r.first <= merged.back().last + 1) {
+      merged.back().last = std::max(merged.back().last, r.last);
+    } else {
+      merged.push_back(r);
+    }
+  }
+  return merged;
+}
+
+// If-Range: the range applies only if the representation is unchanged. ETags
+// are compared strongly and dates exactly.
+// https://www.rfc-editor.org/rfc/rfc9110#section-13.1.5
+inline bool if_range_matches(std::string_view if_range, std::string_view etag,
+                             std::string_view last_modified) {
+  if (if_range.starts_with('"')) {
+    return !etag.empty() && !etag.starts_with("W/") && if_range == etag;
+  }
+  if (if_range.starts_with("W/")) {
+    return false;
+  }
+  auto since = parse_http_date(if_range);
+  auto modified = parse_http_date(last_modified);
+  return since && modified && *since == *modified;
+}
+
+// Answers a Range request: turns a 200 response into 206 (one or more ranges)
+// or 416 (none satisfiable). A file body keeps pointing to the file, so only
+// the requested ranges are read or sent. Call it before the response is
+// written. Returns whether the response has been changed.
+inline bool evaluate_range(HTTPRequest const &req, HTTPResponse &res) {
+  if (res.status != 200 || res.serialized || res.body.generator() ||
+      http_method(req.method) != HTTPMethod::GET) {
+    return false;
+  }
+  auto it = req.headers.find("Range");
+  if (it == req.headers.end()) {
+    return false;
+  }
+  if (auto jt = req.headers.find("If-Range"); jt != req.headers.end()) {
+    std::string_view etag, last_modified;
+    if (auto kt = res.headers.find("ETag"); kt != res.headers.end()) {
+      etag = kt->second;
+    }
+    if (auto kt = res.headers.find("Last-Modified"); kt != res.headers.end()) {
+      last_modified = kt->second;
+    }
+    if (!if_range_matches(jt->second, etag, last_modified)) {
+      return false;
+    }
+  }
+
+  auto file = res.body.file();
+  std::size_t size = file ? file->size : res.body.size();
+  auto ranges = parse_range(it->second, size);
+  if (!ranges) {
+    return false;
+  }
+  if (ranges->empty()) {
+    HTTPResponse r;
+    r.status = 416;
+    r.headers["Content-Range"] = std::format("bytes */{}", size);
+    res = std::move(r);
+    return true;
+  }
+
+  res.status = 206;
+  if (ranges->size() == 1) {
+    auto r = ranges->front();
+    res.headers["Content-Range"] =
+        std::format("bytes {}-{}/{}", r.first, r.last, size);
+    if (file) {
+      file->parts = {FileBody::Part{.offset = static_cast<off_t>(r.first),
+                                    .length = r.length()}};
+    } else {
+      res.body = std::string(res.body.view().substr(r.first, r.length()));
+    }
+    return true;
+  }
+
+  // multipart/byteranges
+  // https://www.rfc-editor.org/rfc/rfc9110#section-14.6
+  std::string content_type = "application/octet-stream";
+  if (auto kt = res.headers.find("Content-Type"); kt != res.headers.end()) {
+    content_type = kt->second;
+  }
+  auto boundary = std::format("{:016x}", xxhash64(req.uri, size));
+  res.headers["Content-Type"] =
+      "multipart/byteranges; boundary=" + boundary;
+  std::vector<FileBody::Part> parts;
+  for (auto const &r : *ranges) {
+    parts.push_back(FileBody::Part{
+        .header = std::format("\r\n--{}\r\nContent-Type: {}\r\nContent-Range: "
+                              "bytes {}-{}/{}\r\n\r\n",
+                              boundary, content_type, r.first, r.last, size),
+        .offset = static_cast<off_t>(r.first),
+        .length = r.length()});
+  }
+  auto trailer = std::format("\r\n--{}--\r\n", boundary);
+  if (file) {
+    file->parts = std::move(parts);
+    file->trailer = std::move(trailer);
+  } else {
+    std::string body;
+    auto bytes = res.body.view();
+    for (auto const &part : parts) {
+      body += part.header;
+      body += bytes.substr(part.offset, part.length);
+    }
+    body += trailer;
+    res.body = std::move(body);
+  }
+  return true;
+}
+
+// Lets clients know they can ask for ranges of a response.
+inline void add_accept_ranges(HTTPResponse &res) {
+  if (res.status == 200 && !res.serialized) {
+    res.headers.try_emplace("Accept-Ranges", "bytes");
+  }
+}
+
+} // namespace coro
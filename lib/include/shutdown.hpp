@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "aio.hpp"
+#include "epoll.hpp"
+#include "task.hpp"
+#include "utility.hpp"
+
+// A graceful stop. install_stop_handler() makes SIGTERM and SIGINT set a flag
+// and make a pipe readable, so a loop waits for them like for a file: its
+// accept loop races wait_for_stop() against socket_accept() (see when_any),
+// and the connections it has left are closed after their current requests
+// (see serve_connection()).
+
+namespace coro {
+
+namespace detail {
+struct StopSignal {
+  static void handler(int) {
+    int saved = errno;
+    requested = 1;
+    [[maybe_unused]] auto ret = ::write(pipe[1], "", 1);
+    errno = saved;
+  }
+
+  static inline volatile std::sig_atomic_t requested = 0;
+  static inline int pipe[2] = {-1, -1};
+};
+} // namespace detail
+
+inline void install_stop_handler() {
+  using detail::StopSignal;
+  if (StopSignal::pipe[0] == -1) {
+    CHECK_SYSCALL(pipe2(StopSignal::pipe, O_NONBLOCK | O_CLOEXEC));
+  }
+  struct sigaction sa {};
+  sa.sa_handler = StopSignal::handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  CHECK_SYSCALL(sigaction(SIGTERM, &sa, nullptr));
+  CHECK_SYSCALL(sigaction(SIGINT, &sa, nullptr));
+}
+
+// Whether the process was asked to stop. Set once, never cleared.
+inline bool stop_requested() { return detail::StopSignal::requested; }
+
+// Same as a SIGTERM. Needs install_stop_handler().
+inline void request_stop() { detail::StopSignal::handler(0); }
+
+// Completes once the process is asked to stop. Needs install_stop_handler().
+// The pipe isn't read, so it stays readable for every waiter that follows.
+// Each waits on a dup of it, as a loop can only wait once on an fd.
+inline Task<> wait_for_stop(EpollScheduler &sched) {
+  if (stop_requested()) {
+    co_return;
+  }
+  AsyncFile file(CHECK_SYSCALL(fcntl(detail::StopSignal::pipe[0],
+                                     F_DUPFD_CLOEXEC, 0)),
+                 false);
+  while (!stop_requested()) {
+    co_await wait_file_event(sched, file, EPOLLIN);
+  }
+}
+
+} // namespace coro
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <arpa/inet.h>
+#include <cerrno>
 #include <cstdio>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -11,6 +12,8 @@
 
 #include "aio.hpp"
 #include "epoll.hpp"
+#include "stats.hpp"
+#include "syscall.hpp"
 #include "utility.hpp"
 
 namespace coro {
@@ -153,11 +156,22 @@ inline Task<AsyncFile> socket_accept(EpollScheduler &sched, AsyncFile &sock,
                                      struct sockaddr *sockaddr,
                                      socklen_t *socklen) {
   // Assume sock already has flag O_NONBLOCKING.
-  co_await wait_file_event(sched, sock, EPOLLIN);
-  // Now accept cannot block.
-  auto res = CHECK_SYSCALL(accept4(sock.fd_, sockaddr, socklen, SOCK_NONBLOCK));
-  // SOCK_NONBLOCK saves us one more syscall (fcntl).
-  co_return AsyncFile{res, false};
+  while (true) {
+    // When the socket is shared by processes (see Prefork), EPOLLEXCLUSIVE
+    // wakes one of their loops for a connection, rather than all of them.
+    co_await wait_file_event(sched, sock, EPOLLIN | EPOLLEXCLUSIVE);
+    // Now accept cannot block.
+    auto res = sys::accept4(sock.fd_, sockaddr, socklen, SOCK_NONBLOCK);
+    // Another loop may still have taken the connection first.
+    if (res == -1 &&
+        (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)) {
+      continue;
+    }
+    CHECK_SYSCALL(res);
+    count_stat(Stat::ACCEPTS);
+    // SOCK_NONBLOCK saves us one more syscall (fcntl).
+    co_return AsyncFile{res, false};
+  }
 }
 
 inline FileDescriptor socket_accept_sync(int sockfd, struct sockaddr *sockaddr,
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
+namespace coro {
+
+// A bounded queue between one producer thread and one consumer thread,
+// without locks. The capacity is rounded up to a power of two, so a position
+// is mapped to a slot with a mask, and the positions only grow.
+//
+// Each position is on a cache line of its own. The producer keeps a copy of
+// the consumer's that it refreshes only when the ring looks full, so a push
+// usually touches no line written by the consumer; the consumer reads the
+// producer's once per batch.
+template <class T> class SpscRing {
+  static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+  explicit SpscRing(std::size_t capacity)
+      : mask_(std::bit_ceil(capacity < 2 ? 2 : capacity) - 1),
+        slots_(std::make_unique<T[]>(mask_ + 1)) {}
+
+  SpscRing(SpscRing const &) = delete;
+  SpscRing &operator=(SpscRing const &) = delete;
+
+  std::size_t capacity() const { return mask_ + 1; }
+
+  // Producer only. Returns false if the ring is full.
+  bool try_push(T const &value) {
+    auto tail = producer_.tail.load(std::memory_order_relaxed);
+    if (tail - producer_.head > mask_) {
+      producer_.head = consumer_.head.load(std::memory_order_acquire);
+      if (tail - producer_.head > mask_) {
+        return false;
+      }
+    }
+    slots_[tail & mask_] = value;
+    producer_.tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only. Calls `f` with each value pushed so far, up to `max`, and
+  // returns how many.
+  template <class F> std::size_t consume(F &&f, std::size_t max = SIZE_MAX) {
+    auto head = consumer_.head.load(std::memory_order_relaxed);
+    auto tail = producer_.tail.load(std::memory_order_acquire);
+    std::size_t n = 0;
+    for (; head != tail && n < max; head++, n++) {
+      f(slots_[head & mask_]);
+    }
+    consumer_.head.store(head, std::memory_order_release);
+    return n;
+  }
+
+  // Either side, approximately.
+  std::size_t size() const {
+    return producer_.tail.load(std::memory_order_acquire) -
+           consumer_.head.load(std::memory_order_acquire);
+  }
+
+private:
+  static constexpr std::size_t line = 64;
+
+  struct alignas(line) Producer {
+    std::atomic<std::size_t> tail{};
+    std::size_t head{}; // Cached consumer_.head.
+  };
+
+  struct alignas(line) Consumer {
+    std::atomic<std::size_t> head{};
+  };
+
+  Producer producer_;
+  Consumer consumer_;
+  std::size_t const mask_;
+  std::unique_ptr<T[]> slots_;
+};
+
+} // namespace coro
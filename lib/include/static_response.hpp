@@ -0,0 +1,122 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "default_headers.hpp"
+#include "epoll.hpp"
+#include "etag.hpp"
+#include "http.hpp"
+#include "task.hpp"
+
+namespace coro {
+
+// A response serialized once, when it's registered. The bytes are kept in two
+// pieces and the default headers (see HeaderTemplate), the only part that
+// changes, are written between them:
+//
+//   head:     "HTTP/1.1 200 OK\r\n<headers>\r\n"
+//   defaults: "Server: coro\r\n...Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+//   tail:     "\r\n<body>"
+//
+// A strong ETag is added if there isn't one, and the 304 for it is serialized
+// as well, so conditional requests are answered without touching the body.
+struct StaticResponse {
+  explicit StaticResponse(HTTPResponse res) : StaticResponse(res, true) {}
+
+  // What to send for `req`: this response, its 304, or nullptr when the
+  // preconditions fail otherwise (412) and the regular path should answer.
+  StaticResponse const *select(HTTPRequest const &req) const {
+    if (!not_modified_ || (!req.headers.contains("If-None-Match") &&
+                           !req.headers.contains("If-Modified-Since"))) {
+      return this;
+    }
+    switch (evaluate_preconditions(req, etag_, last_modified_)) {
+    case 0:
+      return this;
+    case 304:
+      return not_modified_.get();
+    default:
+      return nullptr;
+    }
+  }
+
+  std::array<std::string_view, 3> pieces(std::string_view defaults) const {
+    return {head_, defaults, tail_};
+  }
+
+  template <BufferedStream Stream>
+  Task<> write_to(Stream &f, bool keep_alive = false) const {
+    auto p = pieces(default_response_headers(keep_alive));
+    if (f.try_puts(p)) {
+      co_return;
+    }
+    for (auto sv : p) {
+      co_await f.puts(sv);
+    }
+  }
+
+  std::string to_string(std::string_view defaults) const {
+    std::string s;
+    s.reserve(head_.size() + defaults.size() + tail_.size());
+    for (auto sv : pieces(defaults)) {
+      s += sv;
+    }
+    return s;
+  }
+
+  // The response as registered (plus the ETag), for find_route().
+  HTTPResponse const &response() const { return response_; }
+
+private:
+  StaticResponse(HTTPResponse &res, bool with_not_modified) {
+    std::erase_if(res.headers, [](auto const &kv) {
+      return HeaderTemplate::provides(kv.first);
+    });
+    if (with_not_modified) {
+      add_etag(res);
+      etag_ = res.headers.at("ETag");
+      if (auto it = res.headers.find("Last-Modified"); it != res.headers.end()) {
+        last_modified_ = it->second;
+      }
+      auto r = precondition_response(304, res.headers);
+      not_modified_.reset(new StaticResponse(r, false));
+    }
+
+    auto s = res.to_string();
+    auto [head, _, tail] = HTTPResponse::splice_head(s, "");
+    head_ = head;
+    tail_ = tail;
+    response_ = std::move(res);
+  }
+
+  std::string head_;
+  std::string tail_;
+  std::string etag_;
+  std::string last_modified_;
+  std::unique_ptr<StaticResponse const> not_modified_;
+  HTTPResponse response_;
+};
+
+namespace detail {
+inline Task<HTTPResponse>
+static_response_handler(std::shared_ptr<StaticResponse const> s) {
+  co_return s->response();
+}
+} // namespace detail
+
+inline void HTTPRouter::route_static(HTTPMethod method, std::string_view uri,
+                                     HTTPResponse response) {
+  auto s = std::make_shared<StaticResponse const>(std::move(response));
+  route(method, uri,
+        [s](HTTPRequest const &) {
+          return detail::static_response_handler(s);
+        });
+  patterns[s.get()] = normalize_path(uri);
+  static_matches[normalize_path(uri)][method] = std::move(s);
+}
+
+} // namespace coro
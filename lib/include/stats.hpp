@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace coro {
+
+// What the library counts, per thread (see LoopStats). Gauges are sampled or
+// kept up to date as they change, counters only grow.
+enum class Stat : std::uint8_t {
+  ACCEPTS,          // socket_accept()
+  OPEN_CONNECTIONS, // serve_connection()
+  REQUESTS,
+  EXCEPTIONS, // Thrown out of serve_connection(), other than EOF.
+  BYTES_READ, // AsyncFileBuffer
+  BYTES_WRITTEN,
+  EPOLL_WAKEUPS, // Returns from epoll_wait().
+  EPOLL_EVENTS,
+  TIMERS,      // TimedScheduler, when a run() starts.
+  READY_COROS, // Same.
+  ROUTE_STATIC_HITS, // HTTPRouter, as used by serve_connection().
+  ROUTE_HANDLER_HITS,
+  ROUTE_MISSES,
+  SLOW_RESUMES, // LoopMonitor
+  ACCESS_LOG_DROPS, // AccessLog::Ring
+  MIGRATIONS,       // Balancer, connections moved to another loop.
+};
+
+inline constexpr std::size_t stat_count = 16;
+
+struct StatInfo {
+  std::string_view name; // Without the prefix of the exposition.
+  std::string_view help;
+  bool gauge;
+};
+
+inline StatInfo const &stat_info(Stat stat) {
+  static constexpr std::array<StatInfo, stat_count> infos = {{
+      {"accepts_total", "Connections accepted.", false},
+      {"open_connections", "Connections being served.", true},
+      {"requests_total", "Requests served.", false},
+      {"exceptions_total", "Connections ended by an exception.", false},
+      {"read_bytes_total", "Bytes read from connections.", false},
+      {"written_bytes_total", "Bytes written to connections.", false},
+      {"epoll_wakeups_total", "Returns from epoll_wait().", false},
+      {"epoll_events_total", "Events returned by epoll_wait().", false},
+      {"timers", "Sleeping coroutines.", true},
+      {"ready_coroutines", "Coroutines in the ready queues.", true},
+      {"router_static_hits_total", "Requests answered by static responses.",
+       false},
+      {"router_handler_hits_total", "Requests answered by handlers.", false},
+      {"router_misses_total", "Requests that matched no route.", false},
+      {"slow_resumes_total", "Resumes longer than the monitor's threshold.",
+       false},
+      {"access_log_drops_total", "Access log records lost to a full ring.",
+       false},
+      {"migrated_connections_total", "Connections moved to another loop.",
+       false},
+  }};
+  return infos[static_cast<std::size_t>(stat)];
+}
+
+// The stats of one thread, usually that of an event loop. Like a
+// HeaderTemplate, they are made current with a Scope, and the library adds to
+// the current ones, if any (see count_stat()).
+//
+// Only the owning thread writes, so a value is updated with a relaxed load and
+// store, without a locked instruction, and other threads read it at any time
+// without stopping the loop. LoopStats::merged() adds up those of all threads.
+class LoopStats {
+public:
+  static constexpr std::size_t max_status = 600;
+
+  // Plain values, added up from one or more LoopStats.
+  struct Snapshot {
+    std::array<std::int64_t, stat_count> values{};
+    std::array<std::uint64_t, max_status> responses{}; // By status code.
+    std::size_t threads{};
+
+    std::int64_t operator[](Stat stat) const {
+      return values[static_cast<std::size_t>(stat)];
+    }
+  };
+
+  LoopStats() {
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+    r.stats.push_back(this);
+  }
+
+  LoopStats(LoopStats const &) = delete;
+  LoopStats &operator=(LoopStats const &) = delete;
+
+  // The counters are kept for merged(). The gauges are gone with the thread.
+  ~LoopStats() {
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+    std::erase(r.stats, this);
+    auto s = snapshot();
+    for (std::size_t i = 0; i < stat_count; i++) {
+      if (!stat_info(static_cast<Stat>(i)).gauge) {
+        r.retired.values[i] += s.values[i];
+      }
+    }
+    for (std::size_t i = 0; i < max_status; i++) {
+      r.retired.responses[i] += s.responses[i];
+    }
+  }
+
+  void add(Stat stat, std::int64_t n = 1) {
+    add(values_[static_cast<std::size_t>(stat)], n);
+  }
+
+  void set(Stat stat, std::int64_t value) {
+    values_[static_cast<std::size_t>(stat)].store(value,
+                                                  std::memory_order_relaxed);
+  }
+
+  void add_response(int status) {
+    if (status >= 0 && status < static_cast<int>(max_status)) {
+      add(responses_[status], 1);
+    }
+  }
+
+  Snapshot snapshot() const {
+    Snapshot s;
+    add_to(s);
+    return s;
+  }
+
+  static Snapshot merged() {
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+    Snapshot s = r.retired;
+    for (auto *stats : r.stats) {
+      stats->add_to(s);
+    }
+    return s;
+  }
+
+  // Makes `s` the stats of the current thread while the scope is alive.
+  struct Scope {
+    explicit Scope(LoopStats &s) : prev_(std::exchange(current_, &s)) {}
+    Scope(Scope const &) = delete;
+    Scope &operator=(Scope const &) = delete;
+    ~Scope() { current_ = prev_; }
+
+  private:
+    LoopStats *prev_;
+  };
+
+  static LoopStats *current() { return current_; }
+
+private:
+  struct Registry {
+    std::mutex mutex;
+    std::vector<LoopStats *> stats;
+    Snapshot retired;
+  };
+
+  static Registry &registry() {
+    static Registry r;
+    return r;
+  }
+
+  template <class T> static void add(std::atomic<T> &v, std::int64_t n) {
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  void add_to(Snapshot &s) const {
+    for (std::size_t i = 0; i < stat_count; i++) {
+      s.values[i] += values_[i].load(std::memory_order_relaxed);
+    }
+    for (std::size_t i = 0; i < max_status; i++) {
+      s.responses[i] += responses_[i].load(std::memory_order_relaxed);
+    }
+    s.threads++;
+  }
+
+  static inline thread_local LoopStats *current_ = nullptr;
+
+  std::array<std::atomic<std::int64_t>, stat_count> values_{};
+  std::array<std::atomic<std::uint64_t>, max_status> responses_{};
+};
+
+// Adds to the stats of the current thread, if it has some.
+inline void count_stat(Stat stat, std::int64_t n = 1) {
+  if (auto s = LoopStats::current()) {
+    s->add(stat, n);
+  }
+}
+
+inline void set_stat(Stat stat, std::int64_t value) {
+  if (auto s = LoopStats::current()) {
+    s->set(stat, value);
+  }
+}
+
+} // namespace coro
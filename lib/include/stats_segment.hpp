@@ -0,0 +1,290 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+
+#include "aio.hpp"
+#include "stats.hpp"
+#include "utility.hpp"
+
+namespace coro {
+
+// The layout of a stats segment: a file that a server maps and writes the
+// LoopStats of its loops to, so that other processes (see corostat) read them
+// without going through its sockets.
+//
+//   StatsSegmentHeader
+//   StatsSegmentSlot[max_loops]
+//
+// The layout only changes with `version`. Each loop writes its own slot, under
+// a seqlock: `seq` is odd while the slot is being written, so a reader copies
+// the slot and retries if `seq` was odd or changed meanwhile. The words are
+// accessed with atomic_ref, so a torn read is detected, never undefined.
+struct StatsSegmentHeader {
+  static constexpr char expected_magic[8] = {'C', 'O', 'R', 'O',
+                                             'S', 'T', 'A', 'T'};
+  static constexpr std::uint32_t current_version = 1;
+
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t header_size;
+  std::uint32_t slot_size;
+  std::uint32_t max_loops;
+  std::uint32_t stat_count; // Stats in the order of the Stat enum.
+  std::uint32_t reserved;
+  std::uint64_t pid;
+  std::uint64_t loops; // Slots in use. Only grows.
+};
+
+struct StatsSegmentSlot {
+  static constexpr std::size_t max_stats = 32;
+  static constexpr std::size_t status_classes = 6; // By status / 100.
+
+  std::uint64_t seq;
+  std::uint64_t time_ns; // steady_clock (CLOCK_MONOTONIC) of the snapshot.
+  std::uint64_t tid;
+  std::int64_t values[max_stats];
+  std::uint64_t responses[status_classes];
+};
+
+static_assert(std::is_trivially_copyable_v<StatsSegmentHeader>);
+static_assert(std::is_trivially_copyable_v<StatsSegmentSlot>);
+static_assert(stat_count <= StatsSegmentSlot::max_stats);
+static_assert(sizeof(StatsSegmentHeader) % 8 == 0);
+
+namespace detail {
+template <class T> T load_word(T const &word, std::memory_order order) {
+  return std::atomic_ref<T>(const_cast<T &>(word)).load(order);
+}
+
+template <class T> void store_word(T &word, T value, std::memory_order order) {
+  std::atomic_ref<T>(word).store(value, order);
+}
+} // namespace detail
+
+// The writing side, owned by the server. The file is created (or truncated)
+// by the constructor and removed by the destructor.
+class StatsSegment {
+public:
+  explicit StatsSegment(std::string path, std::size_t max_loops = 64)
+      : path_(std::move(path)), max_loops_(max_loops) {
+    FileDescriptor fd(
+        CHECK_SYSCALL(::open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)));
+    size_ = sizeof(StatsSegmentHeader) + max_loops * sizeof(StatsSegmentSlot);
+    CHECK_SYSCALL(ftruncate(fd.fd, size_));
+    auto p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd.fd, 0);
+    if (p == MAP_FAILED) {
+      THROW_SYSCALL("mmap");
+    }
+    base_ = static_cast<char *>(p);
+    // The file is zeroed; the header is written last, so a reader never
+    // sees the magic of a segment that isn't ready.
+    auto &h = header();
+    h.version = StatsSegmentHeader::current_version;
+    h.header_size = sizeof(StatsSegmentHeader);
+    h.slot_size = sizeof(StatsSegmentSlot);
+    h.max_loops = max_loops;
+    h.stat_count = stat_count;
+    h.pid = getpid();
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(h.magic, StatsSegmentHeader::expected_magic, sizeof(h.magic));
+  }
+
+  StatsSegment(StatsSegment const &) = delete;
+  StatsSegment &operator=(StatsSegment const &) = delete;
+
+  ~StatsSegment() {
+    munmap(base_, size_);
+    unlink(path_.c_str());
+  }
+
+  // The slot of a loop, which only that loop's thread publishes to.
+  class Slot {
+  public:
+    // Copies `stats` into the slot. Called by the loop every so often (e.g.
+    // every 100 ms), not on every change.
+    void publish(LoopStats const &stats) {
+      using namespace std::chrono;
+      auto s = stats.snapshot();
+      std::uint64_t classes[StatsSegmentSlot::status_classes]{};
+      for (std::size_t i = 0; i < s.responses.size(); i++) {
+        classes[i / 100] += s.responses[i];
+      }
+      std::uint64_t time_ns =
+          duration_cast<nanoseconds>(steady_clock::now().time_since_epoch())
+              .count();
+
+      // The slot is odd for as short as possible: only the stores.
+      auto seq = detail::load_word(slot_->seq, std::memory_order_relaxed);
+      detail::store_word(slot_->seq, seq + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      detail::store_word(slot_->time_ns, time_ns, std::memory_order_relaxed);
+      for (std::size_t i = 0; i < stat_count; i++) {
+        detail::store_word(slot_->values[i], s.values[i],
+                           std::memory_order_relaxed);
+      }
+      for (std::size_t i = 0; i < std::size(classes); i++) {
+        detail::store_word(slot_->responses[i], classes[i],
+                           std::memory_order_relaxed);
+      }
+      detail::store_word(slot_->seq, seq + 2, std::memory_order_release);
+    }
+
+  private:
+    friend class StatsSegment;
+    explicit Slot(StatsSegmentSlot *slot) : slot_(slot) {}
+
+    StatsSegmentSlot *slot_;
+  };
+
+  // Takes the next slot for the calling thread's loop. Thread-safe. Throws
+  // when all are taken.
+  Slot add_loop() {
+    auto &loops = header().loops;
+    std::atomic_ref<std::uint64_t> n(loops);
+    auto i = n.fetch_add(1, std::memory_order_relaxed);
+    if (i >= max_loops_) {
+      n.fetch_sub(1, std::memory_order_relaxed);
+      throw std::runtime_error("no slot left in the stats segment\n" +
+                               SOURCE_LOCATION());
+    }
+    auto slot = reinterpret_cast<StatsSegmentSlot *>(
+        base_ + sizeof(StatsSegmentHeader) + i * sizeof(StatsSegmentSlot));
+    detail::store_word<std::uint64_t>(slot->tid, gettid(),
+                                      std::memory_order_relaxed);
+    return Slot(slot);
+  }
+
+  std::string const &path() const { return path_; }
+
+private:
+  StatsSegmentHeader &header() {
+    return *reinterpret_cast<StatsSegmentHeader *>(base_);
+  }
+
+  std::string path_;
+  std::size_t max_loops_;
+  std::size_t size_{};
+  char *base_{};
+};
+
+// The reading side: maps a segment read-only and takes consistent copies of
+// its slots.
+class StatsSegmentReader {
+public:
+  explicit StatsSegmentReader(std::string const &path) {
+    FileDescriptor fd(CHECK_SYSCALL(::open(path.c_str(), O_RDONLY)));
+    struct stat st;
+    CHECK_SYSCALL(fstat(fd.fd, &st));
+    size_ = st.st_size;
+    if (size_ < sizeof(StatsSegmentHeader)) {
+      throw std::runtime_error("not a stats segment: " + path + "\n" +
+                               SOURCE_LOCATION());
+    }
+    auto p = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd.fd, 0);
+    if (p == MAP_FAILED) {
+      THROW_SYSCALL("mmap");
+    }
+    base_ = static_cast<char const *>(p);
+    auto const &h = header();
+    if (std::memcmp(h.magic, StatsSegmentHeader::expected_magic,
+                    sizeof(h.magic)) != 0) {
+      munmap(const_cast<char *>(base_), size_);
+      throw std::runtime_error("not a stats segment: " + path + "\n" +
+                               SOURCE_LOCATION());
+    }
+    if (h.version != StatsSegmentHeader::current_version ||
+        h.header_size != sizeof(StatsSegmentHeader) ||
+        h.slot_size != sizeof(StatsSegmentSlot) ||
+        size_ < h.header_size + std::size_t{h.max_loops} * h.slot_size) {
+      munmap(const_cast<char *>(base_), size_);
+      throw std::runtime_error("unsupported stats segment version " +
+                               std::to_string(h.version) + ": " + path + "\n" +
+                               SOURCE_LOCATION());
+    }
+  }
+
+  StatsSegmentReader(StatsSegmentReader const &) = delete;
+  StatsSegmentReader &operator=(StatsSegmentReader const &) = delete;
+
+  ~StatsSegmentReader() { munmap(const_cast<char *>(base_), size_); }
+
+  std::uint64_t pid() const { return header().pid; }
+
+  std::uint32_t stat_count() const { return header().stat_count; }
+
+  std::size_t loops() const {
+    auto n = detail::load_word(header().loops, std::memory_order_relaxed);
+    return std::min<std::size_t>(n, header().max_loops);
+  }
+
+  // A copy of slot `i` as it was at one instant, or std::nullopt if it's
+  // being written for more than a second (its loop died while writing it).
+  // The writer may be preempted while the slot is odd, so the reader yields.
+  std::optional<StatsSegmentSlot> read(std::size_t i) const {
+    auto const &src = *reinterpret_cast<StatsSegmentSlot const *>(
+        base_ + sizeof(StatsSegmentHeader) + i * sizeof(StatsSegmentSlot));
+    StatsSegmentSlot dst;
+    std::chrono::steady_clock::time_point deadline{};
+    for (unsigned attempt = 1;; attempt++) {
+      if (attempt % 64 == 0) {
+        auto now = std::chrono::steady_clock::now();
+        if (deadline == decltype(deadline){}) {
+          deadline = now + std::chrono::seconds(1);
+        } else if (now > deadline) {
+          return std::nullopt;
+        }
+        std::this_thread::yield();
+      }
+      auto seq = detail::load_word(src.seq, std::memory_order_acquire);
+      if (seq & 1) {
+        continue; // Being written.
+      }
+      dst.seq = seq;
+      dst.time_ns = detail::load_word(src.time_ns, std::memory_order_relaxed);
+      dst.tid = detail::load_word(src.tid, std::memory_order_relaxed);
+      for (std::size_t j = 0; j < StatsSegmentSlot::max_stats; j++) {
+        dst.values[j] =
+            detail::load_word(src.values[j], std::memory_order_relaxed);
+      }
+      for (std::size_t j = 0; j < StatsSegmentSlot::status_classes; j++) {
+        dst.responses[j] =
+            detail::load_word(src.responses[j], std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (detail::load_word(src.seq, std::memory_order_relaxed) == seq) {
+        return dst;
+      }
+    }
+  }
+
+private:
+  StatsSegmentHeader const &header() const {
+    return *reinterpret_cast<StatsSegmentHeader const *>(base_);
+  }
+
+  std::size_t size_{};
+  char const *base_{};
+};
+
+// Where a server with pid `pid` puts its segment by default.
+inline std::string stats_segment_path(long pid) {
+  return "/dev/shm/coro-" + std::to_string(pid) + ".stats";
+}
+
+} // namespace coro
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace coro {
+
+// The system calls made on the I/O path of the library. They go through the
+// wrappers of coro::sys, which count them on the calling thread, so a test can
+// check how many a request costs without LD_PRELOAD or ptrace.
+enum class Syscall : std::uint8_t {
+  READ,
+  WRITE,
+  WRITEV,
+  SENDFILE,
+  EPOLL_CTL,
+  EPOLL_WAIT,
+  ACCEPT4,
+};
+
+inline constexpr std::size_t syscall_count = 7;
+
+inline std::string_view syscall_name(Syscall call) {
+  static constexpr std::array<std::string_view, syscall_count> names = {
+      "read", "write", "writev", "sendfile", "epoll_ctl", "epoll_wait",
+      "accept4",
+  };
+  return names[static_cast<std::size_t>(call)];
+}
+
+// Calls by kind, indexed by Syscall.
+struct SyscallCounts {
+  std::array<std::uint64_t, syscall_count> calls{};
+
+  std::uint64_t operator[](Syscall call) const {
+    return calls[static_cast<std::size_t>(call)];
+  }
+
+  std::uint64_t total() const {
+    std::uint64_t n = 0;
+    for (auto c : calls) {
+      n += c;
+    }
+    return n;
+  }
+
+  friend SyscallCounts operator-(SyscallCounts const &a,
+                                 SyscallCounts const &b) {
+    SyscallCounts d;
+    for (std::size_t i = 0; i < syscall_count; i++) {
+      d.calls[i] = a.calls[i] - b.calls[i];
+    }
+    return d;
+  }
+};
+
+namespace detail {
+inline SyscallCounts &thread_syscalls() {
+  thread_local SyscallCounts counts;
+  return counts;
+}
+
+inline void count_syscall(Syscall call) {
+  thread_syscalls().calls[static_cast<std::size_t>(call)]++;
+}
+} // namespace detail
+
+// The calls made by the current thread so far. Take the difference of two.
+inline SyscallCounts syscall_counts() { return detail::thread_syscalls(); }
+
+// Same as the functions of the same names, but counted.
+namespace sys {
+inline ssize_t read(int fd, void *buf, std::size_t count) {
+  detail::count_syscall(Syscall::READ);
+  return ::read(fd, buf, count);
+}
+
+inline ssize_t write(int fd, void const *buf, std::size_t count) {
+  detail::count_syscall(Syscall::WRITE);
+  return ::write(fd, buf, count);
+}
+
+inline ssize_t writev(int fd, iovec const *iov, int iovcnt) {
+  detail::count_syscall(Syscall::WRITEV);
+  return ::writev(fd, iov, iovcnt);
+}
+
+inline ssize_t sendfile(int out_fd, int in_fd, off_t *offset,
+                        std::size_t count) {
+  detail::count_syscall(Syscall::SENDFILE);
+  return ::sendfile(out_fd, in_fd, offset, count);
+}
+
+inline int epoll_ctl(int epfd, int op, int fd, epoll_event *event) {
+  detail::count_syscall(Syscall::EPOLL_CTL);
+  return ::epoll_ctl(epfd, op, fd, event);
+}
+
+inline int epoll_wait(int epfd, epoll_event *events, int maxevents,
+                      int timeout) {
+  detail::count_syscall(Syscall::EPOLL_WAIT);
+  return ::epoll_wait(epfd, events, maxevents, timeout);
+}
+
+inline int accept4(int sockfd, sockaddr *addr, socklen_t *addrlen,
+                   int flags) {
+  detail::count_syscall(Syscall::ACCEPT4);
+  return ::accept4(sockfd, addr, addrlen, flags);
+}
+} // namespace sys
+
+} // namespace coro
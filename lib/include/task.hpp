@@ -4,15 +4,23 @@
 #include <chrono>
 #include <concepts>
 #include <coroutine>
+#include <cstddef>
 #include <exception>
+#include <new>
 #include <set>
+#include <source_location>
 #include <sstream>
 #include <stdexcept>
 #include <thread>
 #include <type_traits>
 #include <unordered_set>
+#include <utility>
 #include <variant>
 
+#include "frame_profile.hpp"
+#include "frame_registry.hpp"
+#include "loop_monitor.hpp"
+#include "stats.hpp"
 #include "type_name.hpp"
 #include "utility.hpp"
 
@@ -101,6 +109,91 @@ struct PromiseReturnYield<Derived, T, true> {
 };
 } // namespace detail::promise
 
+namespace detail {
+// Coroutine frames freed on a thread are kept in free lists, one per size
+// class, and given out again to coroutines of the same size. A loop creates the
+// same coroutines for every request, so after the first few requests it stops
+// calling the global operator new for frames.
+//
+// Sizes are rounded up to 64 bytes. Frames larger than 4 KiB are not cached,
+// and at most 256 are kept per size class.
+class FrameCache {
+public:
+  static constexpr std::size_t granularity = 64;
+  static constexpr std::size_t classes = 64;
+  static constexpr std::size_t max_cached = 256;
+
+  static void *allocate(std::size_t size) {
+    auto c = size_class(size);
+    if (c >= classes) {
+      note_frame_allocation(size, true);
+      return ::operator new(size);
+    }
+    auto &list = lists().free[c];
+    if (auto frame = list.head) {
+      list.head = frame->next;
+      --list.count;
+      note_frame_allocation(size, false);
+      return frame;
+    }
+    note_frame_allocation(size, true);
+    return ::operator new((c + 1) * granularity);
+  }
+
+  static void deallocate(void *p, std::size_t size) noexcept {
+    auto c = size_class(size);
+    if (c < classes) {
+      auto &list = lists().free[c];
+      if (list.count < max_cached) {
+        list.head = ::new (p) Frame{list.head};
+        ++list.count;
+        return;
+      }
+    }
+    ::operator delete(p);
+  }
+
+  // How many frames of `size` are cached on this thread.
+  static std::size_t cached(std::size_t size) {
+    auto c = size_class(size);
+    return c < classes ? lists().free[c].count : 0;
+  }
+
+private:
+  struct Frame {
+    Frame *next;
+  };
+
+  struct List {
+    Frame *head{};
+    std::size_t count{};
+  };
+
+  // The frames are freed when the thread exits.
+  struct Lists {
+    List free[classes];
+
+    ~Lists() {
+      for (auto &list : free) {
+        while (list.head) {
+          ::operator delete(std::exchange(list.head, list.head->next));
+        }
+        list.count = 0;
+      }
+    }
+  };
+
+  static std::size_t size_class(std::size_t size) {
+    return size ? (size - 1) / granularity : 0;
+  }
+
+  static Lists &lists() {
+    thread_local Lists lists;
+    return lists;
+  }
+};
+} // namespace detail
+
 template <typename T>
 struct Promise : detail::promise::PromiseReturnYield<Promise<T>, T> {
 
@@ -110,6 +203,16 @@ struct Promise : detail::promise::PromiseReturnYield<Promise<T>, T> {
 
   void unhandled_exception() { result_ = std::current_exception(); }
 
+  // Frames are recycled (see FrameCache). The promises derived from this one
+  // inherit these.
+  static void *operator new(std::size_t size) {
+    return detail::FrameCache::allocate(size);
+  }
+
+  static void operator delete(void *p, std::size_t size) noexcept {
+    detail::FrameCache::deallocate(p, size);
+  }
+
   auto get_return_object() {
     return std::coroutine_handle<Promise>::from_promise(*this);
   }
@@ -132,8 +235,13 @@ struct Promise : detail::promise::PromiseReturnYield<Promise<T>, T> {
     }
   }
 
-  Promise() {
+  // `where` is the coroutine's, see register_frame() and profile_frame(). A
+  // derived promise has to take it the same way, or the location is that of
+  // its constructor.
+  Promise(std::source_location where = std::source_location::current()) {
     auto h = std::coroutine_handle<Promise<T>>::from_promise(*this);
+    register_frame(h.address(), where, &prev_);
+    profile_frame(where);
     // DEBUG() << " Promise(): " << h.address() << "\n";
   }
 
@@ -144,6 +252,9 @@ struct Promise : detail::promise::PromiseReturnYield<Promise<T>, T> {
 };
 
 struct DetachedPromise : Promise<void> {
+  DetachedPromise(std::source_location where = std::source_location::current())
+      : Promise(where) {}
+
   void return_void() {}
 
   std::suspend_always initial_suspend() noexcept { return {}; }
@@ -260,7 +371,8 @@ struct ReturnPreviousTask {
 using Clock = std::chrono::steady_clock;
 
 struct TimedPromise : Promise<void> {
-  TimedPromise() = default;
+  TimedPromise(std::source_location where = std::source_location::current())
+      : Promise(where) {}
 
   TimedPromise(Clock::time_point expire) : expire_(expire) {}
 
@@ -333,13 +445,16 @@ struct TimedScheduler {
   // Returns the time we still have to wait for the next task to be ready.
   // Returns std::nullopt if there's no task to wait.
   std::optional<Clock::duration> run() {
+    set_stat(Stat::TIMERS, timed_coros_.size());
+    set_stat(Stat::READY_COROS, ready_coros_.size());
+    auto monitor = LoopMonitor::current();
     // There's no entry point, so the task must be put by other functions.
     while (!ready_coros_.empty() || !timed_coros_.empty()) {
       while (!ready_coros_.empty()) {
         auto it = ready_coros_.begin();
         auto coro = *it;
         ready_coros_.erase(it);
-        coro.resume();
+        resume_monitored(monitor, coro);
       }
       while (!timed_coros_.empty()) {
         auto it = timed_coros_.begin();
@@ -348,7 +463,8 @@ struct TimedScheduler {
         auto now = Clock::now();
         if (promise.expire_ <= now) {
           auto coro = *it;
-          coro.resume();
+          note_frame_wait(coro, {});
+          resume_monitored(monitor, coro);
           // TimedPromise is special and is only created by sleep functions.
           // Their coroutines do not contain co_yield, and we can assume that
           // when coro.resume() returns, coro is destroyed. NOTE: when a
@@ -380,6 +496,8 @@ struct TimedScheduler {
 };
 
 template <typename T> Promise<T>::~Promise() {
+  auto h = std::coroutine_handle<Promise<T>>::from_promise(*this);
+  unregister_frame(h.address());
   // auto h = std::coroutine_handle<Promise<T>>::from_promise(*this);
   // DEBUG() << "~Promise(): " << h.address() << "\n";
   // auto &sched = Scheduler::get();
@@ -411,6 +529,7 @@ struct SleepAwaiter {
     promise.expire_ = expire_;
     promise.tree_ = &scheduler_.timed_coros_;
     scheduler_.add_task(h);
+    note_frame_wait(h, FrameWait::timer(expire_));
     // return std::noop_coroutine();
 
     // UB: A segmentation fault can be caused by erasing the frame first, then
@@ -452,7 +571,8 @@ struct WhenAllAwaiter {
   bool await_ready() const noexcept { return tasks_.empty(); }
 
   std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept {
-    group_.prev_ = h;
+    // A task that throws before suspending would resume h while it's still
+    // being suspended here, so prev_ is only set once they're all started.
     for (auto &task : tasks_.subspan(1)) {
       // TODO: resume is not stackless!
       task.coro_.resume();
@@ -462,6 +582,10 @@ struct WhenAllAwaiter {
       //
       // Scheduler::get().ready_coros_.insert(task.coro_);
     }
+    if (group_.exception_) {
+      return h;
+    }
+    group_.prev_ = h;
     return tasks_[0].coro_;
   }
 
@@ -537,12 +661,17 @@ struct WhenAnyAwaiter {
   bool await_ready() const noexcept { return tasks_.empty(); }
 
   std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept {
-    group_.prev_ = h;
+    // A task that finishes without suspending would resume h while it's still
+    // being suspended here, so prev_ is only set once they're all started.
     for (auto &task : tasks_.subspan(1)) {
       // TODO: resume is not stackless!
       task.coro_.resume();
       // Scheduler::get().ready_coros_.insert(task.coro_);
     }
+    if (group_.index != WhenAnyTaskGroup::invalid_index || group_.exception_) {
+      return h;
+    }
+    group_.prev_ = h;
     return tasks_[0].coro_;
   }
 
@@ -1,8 +1,22 @@
+#include <array>
+#include <string>
+
 #include "HttpStatusCodes_C++11.h"
 #include "http.hpp"
 
 namespace coro {
-std::string HTTPResponse::status_message(int status) {
-  return HttpStatus::reasonPhrase(status);
+// The phrases are made once, so writing a response doesn't allocate them.
+std::string_view HTTPResponse::status_message(int status) {
+  static auto const phrases = [] {
+    std::array<std::string, 600> a;
+    for (int i = 0; i < static_cast<int>(a.size()); i++) {
+      a[i] = HttpStatus::reasonPhrase(i);
+    }
+    return a;
+  }();
+  if (status < 0 || status >= static_cast<int>(phrases.size())) {
+    return {};
+  }
+  return phrases[status];
 }
-} // namespace coro
\ No newline at end of file
+} // namespace coro
@@ -0,0 +1,201 @@
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <format>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "access_log.hpp"
+#include "connection.hpp"
+#include "default_headers.hpp"
+#include "spsc_ring.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+namespace {
+// A file that's removed at the end of the test.
+struct TempFile {
+  TempFile() {
+    char name[] = "/tmp/access_log_XXXXXX";
+    CHECK_SYSCALL(close(CHECK_SYSCALL(mkstemp(name))));
+    path = name;
+  }
+
+  ~TempFile() { unlink(path.c_str()); }
+
+  std::vector<std::string> lines() const {
+    std::ifstream in(path);
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(in, line);) {
+      lines.push_back(line);
+    }
+    return lines;
+  }
+
+  std::string path;
+};
+
+AccessRecord record(std::string_view uri, int status = 200) {
+  return AccessRecord::make("GET", uri, status, 41us);
+}
+} // namespace
+
+TEST(SpscRingTest, WrapsAround) {
+  SpscRing<int> ring(3);
+  EXPECT_EQ(ring.capacity(), 4);
+
+  std::vector<int> got;
+  auto take = [&](int v) { got.push_back(v); };
+  int next = 0;
+  for (int round = 0; round < 10; round++) {
+    while (ring.try_push(next)) {
+      next++;
+    }
+    EXPECT_EQ(ring.size(), 4);
+    EXPECT_EQ(ring.consume(take, 3), 3);
+  }
+  EXPECT_EQ(ring.consume(take), 1);
+  EXPECT_EQ(ring.consume(take), 0);
+  ASSERT_EQ(got.size(), next);
+  for (int i = 0; i < next; i++) {
+    EXPECT_EQ(got[i], i);
+  }
+}
+
+TEST(SpscRingTest, AcrossThreads) {
+  constexpr int n = 10000;
+  SpscRing<int> ring(64);
+  std::thread producer([&] {
+    for (int i = 0; i < n;) {
+      if (ring.try_push(i)) {
+        i++;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  });
+  int expected = 0;
+  bool ordered = true;
+  while (expected < n) {
+    if (!ring.consume([&](int v) { ordered &= v == expected++; })) {
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  EXPECT_TRUE(ordered);
+}
+
+TEST(AccessLogTest, FormatsRecords) {
+  TempFile file;
+  {
+    AccessLog log(file.path);
+    auto &ring = log.add_ring();
+    EXPECT_TRUE(ring.push(record("/home")));
+    EXPECT_TRUE(ring.push(record("/"s + std::string(200, 'a'), 404)));
+    log.flush();
+    EXPECT_EQ(log.written(), 2);
+  }
+
+  auto lines = file.lines();
+  ASSERT_EQ(lines.size(), 2);
+  // 2026-10-17T07:38:01.123Z GET /home 200 41us
+  EXPECT_EQ(lines[0].size(), 24 + " GET /home 200 41us"sv.size()) << lines[0];
+  EXPECT_EQ(lines[0][10], 'T') << lines[0];
+  EXPECT_TRUE(lines[0].ends_with("Z GET /home 200 41us")) << lines[0];
+  EXPECT_TRUE(lines[1].ends_with(
+      std::string(AccessRecord::max_uri - 1, 'a') + "... 404 41us"))
+      << lines[1];
+}
+
+TEST(AccessLogTest, CountsDrops) {
+  TempFile file;
+  LoopStats stats;
+  LoopStats::Scope scope(stats);
+  // The writer only runs when asked.
+  AccessLog log(file.path, {.ring_capacity = 4, .flush_interval = 1h});
+  auto &ring = log.add_ring();
+  int pushed = 0;
+  for (int i = 0; i < 10; i++) {
+    pushed += ring.push(record("/home"));
+  }
+  EXPECT_EQ(pushed, 4);
+  EXPECT_EQ(ring.dropped(), 6);
+  EXPECT_EQ(log.dropped(), 6);
+  EXPECT_EQ(stats.snapshot()[Stat::ACCESS_LOG_DROPS], 6);
+
+  log.flush();
+  EXPECT_EQ(log.written(), 4);
+  EXPECT_TRUE(ring.push(record("/home")));
+  log.flush();
+  EXPECT_EQ(file.lines().size(), 5);
+  EXPECT_EQ(log.write_errors(), 0);
+}
+
+TEST(AccessLogTest, LoopsLogConcurrently) {
+  constexpr int threads = 4;
+  constexpr int per_thread = 20000;
+  TempFile file;
+  AccessLog log(file.path, {.ring_capacity = 256, .flush_interval = 1ms});
+  std::vector<std::thread> loops;
+  for (int t = 0; t < threads; t++) {
+    loops.emplace_back([&log, t] {
+      auto &ring = log.add_ring();
+      AccessLog::Scope scope(ring);
+      auto uri = std::format("/loop/{}", t);
+      for (int i = 0; i < per_thread; i++) {
+        AccessLog::current()->push(record(uri));
+      }
+    });
+  }
+  for (auto &t : loops) {
+    t.join();
+  }
+  log.flush();
+
+  EXPECT_EQ(log.written() + log.dropped(), threads * per_thread);
+  EXPECT_EQ(file.lines().size(), log.written());
+}
+
+TEST(AccessLogTest, ServeConnectionLogsRequests) {
+  HTTPRouter router;
+  router.route_static(HTTPMethod::GET, "/home",
+                      HTTPResponse{.status = 200, .body = "home"});
+
+  TempFile file;
+  AccessLog log(file.path);
+  AccessLog::Scope scope(log.add_ring());
+  {
+    EpollScheduler sched;
+    HeaderTemplate headers;
+    HeaderTemplate::Scope headers_scope(headers);
+    int fds[2];
+    CHECK_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    AsyncFile client(fds[1]);
+    AsyncFileBuffer server(sched, AsyncFile(fds[0]));
+    auto task = serve_connection(sched, server, router);
+    task.coro_.resume();
+
+    auto request = "GET /home HTTP/1.1\r\nHost: a\r\n\r\n"
+                   "POST /nothing?a=1 HTTP/1.1\r\nHost: a\r\n"
+                   "Connection: close\r\n\r\n"sv;
+    ASSERT_EQ(write(client.fd_, request.data(), request.size()),
+              request.size());
+    while (!task.coro_.done()) {
+      sched.run(1s);
+    }
+    task.result();
+  }
+  log.flush();
+
+  auto lines = file.lines();
+  ASSERT_EQ(lines.size(), 2);
+  EXPECT_TRUE(lines[0].contains("Z GET /home 200 ")) << lines[0];
+  EXPECT_TRUE(lines[1].contains("Z POST /nothing?a=1 404 ")) << lines[1];
+  EXPECT_TRUE(lines[1].ends_with("us")) << lines[1];
+}
@@ -0,0 +1,90 @@
+#include <gtest/gtest.h>
+
+#include <netinet/in.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <thread>
+
+#include "affinity.hpp"
+
+using namespace coro;
+
+TEST(AffinityTest, PinsToACpu) {
+  auto cpus = allowed_cpus();
+  ASSERT_FALSE(cpus.empty());
+  // In a thread of its own, so the other tests aren't pinned.
+  std::thread([&] {
+    pin_to_cpu(cpus.back());
+    EXPECT_EQ(sched_getcpu(), cpus.back());
+    EXPECT_EQ(allowed_cpus(), std::vector{cpus.back()});
+    if (int node = numa_node_of_cpu(cpus.back()); node >= 0) {
+      // Refused in some containers, but then it mustn't throw.
+      prefer_memory_of_node(node);
+    }
+  }).join();
+  EXPECT_EQ(allowed_cpus(), cpus);
+}
+
+TEST(AffinityTest, NoNodeOfAMissingCpu) {
+  EXPECT_EQ(numa_node_of_cpu(CPU_SETSIZE), -1);
+}
+
+TEST(AffinityTest, SteersConnectionsByCpu) {
+  auto socks = listen_by_cpu(SocketAddress(in_addr{htonl(INADDR_LOOPBACK)}, 0),
+                             2, 16);
+  ASSERT_EQ(socks.size(), 2);
+  sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  CHECK_SYSCALL(getsockname(socks[0].fd_, (sockaddr *)&addr, &len));
+  sockaddr_in other;
+  CHECK_SYSCALL(getsockname(socks[1].fd_, (sockaddr *)&other, &len));
+  EXPECT_EQ(addr.sin_port, other.sin_port);
+
+  for (int i = 0; i < 8; i++) {
+    FileDescriptor client(CHECK_SYSCALL(socket(AF_INET, SOCK_STREAM, 0)));
+    CHECK_SYSCALL(connect(client.fd, (sockaddr *)&addr, sizeof(addr)));
+    // Only the socket of the CPU has it.
+    int accepted = 0;
+    for (int j = 0; j < 2; j++) {
+      int conn = accept4(socks[j].fd_, nullptr, nullptr, SOCK_CLOEXEC);
+      if (conn == -1) {
+        EXPECT_TRUE(errno == EAGAIN || errno == EWOULDBLOCK);
+        continue;
+      }
+      FileDescriptor guard(conn);
+      accepted++;
+      auto cpu = incoming_cpu(conn);
+      ASSERT_GE(cpu, 0);
+      EXPECT_EQ(cpu % 2, j);
+    }
+    EXPECT_EQ(accepted, 1);
+  }
+}
+
+TEST(AffinityTest, JoinsAListeningSocket) {
+  AsyncFile first(CHECK_SYSCALL(socket(AF_INET, SOCK_STREAM, 0)));
+  int one = 1;
+  CHECK_SYSCALL(
+      setsockopt(first.fd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)));
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  CHECK_SYSCALL(bind(first.fd_, (sockaddr *)&addr, sizeof(addr)));
+  CHECK_SYSCALL(listen(first.fd_, 16));
+  socklen_t len = sizeof(addr);
+  CHECK_SYSCALL(getsockname(first.fd_, (sockaddr *)&addr, &len));
+  int fd = first.fd_;
+
+  // A connection made before the group exists stays in the first backlog.
+  FileDescriptor early(CHECK_SYSCALL(socket(AF_INET, SOCK_STREAM, 0)));
+  CHECK_SYSCALL(connect(early.fd, (sockaddr *)&addr, sizeof(addr)));
+
+  auto socks = listen_by_cpu(std::move(first), 2, 16);
+  ASSERT_EQ(socks.size(), 2);
+  EXPECT_EQ(socks[0].fd_, fd);
+  sockaddr_in other;
+  CHECK_SYSCALL(getsockname(socks[1].fd_, (sockaddr *)&other, &len));
+  EXPECT_EQ(addr.sin_port, other.sin_port);
+  FileDescriptor conn(
+      CHECK_SYSCALL(accept4(socks[0].fd_, nullptr, nullptr, SOCK_CLOEXEC)));
+}
@@ -0,0 +1,227 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <optional>
+#include <signal.h>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "balancer.hpp"
+#include "connection.hpp"
+#include "default_headers.hpp"
+#include "prefork.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+namespace {
+constexpr std::string_view home_request = "GET /home HTTP/1.1\r\n"
+                                          "Host: localhost:9000\r\n"
+                                          "\r\n";
+constexpr std::string_view home_body = "<h1>Hello, World!</h1>";
+
+HTTPRouter home_router() {
+  HTTPRouter router;
+  router.route_static(HTTPMethod::GET, "/home",
+                      HTTPResponse{
+                          .status = 200,
+                          .headers = {{"Content-Type", "text/html"}},
+                          .body = home_body,
+                      });
+  return router;
+}
+
+// A loop driven by hand, with the scopes of its stats and balancer view.
+struct TestLoop {
+  TestLoop(Balancer &balancer, int index) : view(balancer.loop(index)) {}
+
+  struct Scopes {
+    explicit Scopes(TestLoop &loop)
+        : headers(loop.headers), stats(loop.stats), balancer(loop.view) {}
+
+    HeaderTemplate::Scope headers;
+    LoopStats::Scope stats;
+    Balancer::Scope balancer;
+  };
+
+  // Starts a coroutine in the scope of the loop.
+  void spawn(Task<> task) {
+    Scopes scopes(*this);
+    task.coro_.resume();
+    tasks.push_back(std::move(task));
+  }
+
+  void run() {
+    Scopes scopes(*this);
+    sched.run(0ms);
+  }
+
+  EpollScheduler sched;
+  HeaderTemplate headers;
+  LoopStats stats;
+  Balancer::Loop view;
+  ConnectionPool pool;
+  std::vector<Task<>> tasks;
+};
+
+// Serves the connections moved to `loop`.
+Task<> serve_migrated(TestLoop &loop, HTTPRouter const &router) {
+  while (true) {
+    auto conn = co_await loop.view.accept(loop.sched);
+    loop.spawn([](TestLoop &loop, MigratedConnection conn,
+                  HTTPRouter const &router) -> Task<> {
+      try {
+        co_await serve_connection(loop.sched, loop.pool, std::move(conn),
+                                  router);
+      } catch (EOFException &) {
+      }
+    }(loop, std::move(conn), router));
+  }
+}
+
+// Sends a request on `client` and runs the loops until its response is in.
+bool round_trip(int client, std::vector<TestLoop *> loops) {
+  if (::write(client, home_request.data(), home_request.size()) !=
+      static_cast<ssize_t>(home_request.size())) {
+    return false;
+  }
+  std::string response;
+  for (int i = 0; i < 1000 && !response.ends_with(home_body); i++) {
+    for (auto loop : loops) {
+      loop->run();
+    }
+    char buf[1024];
+    auto n = ::read(client, buf, sizeof(buf));
+    if (n > 0) {
+      response.append(buf, n);
+    }
+  }
+  return response.starts_with("HTTP/1.1 200") &&
+         response.ends_with(home_body);
+}
+} // namespace
+
+TEST(BalancerTest, MovesAConnectionWithItsUnreadBytes) {
+  Balancer balancer(2);
+  auto from = balancer.loop(0);
+  auto to = balancer.loop(1);
+  from.add_connections(2);
+
+  int fds[2];
+  CHECK_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  AsyncFile client(fds[1]);
+  EpollScheduler sched;
+  AsyncFileBuffer conn(sched, AsyncFile(fds[0]));
+  ASSERT_EQ(::write(client.fd_, "GET /next", 9), 9);
+  auto fill = conn.fill();
+  sched.run(fill);
+
+  ASSERT_TRUE(from.migrate(conn));
+  EXPECT_EQ(conn.file_.fd_, -1);
+  EXPECT_EQ(from.migrated(), 1);
+  auto accept = to.accept(sched);
+  sched.run(accept);
+  auto moved = std::move(accept.result());
+  EXPECT_EQ(moved.unread, "GET /next");
+  ASSERT_EQ(::write(moved.file.fd_, "ok", 2), 2);
+  char buf[2];
+  ASSERT_EQ(::read(client.fd_, buf, 2), 2);
+  EXPECT_EQ(std::string_view(buf, 2), "ok");
+}
+
+TEST(BalancerTest, KeepsConnectionsWithoutAGap) {
+  Balancer balancer(2);
+  auto a = balancer.loop(0);
+  auto b = balancer.loop(1);
+  a.add_connections(3);
+  b.add_connections(2);
+
+  int fds[2];
+  CHECK_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  AsyncFile client(fds[1]);
+  EpollScheduler sched;
+  AsyncFileBuffer conn(sched, AsyncFile(fds[0]));
+  EXPECT_FALSE(a.migrate(conn));
+  EXPECT_NE(conn.file_.fd_, -1);
+}
+
+TEST(BalancerTest, RespawnedWorkerStartsFromZero) {
+  Balancer balancer(1);
+  int fds[2];
+  CHECK_SYSCALL(pipe(fds));
+  pid_t pid = CHECK_SYSCALL(fork());
+  if (pid == 0) {
+    close(fds[0]);
+    Prefork master({.workers = 1,
+                    .pin_workers = false,
+                    .respawn_delay = 1ms,
+                    .on_respawn = [&](int index) { balancer.reset(index); }},
+                   [&](int index) {
+                     // Reports what it finds, then crashes with connections.
+                     char seen = balancer.connections(index);
+                     [[maybe_unused]] auto ret = write(fds[1], &seen, 1);
+                     balancer.loop(index).add_connections(3);
+                     return 1;
+                   });
+    _exit(master.run());
+  }
+  close(fds[1]);
+  char seen[2];
+  ASSERT_EQ(read(fds[0], &seen[0], 1), 1);
+  ASSERT_EQ(read(fds[0], &seen[1], 1), 1);
+  EXPECT_EQ(seen[0], 0);
+  EXPECT_EQ(seen[1], 0);
+  kill(pid, SIGTERM);
+  CHECK_SYSCALL(waitpid(pid, nullptr, 0));
+  close(fds[0]);
+}
+
+TEST(BalancerTest, EvensOutServedConnections) {
+  auto router = home_router();
+  // Only the first plan of a loop counts here.
+  Balancer balancer(2, {.interval = 1h});
+  TestLoop busy(balancer, 0), idle(balancer, 1);
+  idle.spawn(serve_migrated(idle, router));
+
+  // All the connections land on one loop.
+  std::vector<AsyncFile> clients;
+  for (int i = 0; i < 8; i++) {
+    int fds[2];
+    CHECK_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    clients.emplace_back(fds[1]);
+    busy.spawn([](TestLoop &loop, AsyncFile file,
+                  HTTPRouter const &router) -> Task<> {
+      try {
+        co_await serve_connection(loop.sched, loop.pool, std::move(file),
+                                  router);
+      } catch (EOFException &) {
+      }
+    }(busy, AsyncFile(fds[0]), router));
+  }
+  EXPECT_EQ(balancer.connections(0), 8);
+  EXPECT_EQ(balancer.connections(1), 0);
+
+  for (int round = 0; round < 10; round++) {
+    for (auto &client : clients) {
+      ASSERT_TRUE(round_trip(client.fd_, {&busy, &idle}));
+    }
+  }
+  EXPECT_EQ(balancer.connections(0), 4);
+  EXPECT_EQ(balancer.connections(1), 4);
+  EXPECT_EQ(busy.stats.snapshot()[Stat::MIGRATIONS], 4);
+  // Each moved connection served its later requests on the other loop.
+  EXPECT_EQ(busy.stats.snapshot()[Stat::REQUESTS], 4 * 10 + 4 * 1);
+  EXPECT_EQ(idle.stats.snapshot()[Stat::REQUESTS], 4 * 9);
+
+  clients.clear();
+  for (int i = 0; i < 10; i++) {
+    busy.run();
+    idle.run();
+  }
+  EXPECT_EQ(balancer.connections(0), 0);
+  EXPECT_EQ(balancer.connections(1), 0);
+}
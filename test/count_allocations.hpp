@@ -0,0 +1,42 @@
+#pragma once
+
+// Replaces the global operator new and delete to count the allocations made on
+// this thread while `counting` is set. Include it from the one translation unit
+// of a test or a benchmark.
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace {
+thread_local bool counting = false;
+thread_local std::size_t allocations = 0;
+} // namespace
+
+// Every form allocates with malloc() and frees with free(). Once they're
+// inlined, GCC pairs the free() with the new expression and would warn that
+// they don't match.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void *operator new(std::size_t size) {
+  if (counting) {
+    ++allocations;
+  }
+  if (auto p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+void operator delete[](void *p) noexcept { std::free(p); }
+
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+
+#pragma GCC diagnostic pop
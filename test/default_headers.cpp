@@ -0,0 +1,97 @@
+#include <gtest/gtest.h>
+
+#include <sys/socket.h>
+#include <thread>
+
+#include "default_headers.hpp"
+#include "http.hpp"
+
+using namespace coro;
+
+TEST(HeaderTemplateTest, RefreshInPlace) {
+  HeaderTemplate t;
+  t.refresh(784111777);
+  EXPECT_EQ(t.bytes(), "Server: coro\r\n"
+                       "Connection: close\r\n"
+                       "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n");
+  auto data = t.bytes().data();
+  t.refresh(784111778);
+  EXPECT_EQ(t.date(), "Sun, 06 Nov 1994 08:49:38 GMT");
+  EXPECT_EQ(t.bytes().data(), data);
+
+  HeaderTemplate bare({.server = "", .connection = ""});
+  bare.refresh(784111777);
+  EXPECT_EQ(bare.bytes(), "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n");
+}
+
+TEST(HeaderTemplateTest, OnePerThread) {
+  EXPECT_EQ(HeaderTemplate::current(), nullptr);
+  EXPECT_TRUE(default_response_headers().starts_with("Server: coro\r\n"));
+
+  // Each loop has its own template and refreshes it on its own thread.
+  auto loop = [](std::string server, std::string &seen) {
+    HeaderTemplate t({.server = server});
+    HeaderTemplate::Scope scope(t);
+    for (int i = 0; i < 1000; i++) {
+      t.refresh(784111777 + i);
+      ASSERT_EQ(t.date(), format_http_date(784111777 + i));
+    }
+    ASSERT_EQ(default_response_headers().data(), t.bytes().data());
+    seen = default_response_headers();
+  };
+  std::string a, b;
+  std::thread t1(loop, "a", std::ref(a));
+  std::thread t2(loop, "b", std::ref(b));
+  t1.join();
+  t2.join();
+  EXPECT_TRUE(a.starts_with("Server: a\r\n")) << a;
+  EXPECT_TRUE(b.starts_with("Server: b\r\n")) << b;
+  EXPECT_EQ(HeaderTemplate::current(), nullptr);
+}
+
+TEST(HeaderTemplateTest, AppendedToResponses) {
+  HeaderTemplate t;
+  t.refresh(784111777);
+  HTTPResponse res{
+      .status = 200,
+      .headers = {{"Date", "whenever"}, {"X-Id", "1"}},
+      .body = "hi",
+  };
+  auto expected = "HTTP/1.1 200 OK\r\n"
+                  "X-Id: 1\r\n"
+                  "Content-Length: 2\r\n"
+                  "Server: coro\r\n"
+                  "Connection: close\r\n"
+                  "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+                  "\r\n"
+                  "hi";
+  EXPECT_EQ(res.to_string(t.bytes()), expected);
+
+  // Bytes kept by a cache don't have them; they're put in when written.
+  HTTPResponse cached;
+  cached.serialized = std::make_shared<std::string const>(
+      "HTTP/1.1 200 OK\r\nX-Id: 1\r\nContent-Length: 2\r\n\r\nhi");
+  EXPECT_EQ(cached.to_string(t.bytes()), expected);
+
+  int fds[2];
+  CHECK_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  EpollScheduler sched;
+  AsyncFileBuffer out(sched, AsyncFile(fds[0]));
+  AsyncFile in(fds[1]);
+  HeaderTemplate::Scope scope(t);
+  auto send = [&]() -> Task<> {
+    co_await res.write_to(out);
+    co_await cached.write_to(out);
+    co_await out.flush();
+  };
+  auto task = send();
+  task.coro_.resume();
+  while (!task.coro_.done()) {
+    sched.run();
+  }
+  task.result();
+
+  std::string received(2 * std::string_view(expected).size(), '\0');
+  ASSERT_EQ(read(in.fd_, received.data(), received.size()), received.size());
+  EXPECT_EQ(received, std::string(expected) + expected);
+}
@@ -0,0 +1,122 @@
+#include <gtest/gtest.h>
+
+#include "cache.hpp"
+#include "etag.hpp"
+#include "hash.hpp"
+#include "http_date.hpp"
+
+using namespace coro;
+
+TEST(HashTest, XXHash64) {
+  EXPECT_EQ(xxhash64(""), 0xef46db3751d8e999ULL);
+  EXPECT_EQ(xxhash64("a"), 0xd24ec4f1a98c6e5bULL);
+  EXPECT_EQ(xxhash64("abc"), 0x44bc2cf5ad770999ULL);
+  EXPECT_EQ(xxhash64("Nobody inspects the spammish repetition"),
+            0xfbcea83c8a378bf1ULL);
+  std::string s;
+  for (int i = 0; i < 3; i++) {
+    for (int c = 0; c < 256; c++) {
+      s.push_back(static_cast<char>(c));
+    }
+  }
+  EXPECT_EQ(xxhash64(s, 7), 0xb1e10f6c5294cd6bULL);
+}
+
+TEST(HTTPDateTest, FormatAndParse) {
+  EXPECT_EQ(format_http_date(784111777), "Sun, 06 Nov 1994 08:49:37 GMT");
+  EXPECT_EQ(parse_http_date("Sun, 06 Nov 1994 08:49:37 GMT"), 784111777);
+  // Obsolete formats are not supported.
+  EXPECT_FALSE(parse_http_date("Sunday, 06-Nov-94 08:49:37 GMT"));
+  EXPECT_FALSE(parse_http_date("Sun Nov  6 08:49:37 1994"));
+  EXPECT_FALSE(parse_http_date("Sun, 06 Foo 1994 08:49:37 GMT"));
+}
+
+TEST(ETagTest, MakeAndCompare) {
+  auto strong = make_etag("hello");
+  auto weak = make_etag("hello", true);
+  EXPECT_EQ(strong, "\"26c7827d889f6da3\"");
+  EXPECT_EQ(weak, "W/" + strong);
+  EXPECT_TRUE(etag_weak_equal(strong, weak));
+  EXPECT_NE(strong, make_etag("hello!"));
+
+  EXPECT_TRUE(etag_list_matches("*", strong));
+  EXPECT_TRUE(etag_list_matches("\"x\", " + weak + " ,\"y\"", strong));
+  EXPECT_FALSE(etag_list_matches("\"x\", \"y\"", strong));
+}
+
+TEST(ETagTest, Preconditions) {
+  HTTPRequest req{.method = "GET"};
+  auto etag = make_etag("body");
+  auto date = "Sun, 06 Nov 1994 08:49:37 GMT";
+
+  EXPECT_EQ(evaluate_preconditions(req, etag, date), 0);
+
+  req.headers["If-None-Match"] = etag;
+  EXPECT_EQ(evaluate_preconditions(req, etag, date), 304);
+  req.method = "PUT";
+  EXPECT_EQ(evaluate_preconditions(req, etag, date), 412);
+
+  // If-None-Match takes precedence over If-Modified-Since.
+  req.method = "GET";
+  req.headers["If-None-Match"] = "\"other\"";
+  req.headers["If-Modified-Since"] = date;
+  EXPECT_EQ(evaluate_preconditions(req, etag, date), 0);
+
+  req.headers.erase("If-None-Match");
+  EXPECT_EQ(evaluate_preconditions(req, etag, date), 304);
+  EXPECT_EQ(evaluate_preconditions(req, etag, "Sun, 06 Nov 1994 08:49:38 GMT"),
+            0);
+  req.headers["If-Modified-Since"] = "yesterday";
+  EXPECT_EQ(evaluate_preconditions(req, etag, date), 0);
+}
+
+TEST(ETagTest, EvaluateConditional) {
+  HTTPResponse res{.status = 200,
+                   .headers = {{"Content-Type", "text/html"},
+                               {"Cache-Control", "max-age=60"}},
+                   .body = "<h1>Hello</h1>"};
+  add_etag(res);
+  auto etag = res.headers.at("ETag");
+
+  HTTPRequest req{.method = "GET", .headers = {{"If-None-Match", std::pmr::string(etag)}}};
+  ASSERT_TRUE(evaluate_conditional(req, res));
+  EXPECT_EQ(res.status, 304);
+  EXPECT_TRUE(res.body.empty());
+  EXPECT_EQ(res.headers.at("ETag"), etag);
+  EXPECT_EQ(res.headers.at("Cache-Control"), "max-age=60");
+  EXPECT_FALSE(res.headers.contains("Content-Type"));
+
+  // Not a 200: left alone.
+  HTTPResponse not_found{.status = 404, .headers = {{"ETag", etag}}};
+  EXPECT_FALSE(evaluate_conditional(req, not_found));
+}
+
+TEST(ETagTest, CachedResourceAnswers304) {
+  int calls = 0;
+  ResponseCache cache([&](HTTPRequest) -> Task<HTTPResponse> {
+    ++calls;
+    co_return HTTPResponse{.status = 200, .body = "<h1>Hello</h1>"};
+  });
+  auto run = [](Task<HTTPResponse> t) {
+    t.coro_.resume();
+    return t.result();
+  };
+
+  auto res = run(cache.handle(HTTPRequest{.method = "GET", .uri = "/"}));
+  auto etag = make_etag("<h1>Hello</h1>");
+  EXPECT_TRUE(res.to_string().contains("ETag: " + etag + "\r\n"));
+
+  HTTPRequest req{.method = "GET", .uri = "/",
+                  .headers = {{"If-None-Match", std::pmr::string(etag)}}};
+  auto res304 = run(cache.handle(req));
+  EXPECT_EQ(res304.status, 304);
+  EXPECT_EQ(res304.to_string(),
+            "HTTP/1.1 304 Not Modified\r\nETag: " + etag + "\r\n\r\n");
+  EXPECT_EQ(cache.stats().not_modified, 1);
+  EXPECT_EQ(calls, 1);
+
+  // A conditional miss is also answered with 304.
+  cache.clear();
+  EXPECT_EQ(run(cache.handle(req)).status, 304);
+  EXPECT_EQ(calls, 2);
+}
@@ -0,0 +1,79 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+
+#include "frame_profile.hpp"
+#include "task.hpp"
+
+using namespace coro;
+
+namespace {
+Task<int> leaf(int i) { co_return i; }
+
+Task<int> sum_leaves(int n) {
+  int sum = 0;
+  for (int i = 0; i < n; i++) {
+    sum += co_await leaf(i);
+  }
+  co_return sum;
+}
+
+int run_sum_leaves(int n) {
+  auto task = sum_leaves(n);
+  task.coro_.resume();
+  EXPECT_TRUE(task.coro_.done());
+  return task.result();
+}
+
+FrameSite const *find_site(FrameProfile const &profile, std::string_view f) {
+  auto it = std::ranges::find_if(profile.sites, [&](auto const &site) {
+    return site.function.contains(f);
+  });
+  return it == profile.sites.end() ? nullptr : &*it;
+}
+} // namespace
+
+TEST(FrameProfileTest, RanksFunctionsByFrames) {
+  reset_frame_profile();
+  EXPECT_EQ(run_sum_leaves(100), 4950);
+
+  auto profile = frame_profile();
+  ASSERT_EQ(profile.sites.size(), 2);
+  EXPECT_EQ(profile.frames(), 101);
+  auto const &top = profile.sites[0];
+  EXPECT_TRUE(top.function.contains("leaf(int)")) << top.function;
+  EXPECT_TRUE(top.file.ends_with("frame_profile.cpp")) << top.file;
+  EXPECT_EQ(top.frames, 100);
+  EXPECT_GT(top.bytes, 0);
+  EXPECT_EQ(top.bytes, top.frames * top.max_size);
+  // The frames after the first come from the FrameCache.
+  EXPECT_LE(top.allocations, 1);
+  EXPECT_TRUE(profile.sites[1].function.contains("sum_leaves"));
+  EXPECT_EQ(profile.sites[1].frames, 1);
+
+  auto text = format_frame_profile(profile, 1);
+  EXPECT_TRUE(text.starts_with("101 frames in ")) << text;
+  EXPECT_TRUE(text.contains("leaf(int)")) << text;
+  EXPECT_FALSE(text.contains("sum_leaves")) << text;
+
+  reset_frame_profile();
+  EXPECT_EQ(frame_profile().frames(), 0);
+}
+
+TEST(FrameProfileTest, MergesThreads) {
+  reset_frame_profile();
+  run_sum_leaves(10);
+  std::thread([] { run_sum_leaves(20); }).join();
+
+  // The exited thread's frames are kept.
+  auto profile = frame_profile();
+  auto site = find_site(profile, "leaf(int)");
+  ASSERT_NE(site, nullptr);
+  EXPECT_EQ(site->frames, 30);
+  site = find_site(profile, "sum_leaves");
+  ASSERT_NE(site, nullptr);
+  EXPECT_EQ(site->frames, 2);
+  EXPECT_GT(profile.elapsed.count(), 0);
+}
@@ -0,0 +1,93 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <csignal>
+#include <fcntl.h>
+#include <format>
+#include <string>
+#include <unistd.h>
+
+#include "epoll.hpp"
+#include "frame_registry.hpp"
+#include "memory_stream.hpp"
+#include "task.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+namespace {
+Task<> inner(TimedScheduler &sched) { co_await sleep_for(sched, 1h); }
+
+Task<> outer(TimedScheduler &sched) { co_await inner(sched); }
+
+Task<> read_pipe(MemoryPipe &pipe) {
+  char c;
+  co_await pipe.read({&c, 1});
+}
+
+Task<> wait_readable(EpollScheduler &sched, AsyncFile &file) {
+  co_await wait_file_event(sched, file, EPOLLIN);
+}
+} // namespace
+
+TEST(FrameRegistryTest, DumpsAsyncStacks) {
+  auto before = dump_frames();
+  ASSERT_TRUE(before.starts_with("0 coroutine frames")) << before;
+
+  TimedScheduler sched;
+  {
+    auto task = outer(sched);
+    task.coro_.resume();
+    auto dump = dump_frames();
+    EXPECT_TRUE(dump.starts_with("3 coroutine frames, 1 stacks\n")) << dump;
+    EXPECT_TRUE(dump.contains("waiting for a timer, due in ")) << dump;
+    // From the innermost frame up.
+    auto sleep = dump.find("#0 "), in = dump.find("#1 "),
+         out = dump.find("#2 ");
+    ASSERT_NE(out, std::string::npos) << dump;
+    EXPECT_TRUE(sleep < in && in < out) << dump;
+    EXPECT_NE(dump.find("sleep_until", sleep), std::string::npos) << dump;
+    EXPECT_NE(dump.find("inner", in), std::string::npos) << dump;
+    EXPECT_NE(dump.find("outer", out), std::string::npos) << dump;
+    EXPECT_TRUE(dump.contains("frame_registry.cpp:")) << dump;
+  }
+  // Destroyed while suspended.
+  EXPECT_TRUE(dump_frames().starts_with("0 coroutine frames")) << dump_frames();
+}
+
+TEST(FrameRegistryTest, RecordsWaits) {
+  TimedScheduler sched;
+  MemoryPipe pipe(sched, 16);
+  auto reader = read_pipe(pipe);
+  reader.coro_.resume();
+  EXPECT_TRUE(dump_frames().contains("waiting for a memory pipe:\n"))
+      << dump_frames();
+  pipe.close();
+  sched.run();
+  ASSERT_TRUE(reader.coro_.done());
+  EXPECT_TRUE(dump_frames().contains("not waiting on a known event:\n"))
+      << dump_frames();
+
+  int fds[2];
+  ASSERT_EQ(::pipe(fds), 0);
+  AsyncFile in(fds[0]), out(fds[1]);
+  EpollScheduler loop;
+  auto waiter = wait_readable(loop, in);
+  waiter.coro_.resume();
+  auto dump = dump_frames();
+  EXPECT_TRUE(dump.contains(std::format("waiting for fd {} (IN):\n", fds[0])))
+      << dump;
+  ASSERT_EQ(write(fds[1], "x", 1), 1);
+  loop.run(0ms);
+  ASSERT_TRUE(waiter.coro_.done());
+  EXPECT_FALSE(dump_frames().contains("waiting for fd")) << dump_frames();
+}
+
+TEST(FrameRegistryTest, SignalRequestsADump) {
+  dump_frames_on_signal(SIGUSR1);
+  EXPECT_FALSE(frame_dump_requested());
+  std::raise(SIGUSR1);
+  EXPECT_TRUE(frame_dump_requested());
+  EXPECT_FALSE(frame_dump_requested());
+  std::signal(SIGUSR1, SIG_DFL);
+}
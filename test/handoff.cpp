@@ -0,0 +1,164 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <fcntl.h>
+#include <format>
+#include <netinet/in.h>
+#include <optional>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+#include "handoff.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+namespace {
+int local_port(int fd) {
+  sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  CHECK_SYSCALL(getsockname(fd, (sockaddr *)&addr, &len));
+  return ntohs(addr.sin_port);
+}
+
+// A listening socket on a free port of the loopback.
+FileDescriptor listen_on_loopback() {
+  FileDescriptor sock(CHECK_SYSCALL(socket(AF_INET, SOCK_STREAM, 0)));
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  CHECK_SYSCALL(bind(sock.fd, (sockaddr *)&addr, sizeof(addr)));
+  CHECK_SYSCALL(listen(sock.fd, 16));
+  return sock;
+}
+
+// The server that hands `listener` over at `path`, in a child process that
+// exits once it has.
+pid_t serve_handoff_in_child(std::string const &path, int listener,
+                             Clock::duration ready_timeout = 10s) {
+  pid_t pid = CHECK_SYSCALL(fork());
+  if (pid == 0) {
+    install_stop_handler();
+    EpollScheduler sched;
+    auto task = serve_handoff(sched, path, {listener}, ready_timeout);
+    sched.run(task);
+    _exit(0);
+  }
+  return pid;
+}
+
+// Retries until the child serves handoffs.
+std::optional<Handoff> take_over_child(std::string const &path) {
+  for (int i = 0; i < 500; i++) {
+    if (auto handoff = take_over(path)) {
+      return handoff;
+    }
+    std::this_thread::sleep_for(10ms);
+  }
+  return std::nullopt;
+}
+
+bool exited(pid_t pid, std::chrono::milliseconds timeout) {
+  auto deadline = Clock::now() + timeout;
+  do {
+    int status;
+    if (waitpid(pid, &status, WNOHANG) == pid) {
+      return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    std::this_thread::sleep_for(5ms);
+  } while (Clock::now() < deadline);
+  return false;
+}
+} // namespace
+
+TEST(HandoffTest, SendsFds) {
+  int pair[2], pipe_fds[2];
+  CHECK_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+  CHECK_SYSCALL(pipe(pipe_fds));
+  int const fds[] = {pipe_fds[1], pipe_fds[1]};
+  send_fds(pair[0], fds);
+  close(pipe_fds[1]);
+
+  auto received = receive_fds(pair[1]);
+  ASSERT_EQ(received.size(), 2);
+  EXPECT_NE(received[0].fd, received[1].fd);
+  EXPECT_EQ(write(received[1].fd, "ok", 2), 2);
+  char buf[2];
+  EXPECT_EQ(read(pipe_fds[0], buf, 2), 2);
+  EXPECT_EQ(std::string_view(buf, 2), "ok");
+  close(pipe_fds[0]);
+  close(pair[0]);
+  close(pair[1]);
+}
+
+TEST(HandoffTest, NoServer) {
+  EXPECT_FALSE(take_over(std::format("/tmp/handoff_none_{}", getpid())));
+}
+
+TEST(HandoffTest, HandsOverTheListeningSocket) {
+  auto path = std::format("/tmp/handoff_test_{}", getpid());
+  auto listener = listen_on_loopback();
+  auto port = local_port(listener.fd);
+  auto old = serve_handoff_in_child(path, listener.fd);
+  // Only the old server has it now.
+  close(listener.release());
+
+  // A new server that goes away before it's ready leaves the old one serving.
+  {
+    auto handoff = take_over_child(path);
+    ASSERT_TRUE(handoff);
+  }
+  EXPECT_FALSE(exited(old, 50ms));
+
+  auto handoff = take_over_child(path);
+  ASSERT_TRUE(handoff);
+  ASSERT_EQ(handoff->fds.size(), 1);
+  auto &sock = handoff->fds[0];
+  EXPECT_EQ(local_port(sock.fd), port);
+
+  // The backlog is kept: a connection made before the old server exits is
+  // accepted by the new one.
+  FileDescriptor client(CHECK_SYSCALL(socket(AF_INET, SOCK_STREAM, 0)));
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  CHECK_SYSCALL(connect(client.fd, (sockaddr *)&addr, sizeof(addr)));
+
+  handoff->ready();
+  EXPECT_TRUE(exited(old, 5s));
+  unlink(path.c_str());
+
+  int flags = CHECK_SYSCALL(fcntl(sock.fd, F_GETFL));
+  CHECK_SYSCALL(fcntl(sock.fd, F_SETFL, flags & ~O_NONBLOCK));
+  FileDescriptor conn(CHECK_SYSCALL(accept(sock.fd, nullptr, nullptr)));
+  EXPECT_EQ(write(client.fd, "x", 1), 1);
+  char ch;
+  EXPECT_EQ(read(conn.fd, &ch, 1), 1);
+}
+
+TEST(HandoffTest, DropsANewServerThatHangs) {
+  auto path = std::format("/tmp/handoff_hang_{}", getpid());
+  auto listener = listen_on_loopback();
+  auto old = serve_handoff_in_child(path, listener.fd, 50ms);
+  close(listener.release());
+
+  // Connects, then neither says it's ready nor goes away.
+  auto hung = take_over_child(path);
+  ASSERT_TRUE(hung);
+  // The old server closes the connection.
+  pollfd p{.fd = hung->conn.fd, .events = POLLIN, .revents = 0};
+  ASSERT_EQ(poll(&p, 1, 5000), 1);
+  char ch;
+  EXPECT_EQ(read(hung->conn.fd, &ch, 1), 0);
+
+  auto handoff = take_over_child(path);
+  ASSERT_TRUE(handoff);
+  handoff->ready();
+  EXPECT_TRUE(exited(old, 5s));
+  unlink(path.c_str());
+}
@@ -0,0 +1,69 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+
+#include "histogram.hpp"
+
+using namespace coro;
+
+TEST(HistogramTest, SmallValuesAreExact) {
+  Histogram h;
+  for (std::uint64_t v = 1; v <= 100; v++) {
+    h.record(v);
+  }
+  EXPECT_EQ(h.count(), 100);
+  EXPECT_EQ(h.min(), 1);
+  EXPECT_EQ(h.max(), 100);
+  EXPECT_DOUBLE_EQ(h.mean(), 50.5);
+  EXPECT_EQ(h.percentile(50), 50);
+  EXPECT_EQ(h.percentile(99), 99);
+  EXPECT_EQ(h.percentile(100), 100);
+  EXPECT_EQ(h.percentile(0), 1);
+}
+
+TEST(HistogramTest, LargeValuesWithinBucketWidth) {
+  Histogram h;
+  for (std::uint64_t v = 1000; v <= 1000000; v += 1000) {
+    h.record(v * 1000);
+  }
+  for (double p : {10.0, 50.0, 90.0, 99.0, 99.9}) {
+    auto expected = static_cast<double>(p * 10) * 1000000;
+    auto value = static_cast<double>(h.percentile(p));
+    EXPECT_GE(value, expected) << p;
+    EXPECT_LE(value, expected * (1 + 1.0 / 64)) << p;
+  }
+  EXPECT_EQ(h.percentile(100), 1000000000);
+}
+
+TEST(HistogramTest, IndexAndHighestValueAgree) {
+  for (std::uint64_t v : {0ull, 1ull, 63ull, 64ull, 127ull, 128ull, 129ull,
+                          1000ull, 123456789ull, ~0ull}) {
+    auto i = Histogram::index(v);
+    ASSERT_LT(i, Histogram::bucket_count);
+    EXPECT_GE(Histogram::highest_value(i), v);
+    EXPECT_EQ(Histogram::index(Histogram::highest_value(i)), i);
+    if (v > 0 && i > 0) {
+      EXPECT_LT(Histogram::highest_value(i - 1), v);
+    }
+  }
+}
+
+TEST(HistogramTest, Merge) {
+  Histogram a, b;
+  for (int i = 0; i < 90; i++) {
+    a.record(10);
+  }
+  for (int i = 0; i < 10; i++) {
+    b.record(5000);
+  }
+  a.merge(b);
+  EXPECT_EQ(a.count(), 100);
+  EXPECT_EQ(a.min(), 10);
+  EXPECT_EQ(a.max(), 5000);
+  EXPECT_EQ(a.percentile(90), 10);
+  EXPECT_GE(a.percentile(91), 5000 - 5000 / 64);
+
+  a.clear();
+  EXPECT_EQ(a.count(), 0);
+  EXPECT_EQ(a.percentile(50), 0);
+}
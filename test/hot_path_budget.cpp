@@ -0,0 +1,204 @@
+#include <gtest/gtest.h>
+
+#include <cerrno>
+#include <format>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "connection.hpp"
+#include "count_allocations.hpp"
+#include "default_headers.hpp"
+#include "memory_stream.hpp"
+#include "syscall.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+namespace {
+// What a steady-state request to a static route may cost. The syscalls over
+// a socket are: for the read, epoll_ctl(ADD), epoll_wait(), read() and
+// epoll_ctl(DEL), and the same for the write. In memory, each of the 2 wakeups
+// of a pipe inserts into TimedScheduler::ready_coros_, a node each.
+constexpr double max_allocations_per_request = 0;
+constexpr double max_syscalls_per_request = 8;
+constexpr double max_memory_allocations_per_request = 2;
+constexpr double max_memory_syscalls_per_request = 0;
+
+constexpr int warmup_requests = 5;
+constexpr int measured_requests = 200;
+
+constexpr std::string_view home_request = "GET /home HTTP/1.1\r\n"
+                                          "Host: localhost:9000\r\n"
+                                          "Accept: */*\r\n"
+                                          "\r\n";
+constexpr std::string_view home_body = "<h1>Hello, World!</h1>";
+
+HTTPRouter home_router() {
+  HTTPRouter router;
+  router.route_static(HTTPMethod::GET, "/home",
+                      HTTPResponse{
+                          .status = 200,
+                          .headers = {{"Content-Type", "text/html"}},
+                          .body = home_body,
+                      });
+  return router;
+}
+
+// The allocations and syscalls of the current thread from construction to
+// stop(), per request.
+struct Budget {
+  Budget() {
+    allocations = 0;
+    counting = true;
+    start = syscall_counts();
+  }
+
+  void stop(int requests) {
+    counting = false;
+    auto calls = syscall_counts() - start;
+    allocations_per_request = double(allocations) / requests;
+    syscalls_per_request = double(calls.total()) / requests;
+    for (std::size_t i = 0; i < syscall_count; i++) {
+      if (calls.calls[i]) {
+        summary += std::format("{} {:.2f}, ", syscall_name(Syscall(i)),
+                               double(calls.calls[i]) / requests);
+      }
+    }
+  }
+
+  SyscallCounts start;
+  double allocations_per_request{};
+  double syscalls_per_request{};
+  std::string summary; // Syscalls per request by kind.
+};
+
+// The allocation budget doesn't hold with the debugging hooks.
+bool hooks_allocate() {
+  return frame_registry_enabled || frame_profile_enabled;
+}
+
+// A keep-alive connection over a socket pair, with the client end driven by
+// hand. Only the server's I/O goes through coro::sys and is counted.
+struct SocketConnection {
+  explicit SocketConnection(HTTPRouter const &router) {
+    int fds[2];
+    CHECK_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    client = AsyncFile(fds[1]);
+    server.emplace(sched, AsyncFile(fds[0]));
+    task.emplace(serve_connection(sched, *server, router));
+    task->coro_.resume();
+  }
+
+  // The response is read into a fixed buffer, so the client allocates
+  // nothing.
+  std::string_view round_trip() {
+    EXPECT_EQ(::write(client.fd_, home_request.data(), home_request.size()),
+              home_request.size());
+    std::size_t n = 0;
+    while (!std::string_view(response, n).ends_with(home_body)) {
+      sched.run(1s);
+      auto ret = ::read(client.fd_, response + n, sizeof(response) - n);
+      if (ret > 0) {
+        n += ret;
+      } else if (ret == 0 || errno != EAGAIN || task->coro_.done()) {
+        break;
+      }
+    }
+    return {response, n};
+  }
+
+  EpollScheduler sched;
+  HeaderTemplate headers;
+  HeaderTemplate::Scope scope{headers};
+  AsyncFile client;
+  std::optional<AsyncFileBuffer> server;
+  std::optional<Task<>> task;
+  char response[4096];
+};
+
+// The same over the in-memory transport, where the client is a coroutine.
+struct MemoryConnectionDriver {
+  explicit MemoryConnectionDriver(HTTPRouter const &router)
+      : conn(sched), task(serve_connection(loop, conn.server, router)) {
+    task.coro_.resume();
+  }
+
+  std::string_view round_trip() {
+    auto client = [this]() -> Task<std::size_t> {
+      co_await conn.client.puts(home_request);
+      co_await conn.client.flush();
+      std::size_t n = 0;
+      while (!std::string_view(response, n).ends_with(home_body)) {
+        auto got = co_await conn.client.read(
+            std::span(response + n, sizeof(response) - n));
+        if (!got) {
+          break;
+        }
+        n += got;
+      }
+      co_return n;
+    }();
+    client.coro_.resume();
+    while (!client.coro_.done() && !sched.ready_coros_.empty()) {
+      sched.run();
+    }
+    EXPECT_TRUE(client.coro_.done()) << "deadlock";
+    return {response, client.result()};
+  }
+
+  HeaderTemplate headers;
+  HeaderTemplate::Scope scope{headers};
+  TimedScheduler sched;
+  EpollScheduler loop;
+  MemoryConnection conn;
+  Task<> task;
+  char response[4096];
+};
+
+template <class Connection> Budget measure(Connection &conn) {
+  for (int i = 0; i < warmup_requests; i++) {
+    auto res = conn.round_trip();
+    EXPECT_TRUE(res.starts_with("HTTP/1.1 200 OK\r\n")) << res;
+  }
+  Budget budget;
+  std::string_view res;
+  for (int i = 0; i < measured_requests; i++) {
+    res = conn.round_trip();
+  }
+  budget.stop(measured_requests);
+  EXPECT_TRUE(res.starts_with("HTTP/1.1 200 OK\r\n")) << res;
+  EXPECT_TRUE(res.ends_with(home_body)) << res;
+  return budget;
+}
+} // namespace
+
+TEST(HotPathBudgetTest, StaticRouteOverSocket) {
+  auto router = home_router();
+  SocketConnection conn(router);
+  auto budget = measure(conn);
+  EXPECT_FALSE(conn.task->coro_.done());
+
+  EXPECT_LE(budget.syscalls_per_request, max_syscalls_per_request)
+      << budget.summary;
+  if (!hooks_allocate()) {
+    EXPECT_LE(budget.allocations_per_request, max_allocations_per_request);
+  }
+}
+
+TEST(HotPathBudgetTest, StaticRouteInMemory) {
+  auto router = home_router();
+  MemoryConnectionDriver conn(router);
+  auto budget = measure(conn);
+  EXPECT_FALSE(conn.task.coro_.done());
+
+  EXPECT_LE(budget.syscalls_per_request, max_memory_syscalls_per_request)
+      << budget.summary;
+  if (!hooks_allocate()) {
+    EXPECT_LE(budget.allocations_per_request,
+              max_memory_allocations_per_request);
+  }
+}
@@ -1,6 +1,10 @@
 #include <gtest/gtest.h>
 
+#include <sys/socket.h>
+#include <thread>
+
 #include "http.hpp"
+#include "static_response.hpp"
 
 TEST(HTTPRoutePrefixTest, SimpleRoute) {
   using namespace coro;
@@ -233,4 +237,234 @@ TEST(HTTPRouteTest, ExactMatchHappensFirst) {
   ASSERT_TRUE(h1.target<decltype(f1)>());
   ASSERT_TRUE(h2.target<decltype(f2)>());
   ASSERT_TRUE(h3.target<decltype(f3)>());
-}
\ No newline at end of file
+}
+
+static coro::HTTPResponse hello_response() {
+  return coro::HTTPResponse{
+      .status = 200,
+      .headers = {{"Content-Type", "text/html"}},
+      .body = "<h1>Hello, World!</h1>",
+  };
+}
+
+TEST(HTTPRouteStaticTest, SerializedOnce) {
+  using namespace coro;
+  HTTPRouter router;
+  router.route_static(HTTPMethod::GET, "/home", hello_response());
+
+  auto s = router.find_static(HTTPMethod::GET, "/home?utm=1");
+  ASSERT_NE(s, nullptr);
+  EXPECT_EQ(router.find_static(HTTPMethod::POST, "/home"), nullptr);
+  EXPECT_EQ(router.find_static(HTTPMethod::GET, "/"), nullptr);
+
+  auto etag = make_etag("<h1>Hello, World!</h1>");
+  auto defaults = "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n";
+  EXPECT_EQ(s->to_string(defaults), "HTTP/1.1 200 OK\r\n"
+                                    "Content-Type: text/html\r\n"
+                                    "ETag: " +
+                                        etag +
+                                        "\r\n"
+                                        "Content-Length: 22\r\n"
+                                        "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+                                        "\r\n"
+                                        "<h1>Hello, World!</h1>");
+
+  // Only the default headers change between requests.
+  auto p = s->pieces("Date: Mon, 07 Nov 1994 08:49:37 GMT\r\n");
+  EXPECT_EQ(p[0].data(), s->pieces(defaults)[0].data());
+  EXPECT_EQ(p[1], "Date: Mon, 07 Nov 1994 08:49:37 GMT\r\n");
+}
+
+TEST(HTTPRouteStaticTest, FindRouteFallsBack) {
+  using namespace coro;
+  HTTPRouter router;
+  router.route_static(HTTPMethod::GET, "/home", hello_response());
+
+  auto handler = router.find_route(HTTPMethod::GET, "/home");
+  ASSERT_NE(handler, nullptr);
+  auto h = handler(HTTPRequest{});
+  h.coro_.resume();
+  auto res = h.result();
+  EXPECT_EQ(res.status, 200);
+  EXPECT_EQ(res.body, "<h1>Hello, World!</h1>");
+  EXPECT_EQ(std::string_view{res.headers.at("ETag")},
+            make_etag("<h1>Hello, World!</h1>"));
+}
+
+TEST(HTTPRouteStaticTest, NotModified) {
+  using namespace coro;
+  HTTPRouter router;
+  router.route_static(HTTPMethod::GET, "/home", hello_response());
+  auto s = router.find_static(HTTPMethod::GET, "/home");
+  ASSERT_NE(s, nullptr);
+
+  HTTPRequest req{.method = "GET", .uri = "/home"};
+  EXPECT_EQ(s->select(req), s);
+
+  req.headers["If-None-Match"] = "\"other\"";
+  EXPECT_EQ(s->select(req), s);
+
+  req.headers["If-None-Match"] = make_etag("<h1>Hello, World!</h1>");
+  auto nm = s->select(req);
+  ASSERT_NE(nm, nullptr);
+  ASSERT_NE(nm, s);
+  auto text = nm->to_string("Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n");
+  EXPECT_TRUE(text.starts_with("HTTP/1.1 304 Not Modified\r\n")) << text;
+  EXPECT_TRUE(text.contains("ETag: " + req.headers["If-None-Match"])) << text;
+  EXPECT_TRUE(text.ends_with("Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n"))
+      << text;
+}
+
+namespace {
+// Writes a response to a socket the way the connection driver does and
+// returns the bytes that come out of the other end.
+std::string send(coro::HTTPResponse const &res, std::string_view defaults) {
+  using namespace coro;
+  int fds[2];
+  CHECK_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  std::string received;
+  std::thread reader([&, fd = fds[1]] {
+    char buf[65536];
+    while (auto n = read(fd, buf, sizeof(buf))) {
+      CHECK_SYSCALL(n);
+      received.append(buf, n);
+    }
+    close(fd);
+  });
+  {
+    EpollScheduler sched;
+    AsyncFileBuffer out(sched, AsyncFile(fds[0]));
+    HeaderTemplate headers;
+    headers.refresh(784111777);
+    HeaderTemplate::Scope scope(headers);
+    EXPECT_EQ(headers.bytes(), defaults);
+    auto write = [&]() -> Task<> {
+      co_await res.write_to(out);
+      co_await out.flush();
+    };
+    auto task = write();
+    task.coro_.resume();
+    while (!task.coro_.done()) {
+      sched.run();
+    }
+    task.result();
+  }
+  reader.join();
+  return received;
+}
+
+coro::HTTPResponse run(coro::HTTPRouter const &router, std::string_view uri) {
+  using namespace coro;
+  auto handler = router.find_route(HTTPMethod::GET, uri);
+  EXPECT_NE(handler, nullptr);
+  auto t = handler(HTTPRequest{.method = "GET", .uri = std::pmr::string(uri)});
+  t.coro_.resume();
+  return t.result();
+}
+
+std::string const defaults = "Server: coro\r\n"
+                                      "Connection: close\r\n"
+                                      "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n";
+} // namespace
+
+TEST(HTTPRouteBodyTest, EveryKind) {
+  using namespace coro;
+  using namespace std::literals;
+  using Kind = HTTPBody::Kind;
+
+  static constexpr auto literal = "<h1>Hello, World!</h1>"sv;
+  auto shared = std::make_shared<std::string const>(1 << 20, '@');
+  char path[] = "/tmp/coro_body_XXXXXX";
+  int fd = CHECK_SYSCALL(mkstemp(path));
+  CHECK_SYSCALL(write(fd, "file body", 9));
+  CHECK_SYSCALL(close(fd));
+
+  HTTPRouter router;
+  router.route(HTTPMethod::GET, "/owned", [](HTTPRequest) -> Task<HTTPResponse> {
+    HTTPResponse res{.status = 200};
+    res.body = std::format("{}-{}", 1, 2);
+    co_return res;
+  });
+  router.route(HTTPMethod::GET, "/view", [](HTTPRequest) -> Task<HTTPResponse> {
+    HTTPResponse res{.status = 200};
+    res.body = literal;
+    co_return res;
+  });
+  router.route(HTTPMethod::GET, "/shared",
+               [shared](HTTPRequest) -> Task<HTTPResponse> {
+                 HTTPResponse res{.status = 200};
+                 res.body = shared;
+                 co_return res;
+               });
+  router.route(HTTPMethod::GET, "/file",
+               [&path](HTTPRequest) -> Task<HTTPResponse> {
+                 co_return file_response(path, "text/plain");
+               });
+  router.route(
+      HTTPMethod::GET, "/generator", [](HTTPRequest) -> Task<HTTPResponse> {
+        HTTPResponse res{.status = 200};
+        auto i = std::make_shared<int>(0);
+        res.body = BodyGenerator([i]() -> Task<std::string> {
+          if (*i == 3) {
+            co_return "";
+          }
+          ++*i;
+          co_return std::string(*i * 10, 'a' + *i - 1);
+        });
+        co_return res;
+      });
+
+  auto owned = run(router, "/owned");
+  EXPECT_EQ(owned.body.kind(), Kind::OWNED);
+  EXPECT_EQ(send(owned, defaults),
+            "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n"s + defaults + "\r\n1-2");
+
+  auto view = run(router, "/view");
+  EXPECT_EQ(view.body.kind(), Kind::VIEW);
+  EXPECT_EQ(view.body.view().data(), literal.data()); // Not copied.
+  EXPECT_EQ(send(view, defaults),
+            "HTTP/1.1 200 OK\r\nContent-Length: 22\r\n"s + defaults +
+                "\r\n" + std::string(literal));
+
+  // Larger than the connection buffer, so it goes out with writev().
+  auto res = run(router, "/shared");
+  EXPECT_EQ(res.body.kind(), Kind::SHARED);
+  EXPECT_EQ(res.body.view().data(), shared->data());
+  EXPECT_EQ(send(res, defaults),
+            "HTTP/1.1 200 OK\r\nContent-Length: 1048576\r\n"s + defaults +
+                "\r\n" + *shared);
+
+  auto file = run(router, "/file");
+  EXPECT_EQ(file.body.kind(), Kind::FILE);
+  EXPECT_EQ(file.body.size(), 9);
+  auto bytes = send(file, defaults);
+  EXPECT_TRUE(bytes.starts_with("HTTP/1.1 200 OK\r\nAccept-Ranges: bytes\r\n"))
+      << bytes;
+  EXPECT_TRUE(bytes.ends_with("Content-Length: 9\r\n"s + defaults +
+                              "\r\nfile body"))
+      << bytes;
+  unlink(path);
+
+  auto gen = run(router, "/generator");
+  EXPECT_EQ(gen.body.kind(), Kind::GENERATOR);
+  EXPECT_FALSE(gen.body.content_length());
+  EXPECT_THROW(gen.to_string(), std::logic_error);
+  EXPECT_EQ(send(gen, defaults),
+            "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n"s + defaults +
+                "\r\n"
+                "a\r\n" +
+                std::string(10, 'a') + "\r\n14\r\n" + std::string(20, 'b') +
+                "\r\n1e\r\n" + std::string(30, 'c') + "\r\n0\r\n\r\n");
+}
+
+TEST(HTTPRouteBodyTest, ChangingAViewCopiesIt) {
+  using namespace coro;
+  using namespace std::literals;
+  HTTPResponse res{.status = 200};
+  res.body = "abc"sv;
+  EXPECT_EQ(res.body.kind(), HTTPBody::Kind::VIEW);
+  res.body += "def";
+  EXPECT_EQ(res.body.kind(), HTTPBody::Kind::OWNED);
+  EXPECT_EQ(res.body, "abcdef");
+  EXPECT_EQ(res.to_string(), "HTTP/1.1 200 OK\r\nContent-Length: 6\r\n\r\nabcdef");
+}
@@ -0,0 +1,61 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "io_buffer.hpp"
+
+using namespace coro;
+
+TEST(IOBufferTest, CarvedFromRegions) {
+  auto &slab = IOBufferSlab::local();
+  auto before = slab.stats();
+
+  std::vector<IOBuffer> buffers;
+  for (int i = 0; i < 512; i++) {
+    buffers.push_back(make_io_buffer(8192));
+    std::memset(buffers.back().get(), i, 8192);
+  }
+  auto stats = slab.stats();
+  EXPECT_EQ(stats.buffers, before.buffers + 512);
+  // 512 * 8 KiB is 2 regions (or 3 if the last one was partly used).
+  auto regions = stats.hugetlb_regions + stats.thp_regions -
+                 before.hugetlb_regions - before.thp_regions;
+  EXPECT_GE(regions, 2);
+  EXPECT_LE(regions, 3);
+
+  auto last = buffers.back().get();
+  buffers.pop_back();
+  EXPECT_EQ(slab.stats().buffers, before.buffers + 511);
+  EXPECT_EQ(make_io_buffer(8192).get(), last);
+}
+
+TEST(IOBufferTest, SizeClasses) {
+  auto &slab = IOBufferSlab::local();
+  auto small = make_io_buffer(100);
+  auto odd = make_io_buffer(5000);
+  auto p = odd.get();
+  odd.reset();
+  // 5000 and 8192 are in the same class.
+  EXPECT_EQ(make_io_buffer(8192).get(), p);
+
+  auto buffers = slab.stats().buffers;
+  auto large = make_io_buffer(IOBufferSlab::max_size + 1);
+  EXPECT_EQ(large.get_deleter().slab, nullptr);
+  EXPECT_EQ(slab.stats().buffers, buffers);
+}
+
+TEST(IOBufferTest, SlabPerThread) {
+  IOBufferSlab *main = &IOBufferSlab::local();
+  IOBufferSlab *other = nullptr;
+  IOBuffer buffer;
+  std::thread([&] {
+    other = &IOBufferSlab::local();
+    buffer = make_io_buffer(8192);
+  }).join();
+  EXPECT_NE(main, other);
+  EXPECT_EQ(buffer.get_deleter().slab, other);
+  // The thread has exited, and its slab is freed with its last buffer.
+  buffer.reset();
+}
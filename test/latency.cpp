@@ -0,0 +1,152 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "connection.hpp"
+#include "default_headers.hpp"
+#include "latency.hpp"
+#include "memory_stream.hpp"
+#include "static_response.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+namespace {
+void run(TimedScheduler &sched, Task<> &task) {
+  while (!task.coro_.done() && !sched.ready_coros_.empty()) {
+    sched.run();
+  }
+  ASSERT_TRUE(task.coro_.done()) << "deadlock";
+  task.result();
+}
+
+std::uint64_t count(LatencyRecorder::Snapshot const &s, std::string_view route,
+                    Phase phase) {
+  auto it = s.find(route);
+  if (it == s.end()) {
+    return 0;
+  }
+  return it->second[static_cast<std::size_t>(phase)].count();
+}
+} // namespace
+
+TEST(LatencyTest, RouterPatterns) {
+  HTTPRouter router;
+  HTTPHandler handler = [](HTTPRequest const &) -> Task<HTTPResponse> {
+    co_return HTTPResponse{.status = 200};
+  };
+  router.route(HTTPMethod::GET, "//hello", handler);
+  router.route_prefix(HTTPMethod::GET, "/files", handler);
+  router.route_prefix(HTTPMethod::GET, "/", handler);
+  router.route_static(HTTPMethod::GET, "/home", HTTPResponse{.status = 200});
+
+  auto pattern = [&](std::string_view uri) {
+    return router.pattern_of(&router.find_route(HTTPMethod::GET, uri));
+  };
+  EXPECT_EQ(pattern("/hello?x=1"), "/hello");
+  EXPECT_EQ(pattern("/files/a/b.txt"), "/files/*");
+  EXPECT_EQ(pattern("/other"), "/*");
+  EXPECT_EQ(pattern("/home"), "/home");
+  EXPECT_EQ(router.pattern_of(router.find_static(HTTPMethod::GET, "/home")),
+            "/home");
+  EXPECT_EQ(router.pattern_of(&HTTPRouter::no_handler()), "");
+}
+
+TEST(LatencyTest, PhaseTimer) {
+  PhaseTimer timer;
+  timer.start();
+  std::this_thread::sleep_for(2ms);
+  timer.mark(Phase::HANDLER);
+  timer.mark(Phase::FLUSH);
+  EXPECT_TRUE(timer.marked(Phase::HANDLER));
+  EXPECT_TRUE(timer.marked(Phase::FLUSH));
+  EXPECT_FALSE(timer.marked(Phase::ROUTE_LOOKUP));
+  EXPECT_GE(timer.nanoseconds(Phase::HANDLER), 2000000);
+  EXPECT_LT(timer.nanoseconds(Phase::FLUSH), 2000000);
+  timer.clear();
+  EXPECT_FALSE(timer.marked(Phase::HANDLER));
+
+  PhaseTimer disabled(false);
+  disabled.start();
+  disabled.mark(Phase::HANDLER);
+  EXPECT_FALSE(disabled.marked(Phase::HANDLER));
+}
+
+TEST(LatencyTest, ServeConnectionRecordsPhasesPerRoute) {
+  HeaderTemplate headers;
+  HeaderTemplate::Scope scope(headers);
+  LatencyRecorder recorder;
+  LatencyRecorder::Scope latency_scope(recorder);
+  HTTPRouter router;
+  router.route(HTTPMethod::GET, "/hello",
+               [](HTTPRequest const &req) -> Task<HTTPResponse> {
+                 auto res = HTTPResponse::with_allocator(req.get_allocator());
+                 res.status = 200;
+                 res.body = "Hello, World!"sv;
+                 co_return res;
+               });
+  router.route_static(HTTPMethod::GET, "/home",
+                      HTTPResponse{.status = 200, .body = "home"});
+
+  TimedScheduler sched;
+  EpollScheduler loop;
+  MemoryConnection conn(sched);
+  auto server = [&]() -> Task<> {
+    try {
+      co_await serve_connection(loop, conn.server, router);
+    } catch (EOFException &) {
+    }
+  }();
+  auto client = [&]() -> Task<> {
+    for (auto uri : {"/hello"sv, "/hello"sv, "/home"sv, "/nowhere"sv}) {
+      HTTPRequest req{.method = "GET", .uri = std::pmr::string(uri)};
+      req.headers["Host"] = "localhost";
+      co_await req.write_to(conn.client);
+      co_await conn.client.flush();
+      HTTPResponse res;
+      co_await res.read_from(conn.client);
+    }
+    conn.client.shutdown();
+  }();
+  server.coro_.resume();
+  client.coro_.resume();
+  run(sched, client);
+  run(sched, server);
+
+  auto s = recorder.snapshot();
+  EXPECT_EQ(s.size(), 3);
+  EXPECT_EQ(count(s, "/hello", Phase::ACCEPT_TO_FIRST_BYTE), 1);
+  EXPECT_EQ(count(s, "/hello", Phase::HEADER_PARSE), 2);
+  EXPECT_EQ(count(s, "/hello", Phase::HANDLER), 2);
+  EXPECT_EQ(count(s, "/hello", Phase::FLUSH), 2);
+  EXPECT_EQ(count(s, "/home", Phase::ACCEPT_TO_FIRST_BYTE), 0);
+  EXPECT_EQ(count(s, "/home", Phase::ROUTE_LOOKUP), 1);
+  EXPECT_EQ(count(s, "/home", Phase::HANDLER), 0);
+  EXPECT_EQ(count(s, "/home", Phase::SERIALIZATION), 1);
+  EXPECT_EQ(count(s, "", Phase::SERIALIZATION), 1);
+
+  auto table = format_latency(s);
+  EXPECT_TRUE(table.contains("/hello"));
+  EXPECT_TRUE(table.contains("(none)"));
+}
+
+TEST(LatencyTest, MergedAcrossThreads) {
+  auto before = count(LatencyRecorder::merged(), "/merged", Phase::HANDLER);
+  PhaseTimer timer;
+  timer.start();
+  timer.mark(Phase::HANDLER);
+
+  LatencyRecorder recorder;
+  recorder.record("/merged", timer);
+  std::thread([&] {
+    LatencyRecorder other;
+    other.record("/merged", timer);
+    other.record("/merged", timer);
+  }).join();
+
+  auto merged = LatencyRecorder::merged();
+  EXPECT_EQ(count(merged, "/merged", Phase::HANDLER), before + 3);
+  EXPECT_EQ(count(recorder.snapshot(), "/merged", Phase::HANDLER), 1);
+}
@@ -0,0 +1,148 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "connection.hpp"
+#include "default_headers.hpp"
+#include "epoll.hpp"
+#include "loop_monitor.hpp"
+#include "memory_stream.hpp"
+#include "metrics.hpp"
+#include "stats.hpp"
+#include "task.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+namespace {
+struct Reports {
+  LoopMonitorOptions options() {
+    return {.slow_resume = 10ms, .on_slow_resume = [this](SlowResume const &r) {
+              slow.push_back(r);
+              what.emplace_back(r.what);
+            }};
+  }
+
+  std::vector<SlowResume> slow;
+  std::vector<std::string> what; // SlowResume::what may not outlive the call.
+};
+} // namespace
+
+TEST(LoopMonitorTest, ReportsSlowResumes) {
+  Reports reports;
+  LoopMonitor monitor(reports.options());
+  LoopMonitor::Scope scope(monitor);
+  LoopStats stats;
+  LoopStats::Scope stats_scope(stats);
+  TimedScheduler sched;
+
+  auto task = [&]() -> Task<> {
+    for (int i = 0; i < 3; i++) {
+      co_await sleep_for(sched, 1ms);
+    }
+    LoopMonitor::current()->annotate("busy");
+    std::this_thread::sleep_for(20ms);
+  }();
+  sched.run(task);
+  monitor.before_wait();
+
+  ASSERT_EQ(reports.slow.size(), 1);
+  auto const &r = reports.slow[0];
+  EXPECT_GE(r.duration, 20ms);
+  EXPECT_TRUE(r.type.contains("TimedPromise")) << r.type;
+  EXPECT_NE(r.frame, nullptr);
+  EXPECT_EQ(reports.what[0], "busy");
+  EXPECT_EQ(stats.snapshot()[Stat::SLOW_RESUMES], 1);
+
+  // The first resume is the entry point's, which the scheduler doesn't do.
+  auto s = monitor.snapshot();
+  EXPECT_EQ(s.resume.count(), 3);
+  EXPECT_GE(s.resume.max(), 20'000'000);
+  EXPECT_EQ(s.lag.count(), 0);
+}
+
+TEST(LoopMonitorTest, LagOfIterations) {
+  Reports reports;
+  LoopMonitor monitor(reports.options());
+  LoopMonitor::Scope scope(monitor);
+  EpollScheduler loop;
+
+  loop.run(0ms);
+  std::this_thread::sleep_for(5ms);
+  loop.run(0ms);
+  loop.run(0ms);
+  auto s = monitor.snapshot();
+  ASSERT_EQ(s.lag.count(), 2);
+  EXPECT_GE(s.lag.max(), 5'000'000);
+  EXPECT_TRUE(reports.slow.empty());
+}
+
+TEST(LoopMonitorTest, AnnotatesRoutes) {
+  HeaderTemplate headers;
+  HeaderTemplate::Scope headers_scope(headers);
+  Reports reports;
+  LoopMonitor monitor(reports.options());
+  LoopMonitor::Scope scope(monitor);
+
+  HTTPRouter router;
+  router.route(HTTPMethod::GET, "/slow",
+               [](HTTPRequest const &req) -> Task<HTTPResponse> {
+                 std::this_thread::sleep_for(20ms);
+                 auto res = HTTPResponse::with_allocator(req.get_allocator());
+                 res.status = 200;
+                 co_return res;
+               });
+
+  TimedScheduler sched;
+  EpollScheduler loop;
+  MemoryConnection conn(sched);
+  auto server = [&]() -> Task<> {
+    try {
+      co_await serve_connection(loop, conn.server, router);
+    } catch (EOFException &) {
+    }
+  }();
+  auto client = [&]() -> Task<> {
+    HTTPRequest req{.method = "GET", .uri = "/slow"};
+    req.headers["Host"] = "localhost";
+    co_await req.write_to(conn.client);
+    co_await conn.client.flush();
+    HTTPResponse res;
+    co_await res.read_from(conn.client);
+    conn.client.shutdown();
+  }();
+  server.coro_.resume();
+  client.coro_.resume();
+  while (!sched.ready_coros_.empty()) {
+    sched.run();
+  }
+  ASSERT_TRUE(server.coro_.done() && client.coro_.done());
+  server.result();
+  client.result();
+
+  ASSERT_EQ(reports.slow.size(), 1);
+  EXPECT_EQ(reports.what[0], "/slow");
+}
+
+TEST(LoopMonitorTest, MergedAndExported) {
+  auto before = LoopMonitor::merged();
+  {
+    LoopMonitor monitor;
+    monitor.after_wait();
+    monitor.before_wait();
+  }
+  auto after = LoopMonitor::merged();
+  EXPECT_EQ(after.lag.count(), before.lag.count() + 1);
+
+  auto text = format_prometheus({}, {}, after);
+  EXPECT_TRUE(text.contains("# TYPE coro_loop_lag_seconds summary\n"));
+  EXPECT_TRUE(text.contains(
+      std::format("coro_loop_lag_seconds_count {}\n", after.lag.count())));
+  EXPECT_TRUE(text.contains("coro_loop_lag_seconds{quantile=\"0.99\"} "));
+  EXPECT_TRUE(text.contains("# TYPE coro_resume_seconds summary\n"));
+  EXPECT_TRUE(text.contains("coro_slow_resumes_total 0\n"));
+}
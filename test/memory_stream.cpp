@@ -0,0 +1,185 @@
+#include <gtest/gtest.h>
+
+#include <array>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+
+#include "connection.hpp"
+#include "default_headers.hpp"
+#include "memory_stream.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+namespace {
+// Runs the ready coroutines until `task` is done. Fails if it waits for
+// something that will never come.
+void run(TimedScheduler &sched, Task<> &task) {
+  while (!task.coro_.done() && !sched.ready_coros_.empty()) {
+    sched.run();
+  }
+  ASSERT_TRUE(task.coro_.done()) << "deadlock";
+  task.result();
+}
+} // namespace
+
+TEST(MemoryStreamTest, PipeWrapsAroundAndWaits) {
+  TimedScheduler sched;
+  MemoryPipe pipe(sched, 7);
+  std::string received;
+
+  auto writer = [&]() -> Task<> {
+    std::string_view data = "the quick brown fox jumps over the lazy dog";
+    while (!data.empty()) {
+      auto n = co_await pipe.write(std::span(data.data(), data.size()));
+      EXPECT_GT(n, 0);
+      EXPECT_LE(n, 7);
+      data.remove_prefix(n);
+    }
+    pipe.close();
+  }();
+  auto reader = [&]() -> Task<> {
+    char buf[5];
+    while (auto n = co_await pipe.read(buf)) {
+      received.append(buf, n);
+    }
+  }();
+  reader.coro_.resume();
+  writer.coro_.resume();
+  run(sched, reader);
+  EXPECT_EQ(received, "the quick brown fox jumps over the lazy dog");
+  EXPECT_TRUE(writer.coro_.done());
+
+  auto late = [&]() -> Task<> {
+    char c = 'x';
+    EXPECT_EQ(co_await pipe.write(std::span(&c, 1)), 0);
+  }();
+  late.coro_.resume();
+  run(sched, late);
+}
+
+TEST(MemoryStreamTest, ServesRequests) {
+  HeaderTemplate headers;
+  HeaderTemplate::Scope scope(headers);
+  HTTPRouter router;
+  router.route(HTTPMethod::GET, "/hello",
+               [](HTTPRequest const &req) -> Task<HTTPResponse> {
+                 auto res = HTTPResponse::with_allocator(req.get_allocator());
+                 res.status = 200;
+                 res.headers["X-Name"] = req.parse_uri().params.at("name");
+                 res.body = "Hello, World!"sv;
+                 co_return res;
+               });
+
+  TimedScheduler sched;
+  EpollScheduler loop;
+  MemoryConnection conn(sched, 64); // Smaller than a response.
+  bool closed = false;
+  auto server = [&]() -> Task<> {
+    try {
+      co_await serve_connection(loop, conn.server, router);
+    } catch (EOFException &) {
+      closed = true;
+    }
+  }();
+  auto client = [&]() -> Task<> {
+    for (auto name : {"a"sv, "bb"sv, "ccc"sv}) {
+      HTTPRequest req{.method = "GET",
+                      .uri = std::pmr::string("/hello?name=") +
+                             std::pmr::string(name)};
+      req.headers["Host"] = "localhost";
+      co_await req.write_to(conn.client);
+      co_await conn.client.flush();
+      HTTPResponse res;
+      co_await res.read_from(conn.client);
+      EXPECT_EQ(res.status, 200);
+      EXPECT_EQ(res.headers.at("X-Name"), name);
+      EXPECT_EQ(res.body.view(), "Hello, World!");
+    }
+    HTTPRequest req{.method = "GET", .uri = "/nowhere"};
+    req.headers["Host"] = "localhost";
+    co_await req.write_to(conn.client);
+    co_await conn.client.flush();
+    HTTPResponse res;
+    co_await res.read_from(conn.client);
+    EXPECT_EQ(res.status, 404);
+    conn.client.shutdown();
+  }();
+  server.coro_.resume();
+  client.coro_.resume();
+  run(sched, client);
+  run(sched, server);
+  EXPECT_TRUE(closed);
+}
+
+TEST(MemoryStreamTest, HandlerClosesConnection) {
+  HeaderTemplate headers;
+  HeaderTemplate::Scope scope(headers);
+  HTTPRouter router;
+  router.route(HTTPMethod::GET, "/bye",
+               [](HTTPRequest const &req) -> Task<HTTPResponse> {
+                 auto res = HTTPResponse::with_allocator(req.get_allocator());
+                 res.status = 200;
+                 res.headers["Connection"] = "close"sv;
+                 co_return res;
+               });
+
+  TimedScheduler sched;
+  EpollScheduler loop;
+  MemoryConnection conn(sched);
+  auto server = serve_connection(loop, conn.server, router);
+  auto client = [&]() -> Task<> {
+    HTTPRequest req{.method = "GET", .uri = "/bye"};
+    req.headers["Host"] = "localhost";
+    co_await req.write_to(conn.client);
+    co_await conn.client.flush();
+    HTTPResponse res;
+    co_await res.read_from(conn.client);
+    EXPECT_EQ(res.status, 200);
+    EXPECT_FALSE(res.keep_alive());
+  }();
+  server.coro_.resume();
+  client.coro_.resume();
+  run(sched, client);
+  // The server returns without waiting for another request.
+  run(sched, server);
+}
+
+TEST(MemoryStreamTest, SendsFiles) {
+  TimedScheduler sched;
+  MemoryConnection conn(sched, 1000);
+  std::string content(100000, 'x');
+  for (std::size_t i = 0; i < content.size(); i += 7) {
+    content[i] = 'a' + i % 26;
+  }
+  FILE *f = tmpfile();
+  ASSERT_NE(f, nullptr);
+  ASSERT_EQ(fwrite(content.data(), 1, content.size(), f), content.size());
+  fflush(f);
+
+  std::string received;
+  auto sender = [&]() -> Task<> {
+    co_await conn.server.puts("<"sv);
+    co_await conn.server.sendfile(fileno(f), 10, content.size() - 20);
+    std::array pieces{">"sv, "!"sv};
+    co_await conn.server.writev(pieces);
+    conn.server.shutdown();
+  }();
+  auto receiver = [&]() -> Task<> {
+    try {
+      while (true) {
+        received += co_await conn.client.getchar();
+      }
+    } catch (EOFException &) {
+    }
+  }();
+  sender.coro_.resume();
+  receiver.coro_.resume();
+  run(sched, receiver);
+  EXPECT_TRUE(sender.coro_.done());
+  EXPECT_EQ(received,
+            "<" + content.substr(10, content.size() - 20) + ">!");
+  fclose(f);
+}
@@ -0,0 +1,170 @@
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "connection.hpp"
+#include "default_headers.hpp"
+#include "memory_stream.hpp"
+#include "metrics.hpp"
+#include "stats.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+namespace {
+void run(TimedScheduler &sched, Task<> &task) {
+  while (!task.coro_.done() && !sched.ready_coros_.empty()) {
+    sched.run();
+  }
+  ASSERT_TRUE(task.coro_.done()) << "deadlock";
+  task.result();
+}
+
+// Sends GET requests to `uris` over one connection served by
+// serve_connection(), and returns the bodies of the responses.
+std::vector<std::string> serve(HTTPRouter const &router,
+                               std::vector<std::string_view> uris,
+                               bool *failed = nullptr) {
+  TimedScheduler sched;
+  EpollScheduler loop;
+  MemoryConnection conn(sched);
+  std::vector<std::string> bodies;
+  auto server = [&]() -> Task<> {
+    try {
+      co_await serve_connection(loop, conn.server, router);
+    } catch (EOFException &) {
+    } catch (std::exception &) {
+      if (failed) {
+        *failed = true;
+      }
+      conn.server.shutdown();
+    }
+  }();
+  auto client = [&]() -> Task<> {
+    try {
+      for (auto uri : uris) {
+        HTTPRequest req{.method = "GET", .uri = std::pmr::string(uri)};
+        req.headers["Host"] = "localhost";
+        co_await req.write_to(conn.client);
+        co_await conn.client.flush();
+        HTTPResponse res;
+        co_await res.read_from(conn.client);
+        bodies.emplace_back(res.body.view());
+      }
+    } catch (EOFException &) {
+    }
+    conn.client.shutdown();
+  }();
+  server.coro_.resume();
+  client.coro_.resume();
+  run(sched, client);
+  run(sched, server);
+  return bodies;
+}
+
+HTTPRouter test_router() {
+  HTTPRouter router;
+  router.route(HTTPMethod::GET, "/hello",
+               [](HTTPRequest const &req) -> Task<HTTPResponse> {
+                 auto res = HTTPResponse::with_allocator(req.get_allocator());
+                 res.status = 200;
+                 res.body = "Hello, World!"sv;
+                 co_return res;
+               });
+  router.route(HTTPMethod::GET, "/fail",
+               [](HTTPRequest const &) -> Task<HTTPResponse> {
+                 throw std::runtime_error("fail");
+                 co_return HTTPResponse{};
+               });
+  router.route_static(HTTPMethod::GET, "/home",
+                      HTTPResponse{.status = 200, .body = "home"});
+  route_metrics(router);
+  return router;
+}
+} // namespace
+
+TEST(MetricsTest, ServeConnectionCounts) {
+  HeaderTemplate headers;
+  HeaderTemplate::Scope scope(headers);
+  LoopStats stats;
+  LoopStats::Scope stats_scope(stats);
+  auto router = test_router();
+
+  serve(router, {"/hello", "/hello", "/home", "/nowhere"});
+  auto s = stats.snapshot();
+  EXPECT_EQ(s.threads, 1);
+  EXPECT_EQ(s[Stat::REQUESTS], 4);
+  EXPECT_EQ(s[Stat::ROUTE_HANDLER_HITS], 2);
+  EXPECT_EQ(s[Stat::ROUTE_STATIC_HITS], 1);
+  EXPECT_EQ(s[Stat::ROUTE_MISSES], 1);
+  EXPECT_EQ(s.responses[200], 3);
+  EXPECT_EQ(s.responses[404], 1);
+  EXPECT_EQ(s[Stat::OPEN_CONNECTIONS], 0);
+  EXPECT_EQ(s[Stat::EXCEPTIONS], 0);
+
+  bool failed = false;
+  serve(router, {"/fail"}, &failed);
+  EXPECT_TRUE(failed);
+  s = stats.snapshot();
+  EXPECT_EQ(s[Stat::EXCEPTIONS], 1);
+  EXPECT_EQ(s[Stat::OPEN_CONNECTIONS], 0);
+  EXPECT_EQ(s[Stat::REQUESTS], 4);
+}
+
+TEST(MetricsTest, PrometheusText) {
+  HeaderTemplate headers;
+  HeaderTemplate::Scope scope(headers);
+  LoopStats stats;
+  LoopStats::Scope stats_scope(stats);
+  LatencyRecorder latency;
+  LatencyRecorder::Scope latency_scope(latency);
+  auto router = test_router();
+
+  auto bodies = serve(router, {"/hello", "/nowhere", "/metrics"});
+  ASSERT_EQ(bodies.size(), 3);
+  // The route shows the stats of the whole process, which has those of the
+  // other tests too, so only its format is checked.
+  EXPECT_TRUE(bodies[2].contains("# TYPE coro_requests_total counter\n"));
+  EXPECT_TRUE(bodies[2].contains("coro_open_connections "));
+
+  auto text = format_prometheus(stats.snapshot(), latency.snapshot(),
+                                LoopMonitor::Snapshot{});
+  EXPECT_TRUE(text.contains("# TYPE coro_requests_total counter\n"));
+  EXPECT_TRUE(text.contains("# TYPE coro_open_connections gauge\n"));
+  EXPECT_TRUE(text.contains("coro_requests_total 3\n"));
+  EXPECT_TRUE(text.contains("coro_open_connections 0\n"));
+  EXPECT_TRUE(text.contains("coro_responses_total{code=\"404\"} 1\n"));
+  EXPECT_TRUE(text.contains("# TYPE coro_request_phase_seconds summary\n"));
+  EXPECT_TRUE(
+      text.contains("coro_request_phase_seconds_count{route=\"/hello\","
+                    "phase=\"handler\"} 1\n"));
+  EXPECT_TRUE(
+      text.contains("route=\"\",phase=\"flush\",quantile=\"0.99\"}"));
+}
+
+TEST(MetricsTest, MergedAcrossThreads) {
+  auto before = LoopStats::merged();
+  LoopStats stats;
+  stats.add(Stat::ACCEPTS, 2);
+  stats.add_response(503);
+  std::thread([] {
+    LoopStats other;
+    LoopStats::Scope scope(other);
+    count_stat(Stat::ACCEPTS);
+    set_stat(Stat::TIMERS, 7);
+  }).join();
+
+  auto after = LoopStats::merged();
+  EXPECT_EQ(after[Stat::ACCEPTS] - before[Stat::ACCEPTS], 3);
+  EXPECT_EQ(after.responses[503] - before.responses[503], 1);
+  // The gauges of a thread are gone with it.
+  EXPECT_EQ(after[Stat::TIMERS], before[Stat::TIMERS]);
+  EXPECT_EQ(after.threads, before.threads + 1);
+}
+
+TEST(MetricsTest, LabelEscaping) {
+  EXPECT_EQ(prometheus_label("/a\"b\\c\nd"), "/a\\\"b\\\\c\\nd");
+}
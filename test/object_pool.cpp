@@ -0,0 +1,116 @@
+#include <gtest/gtest.h>
+
+#include <cerrno>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#include "connection.hpp"
+#include "default_headers.hpp"
+#include "object_pool.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+namespace {
+struct Buffer {
+  std::vector<char> bytes = std::vector<char>(1024);
+  int clears = 0;
+
+  void clear() { ++clears; }
+};
+} // namespace
+
+TEST(ObjectPoolTest, ReusesReleasedObjects) {
+  ObjectPool<Buffer> pool;
+  Buffer *first;
+  {
+    auto b = pool.acquire();
+    first = b.get();
+    EXPECT_EQ(pool.size(), 0);
+  }
+  EXPECT_EQ(pool.size(), 1);
+  EXPECT_EQ(first->clears, 1);
+
+  auto b = pool.acquire();
+  EXPECT_EQ(b.get(), first);
+  auto c = pool.acquire();
+  EXPECT_NE(c.get(), first);
+  EXPECT_EQ(pool.created(), 2);
+  EXPECT_EQ(pool.reused(), 1);
+}
+
+TEST(ObjectPoolTest, CustomResetAndMaxIdle) {
+  int resets = 0;
+  auto reset = [&resets](std::string &s) {
+    s.clear();
+    ++resets;
+  };
+  ObjectPool<std::string, decltype(reset)> pool(1, reset);
+  {
+    auto a = pool.acquire("a long string that is not stored in the object");
+    auto b = pool.acquire(3, 'b');
+    EXPECT_EQ(*b, "bbb");
+  }
+  // Only one is kept.
+  EXPECT_EQ(pool.size(), 1);
+  EXPECT_EQ(resets, 1);
+  EXPECT_TRUE(pool.acquire()->empty());
+}
+
+TEST(ObjectPoolTest, IdleStatesKeepLittleArena) {
+  ConnectionPool pool;
+  {
+    auto state = pool.acquire(8192, 4096, 16384);
+    std::pmr::vector<char> body(1 << 20, 'x', &state->arena);
+    EXPECT_GE(state->arena.capacity(), 1 << 20);
+  }
+  auto state = pool.acquire();
+  EXPECT_EQ(pool.reused(), 1);
+  EXPECT_LE(state->arena.capacity(), 16384);
+}
+
+TEST(ObjectPoolTest, ConnectionsShareStates) {
+  EpollScheduler sched;
+  HeaderTemplate headers;
+  HeaderTemplate::Scope scope(headers);
+  HTTPRouter router;
+  router.route(HTTPMethod::GET, "/",
+               [](HTTPRequest const &) -> Task<HTTPResponse> {
+                 co_return HTTPResponse{.status = 200, .body = "ok"sv};
+               });
+  ConnectionPool pool;
+
+  for (int i = 0; i < 3; i++) {
+    int fds[2];
+    CHECK_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    AsyncFile client(fds[1]);
+    auto task = serve_connection(sched, pool, AsyncFile(fds[0]), router);
+    task.coro_.resume();
+
+    auto request = "GET / HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n"sv;
+    ASSERT_EQ(write(client.fd_, request.data(), request.size()),
+              request.size());
+    while (!task.coro_.done()) {
+      sched.run(1s);
+    }
+    task.result();
+
+    // The server's end is closed when the state goes back to the pool.
+    std::string response;
+    char buf[256];
+    ssize_t n;
+    while ((n = read(client.fd_, buf, sizeof(buf))) > 0) {
+      response.append(buf, n);
+    }
+    EXPECT_EQ(n, 0) << errno;
+    EXPECT_TRUE(response.starts_with("HTTP/1.1 200 OK\r\n")) << response;
+    EXPECT_TRUE(response.ends_with("\r\n\r\nok")) << response;
+    EXPECT_EQ(pool.size(), 1);
+  }
+  EXPECT_EQ(pool.created(), 1);
+  EXPECT_EQ(pool.reused(), 2);
+}
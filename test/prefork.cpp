@@ -0,0 +1,166 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <format>
+#include <map>
+#include <optional>
+#include <poll.h>
+#include <set>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "prefork.hpp"
+#include "shutdown.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+namespace {
+// A master in a child process, whose workers tell the test when they start
+// and stop through a pipe.
+struct Master {
+  explicit Master(PreforkOptions options) {
+    CHECK_SYSCALL(pipe(fds));
+    pid = CHECK_SYSCALL(fork());
+    if (pid == 0) {
+      close(fds[0]);
+      Prefork master(options, [this](int index) {
+        report(std::format("start {} {}", index, getpid()));
+        EpollScheduler sched;
+        auto stop = wait_for_stop(sched);
+        sched.run(stop);
+        report(std::format("stop {}", index));
+        return 0;
+      });
+      _exit(master.run());
+    }
+    close(fds[1]);
+  }
+
+  ~Master() {
+    if (pid > 0) {
+      kill(pid, SIGKILL);
+      waitpid(pid, nullptr, 0);
+    }
+    close(fds[0]);
+  }
+
+  void report(std::string const &line) {
+    auto s = line + "\n";
+    [[maybe_unused]] auto ret = write(fds[1], s.data(), s.size());
+  }
+
+  // The next line of a worker, or nothing after `timeout`.
+  std::optional<std::string> next(std::chrono::milliseconds timeout = 5s) {
+    while (!buffer.contains('\n')) {
+      pollfd p{.fd = fds[0], .events = POLLIN, .revents = 0};
+      if (poll(&p, 1, timeout.count()) != 1) {
+        return std::nullopt;
+      }
+      char buf[256];
+      auto n = read(fds[0], buf, sizeof(buf));
+      if (n <= 0) {
+        return std::nullopt;
+      }
+      buffer.append(buf, n);
+    }
+    auto pos = buffer.find('\n');
+    auto line = buffer.substr(0, pos);
+    buffer.erase(0, pos + 1);
+    return line;
+  }
+
+  // The next `n` lines: the pids of the workers that started, by index, and
+  // the indices of those that stopped.
+  std::pair<std::map<int, pid_t>, std::multiset<int>> events(int n) {
+    std::map<int, pid_t> started;
+    std::multiset<int> stopped;
+    for (int i = 0; i < n; i++) {
+      auto line = next();
+      int index, worker;
+      if (line && std::sscanf(line->c_str(), "start %d %d", &index,
+                              &worker) == 2) {
+        started[index] = worker;
+      } else if (line && std::sscanf(line->c_str(), "stop %d", &index) == 1) {
+        stopped.insert(index);
+      } else {
+        ADD_FAILURE() << "expected an event, got " << line.value_or("nothing");
+        break;
+      }
+    }
+    return {started, stopped};
+  }
+
+  int wait() {
+    int status;
+    CHECK_SYSCALL(waitpid(pid, &status, 0));
+    pid = -1;
+    return status;
+  }
+
+  pid_t pid;
+  int fds[2];
+  std::string buffer;
+};
+} // namespace
+
+TEST(PreforkTest, RespawnsReloadsAndStops) {
+  Master master({.workers = 2,
+                 .pin_workers = false,
+                 .respawn_delay = 10ms,
+                 .drain_timeout = 5s});
+  auto [first, none] = master.events(2);
+  ASSERT_EQ(first.size(), 2);
+
+  // A worker that dies is replaced.
+  kill(first[1], SIGKILL);
+  auto [respawned, _] = master.events(1);
+  ASSERT_EQ(respawned.size(), 1);
+  EXPECT_NE(respawned[1], first[1]);
+
+  // A reload starts new workers and stops the old ones.
+  kill(master.pid, SIGHUP);
+  auto [second, old] = master.events(4);
+  ASSERT_EQ(second.size(), 2);
+  EXPECT_NE(second[0], first[0]);
+  EXPECT_EQ(old, (std::multiset{0, 1}));
+
+  kill(master.pid, SIGTERM);
+  auto [more, stopped] = master.events(2);
+  EXPECT_TRUE(more.empty());
+  EXPECT_EQ(stopped, (std::multiset{0, 1}));
+  auto status = master.wait();
+  EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0) << status;
+}
+
+TEST(PreforkTest, KillsWorkersThatDontDrain) {
+  int fds[2];
+  CHECK_SYSCALL(pipe(fds));
+  pid_t pid = CHECK_SYSCALL(fork());
+  if (pid == 0) {
+    Prefork master({.workers = 1, .pin_workers = false, .drain_timeout = 50ms},
+                   [&](int) {
+                     // Ignores SIGTERM.
+                     signal(SIGTERM, SIG_IGN);
+                     [[maybe_unused]] auto ret = write(fds[1], "x", 1);
+                     while (true) {
+                       pause();
+                     }
+                     return 0;
+                   });
+    _exit(master.run());
+  }
+  char ch;
+  ASSERT_EQ(read(fds[0], &ch, 1), 1);
+  auto start = Clock::now();
+  kill(pid, SIGTERM);
+  int status;
+  CHECK_SYSCALL(waitpid(pid, &status, 0));
+  EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0) << status;
+  EXPECT_LT(Clock::now() - start, 5s);
+  close(fds[0]);
+  close(fds[1]);
+}
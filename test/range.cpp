@@ -0,0 +1,174 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "epoll.hpp"
+#include "http.hpp"
+#include "range.hpp"
+
+using namespace coro;
+
+namespace {
+// A temporary file with `content`, removed at the end of the test.
+struct TempFile {
+  explicit TempFile(std::string const &content) {
+    int fd = CHECK_SYSCALL(mkstemp(path));
+    CHECK_SYSCALL(write(fd, content.data(), content.size()));
+    CHECK_SYSCALL(close(fd));
+  }
+
+  ~TempFile() { unlink(path); }
+
+  char path[32] = "/tmp/coro_range_XXXXXX";
+};
+
+HTTPRequest get_range(std::string_view range) {
+  return HTTPRequest{.method = "GET", .uri = "/f",
+                     .headers = {{"Range", std::pmr::string(range)}}};
+}
+} // namespace
+
+TEST(RangeTest, Parse) {
+  using R = std::vector<ByteRange>;
+  EXPECT_EQ(parse_range("bytes=0-499", 1000), (R{{0, 499}}));
+  EXPECT_EQ(parse_range("bytes=500-", 1000), (R{{500, 999}}));
+  EXPECT_EQ(parse_range("bytes=-200", 1000), (R{{800, 999}}));
+  EXPECT_EQ(parse_range("bytes=-2000", 1000), (R{{0, 999}}));
+  EXPECT_EQ(parse_range("bytes=900-5000", 1000), (R{{900, 999}}));
+  // Sorted and merged.
+  EXPECT_EQ(parse_range("bytes=500-599, 0-9,10-19 ,550-700", 1000),
+            (R{{0, 19}, {500, 700}}));
+  // Not satisfiable.
+  EXPECT_EQ(parse_range("bytes=1000-", 1000), R{});
+  EXPECT_EQ(parse_range("bytes=-0", 1000), R{});
+  // Ignored.
+  EXPECT_FALSE(parse_range("items=0-1", 1000));
+  EXPECT_FALSE(parse_range("bytes=5-3", 1000));
+  EXPECT_FALSE(parse_range("bytes=a-3", 1000));
+  EXPECT_FALSE(parse_range("bytes=", 1000));
+  std::string many = "bytes=0-0";
+  for (int i = 1; i <= 16; i++) {
+    many += "," + std::to_string(i * 2) + "-" + std::to_string(i * 2);
+  }
+  EXPECT_FALSE(parse_range(many, 1000));
+}
+
+TEST(RangeTest, IfRange) {
+  auto date = "Sun, 06 Nov 1994 08:49:37 GMT";
+  EXPECT_TRUE(if_range_matches("\"abc\"", "\"abc\"", ""));
+  EXPECT_FALSE(if_range_matches("\"abc\"", "W/\"abc\"", ""));
+  EXPECT_FALSE(if_range_matches("W/\"abc\"", "W/\"abc\"", ""));
+  EXPECT_TRUE(if_range_matches(date, "", date));
+  EXPECT_FALSE(if_range_matches(date, "", "Sun, 06 Nov 1994 08:49:38 GMT"));
+}
+
+TEST(RangeTest, StringBody) {
+  HTTPResponse res{.status = 200,
+                   .headers = {{"ETag", "\"v1\""}},
+                   .body = "0123456789"};
+  ASSERT_TRUE(evaluate_range(get_range("bytes=2-4"), res));
+  EXPECT_EQ(res.status, 206);
+  EXPECT_EQ(res.body, "234");
+  EXPECT_EQ(res.headers.at("Content-Range"), "bytes 2-4/10");
+
+  HTTPResponse res2{.status = 200, .body = "0123456789"};
+  ASSERT_TRUE(evaluate_range(get_range("bytes=20-"), res2));
+  EXPECT_EQ(res2.status, 416);
+  EXPECT_EQ(res2.headers.at("Content-Range"), "bytes */10");
+  EXPECT_TRUE(res2.body.empty());
+
+  // A stale If-Range gives the whole body.
+  HTTPResponse res3{.status = 200,
+                    .headers = {{"ETag", "\"v2\""}},
+                    .body = "0123456789"};
+  auto req = get_range("bytes=2-4");
+  req.headers["If-Range"] = "\"v1\"";
+  EXPECT_FALSE(evaluate_range(req, res3));
+  EXPECT_EQ(res3.status, 200);
+}
+
+TEST(RangeTest, Multipart) {
+  HTTPResponse res{.status = 200,
+                   .headers = {{"Content-Type", "text/plain"}},
+                   .body = "0123456789"};
+  ASSERT_TRUE(evaluate_range(get_range("bytes=0-1,8-"), res));
+  EXPECT_EQ(res.status, 206);
+  auto type = res.headers.at("Content-Type");
+  ASSERT_TRUE(type.starts_with("multipart/byteranges; boundary="));
+  auto boundary = type.substr(type.find('=') + 1);
+  EXPECT_EQ(res.body, "\r\n--" + boundary +
+                          "\r\nContent-Type: text/plain\r\n"
+                          "Content-Range: bytes 0-1/10\r\n\r\n01"
+                          "\r\n--" +
+                          boundary +
+                          "\r\nContent-Type: text/plain\r\n"
+                          "Content-Range: bytes 8-9/10\r\n\r\n89"
+                          "\r\n--" +
+                          boundary + "--\r\n");
+}
+
+TEST(RangeTest, FileBody) {
+  TempFile tmp("0123456789");
+  auto res = file_response(tmp.path, "text/plain");
+  EXPECT_EQ(res.body.file()->size, 10);
+  EXPECT_TRUE(res.to_string().ends_with("\r\n\r\n0123456789"));
+
+  ASSERT_TRUE(evaluate_range(get_range("bytes=-3"), res));
+  EXPECT_EQ(res.status, 206);
+  EXPECT_EQ(res.body.file()->content_length(), 3);
+  auto s = res.to_string();
+  EXPECT_TRUE(s.contains("Content-Range: bytes 7-9/10\r\n"));
+  EXPECT_TRUE(s.contains("Content-Length: 3\r\n"));
+  EXPECT_TRUE(s.ends_with("\r\n\r\n789"));
+}
+
+TEST(RangeTest, SendFileRanges) {
+  std::string content;
+  for (int i = 0; i < 100000; i++) {
+    content += static_cast<char>('a' + i % 26);
+  }
+  TempFile tmp(content);
+  auto res = file_response(tmp.path);
+  ASSERT_TRUE(evaluate_range(get_range("bytes=10-19,50000-99999"), res));
+  HeaderTemplate headers;
+  HeaderTemplate::Scope scope(headers);
+  auto expected = res.to_string(headers.bytes());
+
+  int fds[2];
+  CHECK_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  EpollScheduler sched;
+  AsyncFileBuffer out(sched, AsyncFile(fds[0]));
+  AsyncFile in(fds[1]);
+
+  // Keep the lambda alive: the coroutine refers to its captures.
+  auto send = [&]() -> Task<> {
+    co_await res.write_to(out);
+    co_await out.flush();
+    CHECK_SYSCALL(close(out.file_.release())); // EOF for the reader.
+  };
+  auto task = send();
+  task.coro_.resume();
+
+  std::string received;
+  char buf[4096];
+  while (true) {
+    if (sched.have_registered_events()) {
+      sched.run(std::chrono::milliseconds(0));
+    }
+    auto n = read(in.fd_, buf, sizeof(buf));
+    if (n == -1 && errno == EAGAIN) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    received.append(buf, n);
+  }
+  ASSERT_TRUE(task.coro_.done());
+  task.result();
+  EXPECT_EQ(received, expected);
+}
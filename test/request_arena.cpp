@@ -0,0 +1,173 @@
+#include <gtest/gtest.h>
+
+#include <memory_resource>
+#include <optional>
+#include <string_view>
+#include <sys/socket.h>
+#include <vector>
+
+#include "arena.hpp"
+#include "connection.hpp"
+#include "count_allocations.hpp"
+#include "default_headers.hpp"
+#include "http.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+namespace {
+// A keep-alive connection served by serve_connection(), with the client end
+// driven by hand.
+struct Connection {
+  explicit Connection(HTTPRouter const &router) {
+    int fds[2];
+    CHECK_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    client = AsyncFile(fds[1]);
+    server.emplace(sched, AsyncFile(fds[0]));
+    task.emplace(serve_connection(sched, *server, router));
+    task->coro_.resume();
+  }
+
+  // Sends `request` and runs the loop until `last` ends the response. The
+  // response is read into a fixed buffer, so the client allocates nothing.
+  std::string_view round_trip(std::string_view request, std::string_view last) {
+    EXPECT_EQ(write(client.fd_, request.data(), request.size()),
+              request.size());
+    std::size_t n = 0;
+    while (!std::string_view(response, n).ends_with(last)) {
+      sched.run(1s);
+      auto ret = read(client.fd_, response + n, sizeof(response) - n);
+      if (ret > 0) {
+        n += ret;
+      } else if (ret == 0 || errno != EAGAIN || task->coro_.done()) {
+        break;
+      }
+    }
+    return {response, n};
+  }
+
+  EpollScheduler sched;
+  HeaderTemplate headers;
+  HeaderTemplate::Scope scope{headers};
+  AsyncFile client;
+  std::optional<AsyncFileBuffer> server;
+  std::optional<Task<>> task;
+  char response[4096];
+};
+
+HTTPRouter hello_router() {
+  HTTPRouter router;
+  router.route(HTTPMethod::GET, "/hello",
+               [](HTTPRequest const &req) -> Task<HTTPResponse> {
+                 auto res = HTTPResponse::with_allocator(req.get_allocator());
+                 auto uri = req.parse_uri();
+                 res.status = 200;
+                 res.headers["Content-Type"] = "text/plain; charset=utf-8";
+                 res.headers["X-Name"] = uri.params.at("name");
+                 res.body = "Hello, World!"sv;
+                 co_return res;
+               });
+  return router;
+}
+
+constexpr std::string_view hello_request =
+    "GET /hello?name=someone-with-a-long-name&lang=en HTTP/1.1\r\n"
+    "Host: localhost:9000\r\n"
+    "User-Agent: request-arena-test/1.0 (a header longer than SSO)\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "\r\n";
+} // namespace
+
+TEST(RequestArenaTest, ResetKeepsBlocks) {
+  Arena arena(64);
+  auto fill = [&arena] {
+    std::pmr::vector<int> v(&arena);
+    for (int i = 0; i < 100; i++) {
+      v.push_back(i);
+    }
+    return v.data();
+  };
+  auto data = fill();
+  auto blocks = arena.blocks();
+  auto capacity = arena.capacity();
+  EXPECT_GT(blocks, 1);
+  EXPECT_GE(arena.allocated(), 100 * sizeof(int));
+
+  arena.reset();
+  EXPECT_EQ(arena.allocated(), 0);
+  // The same allocations are made in the same places.
+  EXPECT_EQ(fill(), data);
+  EXPECT_EQ(arena.blocks(), blocks);
+  EXPECT_EQ(arena.capacity(), capacity);
+}
+
+TEST(RequestArenaTest, TrimFreesLaterBlocks) {
+  Arena arena(64);
+  {
+    std::pmr::vector<char> small(64, 'x', &arena);
+    std::pmr::vector<char> large(100000, 'x', &arena);
+    EXPECT_GE(arena.capacity(), 100000 + 64);
+  }
+
+  arena.reset();
+  arena.trim(1024);
+  EXPECT_EQ(arena.blocks(), 1);
+  EXPECT_LE(arena.capacity(), 1024);
+  {
+    // New blocks start small again.
+    std::pmr::vector<char> more(1000, 'x', &arena);
+    EXPECT_LT(arena.capacity(), 4096);
+  }
+
+  arena.reset();
+  arena.trim(0);
+  EXPECT_EQ(arena.blocks(), 0);
+  std::pmr::vector<char> again(10, 'x', &arena);
+  EXPECT_EQ(arena.blocks(), 1);
+}
+
+TEST(RequestArenaTest, KeepAliveSteadyStateAllocatesNothing) {
+  if (frame_registry_enabled) {
+    GTEST_SKIP() << "the frame registry allocates for every frame";
+  }
+  auto router = hello_router();
+  Connection conn(router);
+
+  auto res = conn.round_trip(hello_request, "Hello, World!");
+  EXPECT_TRUE(res.starts_with("HTTP/1.1 200 OK\r\n")) << res;
+  EXPECT_TRUE(res.contains("X-Name: someone-with-a-long-name\r\n")) << res;
+  EXPECT_FALSE(res.contains("Connection:")) << res;
+
+  // The first requests fill the arena and the frame cache.
+  for (int i = 0; i < 3; i++) {
+    conn.round_trip(hello_request, "Hello, World!");
+  }
+
+  counting = true;
+  for (int i = 0; i < 100; i++) {
+    res = conn.round_trip(hello_request, "Hello, World!");
+  }
+  counting = false;
+  EXPECT_EQ(allocations, 0);
+  EXPECT_TRUE(res.starts_with("HTTP/1.1 200 OK\r\n")) << res;
+  EXPECT_FALSE(conn.task->coro_.done());
+}
+
+TEST(RequestArenaTest, ConnectionClose) {
+  auto router = hello_router();
+  Connection conn(router);
+
+  auto res = conn.round_trip(
+      "GET /hello?name=a HTTP/1.1\r\nConnection: close\r\n\r\n"sv,
+      "Hello, World!");
+  EXPECT_TRUE(res.contains("Connection: close\r\n")) << res;
+  EXPECT_TRUE(conn.task->coro_.done());
+  conn.task->result();
+
+  // A route that doesn't exist is answered and the connection stays open.
+  Connection other(router);
+  res = other.round_trip("GET /nothing HTTP/1.1\r\nHost: a\r\n\r\n"sv, "}");
+  EXPECT_TRUE(res.starts_with("HTTP/1.1 404 Not Found\r\n")) << res;
+  EXPECT_FALSE(other.task->coro_.done());
+}
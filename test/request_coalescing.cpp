@@ -0,0 +1,284 @@
+#include <chrono>
+#include <coroutine>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "cache.hpp"
+#include "http.hpp"
+#include "task.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+namespace {
+HTTPRequest get(std::string_view uri) {
+  return HTTPRequest{.method = "GET", .uri = std::pmr::string(uri)};
+}
+
+// Where a coroutine waits until the test resumes it.
+struct Gate {
+  struct Awaiter {
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) noexcept { gate_->h_ = h; }
+    void await_resume() const noexcept {}
+
+    Gate *gate_;
+  };
+
+  Awaiter wait() { return Awaiter{this}; }
+
+  std::coroutine_handle<> h_;
+};
+
+Task<> wait_at(Gate &gate) { co_await gate.wait(); }
+
+// A request that races `gate`.
+Task<> race(RequestCoalescer &flights, Gate &gate) {
+  co_await when_any(flights.handle(get("/")), wait_at(gate));
+}
+
+void run_until_idle(TimedScheduler &sched) {
+  while (auto delay = sched.run()) {
+    std::this_thread::sleep_for(*delay);
+  }
+}
+} // namespace
+
+TEST(RequestCoalescerTest, ThunderingHerd) {
+  TimedScheduler sched;
+  int calls = 0;
+  RequestCoalescer flights(
+      [&](HTTPRequest) -> Task<HTTPResponse> {
+        ++calls;
+        co_await sleep_for(sched, 10ms);
+        co_return HTTPResponse{.status = 200, .body = "expensive"};
+      },
+      {}, &sched);
+
+  std::vector<Task<HTTPResponse>> tasks;
+  for (int i = 0; i < 1000; i++) {
+    tasks.push_back(flights.handle(get("/expensive")));
+    tasks.back().coro_.resume();
+  }
+  EXPECT_EQ(flights.in_flight(), 1);
+  run_until_idle(sched);
+
+  EXPECT_EQ(calls, 1);
+  EXPECT_EQ(flights.stats().invocations, 1);
+  EXPECT_EQ(flights.stats().coalesced, 999);
+  EXPECT_EQ(flights.in_flight(), 0);
+  // Everyone shares the same bytes.
+  std::shared_ptr<const std::string> bytes;
+  for (auto &t : tasks) {
+    ASSERT_TRUE(t.coro_.done());
+    auto res = t.result();
+    ASSERT_TRUE(res.serialized);
+    if (!bytes) {
+      bytes = res.serialized;
+    }
+    EXPECT_EQ(res.serialized.get(), bytes.get());
+  }
+  EXPECT_TRUE(bytes->ends_with("\r\n\r\nexpensive"));
+
+  // The flight is over: the next request runs the handler again.
+  auto t = flights.handle(get("/expensive"));
+  t.coro_.resume();
+  run_until_idle(sched);
+  EXPECT_EQ(calls, 2);
+  // Nobody waited, so the response is left as the handler built it.
+  auto res = t.result();
+  EXPECT_FALSE(res.serialized);
+  EXPECT_EQ(res.body, "expensive");
+}
+
+TEST(RequestCoalescerTest, DifferentKeysDoNotWait) {
+  TimedScheduler sched;
+  int calls = 0;
+  RequestCoalescer flights(
+      [&](HTTPRequest) -> Task<HTTPResponse> {
+        ++calls;
+        co_await sleep_for(sched, 1ms);
+        co_return HTTPResponse{.status = 200};
+      },
+      RequestCoalescerOptions{.query_params = {"id"}}, &sched);
+
+  auto t1 = flights.handle(get("/user?id=1"));
+  auto t2 = flights.handle(get("/user?id=2"));
+  auto t3 = flights.handle(get("/user?id=1&utm=x"));
+  t1.coro_.resume();
+  t2.coro_.resume();
+  t3.coro_.resume();
+  EXPECT_EQ(flights.in_flight(), 2);
+  run_until_idle(sched);
+  EXPECT_EQ(calls, 2);
+  EXPECT_EQ(flights.stats().coalesced, 1);
+}
+
+TEST(RequestCoalescerTest, WaitersGetTheException) {
+  TimedScheduler sched;
+  RequestCoalescer flights(
+      [&](HTTPRequest) -> Task<HTTPResponse> {
+        co_await sleep_for(sched, 1ms);
+        throw std::logic_error{"boom"};
+      },
+      {}, &sched);
+
+  auto t1 = flights.handle(get("/"));
+  auto t2 = flights.handle(get("/"));
+  t1.coro_.resume();
+  t2.coro_.resume();
+  run_until_idle(sched);
+  EXPECT_THROW(t1.result(), std::logic_error);
+  EXPECT_THROW(t2.result(), std::logic_error);
+}
+
+TEST(RequestCoalescerTest, CancelledWaiterIsNotResumed) {
+  TimedScheduler sched;
+  RequestCoalescer flights(
+      [&](HTTPRequest) -> Task<HTTPResponse> {
+        co_await sleep_for(sched, 1ms);
+        co_return HTTPResponse{.status = 200};
+      },
+      {}, &sched);
+
+  auto t1 = flights.handle(get("/"));
+  t1.coro_.resume();
+  {
+    auto t2 = flights.handle(get("/"));
+    t2.coro_.resume();
+  } // Destroys the suspended waiter.
+  run_until_idle(sched);
+  EXPECT_EQ(t1.result().status, 200);
+}
+
+TEST(RequestCoalescerTest, WokenWaiterDestroyedBeforeItsTurn) {
+  TimedScheduler sched;
+  Gate handler_gate, other_gate;
+  RequestCoalescer flights(
+      [&](HTTPRequest) -> Task<HTTPResponse> {
+        co_await handler_gate.wait();
+        co_return HTTPResponse{.status = 200};
+      },
+      {}, &sched);
+
+  auto t1 = flights.handle(get("/"));
+  t1.coro_.resume();
+  {
+    auto t2 = race(flights, other_gate);
+    t2.coro_.resume();
+    // The handler returns: the waiter is put in the ready queue.
+    handler_gate.h_.resume();
+    ASSERT_TRUE(t1.coro_.done());
+    EXPECT_EQ(sched.ready_coros_.size(), 1);
+  } // Destroys the waiter before the scheduler resumes it.
+  EXPECT_TRUE(sched.ready_coros_.empty());
+  run_until_idle(sched);
+  EXPECT_EQ(t1.result().status, 200);
+}
+
+TEST(RequestCoalescerTest, CancelledLeaderFailsWaiters) {
+  TimedScheduler sched;
+  RequestCoalescer flights(
+      [&](HTTPRequest) -> Task<HTTPResponse> {
+        co_await sleep_for(sched, 1ms);
+        co_return HTTPResponse{.status = 200};
+      },
+      {}, &sched);
+
+  auto t2 = flights.handle(get("/"));
+  {
+    auto t1 = flights.handle(get("/"));
+    t1.coro_.resume();
+    t2.coro_.resume();
+  } // Destroys the leader.
+  run_until_idle(sched);
+  ASSERT_TRUE(t2.coro_.done());
+  EXPECT_THROW(t2.result(), std::runtime_error);
+  EXPECT_EQ(flights.in_flight(), 0);
+}
+
+TEST(RequestCoalescerTest, CacheCoalescesMisses) {
+  TimedScheduler sched;
+  int calls = 0;
+  ResponseCache cache(
+      [&](HTTPRequest) -> Task<HTTPResponse> {
+        ++calls;
+        co_await sleep_for(sched, 1ms);
+        co_return HTTPResponse{.status = 200, .body = "x"};
+      },
+      {}, &sched);
+
+  std::vector<Task<HTTPResponse>> tasks;
+  for (int i = 0; i < 10; i++) {
+    tasks.push_back(cache.handle(get("/")));
+    tasks.back().coro_.resume();
+  }
+  run_until_idle(sched);
+  EXPECT_EQ(calls, 1);
+  EXPECT_EQ(cache.stats().misses, 10);
+  EXPECT_EQ(cache.coalescing_stats().coalesced, 9);
+  EXPECT_EQ(cache.size(), 1);
+}
+
+TEST(RequestCoalescerTest, CoalescedMissesGetAnETag) {
+  TimedScheduler sched;
+  ResponseCache cache(
+      [&](HTTPRequest) -> Task<HTTPResponse> {
+        co_await sleep_for(sched, 1ms);
+        co_return HTTPResponse{.status = 200, .body = "x"};
+      },
+      {}, &sched);
+
+  std::vector<Task<HTTPResponse>> tasks;
+  for (int i = 0; i < 3; i++) {
+    tasks.push_back(cache.handle(get("/")));
+    tasks.back().coro_.resume();
+  }
+  run_until_idle(sched);
+  EXPECT_EQ(cache.coalescing_stats().coalesced, 2);
+  auto etag = make_etag("x");
+  for (auto &t : tasks) {
+    ASSERT_TRUE(t.coro_.done());
+    auto res = t.result();
+    ASSERT_TRUE(res.serialized);
+    EXPECT_TRUE(res.serialized->contains("ETag: " + etag + "\r\n"));
+  }
+
+  auto req = get("/");
+  req.headers["If-None-Match"] = etag;
+  auto t = cache.handle(std::move(req));
+  t.coro_.resume();
+  ASSERT_TRUE(t.coro_.done());
+  EXPECT_EQ(t.result().status, 304);
+  EXPECT_EQ(cache.stats().not_modified, 1);
+}
+
+TEST(RequestCoalescerTest, GeneratedBodyIsCollected) {
+  TimedScheduler sched;
+  RequestCoalescer flights(
+      [&](HTTPRequest) -> Task<HTTPResponse> {
+        co_await sleep_for(sched, 1ms);
+        auto left = std::make_shared<int>(3);
+        co_return HTTPResponse{
+            .status = 200,
+            .body = BodyGenerator([left]() -> Task<std::string> {
+              co_return (*left)-- > 0 ? "ab" : "";
+            }),
+        };
+      },
+      {}, &sched);
+
+  auto t1 = flights.handle(get("/stream"));
+  auto t2 = flights.handle(get("/stream"));
+  t1.coro_.resume();
+  t2.coro_.resume();
+  run_until_idle(sched);
+
+  ASSERT_TRUE(t1.coro_.done() && t2.coro_.done());
+  auto r1 = t1.result();
+  auto r2 = t2.result();
+  EXPECT_EQ(r1.serialized.get(), r2.serialized.get());
+  EXPECT_TRUE(r2.serialized->ends_with("Content-Length: 6\r\n\r\nababab"));
+}
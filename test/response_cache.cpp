@@ -0,0 +1,255 @@
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "cache.hpp"
+#include "http.hpp"
+
+using namespace coro;
+using namespace std::literals;
+
+namespace {
+HTTPResponse run(Task<HTTPResponse> t) {
+  t.coro_.resume();
+  EXPECT_TRUE(t.coro_.done());
+  return t.result();
+}
+
+HTTPRequest get(std::string_view uri, HTTPHeaders headers = {}) {
+  return HTTPRequest{.method = "GET", .uri = std::pmr::string(uri),
+                     .headers = std::move(headers)};
+}
+
+// A temporary file with `content`, removed at the end of the test.
+struct TempFile {
+  explicit TempFile(std::string const &content) {
+    int fd = CHECK_SYSCALL(mkstemp(path));
+    CHECK_SYSCALL(write(fd, content.data(), content.size()));
+    CHECK_SYSCALL(close(fd));
+  }
+
+  ~TempFile() { unlink(path); }
+
+  char path[32] = "/tmp/coro_cache_XXXXXX";
+};
+} // namespace
+
+TEST(ResponseCacheTest, HitAfterMiss) {
+  int calls = 0;
+  ResponseCache cache([&](HTTPRequest) -> Task<HTTPResponse> {
+    ++calls;
+    co_return HTTPResponse{.status = 200, .body = "<h1>Hi</h1>"};
+  });
+
+  auto r1 = run(cache.handle(get("/hi")));
+  auto r2 = run(cache.handle(get("//hi")));
+
+  EXPECT_EQ(calls, 1);
+  EXPECT_EQ(cache.stats().misses, 1);
+  EXPECT_EQ(cache.stats().hits, 1);
+  ASSERT_TRUE(r2.serialized);
+  EXPECT_EQ(r1.to_string(), r2.to_string());
+  EXPECT_TRUE(r2.to_string().ends_with("\r\n\r\n<h1>Hi</h1>"));
+  // Hits share the bytes.
+  EXPECT_EQ(r1.serialized.get(), r2.serialized.get());
+}
+
+TEST(ResponseCacheTest, KeyUsesSelectedParamsAndVary) {
+  ResponseCache cache([](HTTPRequest) -> Task<HTTPResponse> { co_return {}; },
+                      ResponseCacheOptions{.query_params = {"q"},
+                                           .vary = {"Accept-Encoding"}});
+
+  EXPECT_EQ(cache.key(get("/s?q=1&utm=a")), cache.key(get("/s?utm=b&q=1")));
+  EXPECT_NE(cache.key(get("/s?q=1")), cache.key(get("/s?q=2")));
+  EXPECT_NE(cache.key(get("/s?q=1", {{"accept-encoding", "gzip"}})),
+            cache.key(get("/s?q=1")));
+  EXPECT_EQ(cache.key(get("/s?q=1", {{"accept-encoding", "gzip"}})),
+            cache.key(get("/s?q=1", {{"Accept-Encoding", "gzip"}})));
+  auto post = get("/s?q=1");
+  post.method = "POST";
+  EXPECT_NE(cache.key(post), cache.key(get("/s?q=1")));
+}
+
+TEST(ResponseCacheTest, ExpiresAfterTTL) {
+  int calls = 0;
+  ResponseCache cache(
+      [&](HTTPRequest) -> Task<HTTPResponse> {
+        co_return HTTPResponse{.status = 200, .body = std::to_string(++calls)};
+      },
+      ResponseCacheOptions{.ttl = 20ms});
+
+  EXPECT_TRUE(run(cache.handle(get("/"))).to_string().ends_with("1"));
+  EXPECT_TRUE(run(cache.handle(get("/"))).to_string().ends_with("1"));
+  std::this_thread::sleep_for(30ms);
+  EXPECT_TRUE(run(cache.handle(get("/"))).to_string().ends_with("2"));
+  EXPECT_EQ(cache.stats().misses, 2);
+}
+
+TEST(ResponseCacheTest, StaleWhileRevalidate) {
+  TimedScheduler sched;
+  int calls = 0;
+  ResponseCache cache(
+      [&](HTTPRequest) -> Task<HTTPResponse> {
+        co_return HTTPResponse{.status = 200, .body = std::to_string(++calls)};
+      },
+      ResponseCacheOptions{.ttl = 20ms, .stale_while_revalidate = 10s},
+      &sched);
+
+  run(cache.handle(get("/")));
+  std::this_thread::sleep_for(30ms);
+
+  // Both requests get the stale body and only one refresh is scheduled.
+  EXPECT_TRUE(run(cache.handle(get("/"))).to_string().ends_with("1"));
+  EXPECT_TRUE(run(cache.handle(get("/"))).to_string().ends_with("1"));
+  EXPECT_EQ(calls, 1);
+  EXPECT_EQ(cache.stats().stale_hits, 2);
+
+  sched.run();
+  EXPECT_EQ(calls, 2);
+  EXPECT_EQ(cache.stats().refreshes, 1);
+  EXPECT_TRUE(run(cache.handle(get("/"))).to_string().ends_with("2"));
+  EXPECT_EQ(cache.stats().hits, 1);
+}
+
+TEST(ResponseCacheTest, StaleWhileRevalidateWithoutScheduler) {
+  int calls = 0;
+  ResponseCache cache(
+      [&](HTTPRequest) -> Task<HTTPResponse> {
+        co_return HTTPResponse{.status = 200, .body = std::to_string(++calls)};
+      },
+      ResponseCacheOptions{.ttl = 20ms, .stale_while_revalidate = 10s});
+
+  run(cache.handle(get("/")));
+  std::this_thread::sleep_for(30ms);
+
+  // The handler never suspends, so the refresh replaces the entry before the
+  // stale response is returned.
+  EXPECT_TRUE(run(cache.handle(get("/"))).to_string().ends_with("1"));
+  EXPECT_EQ(calls, 2);
+  EXPECT_EQ(cache.stats().refreshes, 1);
+  EXPECT_TRUE(run(cache.handle(get("/"))).to_string().ends_with("2"));
+  EXPECT_EQ(cache.stats().hits, 1);
+}
+
+TEST(ResponseCacheTest, FailedRefreshIsRetried) {
+  int calls = 0;
+  ResponseCache cache(
+      [&](HTTPRequest) -> Task<HTTPResponse> {
+        if (++calls == 2) {
+          throw 42; // Not a std::exception.
+        }
+        co_return HTTPResponse{.status = 200, .body = std::to_string(calls)};
+      },
+      ResponseCacheOptions{.ttl = 20ms, .stale_while_revalidate = 10s});
+
+  run(cache.handle(get("/")));
+  std::this_thread::sleep_for(30ms);
+
+  EXPECT_TRUE(run(cache.handle(get("/"))).to_string().ends_with("1"));
+  EXPECT_EQ(cache.stats().refreshes, 1);
+  // The failed refresh doesn't stop the next stale hit from trying again.
+  EXPECT_TRUE(run(cache.handle(get("/"))).to_string().ends_with("1"));
+  EXPECT_EQ(cache.stats().refreshes, 2);
+  EXPECT_TRUE(run(cache.handle(get("/"))).to_string().ends_with("3"));
+}
+
+TEST(ResponseCacheTest, EvictsLeastRecentlyUsed) {
+  ResponseCache cache(
+      [](HTTPRequest) -> Task<HTTPResponse> {
+        co_return HTTPResponse{.status = 200, .body = "x"};
+      },
+      ResponseCacheOptions{.max_entries = 2});
+
+  run(cache.handle(get("/a")));
+  run(cache.handle(get("/b")));
+  run(cache.handle(get("/a"))); // "/b" becomes the oldest.
+  run(cache.handle(get("/c")));
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_EQ(cache.stats().evictions, 1);
+
+  run(cache.handle(get("/a")));
+  EXPECT_EQ(cache.stats().hits, 2);
+  run(cache.handle(get("/b")));
+  EXPECT_EQ(cache.stats().misses, 4);
+}
+
+TEST(ResponseCacheTest, SkipsUncacheableResponses) {
+  int calls = 0;
+  ResponseCache cache([&](HTTPRequest req) -> Task<HTTPResponse> {
+    ++calls;
+    if (req.uri == "/private") {
+      co_return HTTPResponse{.status = 200,
+                             .headers = {{"Cache-Control", "private"}}};
+    }
+    co_return HTTPResponse{.status = 500};
+  });
+
+  run(cache.handle(get("/private")));
+  run(cache.handle(get("/private")));
+  run(cache.handle(get("/error")));
+  run(cache.handle(get("/error")));
+  EXPECT_EQ(calls, 4);
+  EXPECT_EQ(cache.stats().uncacheable, 4);
+  EXPECT_EQ(cache.size(), 0);
+}
+
+TEST(ResponseCacheTest, RouteCached) {
+  HTTPRouter router;
+  int calls = 0;
+  auto cache = route_cached(router, HTTPMethod::GET, "/home",
+                            [&](HTTPRequest) -> Task<HTTPResponse> {
+                              ++calls;
+                              co_return HTTPResponse{.status = 200};
+                            });
+  auto handler = router.find_route(HTTPMethod::GET, "/home");
+  ASSERT_NE(handler, nullptr);
+  run(handler(get("/home")));
+  run(handler(get("/home")));
+  EXPECT_EQ(calls, 1);
+  EXPECT_EQ(cache->stats().hits, 1);
+}
+
+TEST(ResponseCacheTest, RouteCachedFile) {
+  TempFile tmp("0123456789");
+  TimedScheduler sched;
+  HTTPRouter router;
+  int calls = 0;
+  auto cache = route_cached(
+      router, HTTPMethod::GET, "/file",
+      [&](HTTPRequest) -> Task<HTTPResponse> {
+        ++calls;
+        co_await sleep_for(sched, 1ms);
+        co_return file_response(tmp.path, "text/plain");
+      },
+      {}, &sched);
+  auto handler = router.find_route(HTTPMethod::GET, "/file");
+  ASSERT_NE(handler, nullptr);
+
+  auto t1 = handler(get("/file"));
+  auto t2 = handler(get("/file"));
+  t1.coro_.resume();
+  t2.coro_.resume();
+  while (auto delay = sched.run()) {
+    std::this_thread::sleep_for(*delay);
+  }
+  ASSERT_TRUE(t1.coro_.done());
+  ASSERT_TRUE(t2.coro_.done());
+
+  // The waiter shares the file instead of a copy of its content, and nothing
+  // is stored.
+  EXPECT_EQ(calls, 1);
+  EXPECT_EQ(cache->coalescing_stats().coalesced, 1);
+  for (auto *t : {&t1, &t2}) {
+    auto res = t->result();
+    EXPECT_FALSE(res.serialized);
+    ASSERT_TRUE(res.body.file());
+    EXPECT_TRUE(res.headers.contains("ETag"));
+    EXPECT_TRUE(res.to_string().ends_with("\r\n\r\n0123456789"));
+  }
+  EXPECT_EQ(cache->size(), 0);
+  EXPECT_EQ(cache->stats().uncacheable, 2);
+}
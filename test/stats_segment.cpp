@@ -0,0 +1,113 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+#include "stats.hpp"
+#include "stats_segment.hpp"
+
+using namespace coro;
+
+namespace {
+std::string temp_path(char const *name) {
+  return std::string(testing::TempDir()) + name + "-" +
+         std::to_string(getpid());
+}
+} // namespace
+
+TEST(StatsSegmentTest, PublishAndRead) {
+  StatsSegment segment(temp_path("publish"), 4);
+  StatsSegmentReader reader(segment.path());
+  EXPECT_EQ(reader.pid(), static_cast<std::uint64_t>(getpid()));
+  EXPECT_EQ(reader.stat_count(), stat_count);
+  EXPECT_EQ(reader.loops(), 0);
+
+  LoopStats stats;
+  auto slot = segment.add_loop();
+  stats.add(Stat::REQUESTS, 5);
+  stats.set(Stat::OPEN_CONNECTIONS, 3);
+  stats.add_response(200);
+  stats.add_response(204);
+  stats.add_response(503);
+  slot.publish(stats);
+
+  ASSERT_EQ(reader.loops(), 1);
+  auto s = reader.read(0);
+  ASSERT_TRUE(s);
+  EXPECT_EQ(s->seq % 2, 0);
+  EXPECT_EQ(s->tid, static_cast<std::uint64_t>(gettid()));
+  EXPECT_GT(s->time_ns, 0);
+  EXPECT_EQ(s->values[static_cast<std::size_t>(Stat::REQUESTS)], 5);
+  EXPECT_EQ(s->values[static_cast<std::size_t>(Stat::OPEN_CONNECTIONS)], 3);
+  EXPECT_EQ(s->responses[2], 2);
+  EXPECT_EQ(s->responses[5], 1);
+
+  stats.add(Stat::REQUESTS);
+  slot.publish(stats);
+  auto t = reader.read(0);
+  EXPECT_EQ(t->values[static_cast<std::size_t>(Stat::REQUESTS)], 6);
+  EXPECT_GE(t->time_ns, s->time_ns);
+}
+
+TEST(StatsSegmentTest, RunsOutOfSlots) {
+  StatsSegment segment(temp_path("slots"), 2);
+  segment.add_loop();
+  segment.add_loop();
+  EXPECT_THROW(segment.add_loop(), std::runtime_error);
+  StatsSegmentReader reader(segment.path());
+  EXPECT_EQ(reader.loops(), 2);
+}
+
+TEST(StatsSegmentTest, RejectsOtherFiles) {
+  auto path = temp_path("other");
+  {
+    FILE *f = fopen(path.c_str(), "w");
+    ASSERT_NE(f, nullptr);
+    std::string junk(4096, 'x');
+    fwrite(junk.data(), 1, junk.size(), f);
+    fclose(f);
+  }
+  EXPECT_THROW(StatsSegmentReader{path}, std::runtime_error);
+  unlink(path.c_str());
+
+  {
+    StatsSegment segment(path, 1);
+  }
+  // Removed with the segment.
+  EXPECT_THROW(StatsSegmentReader{path}, std::runtime_error);
+}
+
+// The writer keeps every value equal; a torn copy would have two different.
+TEST(StatsSegmentTest, SnapshotsAreConsistent) {
+  StatsSegment segment(temp_path("seqlock"), 1);
+  StatsSegmentReader reader(segment.path());
+  std::atomic<bool> done = false;
+  std::thread writer([&] {
+    LoopStats stats;
+    auto slot = segment.add_loop();
+    for (int i = 1; i <= 20000; i++) {
+      for (std::size_t j = 0; j < stat_count; j++) {
+        stats.set(static_cast<Stat>(j), i);
+      }
+      slot.publish(stats);
+    }
+    done = true;
+  });
+  int torn = 0;
+  while (!done) {
+    if (reader.loops() == 0) {
+      continue;
+    }
+    auto s = reader.read(0);
+    for (std::size_t j = 1; s && j < stat_count; j++) {
+      torn += s->values[j] != s->values[0];
+    }
+    torn += !s;
+  }
+  writer.join();
+  EXPECT_EQ(torn, 0);
+  EXPECT_EQ(reader.read(0)->values[0], 20000);
+}
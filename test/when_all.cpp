@@ -51,3 +51,20 @@ TEST(WhenAllTest, Basic) { EXPECT_EQ(when_all(), 3); }
 TEST(WhenAllTest, Throws) {
   EXPECT_THROW({ when_all<true>(); }, std::runtime_error);
 }
+
+TEST(WhenAllTest, ThrowsWithoutSuspending) {
+  TimedScheduler scheduler;
+  auto task = [](TimedScheduler &sched) -> Task<int> {
+    auto later = [](TimedScheduler &sched) -> Task<int> {
+      co_await sleep_for(sched, std::chrono::milliseconds(1));
+      co_return 1;
+    };
+    auto now = []() -> Task<int> {
+      throw std::runtime_error{"now"};
+      co_return 2;
+    };
+    auto [a, b] = co_await when_all(later(sched), now());
+    co_return a + b;
+  }(scheduler);
+  EXPECT_THROW({ scheduler.run(task); }, std::runtime_error);
+}
@@ -57,3 +57,15 @@ TEST(WhenAnyTest, Basic) { EXPECT_EQ(when_any(), 1); }
 TEST(WhenAnyTest, Throws) {
   EXPECT_THROW({ when_any<true>(); }, std::runtime_error);
 }
+
+TEST(WhenAnyTest, FinishesWithoutSuspending) {
+  auto task = []() -> Task<std::size_t> {
+    auto now = [](int x) -> Task<int> { co_return x; };
+    auto result = co_await when_any(now(1), now(2), now(3));
+    co_return result.index();
+  }();
+  task.coro_.resume();
+  ASSERT_TRUE(task.coro_.done());
+  // The first task is started last.
+  EXPECT_EQ(task.result(), 1);
+}